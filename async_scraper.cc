@@ -0,0 +1,361 @@
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/log/check.h"
+#include "absl/log/log.h"
+#include "absl/status/status.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "curl/curl.h"
+#include "scraper.h"
+#include "scraper_internal.h"
+
+namespace {
+
+using ::scraper_internal::CompleteRequest;
+using ::scraper_internal::ConfigureRequest;
+using ::scraper_internal::State;
+using ::scraper_internal::VersionString;
+
+inline constexpr int kMaxEvents = 64;
+
+// A single in-flight request, owned by the event loop from submission until
+// its callback has been called.
+struct Request final {
+  std::string url;
+  std::string buffer;
+  Scraper::RequestOptions request_options;
+  Scraper::ScrapeCallback callback;
+  CURL* curl = nullptr;
+  State state;
+};
+
+// Drives any number of concurrent requests from one thread. Curl reports the
+// sockets and timeouts it's waiting on through the socket and timer callbacks,
+// which are mapped on to an epoll set, and the loop reports the resulting
+// activity back to curl via curl_multi_socket_action.
+class EventLoop final {
+ public:
+  EventLoop() = delete;
+  EventLoop(const Scraper::Options& options) : options_(options) {
+    multi_ = curl_multi_init();
+    CHECK(multi_ != nullptr) << "curl_multi_init failed";
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    CHECK(epoll_fd_ != -1) << "epoll_create1 failed: " << strerror(errno);
+    wake_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    CHECK(wake_fd_ != -1) << "eventfd failed: " << strerror(errno);
+
+    epoll_event event = {.events = EPOLLIN, .data = {.fd = wake_fd_}};
+    CHECK(epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &event) == 0)
+        << "Failed to add wake fd to epoll set: " << strerror(errno);
+
+    curl_multi_setopt(multi_, CURLMOPT_SOCKETFUNCTION, SocketCallback);
+    curl_multi_setopt(multi_, CURLMOPT_SOCKETDATA, this);
+    curl_multi_setopt(multi_, CURLMOPT_TIMERFUNCTION, TimerCallback);
+    curl_multi_setopt(multi_, CURLMOPT_TIMERDATA, this);
+
+    thread_ = std::thread([this] { Loop(); });
+  }
+
+  EventLoop(const EventLoop&) = delete;
+  EventLoop& operator=(const EventLoop&) = delete;
+
+  ~EventLoop() {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    Wake();
+    thread_.join();
+
+    close(wake_fd_);
+    close(epoll_fd_);
+    curl_multi_cleanup(multi_);
+  }
+
+  void Submit(std::unique_ptr<Request> request) {
+    // The request is only moved in to the queue if the loop is still running.
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (!stopping_) {
+        incoming_.push_back(std::move(request));
+      }
+    }
+    if (request != nullptr) {
+      request->callback(
+          {.result = absl::CancelledError("Scraper is shutting down")});
+      return;
+    }
+    Wake();
+  }
+
+ private:
+  const Scraper::Options options_;
+
+  CURLM* multi_ = nullptr;
+  int epoll_fd_ = -1;
+  int wake_fd_ = -1;
+  std::thread thread_;
+
+  std::mutex mutex_;
+  bool stopping_ = false;
+  std::vector<std::unique_ptr<Request>> incoming_;
+
+  // Only accessed from the loop thread.
+  std::vector<std::unique_ptr<Request>> active_;
+  std::optional<absl::Time> timer_deadline_;
+
+  static int SocketCallback(CURL* curl, curl_socket_t socket, int what,
+                            void* user_data, void* socket_data) {
+    auto& loop = *reinterpret_cast<EventLoop*>(user_data);
+    if (what == CURL_POLL_REMOVE) {
+      epoll_ctl(loop.epoll_fd_, EPOLL_CTL_DEL, socket, nullptr);
+      return 0;
+    }
+
+    epoll_event event = {
+        .events = ((what & CURL_POLL_IN) ? EPOLLIN : 0u) |
+                  ((what & CURL_POLL_OUT) ? EPOLLOUT : 0u),
+        .data = {.fd = socket},
+    };
+    // Curl's per-socket pointer records whether the socket is already in the
+    // epoll set.
+    if (socket_data == nullptr) {
+      if (epoll_ctl(loop.epoll_fd_, EPOLL_CTL_ADD, socket, &event) != 0) {
+        LOG(ERROR) << "Failed to add socket to epoll set: " << strerror(errno);
+        return -1;
+      }
+      curl_multi_assign(loop.multi_, socket, &loop);
+    } else if (epoll_ctl(loop.epoll_fd_, EPOLL_CTL_MOD, socket, &event) != 0) {
+      LOG(ERROR) << "Failed to modify socket in epoll set: " << strerror(errno);
+      return -1;
+    }
+    return 0;
+  }
+
+  static int TimerCallback(CURLM* multi, long timeout_ms, void* user_data) {
+    auto& loop = *reinterpret_cast<EventLoop*>(user_data);
+    if (timeout_ms < 0) {
+      loop.timer_deadline_.reset();
+    } else {
+      loop.timer_deadline_ = absl::Now() + absl::Milliseconds(timeout_ms);
+    }
+    return 0;
+  }
+
+  void Wake() {
+    const uint64_t value = 1;
+    if (write(wake_fd_, &value, sizeof(value)) != sizeof(value)) {
+      LOG(ERROR) << "Failed to wake scraper event loop: " << strerror(errno);
+    }
+  }
+
+  int TimeoutMillis() const {
+    if (!timer_deadline_.has_value()) {
+      return -1;
+    }
+    const auto remaining =
+        absl::Ceil(*timer_deadline_ - absl::Now(), absl::Milliseconds(1));
+    return std::max<int64_t>(0, absl::ToInt64Milliseconds(remaining));
+  }
+
+  void Loop() {
+    epoll_event events[kMaxEvents];
+    int running = 0;
+    while (true) {
+      const int num_events =
+          epoll_wait(epoll_fd_, events, kMaxEvents, TimeoutMillis());
+      if (num_events < 0 && errno != EINTR) {
+        LOG(ERROR) << "epoll_wait failed: " << strerror(errno);
+      }
+
+      bool woken = false;
+      for (int i = 0; i < num_events; ++i) {
+        if (events[i].data.fd == wake_fd_) {
+          woken = true;
+          continue;
+        }
+        const int action =
+            ((events[i].events & EPOLLIN) ? CURL_CSELECT_IN : 0) |
+            ((events[i].events & EPOLLOUT) ? CURL_CSELECT_OUT : 0) |
+            ((events[i].events & (EPOLLERR | EPOLLHUP)) ? CURL_CSELECT_ERR
+                                                        : 0);
+        curl_multi_socket_action(multi_, events[i].data.fd, action, &running);
+      }
+      if (timer_deadline_.has_value() && *timer_deadline_ <= absl::Now()) {
+        timer_deadline_.reset();
+        curl_multi_socket_action(multi_, CURL_SOCKET_TIMEOUT, 0, &running);
+      }
+
+      if (woken && !StartIncoming()) {
+        break;
+      }
+      CompleteFinished();
+    }
+    CancelActive();
+  }
+
+  // Adds any newly submitted requests to the multi handle. Returns false if
+  // the loop is stopping.
+  bool StartIncoming() {
+    uint64_t value;
+    while (read(wake_fd_, &value, sizeof(value)) > 0) {
+    }
+
+    std::vector<std::unique_ptr<Request>> incoming;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (stopping_) {
+        return false;
+      }
+      incoming.swap(incoming_);
+    }
+
+    for (auto& request : incoming) {
+      request->curl = curl_easy_init();
+      if (request->curl == nullptr) {
+        request->callback(
+            {.result = absl::InternalError("curl_easy_init failed")});
+        continue;
+      }
+      const absl::Status configure_status = ConfigureRequest(
+          request->curl, options_, request->request_options, request->url,
+          std::move(request->buffer), request->state);
+      if (!configure_status.ok()) {
+        curl_easy_cleanup(request->curl);
+        request->callback({.result = configure_status});
+        continue;
+      }
+      curl_easy_setopt(request->curl, CURLOPT_PRIVATE, request.get());
+      const CURLMcode code = curl_multi_add_handle(multi_, request->curl);
+      if (code != CURLM_OK) {
+        curl_easy_cleanup(request->curl);
+        request->callback(
+            {.result = absl::InternalError(curl_multi_strerror(code))});
+        continue;
+      }
+      active_.push_back(std::move(request));
+    }
+    return true;
+  }
+
+  void CompleteFinished() {
+    int remaining = 0;
+    while (CURLMsg* message = curl_multi_info_read(multi_, &remaining)) {
+      if (message->msg != CURLMSG_DONE) {
+        continue;
+      }
+      CURL* const curl = message->easy_handle;
+      const CURLcode code = message->data.result;
+      Request* request = nullptr;
+      curl_easy_getinfo(curl, CURLINFO_PRIVATE, &request);
+      curl_multi_remove_handle(multi_, curl);
+
+      const auto it = std::find_if(
+          active_.begin(), active_.end(),
+          [request](const auto& active) { return active.get() == request; });
+      CHECK(it != active_.end()) << "Completed request is not active";
+      auto owned = std::move(*it);
+      *it = std::move(active_.back());
+      active_.pop_back();
+
+      // Connections are held in the multi handle's cache, so remain open for
+      // reuse after the easy handle is cleaned up.
+      auto outcome = CompleteRequest(curl, code, owned->state);
+      curl_easy_cleanup(curl);
+      owned->callback(std::move(outcome));
+    }
+  }
+
+  void CancelActive() {
+    std::vector<std::unique_ptr<Request>> cancelled;
+    cancelled.swap(active_);
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      for (auto& request : incoming_) {
+        cancelled.push_back(std::move(request));
+      }
+      incoming_.clear();
+    }
+    for (auto& request : cancelled) {
+      if (request->curl != nullptr) {
+        curl_multi_remove_handle(multi_, request->curl);
+        curl_easy_cleanup(request->curl);
+      }
+      request->callback(
+          {.result = absl::CancelledError("Scraper is shutting down")});
+    }
+  }
+};
+
+class AsyncScraperImpl final : public Scraper {
+ public:
+  AsyncScraperImpl() = delete;
+  AsyncScraperImpl(const Options& options) {
+    for (int i = 0; i < std::max(1, options.event_loop_threads); ++i) {
+      loops_.push_back(std::make_unique<EventLoop>(options));
+    }
+  }
+
+  ~AsyncScraperImpl() override {
+    loops_.clear();
+    curl_global_cleanup();
+  }
+
+  using Scraper::Scrape;
+
+  ScrapeOutcome Scrape(const std::string& url, std::string buffer,
+                       const RequestOptions& request_options) override {
+    std::promise<ScrapeOutcome> promise;
+    auto future = promise.get_future();
+    ScrapeAsync(url, std::move(buffer), request_options,
+                [&promise](ScrapeOutcome outcome) {
+                  promise.set_value(std::move(outcome));
+                });
+    return future.get();
+  }
+
+  void ScrapeAsync(const std::string& url, std::string buffer,
+                   const RequestOptions& request_options,
+                   ScrapeCallback callback) override {
+    auto request = std::make_unique<Request>();
+    request->url = url;
+    request->buffer = std::move(buffer);
+    request->request_options = request_options;
+    request->callback = std::move(callback);
+    loops_[next_loop_++ % loops_.size()]->Submit(std::move(request));
+  }
+
+  // ForgetOrigin is left to the default, as each multi handle's connection
+  // cache is bounded, and closes the oldest idle connections to make room.
+
+  std::string_view Version() const override { return VersionString(); }
+
+ private:
+  std::vector<std::unique_ptr<EventLoop>> loops_;
+  std::atomic<size_t> next_loop_ = 0;
+};
+
+}  // namespace
+
+absl::StatusOr<std::unique_ptr<Scraper>> CreateAsyncScraper(
+    const Scraper::Options& options) {
+  const CURLcode code = curl_global_init(CURL_GLOBAL_ALL);
+  if (code != CURLE_OK) {
+    return absl::InternalError(curl_easy_strerror(code));
+  }
+  return std::make_unique<AsyncScraperImpl>(options);
+}
@@ -0,0 +1,37 @@
+#include <benchmark/benchmark.h>
+
+#include <memory>
+#include <string>
+
+#include "parser.h"
+
+namespace {
+
+// A Switch.GetStatus response as returned by a Shelly Plus Plug S.
+inline constexpr char kSwitchStatus[] =
+    R"({"id":0,"source":"HTTP_in","output":true,"apower":54.2,)"
+    R"("voltage":231.4,"freq":50.0,"current":0.268,)"
+    R"("aenergy":{"total":10523.871,"by_minute":[903.551,903.551,897.262],)"
+    R"("minute_ts":1717430460},)"
+    R"("ret_aenergy":{"total":0.000,"by_minute":[0.000,0.000,0.000],)"
+    R"("minute_ts":1717430460},)"
+    R"("temperature":{"tC":36.8, "tF":98.3}})";
+
+template <std::unique_ptr<Parser> (*Factory)()>
+void BM_Parse(benchmark::State& state) {
+  auto parser = Factory();
+  // Responses are parsed straight out of the scraper's reused body buffer,
+  // which has spare capacity.
+  std::string data(kSwitchStatus);
+  data.reserve(4096);
+  for (auto _ : state) {
+    auto result = parser->Parse(data);
+    benchmark::DoNotOptimize(result);
+  }
+  state.SetBytesProcessed(state.iterations() * data.size());
+}
+BENCHMARK(BM_Parse<CreateParser>)->Name("BM_Parse/Dom");
+BENCHMARK(BM_Parse<CreateStreamingParser>)->Name("BM_Parse/Streaming");
+BENCHMARK(BM_Parse<CreateSimdjsonParser>)->Name("BM_Parse/Simdjson");
+
+}  // namespace
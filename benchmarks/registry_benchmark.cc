@@ -0,0 +1,87 @@
+#include <benchmark/benchmark.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/log/check.h"
+#include "absl/strings/substitute.h"
+#include "prometheus/text_serializer.h"
+#include "registry.h"
+#include "shelly.h"
+
+namespace {
+
+struct Fleet final {
+  std::unique_ptr<Registry> registry;
+  std::vector<TargetHandle> handles;
+};
+
+// Creates a registry with `num_targets` targets, all of which have reported
+// metrics once.
+template <std::unique_ptr<Registry> (*Factory)(const Registry::Options&)>
+Fleet CreateFleet(int num_targets) {
+  Fleet fleet = {.registry = Factory({})};
+  for (int i = 0; i < num_targets; ++i) {
+    auto handle = fleet.registry->AddTarget(absl::Substitute("plug-$0", i));
+    CHECK_OK(handle.status());
+    fleet.handles.push_back(*handle);
+    fleet.registry->SuccessCallback(*handle, ::shelly::Metrics());
+  }
+  return fleet;
+}
+
+template <std::unique_ptr<Registry> (*Factory)(const Registry::Options&)>
+void BM_SuccessCallback(benchmark::State& state) {
+  auto fleet = CreateFleet<Factory>(state.range(0));
+  const ::shelly::Metrics metrics = {
+      .apower = 54.2,
+      .voltage = 231.4,
+      .current = 0.268,
+      .temp_c = 36.8,
+      .temp_f = 98.3,
+  };
+  size_t next = 0;
+  for (auto _ : state) {
+    fleet.registry->SuccessCallback(fleet.handles[next], metrics);
+    next = (next + 1) % fleet.handles.size();
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_SuccessCallback<CreateRegistry>)
+    ->Name("BM_SuccessCallback/Prometheus")
+    ->RangeMultiplier(10)
+    ->Range(10, 10000);
+BENCHMARK(BM_SuccessCallback<CreateFlatRegistry>)
+    ->Name("BM_SuccessCallback/Flat")
+    ->RangeMultiplier(10)
+    ->Range(10, 10000);
+
+// Collects and serializes the whole registry, as a scrape of the exporter
+// does.
+template <std::unique_ptr<Registry> (*Factory)(const Registry::Options&)>
+void BM_SerializeText(benchmark::State& state) {
+  auto fleet = CreateFleet<Factory>(state.range(0));
+  const auto collectable = fleet.registry->GetCollectable();
+  const ::prometheus::TextSerializer serializer;
+  size_t bytes = 0;
+  for (auto _ : state) {
+    const auto text = serializer.Serialize(collectable->Collect());
+    bytes += text.size();
+    benchmark::DoNotOptimize(text.data());
+  }
+  state.SetBytesProcessed(bytes);
+  state.counters["targets"] = state.range(0);
+}
+BENCHMARK(BM_SerializeText<CreateRegistry>)
+    ->Name("BM_SerializeText/Prometheus")
+    ->RangeMultiplier(10)
+    ->Range(10, 10000)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK(BM_SerializeText<CreateFlatRegistry>)
+    ->Name("BM_SerializeText/Flat")
+    ->RangeMultiplier(10)
+    ->Range(10, 10000)
+    ->Unit(benchmark::kMillisecond);
+
+}  // namespace
@@ -0,0 +1,80 @@
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "scraper_internal.h"
+
+namespace {
+
+// Headers as sent by a Shelly Plus Plug in response to Switch.GetStatus.
+const std::vector<std::string>& ShellyHeaders() {
+  static const auto* const headers = new std::vector<std::string>({
+      "HTTP/1.1 200 OK\r\n",
+      "Server: ShellyHTTP/1.0.0\r\n",
+      "Content-Type: application/json\r\n",
+      "Content-Length: 221\r\n",
+      "Access-Control-Allow-Origin: *\r\n",
+      "Connection: keep-alive\r\n",
+      "\r\n",
+  });
+  return *headers;
+}
+
+void BM_ParseStatusLine(benchmark::State& state) {
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        scraper_internal::ParseStatusLine("HTTP/1.1 200 OK"));
+  }
+}
+BENCHMARK(BM_ParseStatusLine);
+
+void BM_ParseHeaderLine(benchmark::State& state) {
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(
+        scraper_internal::ParseHeaderLine("Content-Type: application/json"));
+  }
+}
+BENCHMARK(BM_ParseHeaderLine);
+
+void BM_HeaderCallback(benchmark::State& state) {
+  auto headers = ShellyHeaders();
+  for (auto _ : state) {
+    scraper_internal::State scraper_state;
+    for (auto& header : headers) {
+      benchmark::DoNotOptimize(scraper_internal::HeaderCallback(
+          header.data(), 1, header.size(), &scraper_state));
+    }
+    benchmark::DoNotOptimize(scraper_state);
+  }
+  state.SetItemsProcessed(state.iterations() * headers.size());
+}
+BENCHMARK(BM_HeaderCallback);
+
+// Delivers a body of range(0) bytes in chunks of range(1) bytes, reusing the
+// content buffer between iterations as the poller does.
+void BM_BodyCallback(benchmark::State& state) {
+  const size_t body_size = state.range(0);
+  const size_t chunk_size = state.range(1);
+  std::string body(body_size, 'x');
+
+  scraper_internal::State scraper_state;
+  for (auto _ : state) {
+    scraper_state.content.clear();
+    scraper_state.content_length = body_size;
+    for (size_t offset = 0; offset < body_size; offset += chunk_size) {
+      benchmark::DoNotOptimize(scraper_internal::BodyCallback(
+          body.data() + offset, 1, std::min(chunk_size, body_size - offset),
+          &scraper_state));
+    }
+    benchmark::DoNotOptimize(scraper_state.content.data());
+  }
+  state.SetBytesProcessed(state.iterations() * body_size);
+}
+BENCHMARK(BM_BodyCallback)
+    ->Args({256, 256})
+    ->Args({16 * 1024, 1024})
+    ->Args({16 * 1024, 16 * 1024});
+
+}  // namespace
@@ -0,0 +1,59 @@
+#include "circuit_breaker.h"
+
+#include <algorithm>
+
+CircuitBreaker::CircuitBreaker(const Options& options)
+    : options_(options), backoff_(options.initial_backoff) {}
+
+bool CircuitBreaker::AllowRequest(absl::Time now) {
+  switch (state_) {
+    case State::kClosed:
+      return true;
+    case State::kOpen:
+      if (now < open_until_) {
+        return false;
+      }
+      state_ = State::kHalfOpen;
+      return true;
+    case State::kHalfOpen:
+      // The probe is still outstanding, or the caller is retrying it.
+      return true;
+  }
+  return true;
+}
+
+void CircuitBreaker::RecordSuccess() {
+  state_ = State::kClosed;
+  consecutive_failures_ = 0;
+  backoff_ = options_.initial_backoff;
+}
+
+void CircuitBreaker::RecordFailure(absl::Time now) {
+  ++consecutive_failures_;
+  if (state_ == State::kHalfOpen) {
+    // The probe failed, so back off for longer than last time.
+    Open(now);
+  } else if (options_.failure_threshold > 0 &&
+             consecutive_failures_ >= options_.failure_threshold) {
+    Open(now);
+  }
+}
+
+void CircuitBreaker::Open(absl::Time now) {
+  state_ = State::kOpen;
+  open_until_ = now + backoff_;
+  backoff_ = std::min(backoff_ * options_.backoff_multiplier,
+                      std::max(options_.max_backoff, options_.initial_backoff));
+}
+
+std::string_view CircuitStateName(CircuitBreaker::State state) {
+  switch (state) {
+    case CircuitBreaker::State::kClosed:
+      return "closed";
+    case CircuitBreaker::State::kHalfOpen:
+      return "half-open";
+    case CircuitBreaker::State::kOpen:
+      return "open";
+  }
+  return "unknown";
+}
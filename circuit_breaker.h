@@ -0,0 +1,63 @@
+#ifndef CIRCUIT_BREAKER_H
+#define CIRCUIT_BREAKER_H
+
+#include <string_view>
+
+#include "absl/time/time.h"
+
+// Tracks the health of a single target, so that one which keeps failing is
+// backed off rather than polled every period.
+//
+// The breaker starts closed, allowing every request. After
+// `failure_threshold` consecutive failures it opens, refusing requests until
+// its backoff has passed. The next request is then allowed through as a
+// half-open probe: if it succeeds the breaker closes again, otherwise it
+// reopens with the backoff multiplied by `backoff_multiplier`, up to
+// `max_backoff`.
+//
+// Not thread-safe, calls must be serialized by the caller.
+class CircuitBreaker final {
+ public:
+  enum class State { kClosed = 0, kHalfOpen = 1, kOpen = 2 };
+
+  struct Options final {
+    // Consecutive failures before the breaker opens. Zero disables the
+    // breaker, so that it never opens.
+    int failure_threshold = 3;
+    absl::Duration initial_backoff = absl::Minutes(1);
+    absl::Duration max_backoff = absl::Minutes(30);
+    double backoff_multiplier = 2.0;
+  };
+
+  CircuitBreaker() = delete;
+  explicit CircuitBreaker(const Options& options);
+
+  // Returns whether a request should be made at `now`. Moves an open breaker
+  // whose backoff has passed to half-open, allowing a single probe.
+  bool AllowRequest(absl::Time now);
+
+  // Records the outcome of an allowed request. A failure completed at `now`
+  // may open the breaker, starting its backoff from then.
+  void RecordSuccess();
+  void RecordFailure(absl::Time now);
+
+  State state() const { return state_; }
+  // Time before which an open breaker refuses requests.
+  absl::Time open_until() const { return open_until_; }
+  // Backoff that will be used the next time the breaker opens.
+  absl::Duration backoff() const { return backoff_; }
+
+ private:
+  const Options options_;
+
+  State state_ = State::kClosed;
+  int consecutive_failures_ = 0;
+  absl::Duration backoff_;
+  absl::Time open_until_ = absl::InfinitePast();
+
+  void Open(absl::Time now);
+};
+
+std::string_view CircuitStateName(CircuitBreaker::State state);
+
+#endif  // CIRCUIT_BREAKER_H
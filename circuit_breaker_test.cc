@@ -0,0 +1,99 @@
+#include "circuit_breaker.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+namespace {
+
+inline const absl::Time kStart = absl::FromUnixSeconds(1000);
+
+CircuitBreaker::Options TestOptions() {
+  return CircuitBreaker::Options{
+      .failure_threshold = 3,
+      .initial_backoff = absl::Seconds(10),
+      .max_backoff = absl::Seconds(35),
+      .backoff_multiplier = 2.0,
+  };
+}
+
+}  // namespace
+
+TEST(CircuitBreaker, StartsClosed) {
+  CircuitBreaker breaker(TestOptions());
+  EXPECT_EQ(breaker.state(), CircuitBreaker::State::kClosed);
+  EXPECT_TRUE(breaker.AllowRequest(kStart));
+}
+
+TEST(CircuitBreaker, OpensAfterThreshold) {
+  CircuitBreaker breaker(TestOptions());
+
+  breaker.RecordFailure(kStart);
+  breaker.RecordFailure(kStart);
+  EXPECT_EQ(breaker.state(), CircuitBreaker::State::kClosed);
+  EXPECT_TRUE(breaker.AllowRequest(kStart));
+
+  breaker.RecordFailure(kStart);
+  EXPECT_EQ(breaker.state(), CircuitBreaker::State::kOpen);
+  EXPECT_EQ(breaker.open_until(), kStart + absl::Seconds(10));
+  EXPECT_FALSE(breaker.AllowRequest(kStart + absl::Seconds(9)));
+}
+
+TEST(CircuitBreaker, SuccessResetsFailureCount) {
+  CircuitBreaker breaker(TestOptions());
+
+  breaker.RecordFailure(kStart);
+  breaker.RecordFailure(kStart);
+  breaker.RecordSuccess();
+  breaker.RecordFailure(kStart);
+  breaker.RecordFailure(kStart);
+  EXPECT_EQ(breaker.state(), CircuitBreaker::State::kClosed);
+}
+
+TEST(CircuitBreaker, HalfOpenProbeSuccessCloses) {
+  CircuitBreaker breaker(TestOptions());
+  for (int i = 0; i < 3; ++i) {
+    breaker.RecordFailure(kStart);
+  }
+
+  EXPECT_TRUE(breaker.AllowRequest(kStart + absl::Seconds(10)));
+  EXPECT_EQ(breaker.state(), CircuitBreaker::State::kHalfOpen);
+
+  breaker.RecordSuccess();
+  EXPECT_EQ(breaker.state(), CircuitBreaker::State::kClosed);
+  EXPECT_EQ(breaker.backoff(), absl::Seconds(10));
+}
+
+TEST(CircuitBreaker, HalfOpenProbeFailureBacksOff) {
+  CircuitBreaker breaker(TestOptions());
+  for (int i = 0; i < 3; ++i) {
+    breaker.RecordFailure(kStart);
+  }
+
+  // Each failed probe reopens the breaker for twice as long, up to the
+  // maximum backoff.
+  absl::Time now = kStart;
+  for (const auto expected : {absl::Seconds(20), absl::Seconds(35),
+                              absl::Seconds(35)}) {
+    now = breaker.open_until();
+    ASSERT_TRUE(breaker.AllowRequest(now));
+    breaker.RecordFailure(now);
+    EXPECT_EQ(breaker.state(), CircuitBreaker::State::kOpen);
+    EXPECT_EQ(breaker.open_until(), now + expected);
+  }
+}
+
+TEST(CircuitBreaker, ZeroThresholdNeverOpens) {
+  CircuitBreaker breaker(
+      {.failure_threshold = 0, .initial_backoff = absl::Seconds(10)});
+  for (int i = 0; i < 100; ++i) {
+    breaker.RecordFailure(kStart);
+  }
+  EXPECT_EQ(breaker.state(), CircuitBreaker::State::kClosed);
+  EXPECT_TRUE(breaker.AllowRequest(kStart));
+}
+
+TEST(CircuitStateName, AllStates) {
+  EXPECT_EQ(CircuitStateName(CircuitBreaker::State::kClosed), "closed");
+  EXPECT_EQ(CircuitStateName(CircuitBreaker::State::kHalfOpen), "half-open");
+  EXPECT_EQ(CircuitStateName(CircuitBreaker::State::kOpen), "open");
+}
@@ -1,10 +1,17 @@
 #include "config.h"
 
+#include <algorithm>
 #include <fstream>
+#include <optional>
 #include <string>
 
+#include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
 #include "absl/status/status.h"
+#include "absl/strings/ascii.h"
+#include "absl/strings/match.h"
 #include "absl/strings/substitute.h"
+#include "absl/time/time.h"
 #include "nlohmann/json.hpp"
 #include "status_macros/status_macros.h"
 
@@ -12,6 +19,78 @@ namespace {
 
 using ::nlohmann::json;
 
+absl::StatusOr<std::optional<absl::Duration>> ParseOptionalDuration(
+    std::string_view target, const json& value, std::string_view field) {
+  const auto it = value.find(field);
+  if (it == value.end()) {
+    return std::nullopt;
+  }
+  absl::Duration duration;
+  if (!it->is_string() ||
+      !absl::ParseDuration(it->get<std::string>(), &duration) ||
+      duration < absl::ZeroDuration()) {
+    return absl::InvalidArgumentError(absl::Substitute(
+        "Value of \"$0\" for \"$1\" is not a duration", field, target));
+  }
+  return duration;
+}
+
+// Returns true if `name` is a valid Prometheus label name, other than those
+// reserved for internal use or already given to every target's metrics.
+bool IsGroupLabelName(std::string_view name) {
+  if (name.empty() || absl::ascii_isdigit(name[0]) ||
+      absl::StartsWith(name, "__") || name == "target") {
+    return false;
+  }
+  return std::all_of(name.begin(), name.end(), [](char c) {
+    return absl::ascii_isalnum(c) || c == '_';
+  });
+}
+
+absl::StatusOr<TargetGroups> ParseGroups(std::string_view target,
+                                         const json& value) {
+  const auto it = value.find("groups");
+  if (it == value.end()) {
+    return TargetGroups();
+  }
+  if (!it->is_object()) {
+    return absl::InvalidArgumentError(absl::Substitute(
+        "Value of \"groups\" for \"$0\" is not an object", target));
+  }
+  TargetGroups groups;
+  for (const auto& [label, group] : it->items()) {
+    if (!IsGroupLabelName(label)) {
+      return absl::InvalidArgumentError(absl::Substitute(
+          "Group \"$0\" for \"$1\" is not a valid label name", label,
+          target));
+    }
+    if (!group.is_string()) {
+      return absl::InvalidArgumentError(absl::Substitute(
+          "Group \"$0\" for \"$1\" is not a string", label, target));
+    }
+    groups.emplace(label, group.get<std::string>());
+  }
+  return groups;
+}
+
+// Parses a target given in the object form, which holds the host/port along
+// with any per-target settings.
+absl::StatusOr<Target> ParseTargetObject(const std::string& name,
+                                         const json& value) {
+  const auto host = value.find("host");
+  if (host == value.end() || !host->is_string()) {
+    return absl::InvalidArgumentError(
+        absl::Substitute("Missing string \"host\" for \"$0\"", name));
+  }
+  Target target = {.name = name, .hostname = *host};
+  ASSIGN_OR_RETURN(target.connect_timeout,
+                   ParseOptionalDuration(name, value, "connect_timeout"));
+  ASSIGN_OR_RETURN(target.timeout,
+                   ParseOptionalDuration(name, value, "timeout"));
+  ASSIGN_OR_RETURN(target.groups, ParseGroups(name, value));
+  return target;
+}
+
 absl::StatusOr<std::vector<Target>> ParseTargetsConfig(json& config) {
   if (!config.is_object()) {
     return absl::InvalidArgumentError(
@@ -21,9 +100,14 @@ absl::StatusOr<std::vector<Target>> ParseTargetsConfig(json& config) {
   std::vector<Target> targets;
   targets.reserve(config.size());
   for (const auto& [key, value] : config.items()) {
+    if (value.is_object()) {
+      ASSIGN_OR_RETURN(auto target, ParseTargetObject(key, value));
+      targets.push_back(std::move(target));
+      continue;
+    }
     if (!value.is_string()) {
-      return absl::InvalidArgumentError(
-          absl::Substitute("Value for \"$0\" is not a string", key));
+      return absl::InvalidArgumentError(absl::Substitute(
+          "Value for \"$0\" is not a string or object", key));
     }
     targets.push_back({
         .name = key,
@@ -53,3 +137,29 @@ absl::StatusOr<std::vector<Target>> LoadTargetsFromFile(
                    _ << "Failed to parse file contents");
   return targets;
 }
+
+TargetsDiff DiffTargets(absl::Span<const Target> old_targets,
+                        absl::Span<const Target> new_targets) {
+  absl::flat_hash_map<std::string_view, const Target*> old_by_name;
+  for (const auto& target : old_targets) {
+    old_by_name.emplace(target.name, &target);
+  }
+  absl::flat_hash_set<std::string_view> new_names;
+
+  TargetsDiff diff;
+  for (const auto& target : new_targets) {
+    new_names.insert(target.name);
+    const auto it = old_by_name.find(target.name);
+    if (it == old_by_name.end()) {
+      diff.added.push_back(target);
+    } else if (!(*it->second == target)) {
+      diff.changed.push_back(target);
+    }
+  }
+  for (const auto& target : old_targets) {
+    if (!new_names.contains(target.name)) {
+      diff.removed.push_back(target.name);
+    }
+  }
+  return diff;
+}
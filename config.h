@@ -1,12 +1,32 @@
 #ifndef CONFIG_H
 #define CONFIG_H
 
+#include <string>
 #include <string_view>
 #include <vector>
 
 #include "absl/status/statusor.h"
+#include "absl/types/span.h"
 #include "target.h"
 
 absl::StatusOr<std::vector<Target>> LoadTargetsFromFile(std::string_view filename); 
 
+// The changes that turn one set of targets in to another, with targets
+// matched by name.
+struct TargetsDiff final {
+  // Targets that are only in the new set.
+  std::vector<Target> added;
+  // Names of the targets that are only in the old set.
+  std::vector<std::string> removed;
+  // Targets in both sets whose settings differ, as given in the new set.
+  std::vector<Target> changed;
+
+  bool empty() const {
+    return added.empty() && removed.empty() && changed.empty();
+  }
+};
+
+TargetsDiff DiffTargets(absl::Span<const Target> old_targets,
+                        absl::Span<const Target> new_targets);
+
 #endif  // CONFIG_H
\ No newline at end of file
@@ -4,6 +4,7 @@
 
 #include <fstream>
 #include <string>
+#include <vector>
 
 #include "absl/log/check.h"
 
@@ -52,6 +53,121 @@ TEST(LoadTargetsFromFileTest, InvalidJson) {
   std::remove(filename.c_str());
 }
 
+TEST(LoadTargetsFromFileTest, ObjectForm) {
+  const std::string json_content = R"(
+    {
+        "One": "192.168.1.1",
+        "Two": {"host": "192.168.1.2"},
+        "Three": {
+            "host": "192.168.1.3",
+            "connect_timeout": "500ms",
+            "timeout": "2s"
+        }
+    }
+  )";
+  const auto filename = CreateTempFile(json_content);
+  const auto result = LoadTargetsFromFile(filename);
+
+  ASSERT_TRUE(result.ok()) << result.status();
+  ASSERT_EQ(result.value().size(), 3);
+  // The targets are ordered by name.
+  EXPECT_EQ(result.value()[0].name, "One");
+  EXPECT_EQ(result.value()[0].connect_timeout, std::nullopt);
+  EXPECT_EQ(result.value()[0].timeout, std::nullopt);
+  EXPECT_EQ(result.value()[1].name, "Three");
+  EXPECT_EQ(result.value()[1].hostname, "192.168.1.3");
+  EXPECT_EQ(result.value()[1].connect_timeout, absl::Milliseconds(500));
+  EXPECT_EQ(result.value()[1].timeout, absl::Seconds(2));
+  EXPECT_EQ(result.value()[2].name, "Two");
+  EXPECT_EQ(result.value()[2].hostname, "192.168.1.2");
+  EXPECT_EQ(result.value()[2].timeout, std::nullopt);
+
+  std::remove(filename.c_str());
+}
+
+TEST(LoadTargetsFromFileTest, Groups) {
+  const std::string json_content = R"(
+    {
+        "One": {
+            "host": "192.168.1.1",
+            "groups": {"room": "Kitchen", "circuit": "B2"}
+        },
+        "Two": {"host": "192.168.1.2", "groups": {}}
+    }
+  )";
+  const auto filename = CreateTempFile(json_content);
+  const auto result = LoadTargetsFromFile(filename);
+
+  ASSERT_TRUE(result.ok()) << result.status();
+  ASSERT_EQ(result.value().size(), 2);
+  EXPECT_EQ(result.value()[0].groups,
+            (TargetGroups{{"circuit", "B2"}, {"room", "Kitchen"}}));
+  EXPECT_TRUE(result.value()[1].groups.empty());
+
+  std::remove(filename.c_str());
+}
+
+TEST(LoadTargetsFromFileTest, InvalidObjectForm) {
+  for (const auto* json_content : {
+           R"({"One": {}})",
+           R"({"One": {"host": 1}})",
+           R"({"One": {"host": "192.168.1.1", "timeout": "soon"}})",
+           R"({"One": {"host": "192.168.1.1", "connect_timeout": 5}})",
+           R"({"One": ["192.168.1.1"]})",
+           R"({"One": {"host": "192.168.1.1", "groups": ["Kitchen"]}})",
+           R"({"One": {"host": "192.168.1.1", "groups": {"room": 1}}})",
+           R"({"One": {"host": "192.168.1.1", "groups": {"a room": "K"}}})",
+           R"({"One": {"host": "192.168.1.1", "groups": {"1room": "K"}}})",
+           R"({"One": {"host": "192.168.1.1", "groups": {"__name__": "K"}}})",
+           R"({"One": {"host": "192.168.1.1", "groups": {"target": "K"}}})",
+       }) {
+    const auto filename = CreateTempFile(json_content);
+    const auto result = LoadTargetsFromFile(filename);
+    EXPECT_FALSE(result.ok()) << json_content;
+    EXPECT_EQ(result.status().code(), absl::StatusCode::kInvalidArgument);
+    std::remove(filename.c_str());
+  }
+}
+
+TEST(DiffTargetsTest, NoChanges) {
+  const std::vector<Target> targets = {
+      {.name = "One", .hostname = "192.168.1.1"},
+      {.name = "Two", .hostname = "192.168.1.2", .timeout = absl::Seconds(1)},
+  };
+  EXPECT_TRUE(DiffTargets(targets, targets).empty());
+}
+
+TEST(DiffTargetsTest, MatchesTargetsByName) {
+  const std::vector<Target> old_targets = {
+      {.name = "Kept", .hostname = "192.168.1.1"},
+      {.name = "Removed", .hostname = "192.168.1.2"},
+      {.name = "NewHost", .hostname = "192.168.1.3"},
+      {.name = "NewTimeout", .hostname = "192.168.1.4"},
+      {.name = "NewGroup", .hostname = "192.168.1.6"},
+  };
+  const std::vector<Target> new_targets = {
+      {.name = "Added", .hostname = "192.168.1.2"},
+      {.name = "NewTimeout",
+       .hostname = "192.168.1.4",
+       .timeout = absl::Seconds(1)},
+      {.name = "NewHost", .hostname = "192.168.1.5"},
+      {.name = "Kept", .hostname = "192.168.1.1"},
+      {.name = "NewGroup",
+       .hostname = "192.168.1.6",
+       .groups = {{"room", "Kitchen"}}},
+  };
+
+  const auto diff = DiffTargets(old_targets, new_targets);
+  ASSERT_EQ(diff.added.size(), 1);
+  EXPECT_EQ(diff.added[0], new_targets[0]);
+  ASSERT_EQ(diff.removed.size(), 1);
+  EXPECT_EQ(diff.removed[0], "Removed");
+  ASSERT_EQ(diff.changed.size(), 3);
+  EXPECT_EQ(diff.changed[0], new_targets[1]);
+  EXPECT_EQ(diff.changed[1], new_targets[2]);
+  EXPECT_EQ(diff.changed[2], new_targets[4]);
+}
+
 int main(int argc, char** argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
@@ -0,0 +1,110 @@
+#include "ddsketch.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "absl/log/check.h"
+
+DDSketch::DDSketch(const Options& options)
+    : options_(options),
+      gamma_((1 + options.relative_accuracy) /
+             (1 - options.relative_accuracy)),
+      log_gamma_(std::log(gamma_)),
+      num_buckets_(static_cast<size_t>(std::ceil(
+                       std::log(options.max_value / options.min_value) /
+                       log_gamma_)) +
+                   1),
+      counts_(new std::atomic<uint64_t>[num_buckets_]) {
+  CHECK(options.relative_accuracy > 0 && options.relative_accuracy < 1)
+      << "Relative accuracy must be between zero and one";
+  CHECK(options.min_value > 0 && options.min_value < options.max_value)
+      << "Range must be positive and non-empty";
+  Clear();
+}
+
+void DDSketch::Add(double value) {
+  if (!std::isfinite(value)) {
+    return;
+  }
+  counts_[GetBucket(value)].fetch_add(1, std::memory_order_relaxed);
+  double max = max_.load(std::memory_order_relaxed);
+  while (value > max && !max_.compare_exchange_weak(
+                            max, value, std::memory_order_relaxed)) {
+  }
+}
+
+void DDSketch::Merge(const DDSketch& other) {
+  CHECK(other.num_buckets_ == num_buckets_)
+      << "Only sketches with the same options can be merged";
+  for (size_t i = 0; i < num_buckets_; ++i) {
+    counts_[i].fetch_add(other.counts_[i].load(std::memory_order_relaxed),
+                         std::memory_order_relaxed);
+  }
+  const double other_max = other.max();
+  double max = max_.load(std::memory_order_relaxed);
+  while (other_max > max && !max_.compare_exchange_weak(
+                                max, other_max, std::memory_order_relaxed)) {
+  }
+}
+
+void DDSketch::Clear() {
+  for (size_t i = 0; i < num_buckets_; ++i) {
+    counts_[i].store(0, std::memory_order_relaxed);
+  }
+  max_.store(0, std::memory_order_relaxed);
+}
+
+uint64_t DDSketch::count() const {
+  uint64_t count = 0;
+  for (size_t i = 0; i < num_buckets_; ++i) {
+    count += counts_[i].load(std::memory_order_relaxed);
+  }
+  return count;
+}
+
+double DDSketch::max() const { return max_.load(std::memory_order_relaxed); }
+
+double DDSketch::Quantile(double q) const {
+  const uint64_t count = this->count();
+  if (count == 0) {
+    return std::numeric_limits<double>::quiet_NaN();
+  }
+  if (q >= 1) {
+    return max();
+  }
+  // The rank of the value at the quantile, counting from zero.
+  const auto rank =
+      static_cast<uint64_t>(std::max(0.0, q) * static_cast<double>(count - 1));
+  uint64_t cumulative_count = 0;
+  for (size_t i = 0; i < num_buckets_; ++i) {
+    cumulative_count += counts_[i].load(std::memory_order_relaxed);
+    if (cumulative_count > rank) {
+      return std::min(GetBucketValue(i), max());
+    }
+  }
+  // Only reached if values were added after counting them above.
+  return max();
+}
+
+size_t DDSketch::GetBucket(double value) const {
+  if (!(value > options_.min_value)) {
+    return 0;
+  }
+  // Clamped before converting, as converting a value that does not fit in a
+  // size_t is undefined.
+  const double bucket = std::clamp(
+      std::ceil(std::log(value / options_.min_value) / log_gamma_), 1.0,
+      static_cast<double>(num_buckets_ - 1));
+  return static_cast<size_t>(bucket);
+}
+
+double DDSketch::GetBucketValue(size_t bucket) const {
+  if (bucket == 0) {
+    return 0;
+  }
+  // The bucket's upper bound scaled down by (1 + gamma) / 2, which is within
+  // the relative accuracy of both of its bounds.
+  return options_.min_value * std::pow(gamma_, static_cast<double>(bucket)) *
+         2 / (1 + gamma_);
+}
@@ -0,0 +1,71 @@
+#ifndef DDSKETCH_H
+#define DDSKETCH_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// A mergeable sketch of a distribution, which answers quantile queries to
+// within a fixed relative error of the true value (DDSketch, Masson et al.
+// 2019). Values are counted in buckets whose bounds grow geometrically, so
+// adding a value is one logarithm and an atomic increment, and never blocks
+// or is blocked by the readers.
+//
+// The buckets cover a fixed range, and are allocated up front so that adding
+// never allocates. Values below the range, including zero and any negative
+// values, share a single bucket and are reported as zero. Values above the
+// range are counted in the last bucket, although the maximum is kept
+// exactly. NaN and infinite values are ignored.
+class DDSketch final {
+ public:
+  struct Options final {
+    // Bound on the error of a quantile, relative to the true value.
+    double relative_accuracy = 0.01;
+    // Range of values that are counted to the relative accuracy.
+    double min_value = 1e-3;
+    double max_value = 1e6;
+  };
+
+  DDSketch() = delete;
+  explicit DDSketch(const Options& options);
+
+  DDSketch(const DDSketch&) = delete;
+  DDSketch& operator=(const DDSketch&) = delete;
+
+  void Add(double value);
+
+  // Adds the values counted by `other`, which must have the same options.
+  void Merge(const DDSketch& other);
+
+  // Forgets every value. Values added concurrently may or may not be kept.
+  void Clear();
+
+  uint64_t count() const;
+  // Largest value added, or zero if there are none.
+  double max() const;
+
+  // Returns the value at quantile `q`, between zero and one, or NaN if no
+  // values have been added. A `q` of one is the exact maximum.
+  double Quantile(double q) const;
+
+  size_t num_buckets() const { return num_buckets_; }
+
+ private:
+  const Options options_;
+  // Ratio between the bounds of consecutive buckets.
+  const double gamma_;
+  const double log_gamma_;
+  // Bucket zero holds the values below the range, and bucket `i` the values
+  // in (min_value * gamma^(i-1), min_value * gamma^i].
+  const size_t num_buckets_;
+  const std::unique_ptr<std::atomic<uint64_t>[]> counts_;
+  std::atomic<double> max_ = 0;
+
+  size_t GetBucket(double value) const;
+  // Returns the estimate of the values counted in `bucket`, which is within
+  // the relative accuracy of all of them.
+  double GetBucketValue(size_t bucket) const;
+};
+
+#endif  // DDSKETCH_H
@@ -0,0 +1,115 @@
+#include "ddsketch.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <thread>
+#include <vector>
+
+namespace {
+
+using ::testing::DoubleEq;
+using ::testing::DoubleNear;
+
+inline constexpr DDSketch::Options kOptions = {
+    .relative_accuracy = 0.01,
+    .min_value = 0.1,
+    .max_value = 10000,
+};
+
+}  // namespace
+
+TEST(DDSketch, Empty) {
+  DDSketch sketch(kOptions);
+  EXPECT_EQ(sketch.count(), 0);
+  EXPECT_TRUE(std::isnan(sketch.Quantile(0.5)));
+  EXPECT_TRUE(std::isnan(sketch.Quantile(1.0)));
+}
+
+TEST(DDSketch, QuantilesWithinRelativeAccuracy) {
+  DDSketch sketch(kOptions);
+  for (int i = 1; i <= 1000; ++i) {
+    sketch.Add(i);
+  }
+
+  EXPECT_EQ(sketch.count(), 1000);
+  for (const double q : {0.0, 0.25, 0.5, 0.9, 0.99}) {
+    const double expected = 1 + std::floor(q * 999);
+    EXPECT_THAT(sketch.Quantile(q), DoubleNear(expected, expected * 0.01))
+        << "q = " << q;
+  }
+  EXPECT_THAT(sketch.Quantile(1.0), DoubleEq(1000));
+}
+
+TEST(DDSketch, ValuesOutsideRange) {
+  DDSketch sketch(kOptions);
+  sketch.Add(0);
+  sketch.Add(-5);
+  sketch.Add(0.05);
+  sketch.Add(50000);
+  sketch.Add(50000);
+
+  // Values below the range are reported as zero, and those above it as the
+  // top of the range, except for the exact maximum.
+  EXPECT_THAT(sketch.Quantile(0.0), DoubleEq(0));
+  EXPECT_THAT(sketch.Quantile(0.5), DoubleEq(0));
+  EXPECT_THAT(sketch.Quantile(0.9), DoubleNear(10000, 200));
+  EXPECT_THAT(sketch.Quantile(1.0), DoubleEq(50000));
+}
+
+TEST(DDSketch, IgnoresNonFiniteValues) {
+  DDSketch sketch(kOptions);
+  sketch.Add(std::numeric_limits<double>::quiet_NaN());
+  sketch.Add(std::numeric_limits<double>::infinity());
+  sketch.Add(-std::numeric_limits<double>::infinity());
+  EXPECT_EQ(sketch.count(), 0);
+
+  sketch.Add(1e300);
+  EXPECT_EQ(sketch.count(), 1);
+  EXPECT_THAT(sketch.Quantile(0.5), DoubleNear(10000, 200));
+  EXPECT_THAT(sketch.Quantile(1.0), DoubleEq(1e300));
+}
+
+TEST(DDSketch, MergeAndClear) {
+  DDSketch low(kOptions);
+  DDSketch high(kOptions);
+  for (int i = 0; i < 50; ++i) {
+    low.Add(10);
+    high.Add(1000);
+  }
+
+  low.Merge(high);
+  EXPECT_EQ(low.count(), 100);
+  EXPECT_THAT(low.Quantile(0.25), DoubleNear(10, 0.1));
+  EXPECT_THAT(low.Quantile(0.75), DoubleNear(1000, 10));
+  EXPECT_THAT(low.Quantile(1.0), DoubleEq(1000));
+  // The merged sketch is unchanged.
+  EXPECT_EQ(high.count(), 50);
+
+  low.Clear();
+  EXPECT_EQ(low.count(), 0);
+  EXPECT_TRUE(std::isnan(low.Quantile(0.5)));
+}
+
+TEST(DDSketch, ConcurrentAdds) {
+  constexpr int kNumThreads = 4;
+  constexpr int kNumAdds = 10000;
+  DDSketch sketch(kOptions);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kNumThreads; ++t) {
+    threads.emplace_back([&sketch, t] {
+      for (int i = 0; i < kNumAdds; ++i) {
+        sketch.Add(t + 1);
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  EXPECT_EQ(sketch.count(), static_cast<uint64_t>(kNumThreads * kNumAdds));
+  EXPECT_THAT(sketch.Quantile(1.0), DoubleEq(kNumThreads));
+}
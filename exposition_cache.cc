@@ -0,0 +1,136 @@
+#include "exposition_cache.h"
+
+#include <iterator>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "absl/log/log.h"
+#include "absl/strings/str_cat.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "prometheus/client_metric.h"
+#include "prometheus/metric_family.h"
+#include "prometheus/metric_type.h"
+#include "prometheus/text_serializer.h"
+#include "zlib.h"
+
+namespace {
+
+// Compresses `text` in to the gzip format, returning an empty string on
+// failure.
+std::string GzipCompress(std::string_view text) {
+  z_stream stream = {};
+  // Adding 16 to the window bits selects the gzip wrapper rather than zlib's.
+  if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                   /*windowBits=*/15 + 16, /*memLevel=*/8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    return "";
+  }
+
+  std::string output(deflateBound(&stream, text.size()), '\0');
+  stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(text.data()));
+  stream.avail_in = text.size();
+  stream.next_out = reinterpret_cast<Bytef*>(output.data());
+  stream.avail_out = output.size();
+  const int result = deflate(&stream, Z_FINISH);
+  deflateEnd(&stream);
+  if (result != Z_STREAM_END) {
+    return "";
+  }
+  output.resize(stream.total_out);
+  return output;
+}
+
+::prometheus::ClientMetric CounterMetric(std::string_view result,
+                                         uint64_t value) {
+  ::prometheus::ClientMetric metric;
+  metric.label.push_back({.name = "result", .value = std::string(result)});
+  metric.counter.value = static_cast<double>(value);
+  return metric;
+}
+
+}  // namespace
+
+ExpositionCache::ExpositionCache(
+    std::shared_ptr<::prometheus::Collectable> collectable)
+    : etag_prefix_(absl::StrCat(absl::Hex(absl::ToUnixMicros(absl::Now())))),
+      collectables_({std::move(collectable)}) {}
+
+void ExpositionCache::AddCollectable(
+    std::shared_ptr<::prometheus::Collectable> collectable) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  collectables_.push_back(std::move(collectable));
+}
+
+void ExpositionCache::Publish() { ++version_; }
+
+std::shared_ptr<const ExpositionCache::Snapshot> ExpositionCache::Get() {
+  const uint64_t version = version_;
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (snapshot_ != nullptr && snapshot_->version == version) {
+    ++stats_.hits;
+    return snapshot_;
+  }
+  ++stats_.renders;
+  snapshot_ = Render(version);
+  return snapshot_;
+}
+
+std::string ExpositionCache::CurrentETag() const { return ETag(version_); }
+
+void ExpositionCache::RecordNotModified() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  ++stats_.not_modified;
+}
+
+ExpositionCache::Stats ExpositionCache::GetStats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+std::string ExpositionCache::ETag(uint64_t version) const {
+  return absl::StrCat("\"", etag_prefix_, "-", version, "\"");
+}
+
+std::shared_ptr<const ExpositionCache::Snapshot> ExpositionCache::Render(
+    uint64_t version) const {
+  std::vector<::prometheus::MetricFamily> families;
+  for (const auto& collectable : collectables_) {
+    auto collected = collectable->Collect();
+    families.insert(families.end(), std::make_move_iterator(collected.begin()),
+                    std::make_move_iterator(collected.end()));
+  }
+
+  // The cache's own stats are rendered along with the metrics, so they are
+  // as of the start of the version being served.
+  families.push_back(::prometheus::MetricFamily{
+      .name = "shelly_exporter_exposition_requests_counter",
+      .help = "Number of metrics requests served from the exposition cache, "
+              "by whether they rendered a new version, hit an already "
+              "rendered one, or were not modified since the client's copy",
+      .type = ::prometheus::MetricType::Counter,
+      .metric = {CounterMetric("render", stats_.renders),
+                 CounterMetric("hit", stats_.hits),
+                 CounterMetric("not_modified", stats_.not_modified)},
+  });
+  ::prometheus::ClientMetric version_metric;
+  version_metric.gauge.value = static_cast<double>(version);
+  families.push_back(::prometheus::MetricFamily{
+      .name = "shelly_exporter_exposition_version",
+      .help = "Version of the metrics being served, which increases once "
+              "every poll period",
+      .type = ::prometheus::MetricType::Gauge,
+      .metric = {std::move(version_metric)},
+  });
+
+  auto snapshot = std::make_shared<Snapshot>();
+  snapshot->version = version;
+  snapshot->etag = ETag(version);
+  snapshot->text = ::prometheus::TextSerializer().Serialize(families);
+  snapshot->gzip = GzipCompress(snapshot->text);
+  if (snapshot->gzip.empty()) {
+    LOG(ERROR) << "Failed to compress metrics version " << version;
+  }
+  return snapshot;
+}
@@ -0,0 +1,85 @@
+#ifndef EXPOSITION_CACHE_H
+#define EXPOSITION_CACHE_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "prometheus/collectable.h"
+
+// Caches the text exposition of a collectable, along with a gzip compressed
+// copy, so that every scrape between two calls to Publish is served the same
+// immutable bytes rather than collecting and serializing the metrics again.
+class ExpositionCache final {
+ public:
+  struct Snapshot final {
+    // Increases by one with every call to Publish.
+    uint64_t version = 0;
+    // Quoted HTTP entity tag, unique to this version and process.
+    std::string etag;
+    std::string text;
+    // Empty if compression failed, in which case only the text can be served.
+    std::string gzip;
+  };
+
+  struct Stats final {
+    // Requests served from an already rendered snapshot.
+    uint64_t hits = 0;
+    // Requests that had to render a new snapshot.
+    uint64_t renders = 0;
+    // Conditional requests whose snapshot was unchanged, so no body was sent.
+    uint64_t not_modified = 0;
+  };
+
+  ExpositionCache() = delete;
+  explicit ExpositionCache(
+      std::shared_ptr<::prometheus::Collectable> collectable);
+
+  ExpositionCache(const ExpositionCache&) = delete;
+  ExpositionCache& operator=(const ExpositionCache&) = delete;
+
+  // Adds another collectable whose metrics are rendered along with the
+  // first, from the next version on.
+  void AddCollectable(std::shared_ptr<::prometheus::Collectable> collectable);
+
+  // Marks the metrics as changed. The next call to Get renders a new
+  // snapshot, which is then served until Publish is called again.
+  void Publish();
+
+  // Returns the snapshot for the latest published version, rendering it if
+  // it's the first request since Publish. Counts the request as a hit or a
+  // render.
+  std::shared_ptr<const Snapshot> Get();
+
+  // Returns the ETag of the latest published version, without rendering it
+  // or counting a request, so that a conditional request can be answered
+  // before deciding whether it needs the snapshot at all.
+  std::string CurrentETag() const;
+
+  // Counts a conditional request that matched the current ETag, and so was
+  // answered without calling Get.
+  void RecordNotModified();
+
+  Stats GetStats() const;
+
+ private:
+  // Distinguishes the ETags of different runs of the exporter.
+  const std::string etag_prefix_;
+
+  std::atomic<uint64_t> version_ = 0;
+
+  // Held while rendering, so that concurrent scrapes wait for one render
+  // rather than all rendering the same version.
+  mutable std::mutex mutex_;
+  std::vector<std::shared_ptr<::prometheus::Collectable>> collectables_;
+  std::shared_ptr<const Snapshot> snapshot_;
+  Stats stats_;
+
+  std::string ETag(uint64_t version) const;
+  std::shared_ptr<const Snapshot> Render(uint64_t version) const;
+};
+
+#endif  // EXPOSITION_CACHE_H
@@ -0,0 +1,194 @@
+#include "exposition_cache.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "prometheus/client_metric.h"
+#include "prometheus/metric_family.h"
+#include "prometheus/metric_type.h"
+#include "zlib.h"
+
+namespace {
+
+using ::testing::HasSubstr;
+using ::testing::Not;
+
+// Exports a single gauge whose value is set by the test, and counts how many
+// times it has been collected.
+class FakeCollectable final : public ::prometheus::Collectable {
+ public:
+  std::vector<::prometheus::MetricFamily> Collect() const override {
+    ++collections;
+    ::prometheus::ClientMetric metric;
+    metric.gauge.value = value;
+    return {::prometheus::MetricFamily{
+        .name = "test_gauge",
+        .help = "Test gauge",
+        .type = ::prometheus::MetricType::Gauge,
+        .metric = {metric},
+    }};
+  }
+
+  std::atomic<double> value = 0;
+  mutable std::atomic<int> collections = 0;
+};
+
+std::string GzipDecompress(std::string_view data) {
+  z_stream stream = {};
+  if (inflateInit2(&stream, /*windowBits=*/15 + 16) != Z_OK) {
+    return "";
+  }
+  stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  stream.avail_in = data.size();
+
+  std::string output;
+  char buffer[4096];
+  int result = Z_OK;
+  while (result == Z_OK) {
+    stream.next_out = reinterpret_cast<Bytef*>(buffer);
+    stream.avail_out = sizeof(buffer);
+    result = inflate(&stream, Z_NO_FLUSH);
+    output.append(buffer, sizeof(buffer) - stream.avail_out);
+  }
+  inflateEnd(&stream);
+  return result == Z_STREAM_END ? output : "";
+}
+
+}  // namespace
+
+TEST(ExpositionCache, RendersLazily) {
+  auto collectable = std::make_shared<FakeCollectable>();
+  ExpositionCache cache(collectable);
+  EXPECT_EQ(collectable->collections, 0);
+
+  const auto snapshot = cache.Get();
+  ASSERT_NE(snapshot, nullptr);
+  EXPECT_EQ(snapshot->version, 0);
+  EXPECT_THAT(snapshot->text, HasSubstr("test_gauge 0"));
+  EXPECT_EQ(collectable->collections, 1);
+}
+
+TEST(ExpositionCache, RendersAddedCollectables) {
+  auto first = std::make_shared<FakeCollectable>();
+  auto second = std::make_shared<FakeCollectable>();
+  first->value = 1;
+  second->value = 2;
+  ExpositionCache cache(first);
+  cache.AddCollectable(second);
+
+  const auto snapshot = cache.Get();
+  EXPECT_THAT(snapshot->text, HasSubstr("test_gauge 1"));
+  EXPECT_THAT(snapshot->text, HasSubstr("test_gauge 2"));
+  EXPECT_EQ(first->collections, 1);
+  EXPECT_EQ(second->collections, 1);
+}
+
+TEST(ExpositionCache, ServesSameSnapshotUntilPublish) {
+  auto collectable = std::make_shared<FakeCollectable>();
+  ExpositionCache cache(collectable);
+
+  const auto first = cache.Get();
+  collectable->value = 123;
+  const auto second = cache.Get();
+  EXPECT_EQ(first, second);
+  EXPECT_THAT(second->text, Not(HasSubstr("test_gauge 123")));
+  EXPECT_EQ(collectable->collections, 1);
+
+  cache.Publish();
+  const auto third = cache.Get();
+  EXPECT_NE(third, first);
+  EXPECT_EQ(third->version, first->version + 1);
+  EXPECT_NE(third->etag, first->etag);
+  EXPECT_THAT(third->text, HasSubstr("test_gauge 123"));
+  EXPECT_EQ(collectable->collections, 2);
+
+  // The earlier snapshot is unchanged for any request still holding it.
+  EXPECT_THAT(first->text, HasSubstr("test_gauge 0"));
+}
+
+TEST(ExpositionCache, SkipsUnrequestedVersions) {
+  auto collectable = std::make_shared<FakeCollectable>();
+  ExpositionCache cache(collectable);
+
+  cache.Publish();
+  cache.Publish();
+  cache.Publish();
+  EXPECT_EQ(cache.Get()->version, 3);
+  EXPECT_EQ(collectable->collections, 1);
+}
+
+TEST(ExpositionCache, ETagIsQuoted) {
+  ExpositionCache cache(std::make_shared<FakeCollectable>());
+  const auto snapshot = cache.Get();
+  ASSERT_GE(snapshot->etag.size(), 2);
+  EXPECT_EQ(snapshot->etag.front(), '"');
+  EXPECT_EQ(snapshot->etag.back(), '"');
+}
+
+TEST(ExpositionCache, GzipMatchesText) {
+  auto collectable = std::make_shared<FakeCollectable>();
+  collectable->value = 42;
+  ExpositionCache cache(collectable);
+
+  const auto snapshot = cache.Get();
+  ASSERT_FALSE(snapshot->gzip.empty());
+  EXPECT_EQ(GzipDecompress(snapshot->gzip), snapshot->text);
+}
+
+TEST(ExpositionCache, CurrentETagDoesNotRender) {
+  ExpositionCache cache(std::make_shared<FakeCollectable>());
+
+  const std::string etag = cache.CurrentETag();
+  EXPECT_EQ(cache.GetStats().renders, 0);
+  EXPECT_EQ(cache.Get()->etag, etag);
+
+  cache.Publish();
+  EXPECT_NE(cache.CurrentETag(), etag);
+  EXPECT_EQ(cache.GetStats().renders, 1);
+  EXPECT_EQ(cache.GetStats().hits, 0);
+}
+
+TEST(ExpositionCache, CountsRequests) {
+  ExpositionCache cache(std::make_shared<FakeCollectable>());
+
+  cache.Get();
+  cache.Get();
+  cache.Get();
+  cache.RecordNotModified();
+  cache.Publish();
+  cache.Get();
+
+  const auto stats = cache.GetStats();
+  EXPECT_EQ(stats.renders, 2);
+  EXPECT_EQ(stats.hits, 2);
+  EXPECT_EQ(stats.not_modified, 1);
+}
+
+TEST(ExpositionCache, ExportsStats) {
+  ExpositionCache cache(std::make_shared<FakeCollectable>());
+
+  cache.Get();
+  cache.Get();
+  cache.RecordNotModified();
+  cache.Publish();
+
+  // The stats are as of the start of the render.
+  const auto snapshot = cache.Get();
+  EXPECT_THAT(snapshot->text,
+              HasSubstr("shelly_exporter_exposition_requests_counter{"
+                        "result=\"render\"} 2"));
+  EXPECT_THAT(snapshot->text,
+              HasSubstr("shelly_exporter_exposition_requests_counter{"
+                        "result=\"hit\"} 1"));
+  EXPECT_THAT(snapshot->text,
+              HasSubstr("shelly_exporter_exposition_requests_counter{"
+                        "result=\"not_modified\"} 1"));
+  EXPECT_THAT(snapshot->text,
+              HasSubstr("shelly_exporter_exposition_version 1"));
+}
@@ -0,0 +1,797 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/log/log.h"
+#include "absl/strings/substitute.h"
+#include "absl/time/clock.h"
+#include "absl/types/span.h"
+#include "prometheus/client_metric.h"
+#include "prometheus/collectable.h"
+#include "prometheus/metric_family.h"
+#include "prometheus/metric_type.h"
+#include "registry.h"
+#include "registry_internal.h"
+#include "seqlock.h"
+#include "shelly.h"
+
+namespace {
+
+using ::prometheus::ClientMetric;
+using ::prometheus::MetricFamily;
+using ::prometheus::MetricType;
+using ::registry_internal::EnergyIntegrator;
+using ::registry_internal::GroupSums;
+using ::registry_internal::Sample;
+using ::registry_internal::StableVector;
+using ::registry_internal::WindowedSketch;
+using BucketBoundaries = ::prometheus::Histogram::BucketBoundaries;
+using Labels = std::vector<ClientMetric::Label>;
+
+// Values are updated by the poller's workers while being read by collection,
+// so every access to a stored value goes through an atomic_ref. The readings
+// from a successful poll are the exception, being published together through
+// a SeqLock.
+template <class T>
+T Load(const T& value) {
+  return std::atomic_ref<T>(const_cast<T&>(value))
+      .load(std::memory_order_relaxed);
+}
+
+template <class T>
+void Store(T& value, T new_value) {
+  std::atomic_ref<T>(value).store(new_value, std::memory_order_relaxed);
+}
+
+template <class T>
+void Add(T& value, T delta) {
+  std::atomic_ref<T>(value).fetch_add(delta, std::memory_order_relaxed);
+}
+
+struct FamilyInfo final {
+  const char* name;
+  const char* help;
+};
+
+enum GaugeColumn : size_t {
+  kCircuitState,
+  kNumGaugeColumns,
+};
+
+enum CounterColumn : size_t {
+  kSuccess,
+  kError,
+  kTimeout,
+  kConnectionReuse,
+  kReconnect,
+  kEnergy,
+  kNumCounterColumns,
+};
+
+enum HistogramColumn : size_t {
+  kNameLookupTime,
+  kConnectTime,
+  kFirstByteTime,
+  kScrapeTime,
+  kParseTime,
+  kNumHistogramColumns,
+};
+
+enum PoolGauge : size_t {
+  kWorkers,
+  kQueueDepth,
+  kUtilisation,
+  kNumPoolGauges,
+};
+
+enum PollHistogram : size_t {
+  kSchedulingLag,
+  kPollDuration,
+  kPollOverrun,
+  kNumPollHistograms,
+};
+
+// The families match those exported by CreateRegistry.
+inline constexpr std::array<FamilyInfo, kNumGaugeColumns> kGaugeFamilies = {{
+    {"shelly_circuit_state",
+     "State of the target's circuit breaker: 0 if closed, 1 if half-open, or "
+     "2 if open and the target is being backed off"},
+}};
+
+inline constexpr std::array<FamilyInfo, kNumCounterColumns> kCounterFamilies =
+    {{
+        {"shelly_success_counter",
+         "Number of successful metrics queries for the target"},
+        {"shelly_error_counter",
+         "Number of failed metrics queries for the target"},
+        {"shelly_timeout_counter",
+         "Number of metrics queries for the target that ran out of time"},
+        {"shelly_connection_reuse_counter",
+         "Number of queries for the target sent over an existing keep-alive "
+         "connection"},
+        {"shelly_reconnect_counter",
+         "Number of queries for the target that had to open a new "
+         "connection"},
+        {"shelly_energy_wh_total",
+         "Energy used by the target in watt hours, integrated from its power "
+         "readings"},
+    }};
+
+inline constexpr std::array<FamilyInfo, kNumHistogramColumns>
+    kHistogramFamilies = {{
+        {"shelly_dns_seconds",
+         "Time taken to resolve the target's hostname, or zero if a "
+         "connection was reused"},
+        {"shelly_connect_seconds",
+         "Time from the start of a query until the target was connected to, "
+         "or zero if a connection was reused"},
+        {"shelly_first_byte_seconds",
+         "Time from the start of a query until the first byte of the "
+         "target's response was received"},
+        {"shelly_scrape_seconds",
+         "Total time taken by each query of the target"},
+        {"shelly_parse_seconds", "Time taken to parse the target's responses"},
+    }};
+
+inline constexpr std::array<FamilyInfo, kNumPoolGauges> kPoolFamilies = {{
+    {"shelly_exporter_workers", "Number of worker threads polling the targets"},
+    {"shelly_exporter_queue_depth",
+     "Peak number of targets waiting for a worker during the last poll "
+     "period"},
+    {"shelly_exporter_worker_utilisation",
+     "Fraction of worker time spent processing targets during the last poll "
+     "period"},
+}};
+
+inline constexpr std::array<FamilyInfo, kNumPollHistograms> kPollFamilies = {{
+    {"shelly_exporter_scheduling_lag_seconds",
+     "Time between a poll being due and a worker starting on it"},
+    {"shelly_exporter_poll_duration_seconds",
+     "Time taken by a worker to scrape and parse a target"},
+    {"shelly_exporter_poll_overrun_seconds",
+     "How long polls that overran their period finished after the next poll "
+     "was due"},
+}};
+
+inline constexpr FamilyInfo kApowerSummaryFamily = {
+    registry_internal::kApowerSummaryName,
+    registry_internal::kApowerSummaryHelp,
+};
+
+// A column of histograms sharing the same buckets, one per row. The bucket
+// counts of every row are stored back to back, with a final +Inf bucket.
+class HistogramColumnData final {
+ public:
+  explicit HistogramColumnData(const BucketBoundaries& boundaries)
+      : boundaries_(boundaries) {}
+
+  void Resize(size_t num_rows) {
+    counts_.Resize(num_rows * stride());
+    sums_.Resize(num_rows);
+  }
+
+  // Must not race with observations of the row.
+  void Reset(size_t row) {
+    for (size_t i = 0; i < stride(); ++i) {
+      Store<uint64_t>(counts_[row * stride() + i], 0);
+    }
+    Store(sums_[row], 0.0);
+  }
+
+  void Observe(size_t row, double value) {
+    const size_t bucket =
+        std::lower_bound(boundaries_.begin(), boundaries_.end(), value) -
+        boundaries_.begin();
+    Add<uint64_t>(counts_[row * stride() + bucket], 1);
+    Add(sums_[row], value);
+  }
+
+  ClientMetric::Histogram Collect(size_t row) const {
+    ClientMetric::Histogram histogram;
+    histogram.bucket.reserve(stride());
+    uint64_t cumulative_count = 0;
+    for (size_t i = 0; i < stride(); ++i) {
+      cumulative_count += Load(counts_[row * stride() + i]);
+      histogram.bucket.push_back({
+          .cumulative_count = cumulative_count,
+          .upper_bound = i < boundaries_.size()
+                             ? boundaries_[i]
+                             : std::numeric_limits<double>::infinity(),
+      });
+    }
+    histogram.sample_count = cumulative_count;
+    histogram.sample_sum = Load(sums_[row]);
+    return histogram;
+  }
+
+ private:
+  const BucketBoundaries& boundaries_;
+  StableVector<uint64_t> counts_;
+  StableVector<double> sums_;
+
+  size_t stride() const { return boundaries_.size() + 1; }
+};
+
+// Holds every metric, and renders them directly in to metric families on
+// collection. Shared with the exposer, so that it may outlive the registry.
+//
+// Collection never takes a lock, so it neither blocks nor is blocked by the
+// workers, or by targets being added and removed. The rows never move, and a
+// removed target's row is only cleared and reused once no collection that
+// might still be reading it is in progress.
+class FlatCollectable final : public ::prometheus::Collectable {
+ public:
+  explicit FlatCollectable(const Registry::Options& options)
+      : quantile_window_(options.quantile_window),
+        energy_max_gap_(options.energy_max_gap),
+        time_func_(options.time_func),
+        histograms_({
+            HistogramColumnData(registry_internal::LatencyBuckets()),
+            HistogramColumnData(registry_internal::LatencyBuckets()),
+            HistogramColumnData(registry_internal::LatencyBuckets()),
+            HistogramColumnData(registry_internal::LatencyBuckets()),
+            HistogramColumnData(registry_internal::ParseBuckets()),
+        }),
+        poll_histograms_({
+            HistogramColumnData(registry_internal::LatencyBuckets()),
+            HistogramColumnData(registry_internal::LatencyBuckets()),
+            HistogramColumnData(registry_internal::LatencyBuckets()),
+        }) {
+    for (auto& histogram : poll_histograms_) {
+      histogram.Resize(1);
+    }
+  }
+
+  absl::StatusOr<TargetHandle> AddTarget(absl::string_view name) {
+    std::unique_lock lock(mutex_);
+    if (handles_.contains(name)) {
+      return absl::InvalidArgumentError(
+          absl::Substitute("Duplicate target name \"$0\"", name));
+    }
+
+    // The label is only rendered once here, then copied in to each of the
+    // target's metrics on collection.
+    auto label = std::make_unique<const Labels>(Labels{{
+        .name = registry_internal::kTargetLabel,
+        .value = std::string(name),
+    }});
+    ReclaimRemovedRows();
+    TargetHandle handle;
+    if (!free_handles_.empty()) {
+      handle = free_handles_.back();
+      free_handles_.pop_back();
+    } else {
+      handle = num_rows_.load(std::memory_order_relaxed);
+      AddRow();
+    }
+    handles_.emplace(name, handle);
+    labels_[handle].store(label.get());
+    owned_labels_[handle] = std::move(label);
+    return handle;
+  }
+
+  absl::Status RemoveTarget(absl::string_view name) {
+    std::unique_lock lock(mutex_);
+    const auto it = handles_.find(name);
+    if (it == handles_.end()) {
+      return absl::NotFoundError(
+          absl::Substitute("Unknown target name \"$0\"", name));
+    }
+    const TargetHandle handle = it->second;
+    handles_.erase(it);
+
+    group_sums_.Leave(target_groups_[handle],
+                      samples_[handle].Load().metrics);
+    target_groups_[handle].clear();
+    // A null label marks the row as removed, and it's skipped on collection.
+    // Its values are left for any collection already reading it, until the
+    // row is reclaimed.
+    labels_[handle].store(nullptr);
+    removed_handles_.push_back(handle);
+    ReclaimRemovedRows();
+    return absl::OkStatus();
+  }
+
+  absl::Status SetTargetGroups(absl::string_view name,
+                               const TargetGroups& groups) {
+    std::unique_lock lock(mutex_);
+    const auto it = handles_.find(name);
+    if (it == handles_.end()) {
+      return absl::NotFoundError(
+          absl::Substitute("Unknown target name \"$0\"", name));
+    }
+    const TargetHandle handle = it->second;
+    const ::shelly::Metrics readings = samples_[handle].Load().metrics;
+    group_sums_.Leave(target_groups_[handle], readings);
+    target_groups_[handle] = group_sums_.Join(groups, readings);
+    return absl::OkStatus();
+  }
+
+  std::optional<TargetHandle> FindTarget(absl::string_view name) const {
+    std::shared_lock lock(mutex_);
+    auto it = handles_.find(name);
+    if (it == handles_.end()) {
+      return std::nullopt;
+    }
+    return it->second;
+  }
+
+  std::vector<TargetState> GetTargetStates() const {
+    std::shared_lock lock(mutex_);
+    std::vector<TargetState> states;
+    states.reserve(handles_.size());
+    for (const auto& [name, handle] : handles_) {
+      const Sample sample = samples_[handle].Load();
+      states.push_back(TargetState{
+          .name = name,
+          .success_queries = Load(counters_[kSuccess][handle]),
+          .error_queries = Load(counters_[kError][handle]),
+          .timeout_queries = Load(counters_[kTimeout][handle]),
+          .reused_connections = Load(counters_[kConnectionReuse][handle]),
+          .new_connections = Load(counters_[kReconnect][handle]),
+          .metrics = sample.metrics,
+          .last_updated = sample.last_updated,
+          .energy_wh = Load(counters_[kEnergy][handle]),
+      });
+    }
+    return states;
+  }
+
+  absl::Status RestoreTargetState(const TargetState& state) {
+    std::shared_lock lock(mutex_);
+    const auto it = handles_.find(state.name);
+    if (it == handles_.end()) {
+      return absl::NotFoundError(
+          absl::Substitute("Unknown target name \"$0\"", state.name));
+    }
+    const TargetHandle handle = it->second;
+    Add(counters_[kSuccess][handle], state.success_queries);
+    Add(counters_[kError][handle], state.error_queries);
+    Add(counters_[kTimeout][handle], state.timeout_queries);
+    Add(counters_[kConnectionReuse][handle], state.reused_connections);
+    Add(counters_[kReconnect][handle], state.new_connections);
+    Add(counters_[kEnergy][handle], state.energy_wh);
+    if (state.last_updated > 0) {
+      GroupSums::Update(target_groups_[handle],
+                        samples_[handle].Load().metrics, state.metrics);
+      samples_[handle].Store(Sample{
+          .metrics = state.metrics,
+          .last_updated = state.last_updated,
+      });
+      energy_integrators_[handle].Add(
+          state.metrics.apower,
+          absl::UnixEpoch() + absl::Seconds(state.last_updated));
+    }
+    return absl::OkStatus();
+  }
+
+  void ErrorCallback(TargetHandle handle, const absl::Status& status) {
+    std::shared_lock lock(mutex_);
+    if (!IsKnownTarget(handle)) {
+      return;
+    }
+    ApplyError(handle, status);
+  }
+
+  void SuccessCallback(TargetHandle handle,
+                       const ::shelly::Metrics& metrics) {
+    std::shared_lock lock(mutex_);
+    if (!IsKnownTarget(handle)) {
+      return;
+    }
+    ApplySuccess(handle, metrics, absl::Now());
+  }
+
+  // Applies the whole batch under a single lock.
+  void Consume(absl::Span<const PollResult> results) {
+    std::shared_lock lock(mutex_);
+    for (const auto& result : results) {
+      if (!IsKnownTarget(result.handle)) {
+        continue;
+      }
+      if (result.metrics.ok()) {
+        ApplySuccess(result.handle, *result.metrics, result.time);
+      } else {
+        ApplyError(result.handle, result.metrics.status());
+      }
+    }
+  }
+
+  void ScrapeStatsCallback(TargetHandle handle, const ScrapeStats& stats) {
+    std::shared_lock lock(mutex_);
+    if (!IsKnownTarget(handle)) {
+      return;
+    }
+    Add(counters_[stats.reused_connection ? kConnectionReuse : kReconnect]
+                 [handle],
+        1.0);
+    histograms_[kNameLookupTime].Observe(
+        handle, absl::ToDoubleSeconds(stats.name_lookup_time));
+    histograms_[kConnectTime].Observe(
+        handle, absl::ToDoubleSeconds(stats.connect_time));
+    histograms_[kFirstByteTime].Observe(
+        handle, absl::ToDoubleSeconds(stats.first_byte_time));
+    histograms_[kScrapeTime].Observe(handle,
+                                     absl::ToDoubleSeconds(stats.total_time));
+  }
+
+  void PoolStatsCallback(const ThreadPool::Stats& stats) {
+    Store(pool_gauges_[kWorkers], static_cast<double>(stats.num_workers));
+    Store(pool_gauges_[kQueueDepth],
+          static_cast<double>(stats.peak_queue_depth));
+    Store(pool_gauges_[kUtilisation], stats.utilisation);
+    has_pool_stats_ = true;
+  }
+
+  void PollTimingsCallback(TargetHandle handle,
+                           const Poller::PollTimings& timings) {
+    poll_histograms_[kSchedulingLag].Observe(
+        0, absl::ToDoubleSeconds(timings.scheduling_lag));
+    poll_histograms_[kPollDuration].Observe(
+        0, absl::ToDoubleSeconds(timings.duration));
+    if (timings.overrun > absl::ZeroDuration()) {
+      poll_histograms_[kPollOverrun].Observe(
+          0, absl::ToDoubleSeconds(timings.overrun));
+    }
+    has_poll_timings_ = true;
+
+    std::shared_lock lock(mutex_);
+    if (!IsKnownTarget(handle)) {
+      return;
+    }
+    if (timings.parse_time > absl::ZeroDuration()) {
+      histograms_[kParseTime].Observe(
+          handle, absl::ToDoubleSeconds(timings.parse_time));
+    }
+  }
+
+  void CircuitStateCallback(TargetHandle handle,
+                            CircuitBreaker::State state) {
+    std::shared_lock lock(mutex_);
+    if (!IsKnownTarget(handle)) {
+      return;
+    }
+    Store(gauges_[kCircuitState][handle], static_cast<double>(state));
+  }
+
+  std::vector<MetricFamily> Collect() const override {
+    std::vector<MetricFamily> families;
+    const absl::Time now = time_func_();
+    const CollectionScope scope(active_collections_);
+    // Each row's label is loaded once, so that every family has the same
+    // targets even if some are added or removed meanwhile.
+    const size_t num_rows = num_rows_.load(std::memory_order_acquire);
+    std::vector<const Labels*> labels(num_rows);
+    size_t num_targets = 0;
+    for (size_t row = 0; row < num_rows; ++row) {
+      labels[row] = labels_[row].load();
+      num_targets += labels[row] != nullptr;
+    }
+    if (num_targets > 0) {
+      // Each target's sample is loaded once, so that all of its readings are
+      // from the same poll.
+      std::vector<Sample> samples(num_rows);
+      for (size_t row = 0; row < num_rows; ++row) {
+        if (labels[row] != nullptr) {
+          samples[row] = samples_[row].Load();
+        }
+      }
+      for (const auto& sample_family : registry_internal::kSampleFamilies) {
+        families.push_back(CollectColumn(
+            {sample_family.name, sample_family.help}, MetricType::Gauge,
+            labels, num_targets, [&](size_t row, ClientMetric& metric) {
+              metric.gauge.value = sample_family.get(samples[row]);
+            }));
+      }
+      for (size_t i = 0; i < kNumGaugeColumns; ++i) {
+        families.push_back(CollectColumn(
+            kGaugeFamilies[i], MetricType::Gauge, labels, num_targets,
+            [&](size_t row, ClientMetric& metric) {
+              metric.gauge.value = Load(gauges_[i][row]);
+            }));
+      }
+      for (size_t i = 0; i < kNumCounterColumns; ++i) {
+        families.push_back(CollectColumn(
+            kCounterFamilies[i], MetricType::Counter, labels, num_targets,
+            [&](size_t row, ClientMetric& metric) {
+              metric.counter.value = Load(counters_[i][row]);
+            }));
+      }
+      for (size_t i = 0; i < kNumHistogramColumns; ++i) {
+        families.push_back(CollectColumn(
+            kHistogramFamilies[i], MetricType::Histogram, labels, num_targets,
+            [&](size_t row, ClientMetric& metric) {
+              metric.histogram = histograms_[i].Collect(row);
+            }));
+      }
+      families.push_back(CollectColumn(
+          kApowerSummaryFamily, MetricType::Summary, labels, num_targets,
+          [&](size_t row, ClientMetric& metric) {
+            metric.summary = apower_summaries_[row]->Collect(now);
+          }));
+    }
+    group_sums_.Collect(families);
+
+    // Like the targets, the exporter wide metrics are only collected once
+    // there is something to report.
+    if (has_pool_stats_) {
+      for (size_t i = 0; i < kNumPoolGauges; ++i) {
+        ClientMetric metric;
+        metric.gauge.value = Load(pool_gauges_[i]);
+        families.push_back(CollectScalar(kPoolFamilies[i], MetricType::Gauge,
+                                         std::move(metric)));
+      }
+    }
+    if (has_poll_timings_) {
+      for (size_t i = 0; i < kNumPollHistograms; ++i) {
+        ClientMetric metric;
+        metric.histogram = poll_histograms_[i].Collect(0);
+        families.push_back(CollectScalar(
+            kPollFamilies[i], MetricType::Histogram, std::move(metric)));
+      }
+    }
+    return families;
+  }
+
+ private:
+  // Counts the collections in progress, for as long as it's in scope.
+  class CollectionScope final {
+   public:
+    explicit CollectionScope(std::atomic<int>& active_collections)
+        : active_collections_(active_collections) {
+      ++active_collections_;
+    }
+    ~CollectionScope() { --active_collections_; }
+
+   private:
+    std::atomic<int>& active_collections_;
+  };
+
+  const absl::Duration quantile_window_;
+  const absl::Duration energy_max_gap_;
+  const std::function<absl::Time()> time_func_;
+
+  // Guards the set of targets against the workers. Adding or removing a
+  // target takes an exclusive lock, so that no worker is updating a row
+  // while it's cleared, while updating values only needs a shared lock.
+  // Collection doesn't take it at all.
+  mutable std::shared_mutex mutex_;
+  absl::flat_hash_map<std::string, TargetHandle> handles_;
+  // Every row below this has been allocated in every column.
+  std::atomic<size_t> num_rows_ = 0;
+  // Indexed by target handle, as are the rows of every column. Null for a
+  // removed target's row, until it's reused.
+  StableVector<std::atomic<const Labels*>> labels_;
+  // Owns the labels, which are only freed once their row is reclaimed.
+  std::vector<std::unique_ptr<const Labels>> owned_labels_;
+  // Handles of removed targets, whose rows may still be being read.
+  std::vector<TargetHandle> removed_handles_;
+  // Handles of reclaimed rows, to be reused before adding any more rows.
+  std::vector<TargetHandle> free_handles_;
+  // Collections in progress. Removed rows are only reclaimed once none are.
+  mutable std::atomic<int> active_collections_ = 0;
+
+  // Read without blocking the workers storing new samples, and never torn
+  // between two polls.
+  StableVector<SeqLock<Sample>> samples_;
+  std::array<StableVector<double>, kNumGaugeColumns> gauges_;
+  std::array<StableVector<double>, kNumCounterColumns> counters_;
+  std::array<HistogramColumnData, kNumHistogramColumns> histograms_;
+  // Each sketch is allocated separately, as it's too large to keep a row of
+  // in every block.
+  StableVector<std::unique_ptr<WindowedSketch>> apower_summaries_;
+  // Only ever updated by the worker polling the row's target.
+  std::vector<EnergyIntegrator> energy_integrators_;
+  // The groups of each row's target, which are only changed with `mutex_`
+  // held exclusively.
+  std::vector<std::vector<GroupSums::Group*>> target_groups_;
+  GroupSums group_sums_;
+
+  std::array<double, kNumPoolGauges> pool_gauges_ = {};
+  std::array<HistogramColumnData, kNumPollHistograms> poll_histograms_;
+  std::atomic<bool> has_pool_stats_ = false;
+  std::atomic<bool> has_poll_timings_ = false;
+
+  // Must be called with `mutex_` held exclusively.
+  void AddRow() {
+    const size_t num_rows = num_rows_.load(std::memory_order_relaxed) + 1;
+    labels_.Resize(num_rows);
+    owned_labels_.resize(num_rows);
+    samples_.Resize(num_rows);
+    for (auto& column : gauges_) {
+      column.Resize(num_rows);
+    }
+    for (auto& column : counters_) {
+      column.Resize(num_rows);
+    }
+    for (auto& column : histograms_) {
+      column.Resize(num_rows);
+    }
+    apower_summaries_.Resize(num_rows);
+    apower_summaries_[num_rows - 1] =
+        std::make_unique<WindowedSketch>(quantile_window_);
+    energy_integrators_.emplace_back(energy_max_gap_);
+    target_groups_.resize(num_rows);
+    num_rows_.store(num_rows, std::memory_order_release);
+  }
+
+  // Clears the removed rows for reuse, unless a collection that may have
+  // seen them before they were removed is still in progress. A collection
+  // starting after this check sees the rows as removed, and skips them.
+  //
+  // Must be called with `mutex_` held exclusively.
+  void ReclaimRemovedRows() {
+    if (removed_handles_.empty() || active_collections_ > 0) {
+      return;
+    }
+    for (const TargetHandle handle : removed_handles_) {
+      owned_labels_[handle].reset();
+      samples_[handle].Store(Sample{});
+      for (auto& column : gauges_) {
+        Store(column[handle], 0.0);
+      }
+      for (auto& column : counters_) {
+        Store(column[handle], 0.0);
+      }
+      for (auto& column : histograms_) {
+        column.Reset(handle);
+      }
+      apower_summaries_[handle]->Clear();
+      energy_integrators_[handle].Reset();
+      free_handles_.push_back(handle);
+    }
+    removed_handles_.clear();
+  }
+
+  // Must be called with `mutex_` held.
+  void ApplyError(TargetHandle handle, const absl::Status& status) {
+    Add(counters_[kError][handle], 1.0);
+    if (status.code() == absl::StatusCode::kDeadlineExceeded) {
+      Add(counters_[kTimeout][handle], 1.0);
+    }
+  }
+
+  // Must be called with `mutex_` held.
+  void ApplySuccess(TargetHandle handle, const ::shelly::Metrics& metrics,
+                    absl::Time time) {
+    // The previous sample is only replaced by this target's own polls, so
+    // can be read back before storing the new one.
+    if (!target_groups_[handle].empty()) {
+      GroupSums::Update(target_groups_[handle],
+                        samples_[handle].Load().metrics, metrics);
+    }
+    samples_[handle].Store(Sample{
+        .metrics = metrics,
+        .last_updated = static_cast<double>(absl::ToUnixSeconds(time)),
+    });
+    Add(counters_[kSuccess][handle], 1.0);
+    apower_summaries_[handle]->Add(metrics.apower, time);
+    Add(counters_[kEnergy][handle],
+        energy_integrators_[handle].Add(metrics.apower, time));
+  }
+
+  // Must be called with `mutex_` held.
+  bool IsKnownTarget(TargetHandle handle) const {
+    if (handle >= num_rows_.load(std::memory_order_relaxed) ||
+        labels_[handle].load(std::memory_order_relaxed) == nullptr) {
+      LOG(ERROR) << "Unknown target handle " << handle;
+      return false;
+    }
+    return true;
+  }
+
+  // Renders a family with a metric for each row that has a label.
+  template <class F>
+  static MetricFamily CollectColumn(const FamilyInfo& info, MetricType type,
+                                    const std::vector<const Labels*>& labels,
+                                    size_t num_targets, F set_value) {
+    MetricFamily family = {.name = info.name, .help = info.help, .type = type};
+    family.metric.reserve(num_targets);
+    for (size_t row = 0; row < labels.size(); ++row) {
+      if (labels[row] == nullptr) {
+        continue;
+      }
+      auto& metric = family.metric.emplace_back();
+      metric.label = *labels[row];
+      set_value(row, metric);
+    }
+    return family;
+  }
+
+  static MetricFamily CollectScalar(const FamilyInfo& info, MetricType type,
+                                    ClientMetric metric) {
+    MetricFamily family = {.name = info.name, .help = info.help, .type = type};
+    family.metric.push_back(std::move(metric));
+    return family;
+  }
+};
+
+class FlatRegistryImpl final : public Registry {
+ public:
+  explicit FlatRegistryImpl(const Options& options)
+      : collectable_(std::make_shared<FlatCollectable>(options)) {}
+
+  std::shared_ptr<::prometheus::Collectable> GetCollectable() override {
+    return collectable_;
+  }
+
+  absl::StatusOr<TargetHandle> AddTarget(absl::string_view name) override {
+    return collectable_->AddTarget(name);
+  }
+
+  absl::Status RemoveTarget(absl::string_view name) override {
+    return collectable_->RemoveTarget(name);
+  }
+
+  absl::Status SetTargetGroups(absl::string_view name,
+                               const TargetGroups& groups) override {
+    return collectable_->SetTargetGroups(name, groups);
+  }
+
+  std::vector<TargetState> GetTargetStates() const override {
+    return collectable_->GetTargetStates();
+  }
+
+  absl::Status RestoreTargetState(const TargetState& state) override {
+    return collectable_->RestoreTargetState(state);
+  }
+
+  std::optional<TargetHandle> FindTarget(
+      absl::string_view name) const override {
+    return collectable_->FindTarget(name);
+  }
+
+  void ErrorCallback(TargetHandle handle,
+                     const absl::Status& status) override {
+    collectable_->ErrorCallback(handle, status);
+  }
+
+  void SuccessCallback(TargetHandle handle,
+                       const ::shelly::Metrics& metrics) override {
+    collectable_->SuccessCallback(handle, metrics);
+  }
+
+  void Consume(absl::Span<const PollResult> results) override {
+    collectable_->Consume(results);
+  }
+
+  void ScrapeStatsCallback(TargetHandle handle,
+                           const ScrapeStats& stats) override {
+    collectable_->ScrapeStatsCallback(handle, stats);
+  }
+
+  void PoolStatsCallback(const ThreadPool::Stats& stats) override {
+    collectable_->PoolStatsCallback(stats);
+  }
+
+  void PollTimingsCallback(TargetHandle handle,
+                           const Poller::PollTimings& timings) override {
+    collectable_->PollTimingsCallback(handle, timings);
+  }
+
+  void CircuitStateCallback(TargetHandle handle,
+                            CircuitBreaker::State state) override {
+    collectable_->CircuitStateCallback(handle, state);
+  }
+
+ private:
+  const std::shared_ptr<FlatCollectable> collectable_;
+};
+
+}  // namespace
+
+std::unique_ptr<Registry> CreateFlatRegistry(
+    const Registry::Options& options) {
+  return std::make_unique<FlatRegistryImpl>(options);
+}
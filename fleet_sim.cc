@@ -0,0 +1,379 @@
+#include "fleet_sim.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "absl/log/log.h"
+#include "absl/status/status.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_join.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/strip.h"
+#include "absl/strings/substitute.h"
+#include "absl/synchronization/notification.h"
+#include "absl/time/clock.h"
+#include "civetweb.h"
+#include "nlohmann/json.hpp"
+#include "status_macros/status_macros.h"
+
+namespace {
+
+inline constexpr auto kStatusPath = "/rpc/Switch.GetStatus";
+inline constexpr auto kPlugPrefix = "plug-";
+inline constexpr auto kHostSuffix = ".localhost";
+// How long an idle keep-alive connection holds its server thread.
+inline constexpr absl::Duration kKeepAliveTimeout = absl::Milliseconds(500);
+// Server threads beyond the computed requirement, for unknown plugs and
+// bursts of reconnects.
+inline constexpr int kSpareThreads = 4;
+
+absl::StatusOr<absl::Duration> ParseDurationArg(std::string_view arg) {
+  absl::Duration duration;
+  if (!absl::ParseDuration(arg, &duration) ||
+      duration < absl::ZeroDuration()) {
+    return absl::InvalidArgumentError(
+        absl::Substitute("Invalid latency duration: $0", arg));
+  }
+  return duration;
+}
+
+// Returns the response body for a plug. The readings drift slowly over time
+// so successive scrapes don't all see the same values.
+std::string StatusResponse(int plug, absl::Time now) {
+  const double phase = absl::ToUnixSeconds(now) / 60.0 + plug;
+  const double apower =
+      5.0 + (plug % 50) * 20.0 * (1.0 + 0.1 * std::sin(phase));
+  const double voltage = 230.0 + 2.0 * std::sin(phase / 7.0);
+  const double temp_c = 30.0 + 5.0 * std::sin(phase / 13.0);
+  return absl::Substitute(
+      R"({"id":0,"source":"init","output":true,"apower":$0,"voltage":$1,)"
+      R"("freq":50.0,"current":$2,"aenergy":{"total":$3,)"
+      R"("by_minute":[0.0,0.0,0.0],"minute_ts":$4},)"
+      R"("temperature":{"tC":$5,"tF":$6}})",
+      apower, voltage, apower / voltage,
+      apower * absl::ToUnixSeconds(now) / 3600.0, absl::ToUnixSeconds(now),
+      temp_c, temp_c * 9.0 / 5.0 + 32.0);
+}
+
+class FleetSimImpl final : public FleetSim {
+ public:
+  FleetSimImpl() = delete;
+  FleetSimImpl(const Options& options) : options_(options) {}
+
+  ~FleetSimImpl() override {
+    // Wake any requests that are sleeping so the server threads can exit.
+    stopping_.Notify();
+    if (ctx_ != nullptr) {
+      mg_stop(ctx_);
+    }
+    mg_exit_library();
+  }
+
+  absl::Status Start() {
+    std::vector<std::string> ports;
+    const int num_ports =
+        options_.routing == Routing::kPort ? options_.num_plugs : 1;
+    for (int i = 0; i < num_ports; ++i) {
+      ports.push_back(absl::StrCat(options_.base_port + i));
+    }
+    const std::string listening_ports = absl::StrJoin(ports, ",");
+    // Civetweb handlers must respond before returning, so a delayed
+    // response can't be parked without holding its thread. Instead, make
+    // sure there are enough threads for the worst case.
+    const int required_threads = RequiredServerThreads(options_);
+    int num_threads = options_.num_threads;
+    if (num_threads <= 0) {
+      num_threads = required_threads;
+    } else if (num_threads < required_threads) {
+      LOG(WARNING) << "Only " << num_threads << " server threads for "
+                   << options_.num_plugs << " plugs, when up to "
+                   << required_threads
+                   << " may be needed; requests will queue and their "
+                      "latency will exceed the simulated latency";
+    }
+    const std::string num_threads_arg = absl::StrCat(num_threads);
+    const std::string keep_alive_timeout_arg =
+        absl::StrCat(absl::ToInt64Milliseconds(kKeepAliveTimeout));
+    const char* civetweb_options[] = {"listening_ports",
+                                      listening_ports.c_str(),
+                                      "num_threads",
+                                      num_threads_arg.c_str(),
+                                      "enable_keep_alive",
+                                      "yes",
+                                      "keep_alive_timeout_ms",
+                                      keep_alive_timeout_arg.c_str(),
+                                      nullptr};
+
+    mg_init_library(0);
+    ctx_ = mg_start(nullptr, nullptr, civetweb_options);
+    if (ctx_ == nullptr) {
+      return absl::InternalError(absl::Substitute(
+          "Failed to start Civetweb server on ports $0 to $1",
+          options_.base_port, options_.base_port + num_ports - 1));
+    }
+    mg_set_request_handler(ctx_, kStatusPath, RequestHandler, this);
+    return absl::OkStatus();
+  }
+
+  std::string PlugName(int plug) const override {
+    return absl::StrCat(kPlugPrefix, plug);
+  }
+
+  std::string PlugHostname(int plug) const override {
+    if (options_.routing == Routing::kPort) {
+      return absl::Substitute("127.0.0.1:$0", options_.base_port + plug);
+    }
+    return absl::Substitute("$0$1:$2", PlugName(plug), kHostSuffix,
+                            options_.base_port);
+  }
+
+  std::string TargetsConfig() const override {
+    ::nlohmann::json config = ::nlohmann::json::object();
+    for (int i = 0; i < options_.num_plugs; ++i) {
+      config[PlugName(i)] = PlugHostname(i);
+    }
+    return config.dump(2);
+  }
+
+  Stats GetStats() const override {
+    return Stats{
+        .ok = ok_,
+        .errors = errors_,
+        .timeouts = timeouts_,
+        .slow_drips = slow_drips_,
+        .unknown = unknown_,
+    };
+  }
+
+ private:
+  const Options options_;
+  mg_context* ctx_ = nullptr;
+  absl::Notification stopping_;
+
+  std::atomic<uint64_t> ok_ = 0;
+  std::atomic<uint64_t> errors_ = 0;
+  std::atomic<uint64_t> timeouts_ = 0;
+  std::atomic<uint64_t> slow_drips_ = 0;
+  std::atomic<uint64_t> unknown_ = 0;
+
+  static int RequestHandler(mg_connection* conn, void* user_data) {
+    return reinterpret_cast<FleetSimImpl*>(user_data)->HandleRequest(conn);
+  }
+
+  // Each server thread has its own generator, seeded from the options so
+  // that runs are repeatable for a given thread count.
+  std::mt19937_64& Rng() {
+    static std::atomic<uint64_t> next_stream = 0;
+    thread_local std::mt19937_64 rng(options_.seed + next_stream++);
+    return rng;
+  }
+
+  // Sleeps for `duration`, returning false if the fleet was stopped first.
+  bool Sleep(absl::Duration duration) {
+    return !stopping_.WaitForNotificationWithTimeout(duration);
+  }
+
+  std::optional<int> FindPlug(mg_connection* conn) const {
+    int plug = -1;
+    if (options_.routing == Routing::kPort) {
+      plug = mg_get_request_info(conn)->server_port - options_.base_port;
+    } else {
+      const char* const host_header = mg_get_header(conn, "Host");
+      if (host_header == nullptr) {
+        return std::nullopt;
+      }
+      std::string_view host = host_header;
+      host = host.substr(0, host.find(':'));
+      if (!absl::ConsumePrefix(&host, kPlugPrefix) ||
+          !absl::ConsumeSuffix(&host, kHostSuffix) ||
+          !absl::SimpleAtoi(host, &plug)) {
+        return std::nullopt;
+      }
+    }
+    if (plug < 0 || plug >= options_.num_plugs) {
+      return std::nullopt;
+    }
+    return plug;
+  }
+
+  int HandleRequest(mg_connection* conn) {
+    const auto plug = FindPlug(conn);
+    if (!plug.has_value()) {
+      ++unknown_;
+      mg_send_http_error(conn, 404, "Unknown plug");
+      return 404;
+    }
+
+    auto& rng = Rng();
+    if (!Sleep(options_.latency.Sample(rng))) {
+      mg_send_http_error(conn, 503, "Shutting down");
+      return 503;
+    }
+
+    std::uniform_real_distribution<double> outcome_distribution(0.0, 1.0);
+    double outcome = outcome_distribution(rng);
+    if (outcome < options_.error_rate) {
+      ++errors_;
+      mg_send_http_error(conn, 500, "Simulated error");
+      return 500;
+    }
+    outcome -= options_.error_rate;
+    if (outcome < options_.timeout_rate) {
+      ++timeouts_;
+      Sleep(options_.timeout);
+      mg_send_http_error(conn, 504, "Simulated timeout");
+      return 504;
+    }
+    outcome -= options_.timeout_rate;
+
+    const std::string body = StatusResponse(*plug, absl::Now());
+    mg_send_http_ok(conn, "application/json", body.size());
+    if (outcome < options_.slow_drip_rate) {
+      ++slow_drips_;
+      const size_t chunk_size = std::max<size_t>(1, options_.drip_chunk_size);
+      for (size_t offset = 0; offset < body.size(); offset += chunk_size) {
+        if (offset > 0 && !Sleep(options_.drip_interval)) {
+          break;
+        }
+        mg_write(conn, body.data() + offset,
+                 std::min(chunk_size, body.size() - offset));
+      }
+      return 200;
+    }
+    ++ok_;
+    mg_write(conn, body.data(), body.size());
+    return 200;
+  }
+};
+
+}  // namespace
+
+absl::Duration LatencyDistribution::Sample(std::mt19937_64& rng) const {
+  double seconds = 0.0;
+  switch (kind) {
+    case Kind::kFixed:
+      return first;
+    case Kind::kUniform:
+      seconds = std::uniform_real_distribution<double>(
+          absl::ToDoubleSeconds(first), absl::ToDoubleSeconds(second))(rng);
+      break;
+    case Kind::kExponential:
+      if (first <= absl::ZeroDuration()) {
+        return absl::ZeroDuration();
+      }
+      seconds = std::exponential_distribution<double>(
+          1.0 / absl::ToDoubleSeconds(first))(rng);
+      break;
+    case Kind::kNormal:
+      seconds = std::normal_distribution<double>(
+          absl::ToDoubleSeconds(first), absl::ToDoubleSeconds(second))(rng);
+      break;
+  }
+  return absl::Seconds(std::max(0.0, seconds));
+}
+
+absl::Duration LatencyDistribution::UpperBound() const {
+  switch (kind) {
+    case Kind::kFixed:
+      return first;
+    case Kind::kUniform:
+      return second;
+    case Kind::kExponential:
+      return first * std::log(1000.0);
+    case Kind::kNormal:
+      return std::max(absl::ZeroDuration(), first + second * 3.09);
+  }
+  return first;
+}
+
+absl::StatusOr<LatencyDistribution> ParseLatencyDistribution(
+    std::string_view spec) {
+  const std::pair<std::string_view, std::string_view> kind_and_args =
+      absl::StrSplit(spec, absl::MaxSplits(':', 1));
+  const std::vector<std::string_view> args =
+      absl::StrSplit(kind_and_args.second, ',');
+
+  LatencyDistribution distribution;
+  size_t num_args = 0;
+  if (kind_and_args.first == "fixed") {
+    distribution.kind = LatencyDistribution::Kind::kFixed;
+    num_args = 1;
+  } else if (kind_and_args.first == "uniform") {
+    distribution.kind = LatencyDistribution::Kind::kUniform;
+    num_args = 2;
+  } else if (kind_and_args.first == "exponential") {
+    distribution.kind = LatencyDistribution::Kind::kExponential;
+    num_args = 1;
+  } else if (kind_and_args.first == "normal") {
+    distribution.kind = LatencyDistribution::Kind::kNormal;
+    num_args = 2;
+  } else {
+    return absl::InvalidArgumentError(
+        absl::Substitute("Unknown latency distribution: $0", spec));
+  }
+  if (args.size() != num_args) {
+    return absl::InvalidArgumentError(absl::Substitute(
+        "Latency distribution \"$0\" expects $1 argument(s): $2",
+        kind_and_args.first, num_args, spec));
+  }
+
+  ASSIGN_OR_RETURN(distribution.first, ParseDurationArg(args[0]));
+  if (num_args > 1) {
+    ASSIGN_OR_RETURN(distribution.second, ParseDurationArg(args[1]));
+  }
+  if (distribution.kind == LatencyDistribution::Kind::kUniform &&
+      distribution.second < distribution.first) {
+    return absl::InvalidArgumentError(
+        absl::Substitute("Uniform latency maximum is below its minimum: $0",
+                         spec));
+  }
+  return distribution;
+}
+
+int RequiredServerThreads(const FleetSim::Options& options) {
+  absl::Duration failure_hold = absl::ZeroDuration();
+  if (options.timeout_rate > 0.0) {
+    failure_hold = options.timeout;
+  }
+  if (options.slow_drip_rate > 0.0) {
+    const size_t chunk_size = std::max<size_t>(1, options.drip_chunk_size);
+    const size_t body_size =
+        StatusResponse(options.num_plugs - 1, absl::Now()).size();
+    const int64_t num_chunks = (body_size + chunk_size - 1) / chunk_size;
+    failure_hold =
+        std::max(failure_hold, options.drip_interval * (num_chunks - 1));
+  }
+  const absl::Duration hold =
+      options.latency.UpperBound() + failure_hold + kKeepAliveTimeout;
+
+  // Each plug has at most one request in flight, so even if every request
+  // is held for longer than the interval there's no need for more threads
+  // than plugs.
+  int num_threads = options.num_plugs;
+  if (options.request_interval > hold) {
+    const double requests_in_flight =
+        options.num_plugs * absl::FDivDuration(hold, options.request_interval);
+    num_threads = static_cast<int>(std::ceil(requests_in_flight));
+  }
+  return num_threads + kSpareThreads;
+}
+
+absl::StatusOr<std::unique_ptr<FleetSim>> CreateFleetSim(
+    const FleetSim::Options& options) {
+  if (options.num_plugs < 1) {
+    return absl::InvalidArgumentError("Fleet must have at least one plug");
+  }
+  if (options.error_rate + options.timeout_rate + options.slow_drip_rate >
+      1.0) {
+    return absl::InvalidArgumentError(
+        "Error, timeout and slow drip rates must sum to at most one");
+  }
+  auto fleet = std::make_unique<FleetSimImpl>(options);
+  RETURN_IF_ERROR(fleet->Start());
+  return fleet;
+}
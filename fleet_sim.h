@@ -0,0 +1,119 @@
+#ifndef FLEET_SIM_H
+#define FLEET_SIM_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <string>
+#include <string_view>
+
+#include "absl/status/statusor.h"
+#include "absl/time/time.h"
+
+// Distribution of the artificial latency added to each simulated response.
+struct LatencyDistribution final {
+  enum class Kind { kFixed, kUniform, kExponential, kNormal };
+
+  Kind kind = Kind::kFixed;
+  // The fixed latency, the lower bound of the uniform distribution, or the
+  // mean of the exponential and normal distributions.
+  absl::Duration first = absl::ZeroDuration();
+  // The upper bound of the uniform distribution, or the standard deviation
+  // of the normal distribution.
+  absl::Duration second = absl::ZeroDuration();
+
+  // Samples a latency, which is never negative.
+  absl::Duration Sample(std::mt19937_64& rng) const;
+
+  // Returns a latency that few samples exceed: the maximum of the fixed and
+  // uniform distributions, or the 99.9th percentile of the others.
+  absl::Duration UpperBound() const;
+};
+
+// Parses a latency distribution spec, one of:
+//   "fixed:<duration>"
+//   "uniform:<min duration>,<max duration>"
+//   "exponential:<mean duration>"
+//   "normal:<mean duration>,<stddev duration>"
+// Where the durations are in absl::ParseDuration format, e.g. "250ms".
+absl::StatusOr<LatencyDistribution> ParseLatencyDistribution(
+    std::string_view spec);
+
+// Simulates a fleet of Shelly plugs, each serving Switch.GetStatus over HTTP
+// with configurable latency and failure modes. Used to load test the exporter
+// without real hardware.
+class FleetSim {
+ public:
+  enum class Routing {
+    // Every plug is served from `base_port`, identified by a
+    // "plug-<n>.localhost" Host header.
+    kHost,
+    // Each plug is served from its own port, starting at `base_port`.
+    kPort,
+  };
+
+  struct Options {
+    int num_plugs = 100;
+    Routing routing = Routing::kHost;
+    int base_port = 18000;
+    // Number of server threads, or zero to use RequiredServerThreads(). Each
+    // in-flight request holds a server thread for its full duration,
+    // including any latency, timeout or slow drip, and each keep-alive
+    // connection holds one until it times out.
+    int num_threads = 0;
+    // How often each plug is expected to be requested, i.e. the exporter's
+    // poll period. Only used to size the server threads.
+    absl::Duration request_interval = absl::Seconds(15);
+
+    LatencyDistribution latency;
+    // Fraction of requests that get a 500 response.
+    double error_rate = 0.0;
+    // Fraction of requests that get no response until `timeout` has passed.
+    double timeout_rate = 0.0;
+    absl::Duration timeout = absl::Seconds(60);
+    // Fraction of requests whose body is sent `drip_chunk_size` bytes at a
+    // time, every `drip_interval`.
+    double slow_drip_rate = 0.0;
+    absl::Duration drip_interval = absl::Milliseconds(100);
+    size_t drip_chunk_size = 16;
+
+    uint64_t seed = 0;
+  };
+
+  struct Stats {
+    uint64_t ok = 0;
+    uint64_t errors = 0;
+    uint64_t timeouts = 0;
+    uint64_t slow_drips = 0;
+    // Requests that didn't match a simulated plug.
+    uint64_t unknown = 0;
+  };
+
+  virtual ~FleetSim() = default;
+
+  // Name and "host:port" of the plug with the given index.
+  virtual std::string PlugName(int plug) const = 0;
+  virtual std::string PlugHostname(int plug) const = 0;
+
+  // Returns a targets config, in the exporter's targets.json format, for
+  // every plug in the fleet.
+  virtual std::string TargetsConfig() const = 0;
+
+  virtual Stats GetStats() const = 0;
+
+ protected:
+  FleetSim() = default;
+};
+
+// Returns the number of server threads needed to serve every plug without
+// queueing, if each is requested once every `options.request_interval` and
+// every request is held for the worst case of the latency and failure modes.
+int RequiredServerThreads(const FleetSim::Options& options);
+
+// Starts serving the fleet, which stops when the returned object is
+// destroyed.
+absl::StatusOr<std::unique_ptr<FleetSim>> CreateFleetSim(
+    const FleetSim::Options& options);
+
+#endif  // FLEET_SIM_H
@@ -0,0 +1,164 @@
+#include <csignal>
+#include <fstream>
+#include <functional>
+#include <string>
+
+#include "absl/base/log_severity.h"
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/log/globals.h"
+#include "absl/log/initialize.h"
+#include "absl/log/log.h"
+#include "absl/synchronization/notification.h"
+#include "absl/time/time.h"
+#include "fleet_sim.h"
+
+ABSL_FLAG(int, plugs, 1000, "Number of simulated plugs.");
+ABSL_FLAG(std::string, routing, "host",
+          "How requests are routed to plugs: \"host\" to serve every plug on "
+          "--base_port as plug-<n>.localhost, or \"port\" to serve each plug "
+          "on its own port starting at --base_port.");
+ABSL_FLAG(int, base_port, 18000, "First port to serve the plugs on.");
+ABSL_FLAG(int, server_threads, 0,
+          "Number of server threads, or zero to size it from --plugs, "
+          "--request_interval and the worst case latency and failures. Each "
+          "in-flight request holds a thread for its full duration, including "
+          "any simulated latency.");
+ABSL_FLAG(absl::Duration, request_interval, absl::Seconds(15),
+          "How often each plug is expected to be requested, i.e. the "
+          "exporter's --poll_period. Used to size the server threads.");
+ABSL_FLAG(std::string, latency, "fixed:0s",
+          "Latency added to each response, as fixed:<d>, uniform:<min>,<max>, "
+          "exponential:<mean> or normal:<mean>,<stddev>.");
+ABSL_FLAG(double, error_rate, 0.0,
+          "Fraction of requests that get a 500 response.");
+ABSL_FLAG(double, timeout_rate, 0.0,
+          "Fraction of requests that get no response until --timeout has "
+          "passed.");
+ABSL_FLAG(absl::Duration, timeout, absl::Seconds(60),
+          "How long simulated timeouts hold the request for.");
+ABSL_FLAG(double, slow_drip_rate, 0.0,
+          "Fraction of requests whose body is sent slowly, in chunks of "
+          "--drip_chunk_size bytes every --drip_interval.");
+ABSL_FLAG(absl::Duration, drip_interval, absl::Milliseconds(100),
+          "Delay between each chunk of a slow drip response.");
+ABSL_FLAG(int, drip_chunk_size, 16,
+          "Size in bytes of each chunk of a slow drip response.");
+ABSL_FLAG(uint64_t, seed, 0, "Seed for the simulated latencies and failures.");
+ABSL_FLAG(std::string, targets_output, "",
+          "If set, a targets config file for the simulated fleet is written "
+          "to this file.");
+ABSL_FLAG(absl::Duration, stats_period, absl::Seconds(10),
+          "How frequently the request counts are logged.");
+
+std::function<void(int)> signal_handler_func;
+void SignalHandler(int signum) {
+  if (signal_handler_func) {
+    signal_handler_func(signum);
+  }
+}
+
+template <class T>
+T GetFlagOrDie(absl::Flag<T>& flag, const std::string& error,
+               std::function<bool(const T&)> validation_func) {
+  T val = absl::GetFlag(flag);
+  if (validation_func != nullptr && !validation_func(val)) {
+    LOG(QFATAL) << "Error with flag --" << flag.Name() << " : " << error;
+  }
+  return val;
+}
+
+bool IsRate(const double& val) { return val >= 0.0 && val <= 1.0; }
+
+FleetSim::Options GetOptionsOrDie() {
+  const auto routing = GetFlagOrDie<std::string>(
+      FLAGS_routing, "Must be one of \"host\" or \"port\"",
+      [](const auto& val) { return val == "host" || val == "port"; });
+  const auto latency_spec = absl::GetFlag(FLAGS_latency);
+  auto latency = ParseLatencyDistribution(latency_spec);
+  if (!latency.ok()) {
+    LOG(QFATAL) << "Error with flag --latency : " << latency.status();
+  }
+
+  return FleetSim::Options{
+      .num_plugs =
+          GetFlagOrDie<int>(FLAGS_plugs, "Must be at least one",
+                            [](const auto& val) { return val >= 1; }),
+      .routing = routing == "port" ? FleetSim::Routing::kPort
+                                   : FleetSim::Routing::kHost,
+      .base_port = GetFlagOrDie<int>(
+          FLAGS_base_port, "Must be a valid port",
+          [](const auto& val) { return val > 0 && val < 65536; }),
+      .num_threads =
+          GetFlagOrDie<int>(FLAGS_server_threads, "Must not be negative",
+                            [](const auto& val) { return val >= 0; }),
+      .request_interval = GetFlagOrDie<absl::Duration>(
+          FLAGS_request_interval, "Must be positive",
+          [](const auto& val) { return val > absl::ZeroDuration(); }),
+      .latency = *latency,
+      .error_rate = GetFlagOrDie<double>(FLAGS_error_rate,
+                                         "Must be between 0 and 1", IsRate),
+      .timeout_rate = GetFlagOrDie<double>(FLAGS_timeout_rate,
+                                           "Must be between 0 and 1", IsRate),
+      .timeout = absl::GetFlag(FLAGS_timeout),
+      .slow_drip_rate = GetFlagOrDie<double>(
+          FLAGS_slow_drip_rate, "Must be between 0 and 1", IsRate),
+      .drip_interval = absl::GetFlag(FLAGS_drip_interval),
+      .drip_chunk_size = static_cast<size_t>(
+          GetFlagOrDie<int>(FLAGS_drip_chunk_size, "Must be at least one",
+                            [](const auto& val) { return val >= 1; })),
+      .seed = absl::GetFlag(FLAGS_seed),
+  };
+}
+
+int main(int argc, char* argv[]) {
+  absl::SetStderrThreshold(absl::LogSeverityAtLeast::kInfo);
+  absl::InitializeLog();
+  absl::ParseCommandLine(argc, argv);
+
+  const auto options = GetOptionsOrDie();
+  const auto stats_period = GetFlagOrDie<absl::Duration>(
+      FLAGS_stats_period, "Must be at least one second",
+      [](const auto& val) { return val >= absl::Seconds(1); });
+
+  auto maybe_fleet = CreateFleetSim(options);
+  if (!maybe_fleet.ok()) {
+    LOG(QFATAL) << "Failed to start fleet: " << maybe_fleet.status();
+  }
+  auto fleet = std::move(maybe_fleet).value();
+  LOG(INFO) << "Simulating " << options.num_plugs << " plugs with "
+            << (options.num_threads > 0 ? options.num_threads
+                                        : RequiredServerThreads(options))
+            << " server threads, from "
+            << fleet->PlugHostname(0) << " to "
+            << fleet->PlugHostname(options.num_plugs - 1);
+
+  const auto targets_output = absl::GetFlag(FLAGS_targets_output);
+  if (!targets_output.empty()) {
+    std::ofstream stream(targets_output);
+    stream << fleet->TargetsConfig() << "\n";
+    if (!stream.good()) {
+      LOG(QFATAL) << "Failed to write targets file \"" << targets_output
+                  << "\"";
+    }
+    LOG(INFO) << "Wrote targets file \"" << targets_output << "\"";
+  }
+
+  absl::Notification stopping;
+  signal_handler_func = [&stopping](int signum) {
+    LOG(WARNING) << "Received signal " << signum << ", terminating";
+    if (!stopping.HasBeenNotified()) {
+      stopping.Notify();
+    }
+  };
+  std::signal(SIGINT, SignalHandler);
+  std::signal(SIGTERM, SignalHandler);
+
+  while (!stopping.WaitForNotificationWithTimeout(stats_period)) {
+    const auto stats = fleet->GetStats();
+    LOG(INFO) << "Requests: " << stats.ok << " ok, " << stats.errors
+              << " errors, " << stats.timeouts << " timeouts, "
+              << stats.slow_drips << " slow drips, " << stats.unknown
+              << " unknown";
+  }
+}
@@ -0,0 +1,218 @@
+#include "fleet_sim.h"
+
+#include <gtest/gtest.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <random>
+
+#include "absl/log/check.h"
+#include "nlohmann/json.hpp"
+#include "parser.h"
+#include "scraper.h"
+
+namespace {
+
+uint16_t FindUnusedPortOrDie() {
+  int fd = socket(AF_INET, SOCK_STREAM, /*protocol=*/0);
+  CHECK(fd != -1) << "Failed to create socket";
+
+  sockaddr_in addr;
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = INADDR_ANY;
+  addr.sin_port = htons(0);  // Bind to any available port.
+  CHECK(bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+      << "Failed to bind socket";
+
+  socklen_t addrlen = sizeof(addr);
+  CHECK(getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &addrlen) == 0)
+      << "Failed to get socket name";
+  const uint16_t port = ntohs(addr.sin_port);
+  CHECK(port != 0) << "Failed to get port number";
+
+  shutdown(fd, SHUT_RDWR);
+  CHECK(close(fd) == 0) << "Failed to close socket";
+  return port;
+}
+
+std::unique_ptr<FleetSim> CreateFleetSimOrDie(FleetSim::Options options) {
+  options.base_port = FindUnusedPortOrDie();
+  options.num_threads = 4;
+  auto fleet = CreateFleetSim(options);
+  CHECK(fleet.ok()) << "Failed to create fleet: " << fleet.status();
+  return std::move(fleet).value();
+}
+
+std::unique_ptr<Scraper> CreateScraperOrDie() {
+  auto scraper = CreateScraper({});
+  CHECK(scraper.ok()) << "Failed to create Scraper: " << scraper.status();
+  return std::move(scraper).value();
+}
+
+std::string StatusUrl(const FleetSim& fleet, int plug) {
+  return "http://" + fleet.PlugHostname(plug) + "/rpc/Switch.GetStatus?id=0";
+}
+
+}  // namespace
+
+TEST(ParseLatencyDistribution, ValidSpecs) {
+  auto fixed = ParseLatencyDistribution("fixed:250ms");
+  ASSERT_TRUE(fixed.ok());
+  EXPECT_EQ(fixed->kind, LatencyDistribution::Kind::kFixed);
+  EXPECT_EQ(fixed->first, absl::Milliseconds(250));
+
+  auto uniform = ParseLatencyDistribution("uniform:1ms,2s");
+  ASSERT_TRUE(uniform.ok());
+  EXPECT_EQ(uniform->kind, LatencyDistribution::Kind::kUniform);
+  EXPECT_EQ(uniform->first, absl::Milliseconds(1));
+  EXPECT_EQ(uniform->second, absl::Seconds(2));
+
+  auto exponential = ParseLatencyDistribution("exponential:10ms");
+  ASSERT_TRUE(exponential.ok());
+  EXPECT_EQ(exponential->kind, LatencyDistribution::Kind::kExponential);
+
+  auto normal = ParseLatencyDistribution("normal:10ms,2ms");
+  ASSERT_TRUE(normal.ok());
+  EXPECT_EQ(normal->kind, LatencyDistribution::Kind::kNormal);
+  EXPECT_EQ(normal->second, absl::Milliseconds(2));
+}
+
+TEST(ParseLatencyDistribution, InvalidSpecs) {
+  for (const auto* spec :
+       {"", "fixed", "fixed:", "fixed:abc", "fixed:-1s", "uniform:1s",
+        "uniform:2s,1s", "normal:1s,2s,3s", "pareto:1s"}) {
+    EXPECT_FALSE(ParseLatencyDistribution(spec).ok()) << spec;
+  }
+}
+
+TEST(LatencyDistribution, SamplesWithinBounds) {
+  std::mt19937_64 rng(0);
+  const LatencyDistribution uniform = {
+      .kind = LatencyDistribution::Kind::kUniform,
+      .first = absl::Milliseconds(10),
+      .second = absl::Milliseconds(20),
+  };
+  const LatencyDistribution normal = {
+      .kind = LatencyDistribution::Kind::kNormal,
+      .first = absl::ZeroDuration(),
+      .second = absl::Milliseconds(10),
+  };
+  for (int i = 0; i < 1000; ++i) {
+    const auto uniform_sample = uniform.Sample(rng);
+    EXPECT_GE(uniform_sample, absl::Milliseconds(10));
+    EXPECT_LE(uniform_sample, absl::Milliseconds(20));
+    EXPECT_GE(normal.Sample(rng), absl::ZeroDuration());
+  }
+}
+
+TEST(LatencyDistribution, UpperBound) {
+  using Kind = LatencyDistribution::Kind;
+  EXPECT_EQ((LatencyDistribution{Kind::kFixed, absl::Milliseconds(5)})
+                .UpperBound(),
+            absl::Milliseconds(5));
+  EXPECT_EQ((LatencyDistribution{Kind::kUniform, absl::Milliseconds(5),
+                                 absl::Milliseconds(20)})
+                .UpperBound(),
+            absl::Milliseconds(20));
+  EXPECT_GT((LatencyDistribution{Kind::kExponential, absl::Milliseconds(10)})
+                .UpperBound(),
+            absl::Milliseconds(60));
+  EXPECT_GT((LatencyDistribution{Kind::kNormal, absl::Milliseconds(10),
+                                 absl::Milliseconds(2)})
+                .UpperBound(),
+            absl::Milliseconds(16));
+}
+
+TEST(RequiredServerThreads, GrowsWithHoldTime) {
+  const FleetSim::Options fast = {.num_plugs = 1000};
+  const int fast_threads = RequiredServerThreads(fast);
+  EXPECT_GT(fast_threads, 1000 * 0.5 / 15);
+  EXPECT_LT(fast_threads, 1000);
+
+  FleetSim::Options slow = fast;
+  slow.latency = {LatencyDistribution::Kind::kFixed, absl::Seconds(3)};
+  EXPECT_GT(RequiredServerThreads(slow), fast_threads);
+  EXPECT_LT(RequiredServerThreads(slow), 1000);
+
+  FleetSim::Options dripping = fast;
+  dripping.slow_drip_rate = 0.01;
+  dripping.drip_interval = absl::Seconds(1);
+  EXPECT_GT(RequiredServerThreads(dripping), RequiredServerThreads(slow));
+
+  // A timeout longer than the interval could hold a thread for every plug.
+  FleetSim::Options hanging = fast;
+  hanging.timeout_rate = 0.01;
+  hanging.timeout = absl::Seconds(60);
+  EXPECT_GE(RequiredServerThreads(hanging), 1000);
+}
+
+TEST(FleetSim, ServesEveryPlug) {
+  constexpr int kNumPlugs = 5;
+  auto fleet = CreateFleetSimOrDie({.num_plugs = kNumPlugs});
+  auto scraper = CreateScraperOrDie();
+  auto parser = CreateParser();
+
+  for (int i = 0; i < kNumPlugs; ++i) {
+    auto result = scraper->Scrape(StatusUrl(*fleet, i)).result;
+    ASSERT_TRUE(result.ok()) << result.status();
+    EXPECT_EQ(result->code, 200);
+    EXPECT_EQ(result->content_type, "application/json");
+    EXPECT_TRUE(parser->Parse(result->content).ok());
+  }
+  EXPECT_EQ(fleet->GetStats().ok, kNumPlugs);
+}
+
+TEST(FleetSim, UnknownPlug) {
+  auto fleet = CreateFleetSimOrDie({.num_plugs = 1});
+  auto scraper = CreateScraperOrDie();
+
+  // Plug 1 is outside of the fleet, but still routes to the same port.
+  auto result = scraper->Scrape(StatusUrl(*fleet, 1)).result;
+  ASSERT_TRUE(result.ok()) << result.status();
+  EXPECT_EQ(result->code, 404);
+  EXPECT_EQ(fleet->GetStats().unknown, 1);
+}
+
+TEST(FleetSim, SimulatesErrors) {
+  auto fleet = CreateFleetSimOrDie({.num_plugs = 1, .error_rate = 1.0});
+  auto scraper = CreateScraperOrDie();
+
+  auto result = scraper->Scrape(StatusUrl(*fleet, 0)).result;
+  ASSERT_TRUE(result.ok()) << result.status();
+  EXPECT_EQ(result->code, 500);
+  EXPECT_EQ(fleet->GetStats().errors, 1);
+}
+
+TEST(FleetSim, SimulatesSlowDrip) {
+  auto fleet = CreateFleetSimOrDie({
+      .num_plugs = 1,
+      .slow_drip_rate = 1.0,
+      .drip_interval = absl::Milliseconds(1),
+      .drip_chunk_size = 32,
+  });
+  auto scraper = CreateScraperOrDie();
+
+  auto result = scraper->Scrape(StatusUrl(*fleet, 0)).result;
+  ASSERT_TRUE(result.ok()) << result.status();
+  EXPECT_EQ(result->code, 200);
+  EXPECT_TRUE(CreateParser()->Parse(result->content).ok());
+  EXPECT_EQ(fleet->GetStats().slow_drips, 1);
+}
+
+TEST(FleetSim, TargetsConfig) {
+  auto fleet = CreateFleetSimOrDie({.num_plugs = 3});
+
+  const auto config = ::nlohmann::json::parse(fleet->TargetsConfig());
+  ASSERT_TRUE(config.is_object());
+  EXPECT_EQ(config.size(), 3);
+  for (int i = 0; i < 3; ++i) {
+    EXPECT_EQ(config[fleet->PlugName(i)], fleet->PlugHostname(i));
+  }
+}
+
+TEST(CreateFleetSim, InvalidOptions) {
+  EXPECT_FALSE(CreateFleetSim({.num_plugs = 0}).ok());
+  EXPECT_FALSE(CreateFleetSim({.error_rate = 0.6, .timeout_rate = 0.6}).ok());
+}
@@ -1,8 +1,13 @@
+#include <pthread.h>
+
+#include <atomic>
 #include <csignal>
 #include <filesystem>
 #include <functional>
+#include <memory>
 #include <string>
 #include <string_view>
+#include <thread>
 #include <tuple>
 #include <vector>
 
@@ -14,15 +19,22 @@
 #include "absl/log/initialize.h"
 #include "absl/log/log.h"
 #include "absl/status/status.h"
+#include "circuit_breaker.h"
 #include "config.h"
+#include "exposition_cache.h"
+#include "metrics_server.h"
 #include "parser.h"
 #include "poller.h"
 #include "prometheus/exposer.h"
 #include "prometheus/registry.h"
 #include "registry.h"
+#include "remote_write.h"
+#include "sample_history.h"
 #include "scraper.h"
 #include "shelly.h"
+#include "state_file.h"
 #include "target.h"
+#include "thread_pool.h"
 
 ABSL_FLAG(std::string, metrics_addr, "0.0.0.0:9100",
           "Address on which the metrics will be served. Defaults to the "
@@ -31,8 +43,94 @@ ABSL_FLAG(std::string, metrics_path, "/metrics",
           "Path on which the metrics will be served.");
 ABSL_FLAG(absl::Duration, poll_period, absl::Seconds(15),
           "How frequently the targets will be polled for new metrics.");
+ABSL_FLAG(int, worker_threads, 8,
+          "Number of worker threads used to poll the targets.");
 ABSL_FLAG(std::string, targets_config_file, "./targets.json",
           "File name of the JSON targets config file.");
+ABSL_FLAG(bool, async_scraper, false,
+          "If true, drive all of the target requests from event loop threads "
+          "rather than blocking a worker thread per request.");
+ABSL_FLAG(int, scraper_event_loops, 1,
+          "Number of event loop threads used when --async_scraper is set.");
+ABSL_FLAG(std::string, parser, "dom",
+          "Response parser to use: \"dom\" to parse each response in to a "
+          "JSON document, \"streaming\" to read just the required fields in "
+          "a single pass, or \"simdjson\" to use simdjson's on-demand API.");
+ABSL_FLAG(std::string, registry, "prometheus",
+          "Metrics registry to use: \"prometheus\" to keep the metrics in "
+          "prometheus-cpp families, or \"flat\" to keep each metric in a flat "
+          "array indexed by target, which is cheaper to update and serve for "
+          "large numbers of targets.");
+ABSL_FLAG(bool, exposition_cache, false,
+          "If true, render the metrics once per poll period and serve every "
+          "request in that period the same cached text, or a gzip compressed "
+          "copy, with an ETag for conditional requests.");
+ABSL_FLAG(int64_t, max_response_size, 64 * 1024,
+          "Maximum size of a target's response body, in bytes. Larger "
+          "responses are aborted and counted as errors.");
+ABSL_FLAG(absl::Duration, connect_timeout, absl::Seconds(5),
+          "Default limit on the time taken to connect to a target. Zero "
+          "means no limit.");
+ABSL_FLAG(absl::Duration, scrape_timeout, absl::Seconds(10),
+          "Default limit on the time taken by each request to a target, "
+          "including connecting. Zero means no limit.");
+ABSL_FLAG(absl::Duration, poll_budget, absl::ZeroDuration(),
+          "Upper bound on the time each poll of a target can take, from when "
+          "it was due. Zero means the poll period.");
+ABSL_FLAG(int, circuit_failure_threshold, 3,
+          "Consecutive failures after which a target is backed off. Zero "
+          "means targets are never backed off.");
+ABSL_FLAG(absl::Duration, circuit_initial_backoff, absl::Minutes(1),
+          "How long a failing target is first backed off for. Each failed "
+          "probe after the backoff doubles it.");
+ABSL_FLAG(absl::Duration, circuit_max_backoff, absl::Minutes(30),
+          "Upper bound on how long a failing target is backed off for.");
+ABSL_FLAG(int, sink_batch_size, 64,
+          "Number of poll results applied to the registry at a time. Any "
+          "remainder is applied once every poll period. Zero means results "
+          "are only applied once every poll period.");
+ABSL_FLAG(int, sample_history_size, 0,
+          "Number of each target's most recent readings to keep, from which "
+          "the minimum, maximum and mean of every reading over "
+          "--sample_window are exported. Zero means no readings are kept.");
+ABSL_FLAG(absl::Duration, sample_window, absl::Seconds(30),
+          "Window over which the kept readings are summarised, which would "
+          "usually be the scrape interval.");
+ABSL_FLAG(absl::Duration, quantile_window, absl::Seconds(30),
+          "Window over which the quantiles of each target's power draw are "
+          "taken, which would usually be the scrape interval.");
+ABSL_FLAG(absl::Duration, energy_max_gap, absl::Minutes(1),
+          "Longest time between two of a target's readings that its power is "
+          "integrated over. Energy used across longer gaps, such as while the "
+          "target is unreachable, isn't counted.");
+ABSL_FLAG(std::string, state_file, "",
+          "If set, the targets' counters and last readings are saved to this "
+          "file every poll period, and restored from it on startup. Empty "
+          "means the state isn't saved.");
+ABSL_FLAG(std::string, remote_write_url, "",
+          "If set, every reading is also pushed to this Prometheus remote "
+          "write endpoint, such as \"http://prometheus:9090/api/v1/write\". "
+          "Empty means readings are only served for scraping.");
+ABSL_FLAG(int, remote_write_shards, 4,
+          "Number of shards that the targets are divided between for remote "
+          "write, each of which sends one request at a time.");
+ABSL_FLAG(int, remote_write_queue_capacity, 2000,
+          "Number of polls queued in each remote write shard, beyond which "
+          "the oldest are dropped.");
+ABSL_FLAG(int, remote_write_max_polls_per_send, 200,
+          "Largest number of polls sent in one remote write request.");
+ABSL_FLAG(absl::Duration, remote_write_batch_delay, absl::Seconds(5),
+          "How long a partial remote write batch waits for more polls before "
+          "being sent.");
+ABSL_FLAG(absl::Duration, remote_write_timeout, absl::Seconds(30),
+          "Limit on the time taken by each remote write request.");
+ABSL_FLAG(std::string, remote_write_spill_directory, "",
+          "If set, remote write batches are spilled to files in this "
+          "directory while the endpoint is down, and on shutdown, to be sent "
+          "once it's back. Empty means they're dropped instead.");
+ABSL_FLAG(int64_t, remote_write_max_spill_bytes, int64_t{256} << 20,
+          "Limit on the size of the remote write spill files, beyond which "
+          "the oldest are deleted.");
 ABSL_FLAG(bool, verbose_scraper, false, "If true, log verbose scraper output");
 ABSL_FLAG(bool, verbose_poller, false, "If true, log verbose poller output");
 
@@ -54,15 +152,107 @@ T GetFlagOrDie(absl::Flag<T>& flag, const std::string& error,
 }
 
 std::unique_ptr<Scraper> CreateScraperOrDie() {
-  auto maybe_scraper = CreateScraper(Scraper::Options{
+  const Scraper::Options options = {
       .verbose = absl::GetFlag(FLAGS_verbose_scraper),
-  });
+      .event_loop_threads = GetFlagOrDie<int>(
+          FLAGS_scraper_event_loops, "Must be at least one",
+          [](const auto& val) { return val >= 1; }),
+      .max_body_size = static_cast<size_t>(GetFlagOrDie<int64_t>(
+          FLAGS_max_response_size, "Must be at least one byte",
+          [](const auto& val) { return val >= 1; })),
+      .connect_timeout = GetFlagOrDie<absl::Duration>(
+          FLAGS_connect_timeout, "Must not be negative",
+          [](const auto& val) { return val >= absl::ZeroDuration(); }),
+      .timeout = GetFlagOrDie<absl::Duration>(
+          FLAGS_scrape_timeout, "Must not be negative",
+          [](const auto& val) { return val >= absl::ZeroDuration(); }),
+  };
+  auto maybe_scraper = absl::GetFlag(FLAGS_async_scraper)
+                           ? CreateAsyncScraper(options)
+                           : CreateScraper(options);
   if (!maybe_scraper.ok()) {
     LOG(FATAL) << maybe_scraper.status();
   }
   return std::move(maybe_scraper).value();
 }
 
+std::unique_ptr<Parser> CreateParserOrDie() {
+  const auto parser = GetFlagOrDie<std::string>(
+      FLAGS_parser, "Must be one of \"dom\", \"streaming\" or \"simdjson\"",
+      [](const auto& val) {
+        return val == "dom" || val == "streaming" || val == "simdjson";
+      });
+  if (parser == "streaming") {
+    return CreateStreamingParser();
+  } else if (parser == "simdjson") {
+    return CreateSimdjsonParser();
+  }
+  return CreateParser();
+}
+
+CircuitBreaker::Options GetCircuitBreakerOptionsOrDie() {
+  return CircuitBreaker::Options{
+      .failure_threshold = GetFlagOrDie<int>(
+          FLAGS_circuit_failure_threshold, "Must not be negative",
+          [](const auto& val) { return val >= 0; }),
+      .initial_backoff = GetFlagOrDie<absl::Duration>(
+          FLAGS_circuit_initial_backoff, "Must be positive",
+          [](const auto& val) { return val > absl::ZeroDuration(); }),
+      .max_backoff = GetFlagOrDie<absl::Duration>(
+          FLAGS_circuit_max_backoff, "Must be positive",
+          [](const auto& val) { return val > absl::ZeroDuration(); }),
+  };
+}
+
+std::unique_ptr<Registry> CreateRegistryOrDie() {
+  const auto registry = GetFlagOrDie<std::string>(
+      FLAGS_registry, "Must be one of \"prometheus\" or \"flat\"",
+      [](const auto& val) { return val == "prometheus" || val == "flat"; });
+  const Registry::Options options = {
+      .quantile_window = GetFlagOrDie<absl::Duration>(
+          FLAGS_quantile_window, "Must be positive",
+          [](const auto& val) { return val > absl::ZeroDuration(); }),
+      .energy_max_gap = GetFlagOrDie<absl::Duration>(
+          FLAGS_energy_max_gap, "Must be positive",
+          [](const auto& val) { return val > absl::ZeroDuration(); }),
+  };
+  if (registry == "flat") {
+    return CreateFlatRegistry(options);
+  }
+  return CreateRegistry(options);
+}
+
+std::unique_ptr<RemoteWriter> CreateRemoteWriterOrDie(std::string url) {
+  const RemoteWriter::Options options = {
+      .url = std::move(url),
+      .num_shards = static_cast<size_t>(GetFlagOrDie<int>(
+          FLAGS_remote_write_shards, "Must be at least one",
+          [](const auto& val) { return val >= 1; })),
+      .queue_capacity = static_cast<size_t>(GetFlagOrDie<int>(
+          FLAGS_remote_write_queue_capacity, "Must be at least one",
+          [](const auto& val) { return val >= 1; })),
+      .max_polls_per_send = static_cast<size_t>(GetFlagOrDie<int>(
+          FLAGS_remote_write_max_polls_per_send, "Must be at least one",
+          [](const auto& val) { return val >= 1; })),
+      .batch_delay = GetFlagOrDie<absl::Duration>(
+          FLAGS_remote_write_batch_delay, "Must not be negative",
+          [](const auto& val) { return val >= absl::ZeroDuration(); }),
+      .timeout = GetFlagOrDie<absl::Duration>(
+          FLAGS_remote_write_timeout, "Must be positive",
+          [](const auto& val) { return val > absl::ZeroDuration(); }),
+      .spill_directory = absl::GetFlag(FLAGS_remote_write_spill_directory),
+      .max_spill_bytes = static_cast<size_t>(GetFlagOrDie<int64_t>(
+          FLAGS_remote_write_max_spill_bytes, "Must not be negative",
+          [](const auto& val) { return val >= 0; })),
+  };
+  auto maybe_remote_writer = CreateRemoteWriter(options);
+  if (!maybe_remote_writer.ok()) {
+    LOG(QFATAL) << "Failed to create remote writer: "
+                << maybe_remote_writer.status();
+  }
+  return std::move(maybe_remote_writer).value();
+}
+
 std::vector<Target> LoadTargetsOrDie(std::string_view filename) {
   auto maybe_targets = LoadTargetsFromFile(filename);
   if (!maybe_targets.ok()) {
@@ -72,11 +262,121 @@ std::vector<Target> LoadTargetsOrDie(std::string_view filename) {
   return *std::move(maybe_targets);
 }
 
+std::unique_ptr<StateFile> OpenStateFileOrDie(std::string_view filename) {
+  auto maybe_state_file = OpenStateFile(filename);
+  if (!maybe_state_file.ok()) {
+    LOG(QFATAL) << "Failed to open state file \"" << filename
+                << "\": " << maybe_state_file.status();
+  }
+  return std::move(maybe_state_file).value();
+}
+
+// Restores the registry's targets from the state file. Any state that can't
+// be loaded is logged and skipped, so that the exporter starts afresh.
+void RestoreTargetStates(const StateFile& state_file, Registry& registry) {
+  const auto maybe_states = state_file.Load();
+  if (!maybe_states.ok()) {
+    LOG(WARNING) << "Not restoring target state: " << maybe_states.status();
+    return;
+  }
+  int num_restored = 0;
+  for (const auto& state : *maybe_states) {
+    // Targets that have since been removed from the config are dropped.
+    if (registry.RestoreTargetState(state).ok()) {
+      ++num_restored;
+    }
+  }
+  LOG(INFO) << "Restored state of targets: " << num_restored;
+}
+
+Scraper::RequestOptions GetRequestOptions(const Target& target) {
+  return {.connect_timeout = target.connect_timeout,
+          .timeout = target.timeout};
+}
+
+// Brings the running targets in line with the targets file, leaving the
+// targets that haven't changed to carry on being polled undisturbed. A target
+// whose settings have changed keeps its metrics, and is only restarted in the
+// poller. If the file can't be loaded the current targets are kept.
+void ReloadTargets(std::string_view filename, Registry& registry,
+                   SampleHistory* sample_history,
+                   RemoteWriter* remote_writer, Poller& poller,
+                   std::vector<Target>& targets) {
+  auto maybe_targets = LoadTargetsFromFile(filename);
+  if (!maybe_targets.ok()) {
+    LOG(ERROR) << "Failed to reload targets file \"" << filename
+               << "\", keeping the current targets: "
+               << maybe_targets.status();
+    return;
+  }
+  if (maybe_targets->empty()) {
+    LOG(ERROR) << "Targets file \"" << filename
+               << "\" contains no targets, keeping the current targets";
+    return;
+  }
+
+  const auto diff = DiffTargets(targets, *maybe_targets);
+  for (const auto& name : diff.removed) {
+    // The poller must stop reporting the target before the registry can
+    // release its handle.
+    const auto handle = registry.FindTarget(name);
+    poller.RemoveTarget(name);
+    if (sample_history != nullptr && handle.has_value()) {
+      sample_history->RemoveTarget(*handle);
+    }
+    if (remote_writer != nullptr && handle.has_value()) {
+      remote_writer->RemoveTarget(*handle);
+    }
+    if (const auto status = registry.RemoveTarget(name); !status.ok()) {
+      LOG(ERROR) << "Failed to remove \"" << name
+                 << "\" from the registry: " << status;
+    }
+  }
+  for (const auto& target : diff.changed) {
+    const auto handle = registry.FindTarget(target.name);
+    CHECK(handle.has_value())
+        << "Target \"" << target.name << "\" is missing from the registry";
+    CHECK_OK(registry.SetTargetGroups(target.name, target.groups));
+    poller.RemoveTarget(target.name);
+    poller.AddTarget(target.name, target.hostname, *handle,
+                     GetRequestOptions(target));
+  }
+  for (const auto& target : diff.added) {
+    const auto handle = registry.AddTarget(target.name);
+    if (!handle.ok()) {
+      LOG(ERROR) << "Failed to add \"" << target.name
+                 << "\" to the registry: " << handle.status();
+      continue;
+    }
+    CHECK_OK(registry.SetTargetGroups(target.name, target.groups));
+    if (sample_history != nullptr) {
+      sample_history->AddTarget(*handle, target.name);
+    }
+    if (remote_writer != nullptr) {
+      remote_writer->AddTarget(*handle, target.name);
+    }
+    poller.AddTarget(target.name, target.hostname, *handle,
+                     GetRequestOptions(target));
+  }
+  LOG(INFO) << "Reloaded targets: " << diff.added.size() << " added, "
+            << diff.removed.size() << " removed, " << diff.changed.size()
+            << " changed";
+  targets = *std::move(maybe_targets);
+}
+
 int main(int argc, char* argv[]) {
   absl::SetStderrThreshold(absl::LogSeverityAtLeast::kInfo);
   absl::InitializeLog();
   absl::ParseCommandLine(argc, argv);
 
+  // SIGHUP is blocked before any threads are started, so that every thread
+  // inherits the mask and it's only ever taken by the reload thread.
+  sigset_t reload_signals;
+  sigemptyset(&reload_signals);
+  sigaddset(&reload_signals, SIGHUP);
+  CHECK(pthread_sigmask(SIG_BLOCK, &reload_signals, nullptr) == 0)
+      << "Failed to block SIGHUP";
+
   // Parse the command-line arguments
   const auto metrics_addr =
       GetFlagOrDie<std::string>(FLAGS_metrics_addr, "Must provide a value",
@@ -87,12 +387,18 @@ int main(int argc, char* argv[]) {
   const auto poll_period = GetFlagOrDie<absl::Duration>(
       FLAGS_poll_period, "Must be at least one second",
       [](const auto& val) { return val >= absl::Seconds(1); });
+  const auto poll_budget = GetFlagOrDie<absl::Duration>(
+      FLAGS_poll_budget, "Must not be negative",
+      [](const auto& val) { return val >= absl::ZeroDuration(); });
+  const auto worker_threads = GetFlagOrDie<int>(
+      FLAGS_worker_threads, "Must be at least one",
+      [](const auto& val) { return val >= 1; });
   const auto target_config_file = GetFlagOrDie<std::string>(
       FLAGS_targets_config_file, "File must exist", [](const auto& val) {
         return !val.empty() && std::filesystem::exists(val);
       });
 
-  const auto targets = LoadTargetsOrDie(target_config_file);
+  auto targets = LoadTargetsOrDie(target_config_file);
   if (targets.empty()) {
     LOG(QFATAL) << "Targets file \"" << target_config_file
                 << "\" contains no targets";
@@ -101,35 +407,127 @@ int main(int argc, char* argv[]) {
 
   auto scraper = CreateScraperOrDie();
   LOG(INFO) << "Initialized scraper: " << scraper->Version();
-  auto parser = CreateParser();
+  auto parser = CreateParserOrDie();
   LOG(INFO) << "Initialized parser: " << parser->Version();
 
-  auto registry = CreateRegistry();
+  auto registry = CreateRegistryOrDie();
+  std::unique_ptr<StateFile> state_file;
+  if (const auto filename = absl::GetFlag(FLAGS_state_file);
+      !filename.empty()) {
+    state_file = OpenStateFileOrDie(filename);
+  }
+  std::shared_ptr<ExpositionCache> exposition_cache;
+  if (absl::GetFlag(FLAGS_exposition_cache)) {
+    exposition_cache =
+        std::make_shared<ExpositionCache>(registry->GetCollectable());
+  }
+
+  std::vector<Sink*> sinks = {registry.get()};
+  std::shared_ptr<SampleHistory> sample_history;
+  if (const auto sample_history_size = GetFlagOrDie<int>(
+          FLAGS_sample_history_size, "Must not be negative",
+          [](const auto& val) { return val >= 0; });
+      sample_history_size > 0) {
+    sample_history = std::make_shared<SampleHistory>(SampleHistory::Options{
+        .capacity = static_cast<size_t>(sample_history_size),
+        .window = GetFlagOrDie<absl::Duration>(
+            FLAGS_sample_window, "Must be positive",
+            [](const auto& val) { return val > absl::ZeroDuration(); }),
+    });
+    sinks.push_back(sample_history.get());
+    if (exposition_cache != nullptr) {
+      exposition_cache->AddCollectable(sample_history);
+    }
+  }
+
+  // Outlives the poller, so that it sends or spills every queued poll on
+  // shutdown.
+  std::unique_ptr<RemoteWriter> remote_writer;
+  if (auto url = absl::GetFlag(FLAGS_remote_write_url); !url.empty()) {
+    remote_writer = CreateRemoteWriterOrDie(std::move(url));
+    sinks.push_back(remote_writer.get());
+  }
 
   Poller poller(
       std::move(parser), std::move(scraper),
       Poller::Options{
           .poll_period = poll_period,
+          .poll_budget = poll_budget,
+          .num_workers = worker_threads,
+          .circuit_breaker = GetCircuitBreakerOptionsOrDie(),
           .verbose_logging = absl::GetFlag(FLAGS_verbose_poller),
-          .error_callback =
-              [&registry](absl::string_view name, const absl::Status& error) {
-                registry->ErrorCallback(name, error);
+          .sinks = sinks,
+          .sink_batch_size = static_cast<size_t>(GetFlagOrDie<int>(
+              FLAGS_sink_batch_size, "Must not be negative",
+              [](const auto& val) { return val >= 0; })),
+          .scrape_stats_callback =
+              [&registry](TargetHandle handle, const ScrapeStats& stats) {
+                registry->ScrapeStatsCallback(handle, stats);
+              },
+          .pool_stats_callback =
+              [&registry, &exposition_cache,
+               &state_file](const ThreadPool::Stats& stats) {
+                registry->PoolStatsCallback(stats);
+                // The pool stats are reported once per poll period, which
+                // marks the end of a polling cycle.
+                if (exposition_cache != nullptr) {
+                  exposition_cache->Publish();
+                }
+                if (state_file != nullptr) {
+                  if (const auto status =
+                          state_file->Save(registry->GetTargetStates());
+                      !status.ok()) {
+                    LOG(ERROR) << "Failed to save target state: " << status;
+                  }
+                }
+              },
+          .poll_timings_callback =
+              [&registry](TargetHandle handle,
+                          const Poller::PollTimings& timings) {
+                registry->PollTimingsCallback(handle, timings);
               },
-          .success_callback =
-              [&registry](absl::string_view name,
-                          const ::shelly::Metrics& metrics) {
-                registry->SuccessCallback(name, metrics);
+          .circuit_state_callback =
+              [&registry](TargetHandle handle, CircuitBreaker::State state) {
+                registry->CircuitStateCallback(handle, state);
               },
       });
 
   for (const auto& target : targets) {
-    poller.AddTarget(target.name, target.hostname);
-    CHECK_OK(registry->AddTarget(target.name))
+    const auto handle = registry->AddTarget(target.name);
+    CHECK_OK(handle.status())
         << "Failed to add \"" << target.name << "\" to the registry";
+    CHECK_OK(registry->SetTargetGroups(target.name, target.groups));
+    if (sample_history != nullptr) {
+      sample_history->AddTarget(*handle, target.name);
+    }
+    if (remote_writer != nullptr) {
+      remote_writer->AddTarget(*handle, target.name);
+    }
+    poller.AddTarget(target.name, target.hostname, *handle,
+                     GetRequestOptions(target));
   };
+  // Restored before the metrics are served, so that the first scrape sees
+  // the previous run's metrics rather than zeros.
+  if (state_file != nullptr) {
+    RestoreTargetStates(*state_file, *registry);
+  }
 
-  ::prometheus::Exposer exposer(metrics_addr);
-  exposer.RegisterCollectable(registry->GetRegistry(), metrics_path);
+  std::unique_ptr<::prometheus::Exposer> exposer;
+  std::unique_ptr<MetricsServer> metrics_server;
+  if (exposition_cache != nullptr) {
+    auto maybe_metrics_server = CreateMetricsServer(
+        {.address = metrics_addr, .path = metrics_path}, exposition_cache);
+    if (!maybe_metrics_server.ok()) {
+      LOG(QFATAL) << maybe_metrics_server.status();
+    }
+    metrics_server = std::move(maybe_metrics_server).value();
+  } else {
+    exposer = std::make_unique<::prometheus::Exposer>(metrics_addr);
+    exposer->RegisterCollectable(registry->GetCollectable(), metrics_path);
+    if (sample_history != nullptr) {
+      exposer->RegisterCollectable(sample_history, metrics_path);
+    }
+  }
 
   // Setup the signal handlers to kill the poller gracefully.
   signal_handler_func = [&poller](int signum) {
@@ -139,5 +537,27 @@ int main(int argc, char* argv[]) {
   std::signal(SIGINT, SignalHandler);
   std::signal(SIGTERM, SignalHandler);
 
+  // Reloads the targets file on SIGHUP. The reload is applied from its own
+  // thread, as it may need to wait for the polls of removed targets.
+  std::atomic<bool> stop_reloading = false;
+  std::thread reload_thread([&] {
+    int signum;
+    while (sigwait(&reload_signals, &signum) == 0 && !stop_reloading) {
+      LOG(INFO) << "Received signal " << signum << ", reloading targets";
+      ReloadTargets(target_config_file, *registry, sample_history.get(),
+                    remote_writer.get(), poller, targets);
+    }
+  });
+
   poller.Run();
+
+  if (state_file != nullptr) {
+    if (const auto status = state_file->Save(registry->GetTargetStates());
+        !status.ok()) {
+      LOG(ERROR) << "Failed to save target state: " << status;
+    }
+  }
+  stop_reloading = true;
+  pthread_kill(reload_thread.native_handle(), SIGHUP);
+  reload_thread.join();
 }
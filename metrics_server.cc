@@ -0,0 +1,164 @@
+#include "metrics_server.h"
+
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "absl/log/die_if_null.h"
+#include "absl/status/status.h"
+#include "absl/strings/ascii.h"
+#include "absl/strings/match.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/strip.h"
+#include "absl/strings/substitute.h"
+#include "civetweb.h"
+#include "status_macros/status_macros.h"
+
+namespace {
+
+inline constexpr auto kContentType = "text/plain; version=0.0.4; charset=utf-8";
+
+// Returns whether the comma separated `header` contains `token`, ignoring any
+// parameters and surrounding whitespace. A token with a quality of zero is
+// treated as absent.
+bool HeaderContainsToken(const char* header, std::string_view token) {
+  if (header == nullptr) {
+    return false;
+  }
+  for (std::string_view entry : absl::StrSplit(header, ',')) {
+    std::vector<std::string_view> parts = absl::StrSplit(entry, ';');
+    if (!absl::EqualsIgnoreCase(absl::StripAsciiWhitespace(parts[0]),
+                                token)) {
+      continue;
+    }
+    for (size_t i = 1; i < parts.size(); ++i) {
+      std::string_view parameter = absl::StripAsciiWhitespace(parts[i]);
+      double quality;
+      if (absl::ConsumePrefix(&parameter, "q=") &&
+          absl::SimpleAtod(parameter, &quality) && quality <= 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+  return false;
+}
+
+// Returns whether the If-None-Match `header` matches `etag`.
+bool ETagMatches(const char* header, std::string_view etag) {
+  if (header == nullptr) {
+    return false;
+  }
+  for (std::string_view entry : absl::StrSplit(header, ',')) {
+    entry = absl::StripAsciiWhitespace(entry);
+    // Weak comparison is used, as the snapshots are never transformed.
+    absl::ConsumePrefix(&entry, "W/");
+    if (entry == "*" || entry == etag) {
+      return true;
+    }
+  }
+  return false;
+}
+
+class MetricsServerImpl final : public MetricsServer {
+ public:
+  MetricsServerImpl() = delete;
+  MetricsServerImpl(const Options& options,
+                    std::shared_ptr<ExpositionCache> cache)
+      : options_(options), cache_(std::move(cache)) {}
+
+  ~MetricsServerImpl() override {
+    if (ctx_ != nullptr) {
+      mg_stop(ctx_);
+    }
+    mg_exit_library();
+  }
+
+  absl::Status Start() {
+    const std::string num_threads = absl::StrCat(options_.num_threads);
+    const char* civetweb_options[] = {"listening_ports",
+                                      options_.address.c_str(),
+                                      "num_threads",
+                                      num_threads.c_str(),
+                                      "enable_keep_alive",
+                                      "yes",
+                                      nullptr};
+
+    mg_init_library(0);
+    ctx_ = mg_start(nullptr, nullptr, civetweb_options);
+    if (ctx_ == nullptr) {
+      return absl::InternalError(absl::Substitute(
+          "Failed to start Civetweb server on $0", options_.address));
+    }
+    mg_set_request_handler(ctx_, options_.path.c_str(), RequestHandler, this);
+    return absl::OkStatus();
+  }
+
+ private:
+  const Options options_;
+  const std::shared_ptr<ExpositionCache> cache_;
+  mg_context* ctx_ = nullptr;
+
+  static int RequestHandler(mg_connection* conn, void* user_data) {
+    return static_cast<MetricsServerImpl*>(user_data)->HandleRequest(conn);
+  }
+
+  int HandleRequest(mg_connection* conn) {
+    const std::string_view method = mg_get_request_info(conn)->request_method;
+    if (method != "GET" && method != "HEAD") {
+      mg_send_http_error(conn, 405, "Method not allowed");
+      return 405;
+    }
+
+    // Checked before getting the snapshot, so that a request for an
+    // unchanged version is only counted as not modified.
+    const std::string etag = cache_->CurrentETag();
+    if (ETagMatches(mg_get_header(conn, "If-None-Match"), etag)) {
+      cache_->RecordNotModified();
+      mg_response_header_start(conn, 304);
+      mg_response_header_add(conn, "ETag", etag.c_str(), -1);
+      mg_response_header_add(conn, "Vary", "Accept-Encoding", -1);
+      mg_response_header_send(conn);
+      return 304;
+    }
+
+    // Holding the snapshot keeps its bytes alive for the whole response, even
+    // if a newer one is rendered meanwhile.
+    const auto snapshot = cache_->Get();
+
+    const bool gzip = !snapshot->gzip.empty() &&
+                      HeaderContainsToken(
+                          mg_get_header(conn, "Accept-Encoding"), "gzip");
+    const std::string& body = gzip ? snapshot->gzip : snapshot->text;
+    const std::string content_length = absl::StrCat(body.size());
+
+    mg_response_header_start(conn, 200);
+    mg_response_header_add(conn, "Content-Type", kContentType, -1);
+    mg_response_header_add(conn, "Content-Length", content_length.c_str(),
+                           -1);
+    mg_response_header_add(conn, "ETag", snapshot->etag.c_str(), -1);
+    mg_response_header_add(conn, "Vary", "Accept-Encoding", -1);
+    if (gzip) {
+      mg_response_header_add(conn, "Content-Encoding", "gzip", -1);
+    }
+    mg_response_header_send(conn);
+    if (method != "HEAD") {
+      mg_write(conn, body.data(), body.size());
+    }
+    return 200;
+  }
+};
+
+}  // namespace
+
+absl::StatusOr<std::unique_ptr<MetricsServer>> CreateMetricsServer(
+    const MetricsServer::Options& options,
+    std::shared_ptr<ExpositionCache> cache) {
+  auto server =
+      std::make_unique<MetricsServerImpl>(options, ABSL_DIE_IF_NULL(cache));
+  RETURN_IF_ERROR(server->Start());
+  return server;
+}
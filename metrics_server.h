@@ -0,0 +1,35 @@
+#ifndef METRICS_SERVER_H
+#define METRICS_SERVER_H
+
+#include <memory>
+#include <string>
+
+#include "absl/status/statusor.h"
+#include "exposition_cache.h"
+
+// Serves the snapshots of an exposition cache over HTTP. Every response
+// carries the snapshot's ETag, so conditional requests for an unchanged
+// snapshot are answered with a bodiless 304, and clients that accept gzip are
+// sent the precompressed copy.
+class MetricsServer {
+ public:
+  struct Options final {
+    // Address and port to listen on, e.g. "0.0.0.0:9100".
+    std::string address = "0.0.0.0:9100";
+    std::string path = "/metrics";
+    int num_threads = 4;
+  };
+
+  virtual ~MetricsServer() = default;
+
+ protected:
+  MetricsServer() = default;
+};
+
+// Starts serving the cache, which stops when the returned object is
+// destroyed.
+absl::StatusOr<std::unique_ptr<MetricsServer>> CreateMetricsServer(
+    const MetricsServer::Options& options,
+    std::shared_ptr<ExpositionCache> cache);
+
+#endif  // METRICS_SERVER_H
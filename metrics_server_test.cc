@@ -0,0 +1,203 @@
+#include "metrics_server.h"
+
+#include <curl/curl.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "absl/log/check.h"
+#include "absl/strings/ascii.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/substitute.h"
+#include "prometheus/client_metric.h"
+#include "prometheus/metric_family.h"
+#include "prometheus/metric_type.h"
+
+namespace {
+
+using ::testing::HasSubstr;
+using ::testing::IsEmpty;
+
+class FakeCollectable final : public ::prometheus::Collectable {
+ public:
+  std::vector<::prometheus::MetricFamily> Collect() const override {
+    ::prometheus::ClientMetric metric;
+    metric.gauge.value = 123;
+    return {::prometheus::MetricFamily{
+        .name = "test_gauge",
+        .help = "Test gauge",
+        .type = ::prometheus::MetricType::Gauge,
+        .metric = {metric},
+    }};
+  }
+};
+
+uint16_t FindUnusedPortOrDie() {
+  int fd = socket(AF_INET, SOCK_STREAM, /*protocol=*/0);
+  CHECK(fd != -1) << "Failed to create socket";
+
+  sockaddr_in addr;
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = INADDR_ANY;
+  addr.sin_port = htons(0);  // Bind to any available port.
+  CHECK(bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+      << "Failed to bind socket";
+
+  socklen_t addrlen = sizeof(addr);
+  CHECK(getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &addrlen) == 0)
+      << "Failed to get socket name";
+  const uint16_t port = ntohs(addr.sin_port);
+  CHECK(port != 0) << "Failed to get port number";
+
+  shutdown(fd, SHUT_RDWR);
+  CHECK(close(fd) == 0) << "Failed to close socket";
+  return port;
+}
+
+struct Response final {
+  long status = 0;
+  std::string body;
+  // Header names are lower cased.
+  std::vector<std::pair<std::string, std::string>> headers;
+
+  std::string Header(std::string_view name) const {
+    for (const auto& [header_name, value] : headers) {
+      if (header_name == name) {
+        return value;
+      }
+    }
+    return "";
+  }
+};
+
+size_t WriteCallback(char* data, size_t size, size_t nmemb, void* userdata) {
+  static_cast<std::string*>(userdata)->append(data, size * nmemb);
+  return size * nmemb;
+}
+
+size_t HeaderCallback(char* data, size_t size, size_t nitems, void* userdata) {
+  std::string_view line(data, size * nitems);
+  const size_t colon = line.find(':');
+  if (colon != std::string_view::npos) {
+    static_cast<Response*>(userdata)->headers.emplace_back(
+        absl::AsciiStrToLower(line.substr(0, colon)),
+        std::string(absl::StripAsciiWhitespace(line.substr(colon + 1))));
+  }
+  return size * nitems;
+}
+
+// Makes a GET request, without curl decoding any content encoding so the
+// test sees the bytes as sent.
+Response GetOrDie(const std::string& url,
+                  const std::vector<std::string>& request_headers = {}) {
+  CURL* curl = curl_easy_init();
+  CHECK(curl != nullptr);
+  curl_slist* header_list = nullptr;
+  for (const auto& header : request_headers) {
+    header_list = curl_slist_append(header_list, header.c_str());
+  }
+
+  Response response;
+  curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+  curl_easy_setopt(curl, CURLOPT_HTTPHEADER, header_list);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteCallback);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response.body);
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, HeaderCallback);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, &response);
+  CHECK(curl_easy_perform(curl) == CURLE_OK) << "Request failed: " << url;
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &response.status);
+
+  curl_slist_free_all(header_list);
+  curl_easy_cleanup(curl);
+  return response;
+}
+
+class Fixture final {
+ public:
+  Fixture()
+      : cache_(std::make_shared<ExpositionCache>(
+            std::make_shared<FakeCollectable>())) {
+    const uint16_t port = FindUnusedPortOrDie();
+    auto maybe_server = CreateMetricsServer(
+        {.address = absl::StrCat("127.0.0.1:", port), .path = "/metrics"},
+        cache_);
+    CHECK_OK(maybe_server.status());
+    server_ = std::move(maybe_server).value();
+    url_ = absl::Substitute("http://127.0.0.1:$0/metrics", port);
+  }
+
+  ExpositionCache& cache() { return *cache_; }
+  const std::string& url() const { return url_; }
+
+ private:
+  std::shared_ptr<ExpositionCache> cache_;
+  std::unique_ptr<MetricsServer> server_;
+  std::string url_;
+};
+
+}  // namespace
+
+TEST(MetricsServer, ServesText) {
+  Fixture fixture;
+
+  const auto response = GetOrDie(fixture.url());
+  EXPECT_EQ(response.status, 200);
+  EXPECT_THAT(response.body, HasSubstr("test_gauge 123"));
+  EXPECT_EQ(response.body, fixture.cache().Get()->text);
+  EXPECT_THAT(response.Header("content-type"), HasSubstr("text/plain"));
+  EXPECT_THAT(response.Header("content-encoding"), IsEmpty());
+  EXPECT_EQ(response.Header("etag"), fixture.cache().Get()->etag);
+}
+
+TEST(MetricsServer, ServesGzip) {
+  Fixture fixture;
+
+  const auto response =
+      GetOrDie(fixture.url(), {"Accept-Encoding: deflate, gzip"});
+  EXPECT_EQ(response.status, 200);
+  EXPECT_EQ(response.Header("content-encoding"), "gzip");
+  EXPECT_EQ(response.body, fixture.cache().Get()->gzip);
+}
+
+TEST(MetricsServer, RespectsRejectedGzip) {
+  Fixture fixture;
+
+  const auto response = GetOrDie(fixture.url(), {"Accept-Encoding: gzip;q=0"});
+  EXPECT_EQ(response.status, 200);
+  EXPECT_THAT(response.Header("content-encoding"), IsEmpty());
+  EXPECT_EQ(response.body, fixture.cache().Get()->text);
+}
+
+TEST(MetricsServer, NotModified) {
+  Fixture fixture;
+
+  const auto first = GetOrDie(fixture.url());
+  const std::string etag = first.Header("etag");
+  ASSERT_FALSE(etag.empty());
+
+  const auto second =
+      GetOrDie(fixture.url(), {absl::StrCat("If-None-Match: ", etag)});
+  EXPECT_EQ(second.status, 304);
+  EXPECT_THAT(second.body, IsEmpty());
+  EXPECT_EQ(second.Header("etag"), etag);
+  // The conditional request is counted once, only as not modified.
+  const auto stats = fixture.cache().GetStats();
+  EXPECT_EQ(stats.renders, 1);
+  EXPECT_EQ(stats.hits, 0);
+  EXPECT_EQ(stats.not_modified, 1);
+
+  // Once a new version is published the old ETag no longer matches.
+  fixture.cache().Publish();
+  const auto third =
+      GetOrDie(fixture.url(), {absl::StrCat("If-None-Match: ", etag)});
+  EXPECT_EQ(third.status, 200);
+  EXPECT_NE(third.Header("etag"), etag);
+}
@@ -19,6 +19,15 @@ class Parser {
   Parser() = default;
 };
 
+// Parses each response in to a JSON DOM before reading the metrics from it.
 std::unique_ptr<Parser> CreateParser();
 
+// Reads the metrics in a single streaming pass over each response, skipping
+// the fields that aren't needed rather than building a DOM.
+std::unique_ptr<Parser> CreateStreamingParser();
+
+// Reads the metrics with simdjson's on-demand API, which only validates the
+// parts of each response that are accessed.
+std::unique_ptr<Parser> CreateSimdjsonParser();
+
 #endif  // PARSER_H
@@ -2,21 +2,30 @@
 
 #include <gtest/gtest.h>
 
+#include <memory>
+
 #include "absl/log/check.h"
 
-TEST(ParseJson, EmptyString) {
+using ParserFactory = std::unique_ptr<Parser> (*)();
+
+class ParseJson : public ::testing::TestWithParam<ParserFactory> {
+ protected:
+  std::unique_ptr<Parser> CreateParser() { return GetParam()(); }
+};
+
+TEST_P(ParseJson, EmptyString) {
   auto result = CreateParser()->Parse("");
   ASSERT_FALSE(result.ok());
   EXPECT_EQ(result.status().code(), absl::StatusCode::kInvalidArgument);
 }
 
-TEST(ParseJson, NotJson) {
+TEST_P(ParseJson, NotJson) {
   auto result = CreateParser()->Parse(R"(not json)");
   ASSERT_FALSE(result.ok());
   EXPECT_EQ(result.status().code(), absl::StatusCode::kInvalidArgument);
 }
 
-TEST(ParseJson, MissingTopLevelField) {
+TEST_P(ParseJson, MissingTopLevelField) {
   auto result = CreateParser()->Parse(R"(
   {
     "apower": 100.0,
@@ -31,7 +40,26 @@ TEST(ParseJson, MissingTopLevelField) {
   EXPECT_EQ(result.status().code(), absl::StatusCode::kNotFound);
 }
 
-TEST(ParseJson, MissingContainerField) {
+// Like an empty object, any other top level value has no fields.
+TEST_P(ParseJson, TopLevelNotObject) {
+  for (const char* data : {"[]", "5", R"("voltage")", "null",
+                           R"([{"voltage": 120.0}])"}) {
+    auto result = CreateParser()->Parse(data);
+    ASSERT_FALSE(result.ok()) << data;
+    EXPECT_EQ(result.status().code(), absl::StatusCode::kNotFound) << data;
+  }
+}
+
+TEST_P(ParseJson, TopLevelNotObjectInvalid) {
+  for (const char* data : {"[1,", "[1] 2", "5x"}) {
+    auto result = CreateParser()->Parse(data);
+    ASSERT_FALSE(result.ok()) << data;
+    EXPECT_EQ(result.status().code(), absl::StatusCode::kInvalidArgument)
+        << data;
+  }
+}
+
+TEST_P(ParseJson, MissingContainerField) {
   auto result = CreateParser()->Parse(R"(
   {
     "voltage": 120.0,
@@ -43,7 +71,7 @@ TEST(ParseJson, MissingContainerField) {
   EXPECT_EQ(result.status().code(), absl::StatusCode::kNotFound);
 }
 
-TEST(ParseJson, Success) {
+TEST_P(ParseJson, Success) {
   auto result = CreateParser()->Parse(R"(
   {
     "voltage": 120.0,
@@ -61,4 +89,130 @@ TEST(ParseJson, Success) {
   EXPECT_DOUBLE_EQ(result->current, 12.0);
   EXPECT_DOUBLE_EQ(result->temp_c, 28.0);
   EXPECT_DOUBLE_EQ(result->temp_f, 82.0);
-}
\ No newline at end of file
+}
+
+TEST_P(ParseJson, FieldNotNumber) {
+  auto result = CreateParser()->Parse(R"(
+  {
+    "voltage": "120.0",
+    "apower": 100.0,
+    "current": 12.0,
+    "temperature": {
+      "tC": 28.0,
+      "tF": 82.0
+    }
+  }
+  )");
+  ASSERT_FALSE(result.ok());
+  EXPECT_EQ(result.status().code(), absl::StatusCode::kInvalidArgument);
+}
+
+TEST_P(ParseJson, ContainerFieldNotObject) {
+  auto result = CreateParser()->Parse(R"(
+  {
+    "voltage": 120.0,
+    "apower": 100.0,
+    "current": 12.0,
+    "temperature": [28.0, 82.0]
+  }
+  )");
+  ASSERT_FALSE(result.ok());
+  EXPECT_EQ(result.status().code(), absl::StatusCode::kInvalidArgument);
+}
+
+TEST_P(ParseJson, IgnoresOtherFields) {
+  auto result = CreateParser()->Parse(R"(
+  {
+    "id": 0,
+    "source": "init",
+    "output": true,
+    "aenergy": {
+      "total": 1234.5,
+      "by_minute": [1.0, 2.0, 3.0],
+      "voltage": 1.0
+    },
+    "voltage": 120.0,
+    "apower": 100.0,
+    "current": 12.0,
+    "temperature": {
+      "tC": 28.0,
+      "tF": 82.0,
+      "nested": {"tC": 1.0}
+    }
+  }
+  )");
+  ASSERT_TRUE(result.ok());
+  EXPECT_DOUBLE_EQ(result->voltage, 120.0);
+  EXPECT_DOUBLE_EQ(result->apower, 100.0);
+  EXPECT_DOUBLE_EQ(result->current, 12.0);
+  EXPECT_DOUBLE_EQ(result->temp_c, 28.0);
+  EXPECT_DOUBLE_EQ(result->temp_f, 82.0);
+}
+
+// A Switch.GetStatus response as returned by a Shelly Plus Plug S.
+TEST_P(ParseJson, CapturedResponse) {
+  auto result = CreateParser()->Parse(
+      R"({"id":0,"source":"HTTP_in","output":true,"apower":54.2,)"
+      R"("voltage":231.4,"freq":50.0,"current":0.268,)"
+      R"("aenergy":{"total":10523.871,"by_minute":[903.551,903.551,897.262],)"
+      R"("minute_ts":1717430460},)"
+      R"("ret_aenergy":{"total":0.000,"by_minute":[0.000,0.000,0.000],)"
+      R"("minute_ts":1717430460},)"
+      R"("temperature":{"tC":36.8, "tF":98.3}})");
+  ASSERT_TRUE(result.ok());
+  EXPECT_DOUBLE_EQ(result->voltage, 231.4);
+  EXPECT_DOUBLE_EQ(result->apower, 54.2);
+  EXPECT_DOUBLE_EQ(result->current, 0.268);
+  EXPECT_DOUBLE_EQ(result->temp_c, 36.8);
+  EXPECT_DOUBLE_EQ(result->temp_f, 98.3);
+}
+
+TEST_P(ParseJson, IntegerFields) {
+  auto result = CreateParser()->Parse(
+      R"({"voltage": 120, "apower": 0, "current": 12,
+          "temperature": {"tC": -5, "tF": 23}})");
+  ASSERT_TRUE(result.ok());
+  EXPECT_DOUBLE_EQ(result->voltage, 120.0);
+  EXPECT_DOUBLE_EQ(result->apower, 0.0);
+  EXPECT_DOUBLE_EQ(result->current, 12.0);
+  EXPECT_DOUBLE_EQ(result->temp_c, -5.0);
+  EXPECT_DOUBLE_EQ(result->temp_f, 23.0);
+}
+
+TEST_P(ParseJson, TrailingGarbage) {
+  auto result = CreateParser()->Parse(
+      R"({"voltage": 120.0, "apower": 100.0, "current": 12.0,
+          "temperature": {"tC": 28.0, "tF": 82.0}} {"voltage": 1.0})");
+  ASSERT_FALSE(result.ok());
+  EXPECT_EQ(result.status().code(), absl::StatusCode::kInvalidArgument);
+}
+
+// Every parser takes the last value of a repeated key.
+TEST_P(ParseJson, DuplicateKey) {
+  auto result = CreateParser()->Parse(
+      R"({"voltage": 110.0, "apower": 100.0, "current": 12.0,
+          "temperature": {"tC": 1.0, "tF": 2.0, "tC": 3.0},
+          "voltage": 120.0,
+          "temperature": {"tF": 82.0, "tC": 28.0}})");
+  ASSERT_TRUE(result.ok()) << result.status();
+  EXPECT_DOUBLE_EQ(result->voltage, 120.0);
+  EXPECT_DOUBLE_EQ(result->apower, 100.0);
+  EXPECT_DOUBLE_EQ(result->current, 12.0);
+  EXPECT_DOUBLE_EQ(result->temp_c, 28.0);
+  EXPECT_DOUBLE_EQ(result->temp_f, 82.0);
+}
+
+TEST_P(ParseJson, DuplicateKeyWrongType) {
+  auto result = CreateParser()->Parse(
+      R"({"voltage": 120.0, "apower": 100.0, "current": 12.0,
+          "temperature": {"tC": 28.0, "tF": 82.0},
+          "apower": "100.0"})");
+  ASSERT_FALSE(result.ok());
+  EXPECT_EQ(result.status().code(), absl::StatusCode::kInvalidArgument);
+}
+
+INSTANTIATE_TEST_SUITE_P(Dom, ParseJson, ::testing::Values(&::CreateParser));
+INSTANTIATE_TEST_SUITE_P(Streaming, ParseJson,
+                         ::testing::Values(&::CreateStreamingParser));
+INSTANTIATE_TEST_SUITE_P(Simdjson, ParseJson,
+                         ::testing::Values(&::CreateSimdjsonParser));
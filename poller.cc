@@ -1,7 +1,9 @@
 #include "poller.h"
 
-#include <chrono>
-#include <future>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <vector>
 
 #include "absl/log/check.h"
 #include "absl/log/die_if_null.h"
@@ -23,17 +25,67 @@ Poller::Poller(std::unique_ptr<Parser> parser, std::unique_ptr<Scraper> scraper,
     : parser_(std::move(ABSL_DIE_IF_NULL(parser))),
       scraper_(std::move(ABSL_DIE_IF_NULL(scraper))),
       options_(options),
+      pool_(std::make_unique<ThreadPool>(options.num_workers)),
       alive_(false) {}
 
-void Poller::AddTarget(std::string_view name, std::string_view hostname) {
-  {
-    std::unique_lock<std::mutex> lock(alive_mutex_);
-    CHECK(!alive_) << "App::AddTarget must be called before App::Run";
-  }
-  targets_.push_back(Target{
+void Poller::AddTarget(std::string_view name, std::string_view hostname,
+                       TargetHandle handle,
+                       const Scraper::RequestOptions& request_options) {
+  auto target = std::shared_ptr<Target>(new Target{
+      .handle = handle,
       .name = std::string(name),
       .hostname = std::string(hostname),
+      .url = CreateScrapeUrl(hostname),
+      .request_options = request_options,
+      .circuit_breaker = CircuitBreaker(options_.circuit_breaker),
+  });
+  std::unique_lock<std::mutex> lock(targets_mutex_);
+  targets_.push_back(target);
+  added_targets_.push_back(std::move(target));
+}
+
+bool Poller::RemoveTarget(std::string_view name) {
+  std::shared_ptr<Target> target;
+  bool last_of_origin;
+  {
+    std::unique_lock<std::mutex> lock(targets_mutex_);
+    const auto it = std::find_if(
+        targets_.begin(), targets_.end(),
+        [name](const auto& target) { return target->name == name; });
+    if (it == targets_.end()) {
+      return false;
+    }
+    target = std::move(*it);
+    targets_.erase(it);
+    std::erase(added_targets_, target);
+    // The scheduler checks this while holding the mutex, so no new poll of the
+    // target can start from here on.
+    target->removed = true;
+    const std::string_view origin = UrlOrigin(target->url);
+    last_of_origin = std::none_of(
+        targets_.begin(), targets_.end(), [origin](const auto& other) {
+          return UrlOrigin(other->url) == origin;
+        });
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(in_flight_mutex_);
+    in_flight_done_.wait(lock, [&target] { return !target->in_flight; });
+  }
+  // Once nothing else is polled there, the scraper needn't keep connections
+  // open to the target's host, which a reload may have moved or dropped.
+  if (last_of_origin) {
+    scraper_->ForgetOrigin(target->url);
+  }
+
+  // The outstanding poll may have left a result in the batch. Holding the
+  // sink mutex also waits out any delivery of a batch that's already taken.
+  std::unique_lock<std::mutex> sink_lock(sink_mutex_);
+  std::unique_lock<std::mutex> lock(batch_mutex_);
+  std::erase_if(batch_, [&target](const PollResult& result) {
+    return result.handle == target->handle;
   });
+  return true;
 }
 
 void Poller::Run() {
@@ -44,37 +96,73 @@ void Poller::Run() {
   }
 
   LOG(INFO) << "Entered run loop, will poll every " << options_.poll_period;
-  do {
-    const auto start_time = options_.time_func();
 
-    {
-      std::unique_lock<std::mutex> lock(alive_mutex_);
-      if (!alive_) {
-        break;
-      }
-    }
+  // Stagger the first poll of each target evenly across the period so that
+  // the requests don't all land at the same instant. From then on each target
+  // keeps to its own absolute deadlines, which don't drift however long the
+  // polls take.
+  const auto start_time = options_.time_func();
+  DeadlineQueue deadlines;
+  {
+    // Every target is scheduled afresh, in case this isn't the first run.
+    std::unique_lock<std::mutex> lock(targets_mutex_);
+    added_targets_ = targets_;
+  }
+  ScheduleAddedTargets(start_time, deadlines);
+  deadlines.push({
+      .time = start_time + options_.poll_period,
+      .target = nullptr,
+  });
 
-    // Process th targets in parallel and then block this thread until they have
-    // all completed.
-    std::vector<std::future<void>> futures;
-    futures.reserve(targets_.size());
-    for (const auto& target : targets_) {
-      futures.push_back(std::async(std::launch::async,
-                                   [this, &target] { ProcessTarget(target); }));
-    }
-    for (auto& future : futures) {
-      future.wait();
+  while (SleepUntil(deadlines.top().time)) {
+    auto deadline = deadlines.top();
+    deadlines.pop();
+
+    if (deadline.target == nullptr) {
+      FlushResults();
+      if (options_.pool_stats_callback) {
+        options_.pool_stats_callback(pool_->GetStats());
+      }
+    } else {
+      std::unique_lock<std::mutex> lock(targets_mutex_);
+      auto& target = *deadline.target;
+      if (target.removed) {
+        // Dropping the deadline releases the target.
+        continue;
+      }
+      if (target.in_flight) {
+        LOG(WARNING) << "Skipping poll of target \"" << target.name
+                     << "\", the previous poll is still in progress";
+      } else {
+        const auto previous = target.circuit_breaker.state();
+        if (target.circuit_breaker.AllowRequest(deadline.time)) {
+          CircuitStateChanged(target, previous);
+          StartTarget(target, deadline.time);
+        }
+      }
     }
 
-    const auto delay =
-        (start_time + options_.poll_period) - options_.time_func();
-    if (delay > absl::ZeroDuration()) {
-      std::unique_lock<std::mutex> lock(sleep_mutex_);
-      sleeper_.wait_for(
-          lock, std::chrono::milliseconds(absl::ToInt64Milliseconds(delay)));
+    // If the loop has fallen more than a period behind, skip the missed
+    // deadlines rather than firing them all at once.
+    deadline.time += options_.poll_period;
+    const auto now = options_.time_func();
+    if (deadline.time <= now) {
+      absl::Duration remainder;
+      deadline.time +=
+          options_.poll_period *
+          (absl::IDivDuration(now - deadline.time, options_.poll_period,
+                              &remainder) +
+           1);
     }
+    deadlines.push(std::move(deadline));
+    ScheduleAddedTargets(now, deadlines);
+  }
 
-  } while (true);
+  {
+    std::unique_lock<std::mutex> lock(in_flight_mutex_);
+    in_flight_done_.wait(lock, [this] { return in_flight_ == 0; });
+  }
+  FlushResults();
   LOG(INFO) << "Exited run loop";
 }
 
@@ -86,6 +174,9 @@ void Poller::Kill() {
     }
     alive_ = false;
   }
+  // Holding the sleep mutex ensures that Run is either already waiting, or
+  // has yet to check whether it's alive, so the notification isn't lost.
+  std::unique_lock<std::mutex> lock(sleep_mutex_);
   sleeper_.notify_all();
 }
 
@@ -94,11 +185,136 @@ bool Poller::Alive() const {
   return alive_;
 }
 
-void Poller::ProcessTarget(const Target& target) {
-  auto maybe_metrics = RetrieveMetrics(target);
+void Poller::ScheduleAddedTargets(absl::Time start_time,
+                                  DeadlineQueue& deadlines) {
+  std::vector<std::shared_ptr<Target>> added;
+  {
+    std::unique_lock<std::mutex> lock(targets_mutex_);
+    added.swap(added_targets_);
+  }
+  const auto num_added = static_cast<int64_t>(added.size());
+  for (int64_t i = 0; i < num_added; ++i) {
+    deadlines.push({
+        .time = start_time + options_.poll_period * i / num_added,
+        .target = std::move(added[i]),
+    });
+  }
+}
+
+bool Poller::SleepUntil(absl::Time deadline) {
+  const auto delay = deadline - options_.time_func();
+  std::unique_lock<std::mutex> lock(sleep_mutex_);
+  if (delay > absl::ZeroDuration()) {
+    sleeper_.wait_for(lock, absl::ToChronoNanoseconds(delay),
+                      [this] { return !Alive(); });
+  }
+  return Alive();
+}
+
+void Poller::StartTarget(Target& target, absl::Time due_time) {
+  target.in_flight = true;
+  target.due_time = due_time;
+
+  // The time function may not be the wall clock the scraper uses, so convert
+  // the remaining budget in to a wall clock deadline.
+  const auto budget = options_.poll_budget > absl::ZeroDuration()
+                          ? options_.poll_budget
+                          : options_.poll_period;
+  target.request_options.deadline =
+      absl::Now() + (due_time + budget - options_.time_func());
+
+  {
+    std::unique_lock<std::mutex> lock(in_flight_mutex_);
+    ++in_flight_;
+  }
+  pool_->Schedule([this, &target] { ProcessTarget(target); });
+}
+
+void Poller::ProcessTarget(Target& target) {
+  target.timings = PollTimings{
+      .scheduling_lag = options_.time_func() - target.due_time,
+  };
+  scraper_->ScrapeAsync(
+      target.url, std::move(target.body_buffer), target.request_options,
+      [this, &target](ScrapeOutcome outcome) {
+        // The scraper may complete on its own thread, so hand the result back
+        // to the worker pool to be parsed.
+        pool_->Schedule(
+            [this, &target, outcome = std::move(outcome)]() mutable {
+              CompleteTarget(target, std::move(outcome));
+              FinishTarget(target);
+            });
+      });
+}
+
+void Poller::FinishTarget(Target& target) {
+  if (options_.poll_timings_callback) {
+    const auto now = options_.time_func();
+    auto& timings = target.timings;
+    timings.duration = now - target.due_time - timings.scheduling_lag;
+    timings.overrun = std::max(
+        absl::ZeroDuration(), now - (target.due_time + options_.poll_period));
+    options_.poll_timings_callback(target.handle, timings);
+  }
+
+  // Notify while holding the mutex, as Run may return and the poller be
+  // destroyed as soon as the count reaches zero. The target may likewise be
+  // destroyed by RemoveTarget as soon as it's no longer in flight.
+  std::unique_lock<std::mutex> lock(in_flight_mutex_);
+  target.in_flight = false;
+  --in_flight_;
+  in_flight_done_.notify_all();
+}
+
+void Poller::CircuitStateChanged(const Target& target,
+                                 CircuitBreaker::State previous) {
+  const auto state = target.circuit_breaker.state();
+  if (state == previous) {
+    return;
+  }
+  if (state == CircuitBreaker::State::kOpen) {
+    LOG(WARNING) << "Backing off target \"" << target.name << "\" until "
+                 << target.circuit_breaker.open_until();
+  } else if (options_.verbose_logging ||
+             state == CircuitBreaker::State::kClosed) {
+    LOG(INFO) << "Circuit breaker for target \"" << target.name
+              << "\" is now " << CircuitStateName(state);
+  }
+  if (options_.circuit_state_callback) {
+    options_.circuit_state_callback(target.handle, state);
+  }
+}
+
+void Poller::CompleteTarget(Target& target, ScrapeOutcome outcome) {
+  // Failed requests still have stats, unless no request was started.
+  if (options_.scrape_stats_callback && outcome.stats.has_value()) {
+    options_.scrape_stats_callback(target.handle, *outcome.stats);
+  }
+
+  auto& maybe_scraper_result = outcome.result;
+  auto maybe_metrics = RetrieveMetrics(target, maybe_scraper_result);
+  if (maybe_scraper_result.ok()) {
+    target.body_buffer = std::move(maybe_scraper_result->content);
+  }
+  const auto previous = target.circuit_breaker.state();
+  if (maybe_metrics.ok()) {
+    target.circuit_breaker.RecordSuccess();
+  } else {
+    target.circuit_breaker.RecordFailure(options_.time_func());
+  }
+  CircuitStateChanged(target, previous);
+
+  if (!options_.sinks.empty()) {
+    AddResult({
+        .handle = target.handle,
+        .time = options_.time_func(),
+        .metrics = maybe_metrics,
+    });
+  }
+
   if (!maybe_metrics.ok()) {
     if (options_.error_callback) {
-      options_.error_callback(target.name, maybe_metrics.status());
+      options_.error_callback(target.handle, maybe_metrics.status());
     }
     LOG(ERROR) << "Failed to retrieve metrics for target \"" << target.name
                << "\": " << maybe_metrics.status();
@@ -107,7 +323,7 @@ void Poller::ProcessTarget(const Target& target) {
   const auto metrics = std::move(maybe_metrics).value();
 
   if (options_.success_callback) {
-    options_.success_callback(target.name, metrics);
+    options_.success_callback(target.handle, metrics);
   }
   if (options_.verbose_logging) {
     LOG(INFO) << "Got successful response for target \"" << target.name
@@ -116,10 +332,12 @@ void Poller::ProcessTarget(const Target& target) {
 }
 
 absl::StatusOr<::shelly::Metrics> Poller::RetrieveMetrics(
-    const Target& target) {
-  const auto url = CreateScrapeUrl(target.hostname);
-  ASSIGN_OR_RETURN(const auto scraper_result, scraper_->Scrape(url),
-                   _ << "Failed to scraper " << url);
+    Target& target,
+    const absl::StatusOr<ScraperResult>& maybe_scraper_result) {
+  const auto& url = target.url;
+  RETURN_IF_ERROR(maybe_scraper_result.status())
+      << "Failed to scraper " << url;
+  const auto& scraper_result = *maybe_scraper_result;
   if (scraper_result.code != 200) {
     return absl::InvalidArgumentError(absl::Substitute(
         "Got HTTP response code $0 for $1", scraper_result.code, url));
@@ -130,7 +348,40 @@ absl::StatusOr<::shelly::Metrics> Poller::RetrieveMetrics(
         scraper_result.content_type, url));
   }
 
-  ASSIGN_OR_RETURN(const auto metrics, parser_->Parse(scraper_result.content),
+  const auto parse_start = options_.time_func();
+  auto maybe_metrics = parser_->Parse(scraper_result.content);
+  target.timings.parse_time = options_.time_func() - parse_start;
+  ASSIGN_OR_RETURN(const auto metrics, std::move(maybe_metrics),
                    _ << "Failed to parse JSON from " << url);
   return metrics;
 }
+
+void Poller::AddResult(PollResult result) {
+  bool full;
+  {
+    std::unique_lock<std::mutex> lock(batch_mutex_);
+    batch_.push_back(std::move(result));
+    full = options_.sink_batch_size > 0 &&
+           batch_.size() >= options_.sink_batch_size;
+  }
+  if (full) {
+    FlushResults();
+  }
+}
+
+void Poller::FlushResults() {
+  std::unique_lock<std::mutex> sink_lock(sink_mutex_);
+  {
+    // The workers only wait on the batch mutex for as long as the swap takes,
+    // not for the sinks.
+    std::unique_lock<std::mutex> lock(batch_mutex_);
+    sink_batch_.swap(batch_);
+  }
+  if (sink_batch_.empty()) {
+    return;
+  }
+  for (auto* sink : options_.sinks) {
+    sink->Consume(sink_batch_);
+  }
+  sink_batch_.clear();
+}
@@ -1,39 +1,113 @@
 #ifndef POLLER_H
 #define POLLER_H
 
+#include <atomic>
 #include <condition_variable>
 #include <functional>
 #include <memory>
 #include <mutex>
+#include <queue>
 #include <string_view>
+#include <vector>
 
 #include "absl/status/statusor.h"
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
+#include "circuit_breaker.h"
 #include "parser.h"
 #include "scraper.h"
 #include "shelly.h"
-
+#include "sink.h"
+#include "target.h"
+#include "thread_pool.h"
+
+// Polls each target once every poll period. Every target is scheduled
+// independently against its own absolute deadlines, with the first polls
+// spread evenly across the period, so a slow target only delays itself.
+// Targets that keep failing are backed off by a per-target circuit breaker,
+// so that unreachable devices don't take worker time from the healthy ones.
+// Targets can be added and removed while the poller runs, without disturbing
+// the schedule of the others.
 class Poller final {
  public:
+  // Timings for a single poll of a target, measured with `time_func`.
+  struct PollTimings final {
+    // Time between the poll being due and a worker starting on it.
+    absl::Duration scheduling_lag = absl::ZeroDuration();
+    // Time taken by the worker to scrape and parse the target.
+    absl::Duration duration = absl::ZeroDuration();
+    // How long the poll finished after the next one was due, or zero if it
+    // finished in time.
+    absl::Duration overrun = absl::ZeroDuration();
+    // Time spent parsing the response, or zero if there was nothing to parse.
+    absl::Duration parse_time = absl::ZeroDuration();
+  };
+
   struct Options final {
     absl::Duration poll_period = absl::Seconds(15);
     std::function<absl::Time()> time_func = [] { return absl::Now(); };
 
+    // Upper bound on the time each poll can take, measured from when it was
+    // due, including any time spent waiting for a worker. Polls that run out
+    // of budget fail with a deadline exceeded error. Zero means the poll
+    // period, so that a poll is always finished before the next one is due.
+    absl::Duration poll_budget = absl::ZeroDuration();
+
+    // Number of worker threads used to process the targets.
+    int num_workers = 8;
+
+    // Applied to each target separately. While a target's breaker is open its
+    // polls are skipped, until the first poll due after the backoff which is
+    // sent as a probe.
+    CircuitBreaker::Options circuit_breaker;
+
     bool verbose_logging = false;
 
-    std::function<void(absl::string_view name, const absl::Status& error)>
+    // Receive the result of every poll, in batches of up to `sink_batch_size`
+    // results. Any partial batch is delivered once every poll period, before
+    // `pool_stats_callback` is called. Zero means the results are only
+    // delivered once every poll period. The sinks must outlive the poller.
+    std::vector<Sink*> sinks;
+    size_t sink_batch_size = 64;
+
+    // The per-target callbacks identify the target by the handle it was added
+    // with.
+    std::function<void(TargetHandle handle, const absl::Status& error)>
         error_callback;
-    std::function<void(absl::string_view name,
-                       const ::shelly::Metrics& metrics)>
+    std::function<void(TargetHandle handle, const ::shelly::Metrics& metrics)>
         success_callback;
+    // Called for every completed HTTP request, successful or not. Scrapes
+    // that fail before starting a request have no stats to report.
+    std::function<void(TargetHandle handle, const ScrapeStats& stats)>
+        scrape_stats_callback;
+    // Called once every poll period with the worker pool statistics.
+    std::function<void(const ThreadPool::Stats& stats)> pool_stats_callback;
+    // Called once every poll of a target has finished, successful or not.
+    std::function<void(TargetHandle handle, const PollTimings& timings)>
+        poll_timings_callback;
+    // Called whenever a target's circuit breaker changes state.
+    std::function<void(TargetHandle handle, CircuitBreaker::State state)>
+        circuit_state_callback;
   };
 
   Poller() = delete;
   Poller(std::unique_ptr<Parser> parser, std::unique_ptr<Scraper> scraper,
          const Options& options);
 
-  void AddTarget(std::string_view name, std::string_view hostname);
+  // Adds a target to be polled, whose results are reported with `handle`.
+  // The `request_options` override the scraper's options for its requests,
+  // except for any deadline which is replaced by the poll budget. Targets
+  // added while running are picked up when the next deadline passes, and
+  // their first polls spread across the following period.
+  void AddTarget(std::string_view name, std::string_view hostname,
+                 TargetHandle handle,
+                 const Scraper::RequestOptions& request_options = {});
+  // Stops polling the target called `name`, returning false if there isn't
+  // one. Waits for any outstanding poll of the target to finish and discards
+  // its undelivered results, so that once this returns nothing more is
+  // reported with its handle and the handle may be reused. If no other target
+  // is on the same host, the scraper's idle connections to it are closed.
+  bool RemoveTarget(std::string_view name);
 
   void Run();
   void Kill();
@@ -42,25 +116,104 @@ class Poller final {
 
  private:
   struct Target final {
+    TargetHandle handle;
     std::string name;
     std::string hostname;
+    std::string url;
+    Scraper::RequestOptions request_options;
+
+    // Holds the storage for the response body between polls, so that it is
+    // only allocated once. Only touched by the task processing the target.
+    std::string body_buffer;
+    // Timings of the current poll. Only touched by the task processing the
+    // target.
+    absl::Time due_time;
+    PollTimings timings;
+
+    // Only touched by the scheduler while no poll is in flight, and by the
+    // task processing the target otherwise.
+    CircuitBreaker circuit_breaker;
+
+    // Set while a poll of the target is outstanding. A deadline that passes
+    // while it's set is skipped rather than queueing up another poll. Only
+    // cleared while holding `in_flight_mutex_`.
+    std::atomic<bool> in_flight = false;
+
+    // Set once the target has been removed, after which its deadlines are
+    // dropped instead of being polled. Guarded by `targets_mutex_`.
+    bool removed = false;
   };
 
+  // An entry in the scheduler's queue of deadlines.
+  struct Deadline final {
+    absl::Time time;
+    // The target to poll, or null for the pool statistics. Holding the target
+    // keeps it alive until its deadline is dropped, even once it's removed.
+    std::shared_ptr<Target> target;
+
+    bool operator>(const Deadline& other) const { return time > other.time; }
+  };
+  using DeadlineQueue =
+      std::priority_queue<Deadline, std::vector<Deadline>, std::greater<>>;
+
   std::unique_ptr<Parser> parser_;
   std::unique_ptr<Scraper> scraper_;
   const Options options_;
 
-  std::vector<Target> targets_;
+  // Guards `targets_` and `added_targets_`, and is held by the scheduler
+  // while it decides whether to poll a target, so that a target can't be
+  // removed in between.
+  std::mutex targets_mutex_;
+  std::vector<std::shared_ptr<Target>> targets_;
+  // Targets added since the scheduler last looked, which have yet to be given
+  // a deadline.
+  std::vector<std::shared_ptr<Target>> added_targets_;
+  std::unique_ptr<ThreadPool> pool_;
+
+  // Results waiting to be delivered to the sinks.
+  std::vector<PollResult> batch_;
+  std::mutex batch_mutex_;
+  // Held while delivering a batch, so that batches are delivered one at a
+  // time and in the order they were filled. Guards `sink_batch_`, which holds
+  // the batch being delivered and is then reused for the next one.
+  std::mutex sink_mutex_;
+  std::vector<PollResult> sink_batch_;
+
+  // Number of targets with a poll outstanding, which Run waits to reach zero
+  // before returning.
+  int in_flight_ = 0;
+  std::mutex in_flight_mutex_;
+  std::condition_variable in_flight_done_;
 
   bool alive_ = false;
   mutable std::mutex alive_mutex_;
   std::mutex sleep_mutex_;
   std::condition_variable sleeper_;
 
-  // TODO Worker thread pool
-
-  void ProcessTarget(const Target& target);
-  absl::StatusOr<::shelly::Metrics> RetrieveMetrics(const Target& target);
+  // Sleeps until `deadline`, returning false if the poller was killed first.
+  bool SleepUntil(absl::Time deadline);
+
+  // Gives each newly added target its first deadline, spreading them evenly
+  // across the period that starts at `start_time`.
+  void ScheduleAddedTargets(absl::Time start_time, DeadlineQueue& deadlines);
+
+  // Starts polling the target, which was due at `due_time`.
+  void StartTarget(Target& target, absl::Time due_time);
+  // Starts scraping the target, calling FinishTarget once the result has been
+  // handled.
+  void ProcessTarget(Target& target);
+  void FinishTarget(Target& target);
+  // Reports the breaker's state if it has changed from `previous`.
+  void CircuitStateChanged(const Target& target,
+                           CircuitBreaker::State previous);
+  void CompleteTarget(Target& target, ScrapeOutcome outcome);
+  // Adds a result to the batch, delivering the batch if it's full.
+  void AddResult(PollResult result);
+  // Delivers any batched results to the sinks.
+  void FlushResults();
+  absl::StatusOr<::shelly::Metrics> RetrieveMetrics(
+      Target& target,
+      const absl::StatusOr<ScraperResult>& maybe_scraper_result);
 };
 
 #endif  // POLLER_H
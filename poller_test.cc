@@ -3,12 +3,18 @@
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
+#include <atomic>
+#include <chrono>
 #include <latch>
+#include <map>
 #include <mutex>
+#include <optional>
 #include <regex>
+#include <set>
 #include <thread>
 
 #include "absl/log/check.h"
+#include "absl/strings/str_cat.h"
 #include "absl/strings/substitute.h"
 
 MATCHER_P(MetricsEq, cmp, "") {
@@ -39,9 +45,23 @@ class MockParser : public Parser {
 
 class MockScraper : public Scraper {
  public:
-  MOCK_METHOD(absl::StatusOr<ScraperResult>, Scrape, (const std::string&),
-              (override));
+  using Scraper::Scrape;
+
+  // Each scrape has the mocked result, along with `stats`.
+  ScrapeOutcome Scrape(const std::string& url, std::string buffer,
+                       const RequestOptions& request_options) override {
+    return {
+        .result = ScrapeResult(url, std::move(buffer), request_options),
+        .stats = stats,
+    };
+  }
+
+  MOCK_METHOD(absl::StatusOr<ScraperResult>, ScrapeResult,
+              (const std::string&, std::string, const RequestOptions&));
+  MOCK_METHOD(void, ForgetOrigin, (std::string_view), (override));
   MOCK_METHOD(std::string_view, Version, (), (const, override));
+
+  std::optional<ScrapeStats> stats;
 };
 
 class FakeClock final {
@@ -65,9 +85,8 @@ class Fixture final {
  public:
   Fixture() = delete;
 
-  Fixture(std::function<void(absl::string_view, const absl::Status&)>
-              error_callback,
-          std::function<void(absl::string_view, const ::shelly::Metrics&)>
+  Fixture(std::function<void(TargetHandle, const absl::Status&)> error_callback,
+          std::function<void(TargetHandle, const ::shelly::Metrics&)>
               success_callback)
       : clock_(absl::FromUnixSeconds(0)) {
     auto parser = std::make_unique<MockParser>();
@@ -126,12 +145,12 @@ class LatchTest : public ::testing::Test {
  public:
   LatchTest()
       : fixture_(
-            [this](absl::string_view name, const absl::Status& error) {
+            [this](TargetHandle handle, const absl::Status& error) {
               error_ = error;
               latch_.arrive_and_wait();
             },
-            [this](absl::string_view name, const ::shelly::Metrics& metrics) {
-              success_name_ = std::string(name);
+            [this](TargetHandle handle, const ::shelly::Metrics& metrics) {
+              success_handle_ = handle;
               success_metrics_ = metrics;
               latch_.arrive_and_wait();
             }),
@@ -141,7 +160,7 @@ class LatchTest : public ::testing::Test {
   Fixture fixture_;
   std::latch latch_;
   absl::Status error_;
-  std::string success_name_;
+  std::optional<TargetHandle> success_handle_;
   ::shelly::Metrics success_metrics_;
 
   void Run() {
@@ -157,7 +176,7 @@ TYPED_TEST_P(LatchTest, Test) {
   TypeParam::AddTargets(this->fixture_);
   this->Run();
   if (this->error_.ok()) {
-    EXPECT_THAT(this->success_name_, TypeParam::kExpectedName);
+    EXPECT_EQ(this->success_handle_, TypeParam::kExpectedHandle);
     EXPECT_THAT(this->success_metrics_, MetricsEq(TypeParam::kExpectedMetrics));
   } else {
     EXPECT_EQ(this->error_.code(), TypeParam::kExpectedStatusCode);
@@ -172,17 +191,18 @@ struct ScraperErrorTest final {
   static constexpr absl::StatusCode kExpectedStatusCode =
       absl::StatusCode::kPermissionDenied;
   static constexpr absl::string_view kExpectedMessage = "expected error";
-  static constexpr absl::string_view kExpectedName = "";
+  static constexpr std::optional<TargetHandle> kExpectedHandle = std::nullopt;
   static constexpr shelly::Metrics kExpectedMetrics = {};
 
   static void SetExpectations(Fixture& fixture) {
-    EXPECT_CALL(fixture.scraper(), Scrape(testing::_))
+    EXPECT_CALL(fixture.scraper(),
+                ScrapeResult(testing::_, testing::_, testing::_))
         .WillOnce(
             testing::Return(absl::PermissionDeniedError("expected error")));
   }
 
   static void AddTargets(Fixture& fixture) {
-    fixture.poller().AddTarget("test_target", "localhost:80");
+    fixture.poller().AddTarget("test_target", "localhost:80", /*handle=*/0);
   }
 };
 INSTANTIATE_TYPED_TEST_SUITE_P(ScraperError, LatchTest, ScraperErrorTest);
@@ -191,17 +211,18 @@ struct ScraperReturnsHttpError final {
   static constexpr absl::StatusCode kExpectedStatusCode =
       absl::StatusCode::kInvalidArgument;
   static constexpr absl::string_view kExpectedMessage = "404";
-  static constexpr absl::string_view kExpectedName = "";
+  static constexpr std::optional<TargetHandle> kExpectedHandle = std::nullopt;
   static constexpr shelly::Metrics kExpectedMetrics = {};
 
   static void SetExpectations(Fixture& fixture) {
-    EXPECT_CALL(fixture.scraper(), Scrape(testing::_))
+    EXPECT_CALL(fixture.scraper(),
+                ScrapeResult(testing::_, testing::_, testing::_))
         .WillOnce(testing::Return(
             ScraperResult{.code = 404, .content = "Not Found"}));
   }
 
   static void AddTargets(Fixture& fixture) {
-    fixture.poller().AddTarget("test_target", "localhost:80");
+    fixture.poller().AddTarget("test_target", "localhost:80", /*handle=*/0);
   }
 };
 INSTANTIATE_TYPED_TEST_SUITE_P(ScraperReturnsHttp, LatchTest,
@@ -211,17 +232,18 @@ struct ScraperReturnsNonJsonTest final {
   static constexpr absl::StatusCode kExpectedStatusCode =
       absl::StatusCode::kInvalidArgument;
   static constexpr absl::string_view kExpectedMessage = "text/plain";
-  static constexpr absl::string_view kExpectedName = "";
+  static constexpr std::optional<TargetHandle> kExpectedHandle = std::nullopt;
   static constexpr shelly::Metrics kExpectedMetrics = {};
 
   static void SetExpectations(Fixture& fixture) {
-    EXPECT_CALL(fixture.scraper(), Scrape(testing::_))
+    EXPECT_CALL(fixture.scraper(),
+                ScrapeResult(testing::_, testing::_, testing::_))
         .WillOnce(testing::Return(ScraperResult{
             .code = 200, .content_type = "text/plain", .content = "Not JSON"}));
   }
 
   static void AddTargets(Fixture& fixture) {
-    fixture.poller().AddTarget("test_target", "localhost:80");
+    fixture.poller().AddTarget("test_target", "localhost:80", /*handle=*/0);
   }
 };
 INSTANTIATE_TYPED_TEST_SUITE_P(ScraperReturnsNonJson, LatchTest,
@@ -231,11 +253,12 @@ struct ParserReturnsErrorTest final {
   static constexpr absl::StatusCode kExpectedStatusCode =
       absl::StatusCode::kInternal;
   static constexpr absl::string_view kExpectedMessage = "expected error";
-  static constexpr absl::string_view kExpectedName = "";
+  static constexpr std::optional<TargetHandle> kExpectedHandle = std::nullopt;
   static constexpr shelly::Metrics kExpectedMetrics = {};
 
   static void SetExpectations(Fixture& fixture) {
-    EXPECT_CALL(fixture.scraper(), Scrape(testing::_))
+    EXPECT_CALL(fixture.scraper(),
+                ScrapeResult(testing::_, testing::_, testing::_))
         .WillOnce(testing::Return(ScraperResult{
             .code = 200, .content_type = "application/json", .content = "{}"}));
     EXPECT_CALL(fixture.parser(), Parse(testing::_))
@@ -243,7 +266,7 @@ struct ParserReturnsErrorTest final {
   }
 
   static void AddTargets(Fixture& fixture) {
-    fixture.poller().AddTarget("test_target", "localhost:80");
+    fixture.poller().AddTarget("test_target", "localhost:80", /*handle=*/0);
   }
 };
 INSTANTIATE_TYPED_TEST_SUITE_P(ParserReturnsError, LatchTest,
@@ -252,7 +275,7 @@ INSTANTIATE_TYPED_TEST_SUITE_P(ParserReturnsError, LatchTest,
 struct ParserReturnsMetricsTest final {
   static constexpr absl::StatusCode kExpectedStatusCode = absl::StatusCode::kOk;
   static constexpr absl::string_view kExpectedMessage = "";
-  static constexpr absl::string_view kExpectedName = "test_target";
+  static constexpr std::optional<TargetHandle> kExpectedHandle = 7;
   static constexpr shelly::Metrics kExpectedMetrics = {
       .apower = 115.0,
       .voltage = 230.0,
@@ -262,7 +285,8 @@ struct ParserReturnsMetricsTest final {
   };
 
   static void SetExpectations(Fixture& fixture) {
-    EXPECT_CALL(fixture.scraper(), Scrape(testing::_))
+    EXPECT_CALL(fixture.scraper(),
+                ScrapeResult(testing::_, testing::_, testing::_))
         .WillOnce(testing::Return(ScraperResult{
             .code = 200, .content_type = "application/json", .content = "{}"}));
     EXPECT_CALL(fixture.parser(), Parse(testing::_))
@@ -270,7 +294,7 @@ struct ParserReturnsMetricsTest final {
   }
 
   static void AddTargets(Fixture& fixture) {
-    fixture.poller().AddTarget("test_target", "localhost:80");
+    fixture.poller().AddTarget("test_target", "localhost:80", /*handle=*/7);
   }
 };
 INSTANTIATE_TYPED_TEST_SUITE_P(ParserReturnsMetrics, LatchTest,
@@ -287,7 +311,7 @@ TEST(Run, MultipleTargets) {
 
   Fixture fixture(
       /*error_callback=*/nullptr,
-      [&](absl::string_view name, const ::shelly::Metrics& metrics) {
+      [&](TargetHandle, const ::shelly::Metrics& metrics) {
         {
           std::lock_guard<std::mutex> lock(received_metrics_mutex);
           received_metrics.push_back(metrics);
@@ -301,14 +325,16 @@ TEST(Run, MultipleTargets) {
   std::vector<::shelly::Metrics> expected_metrics;
   for (int i = 0; i < kNumTargets; ++i) {
     fixture.poller().AddTarget(absl::Substitute("target_$0", i),
-                               absl::Substitute("$0", i));
+                               absl::Substitute("$0", i), i);
     expected_metrics.push_back(
         ::shelly::Metrics{.voltage = static_cast<double>(i)});
   }
-  EXPECT_CALL(fixture.scraper(), Scrape(testing::_))
+  EXPECT_CALL(fixture.scraper(),
+              ScrapeResult(testing::_, testing::_, testing::_))
       .Times(kNumTargets)
       .WillRepeatedly(
-          testing::Invoke([](const std::string& hostname) -> ScraperResult {
+          testing::Invoke([](const std::string& hostname, std::string,
+                             const Scraper::RequestOptions&) -> ScraperResult {
             const std::regex re("^http://(\\d+)/.*");
             std::smatch match;
             std::regex_search(hostname, match, re);
@@ -336,4 +362,661 @@ TEST(Run, MultipleTargets) {
   std::lock_guard<std::mutex> lock(received_metrics_mutex);
   EXPECT_THAT(received_metrics, testing::UnorderedPointwise(
                                     MetricsPointwiseEq(), expected_metrics));
-}
\ No newline at end of file
+}
+
+TEST(Run, ReportsPoolStats) {
+  std::latch latch(2);
+  std::once_flag once;
+  ThreadPool::Stats received_stats;
+
+  auto scraper = std::make_unique<MockScraper>();
+  EXPECT_CALL(*scraper, ScrapeResult(testing::_, testing::_, testing::_))
+      .WillRepeatedly(
+          testing::Return(absl::PermissionDeniedError("expected error")));
+
+  Poller poller(std::make_unique<MockParser>(), std::move(scraper),
+                Poller::Options{
+                    .poll_period = absl::Milliseconds(100),
+                    .num_workers = 3,
+                    .pool_stats_callback =
+                        [&](const ThreadPool::Stats& stats) {
+                          std::call_once(once, [&] {
+                            received_stats = stats;
+                            latch.count_down();
+                          });
+                        },
+                });
+  poller.AddTarget("test_target", "localhost:80", /*handle=*/0);
+
+  std::thread run_thread([&poller] { poller.Run(); });
+  WaitUntilPollerIsAlive(poller);
+  latch.arrive_and_wait();
+  poller.Kill();
+  run_thread.join();
+
+  EXPECT_EQ(received_stats.num_workers, 3);
+  EXPECT_EQ(received_stats.queue_depth, 0);
+  EXPECT_GE(received_stats.utilisation, 0.0);
+}
+
+// Records every batch of results it's given.
+class RecordingSink final : public Sink {
+ public:
+  void Consume(absl::Span<const PollResult> results) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    batches_.emplace_back(results.begin(), results.end());
+  }
+
+  std::vector<std::vector<PollResult>> batches() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return batches_;
+  }
+
+ private:
+  mutable std::mutex mutex_;
+  std::vector<std::vector<PollResult>> batches_;
+};
+
+TEST(Run, DeliversFullBatchesToSinks) {
+  constexpr int kNumTargets = 4;
+  std::latch latch(kNumTargets + 1);
+  std::atomic<int> num_polls = 0;
+
+  auto scraper = std::make_unique<MockScraper>();
+  EXPECT_CALL(*scraper, ScrapeResult(testing::_, testing::_, testing::_))
+      .WillRepeatedly(testing::Invoke([&](const std::string& url, std::string,
+                                          const Scraper::RequestOptions&) {
+        if (++num_polls <= kNumTargets) {
+          latch.count_down();
+        }
+        return ScraperResult{.code = 500};
+      }));
+
+  RecordingSink first_sink;
+  RecordingSink second_sink;
+  Poller poller(std::make_unique<MockParser>(), std::move(scraper),
+                Poller::Options{
+                    .poll_period = absl::Seconds(1),
+                    .sinks = {&first_sink, &second_sink},
+                    .sink_batch_size = 2,
+                });
+  for (int i = 0; i < kNumTargets; ++i) {
+    poller.AddTarget(absl::Substitute("target_$0", i), absl::StrCat(i), i);
+  }
+
+  std::thread run_thread([&poller] { poller.Run(); });
+  WaitUntilPollerIsAlive(poller);
+  latch.arrive_and_wait();
+  poller.Kill();
+  run_thread.join();
+
+  // Every sink gets the same batches, each of which is full.
+  const auto batches = first_sink.batches();
+  ASSERT_EQ(batches.size(), 2);
+  EXPECT_EQ(second_sink.batches().size(), 2);
+  std::set<TargetHandle> handles;
+  for (const auto& batch : batches) {
+    EXPECT_EQ(batch.size(), 2);
+    for (const auto& result : batch) {
+      EXPECT_FALSE(result.metrics.ok());
+      handles.insert(result.handle);
+    }
+  }
+  EXPECT_THAT(handles, testing::ElementsAre(0, 1, 2, 3));
+}
+
+TEST(Run, DeliversPartialBatchEveryPeriod) {
+  std::latch latch(2);
+  std::once_flag once;
+  size_t delivered_before_stats = 0;
+  RecordingSink sink;
+
+  auto scraper = std::make_unique<MockScraper>();
+  EXPECT_CALL(*scraper, ScrapeResult(testing::_, testing::_, testing::_))
+      .WillRepeatedly(testing::Return(ScraperResult{
+          .code = 200,
+          .content_type = "application/json",
+      }));
+  auto parser = std::make_unique<MockParser>();
+  EXPECT_CALL(*parser, Parse(testing::_))
+      .WillRepeatedly(testing::Return(::shelly::Metrics{.voltage = 230.0}));
+
+  Poller poller(std::move(parser), std::move(scraper),
+                Poller::Options{
+                    .poll_period = absl::Milliseconds(100),
+                    .sinks = {&sink},
+                    .sink_batch_size = 0,
+                    .pool_stats_callback =
+                        [&](const ThreadPool::Stats&) {
+                          std::call_once(once, [&] {
+                            delivered_before_stats = sink.batches().size();
+                            latch.count_down();
+                          });
+                        },
+                });
+  poller.AddTarget("test_target", "localhost:80", /*handle=*/3);
+
+  std::thread run_thread([&poller] { poller.Run(); });
+  WaitUntilPollerIsAlive(poller);
+  latch.arrive_and_wait();
+  poller.Kill();
+  run_thread.join();
+
+  // The first poll's result is delivered at the end of the first period.
+  EXPECT_EQ(delivered_before_stats, 1);
+  const auto batches = sink.batches();
+  ASSERT_FALSE(batches.empty());
+  ASSERT_EQ(batches.front().size(), 1);
+  EXPECT_EQ(batches.front().front().handle, 3);
+  ASSERT_TRUE(batches.front().front().metrics.ok());
+  EXPECT_EQ(batches.front().front().metrics->voltage, 230.0);
+}
+
+// Completes every request from its own thread, as the event driven scrapers
+// do.
+class ThreadedScraper final : public Scraper {
+ public:
+  ~ThreadedScraper() override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& thread : threads_) {
+      thread.join();
+    }
+  }
+
+  using Scraper::Scrape;
+
+  ScrapeOutcome Scrape(const std::string& url, std::string buffer,
+                       const RequestOptions& request_options) override {
+    return {.result = ScraperResult{.code = 200,
+                                    .content_type = "application/json",
+                                    .content = url}};
+  }
+
+  void ScrapeAsync(const std::string& url, std::string buffer,
+                   const RequestOptions& request_options,
+                   ScrapeCallback callback) override {
+    std::lock_guard<std::mutex> lock(mutex_);
+    threads_.emplace_back([this, url, callback] { callback(Scrape(url)); });
+  }
+
+  std::string_view Version() const override { return "threaded"; }
+
+ private:
+  std::mutex mutex_;
+  std::vector<std::thread> threads_;
+};
+
+TEST(Run, AsyncScraper) {
+  constexpr int kNumTargets = 5;
+  std::latch latch(kNumTargets + 1);
+  std::mutex received_handles_mutex;
+  std::set<TargetHandle> received_handles;
+
+  auto parser = std::make_unique<MockParser>();
+  EXPECT_CALL(*parser, Parse(testing::_))
+      .WillRepeatedly(testing::Return(::shelly::Metrics{}));
+
+  Poller poller(std::move(parser), std::make_unique<ThreadedScraper>(),
+                Poller::Options{
+                    .poll_period = absl::Milliseconds(100),
+                    .num_workers = 2,
+                    .success_callback =
+                        [&](TargetHandle handle, const ::shelly::Metrics&) {
+                          std::lock_guard<std::mutex> lock(
+                              received_handles_mutex);
+                          if (received_handles.insert(handle).second) {
+                            latch.count_down();
+                          }
+                        },
+                });
+  for (int i = 0; i < kNumTargets; ++i) {
+    poller.AddTarget(absl::Substitute("target_$0", i), "localhost:80", i);
+  }
+
+  std::thread run_thread([&poller] { poller.Run(); });
+  WaitUntilPollerIsAlive(poller);
+  latch.arrive_and_wait();
+  poller.Kill();
+  run_thread.join();
+
+  std::lock_guard<std::mutex> lock(received_handles_mutex);
+  EXPECT_THAT(received_handles, testing::ElementsAre(0, 1, 2, 3, 4));
+}
+
+TEST(Run, ReusesBodyBuffer) {
+  const std::string first_content(1000, 'x');
+  std::latch latch(2);
+  std::once_flag once;
+  std::atomic<size_t> second_capacity = 0;
+
+  Fixture fixture(/*error_callback=*/nullptr, /*success_callback=*/nullptr);
+  fixture.poller().AddTarget("test_target", "localhost:80", /*handle=*/0);
+  EXPECT_CALL(fixture.scraper(),
+              ScrapeResult(testing::_, testing::_, testing::_))
+      .WillOnce(testing::Return(ScraperResult{
+          .code = 200,
+          .content_type = "application/json",
+          .content = first_content,
+      }))
+      .WillRepeatedly(testing::Invoke(
+          [&](const std::string&, std::string buffer,
+              const Scraper::RequestOptions&) -> ScraperResult {
+            std::call_once(once, [&] {
+              second_capacity = buffer.capacity();
+              latch.count_down();
+            });
+            return ScraperResult{.code = 500};
+          }));
+  EXPECT_CALL(fixture.parser(), Parse(testing::_))
+      .WillRepeatedly(testing::Return(::shelly::Metrics{}));
+
+  fixture.Run();
+  latch.arrive_and_wait();
+  fixture.Stop();
+
+  // The content returned by the first poll is handed back as the buffer for
+  // the second.
+  EXPECT_GE(second_capacity, first_content.size());
+}
+
+TEST(Run, SlowTargetDoesNotDelayOthers) {
+  constexpr int kNumFastPolls = 3;
+  std::latch fast_polls(kNumFastPolls);
+  std::latch release_slow(1);
+  std::atomic<int> num_fast_polls = 0;
+
+  auto scraper = std::make_unique<MockScraper>();
+  EXPECT_CALL(*scraper, ScrapeResult("http://slow/rpc/Switch.GetStatus?id=0",
+                                     testing::_, testing::_))
+      .WillRepeatedly(testing::Invoke([&](const std::string&, std::string,
+                                          const Scraper::RequestOptions&) {
+        release_slow.wait();
+        return ScraperResult{.code = 500};
+      }));
+  EXPECT_CALL(*scraper, ScrapeResult("http://fast/rpc/Switch.GetStatus?id=0",
+                                     testing::_, testing::_))
+      .WillRepeatedly(testing::Invoke([&](const std::string&, std::string,
+                                          const Scraper::RequestOptions&) {
+        if (++num_fast_polls <= kNumFastPolls) {
+          fast_polls.count_down();
+        }
+        return ScraperResult{.code = 500};
+      }));
+
+  Poller poller(std::make_unique<MockParser>(), std::move(scraper),
+                Poller::Options{
+                    .poll_period = absl::Milliseconds(20),
+                    .num_workers = 2,
+                });
+  poller.AddTarget("slow_target", "slow", /*handle=*/0);
+  poller.AddTarget("fast_target", "fast", /*handle=*/1);
+
+  std::thread run_thread([&poller] { poller.Run(); });
+  WaitUntilPollerIsAlive(poller);
+
+  // The fast target keeps being polled while the slow one is stuck.
+  fast_polls.wait();
+  release_slow.count_down();
+  poller.Kill();
+  run_thread.join();
+}
+
+TEST(Run, AddsTargetWhileRunning) {
+  std::latch added_polled(1);
+  std::atomic<int> num_added_polls = 0;
+
+  auto scraper = std::make_unique<MockScraper>();
+  EXPECT_CALL(*scraper, ScrapeResult("http://first/rpc/Switch.GetStatus?id=0",
+                                     testing::_, testing::_))
+      .WillRepeatedly(testing::Return(ScraperResult{.code = 500}));
+  EXPECT_CALL(*scraper, ScrapeResult("http://second/rpc/Switch.GetStatus?id=0",
+                                     testing::_, testing::_))
+      .WillRepeatedly(testing::Invoke([&](const std::string&, std::string,
+                                          const Scraper::RequestOptions&) {
+        if (++num_added_polls == 1) {
+          added_polled.count_down();
+        }
+        return ScraperResult{.code = 500};
+      }));
+
+  Poller poller(std::make_unique<MockParser>(), std::move(scraper),
+                Poller::Options{.poll_period = absl::Milliseconds(20)});
+  poller.AddTarget("first_target", "first", /*handle=*/0);
+
+  std::thread run_thread([&poller] { poller.Run(); });
+  WaitUntilPollerIsAlive(poller);
+  poller.AddTarget("second_target", "second", /*handle=*/1);
+
+  added_polled.wait();
+  poller.Kill();
+  run_thread.join();
+}
+
+TEST(Run, RemovesTargetWhileRunning) {
+  std::latch removed_polled(1);
+  std::latch release_removed(1);
+  std::atomic<int> num_removed_polls = 0;
+  std::atomic<int> num_kept_polls = 0;
+  RecordingSink sink;
+
+  auto scraper = std::make_unique<MockScraper>();
+  EXPECT_CALL(*scraper, ScrapeResult("http://removed/rpc/Switch.GetStatus?id=0",
+                                     testing::_, testing::_))
+      .WillRepeatedly(testing::Invoke([&](const std::string&, std::string,
+                                          const Scraper::RequestOptions&) {
+        if (++num_removed_polls == 1) {
+          removed_polled.count_down();
+          release_removed.wait();
+        }
+        return ScraperResult{.code = 500};
+      }));
+  EXPECT_CALL(*scraper, ScrapeResult("http://kept/rpc/Switch.GetStatus?id=0",
+                                     testing::_, testing::_))
+      .WillRepeatedly(testing::Invoke([&](const std::string&, std::string,
+                                          const Scraper::RequestOptions&) {
+        ++num_kept_polls;
+        return ScraperResult{
+            .code = 200,
+            .content_type = "application/json",
+        };
+      }));
+  auto parser = std::make_unique<MockParser>();
+  EXPECT_CALL(*parser, Parse(testing::_))
+      .WillRepeatedly(testing::Return(::shelly::Metrics{}));
+
+  Poller poller(std::move(parser), std::move(scraper),
+                Poller::Options{
+                    .poll_period = absl::Milliseconds(20),
+                    .num_workers = 2,
+                    .sinks = {&sink},
+                    .sink_batch_size = 0,
+                });
+  poller.AddTarget("removed_target", "removed", /*handle=*/0);
+  poller.AddTarget("kept_target", "kept", /*handle=*/1);
+  EXPECT_FALSE(poller.RemoveTarget("unknown_target"));
+
+  std::thread run_thread([&poller] { poller.Run(); });
+  WaitUntilPollerIsAlive(poller);
+  removed_polled.wait();
+
+  // Removing the target waits for its outstanding poll.
+  std::atomic<bool> removed = false;
+  std::thread remove_thread([&] {
+    EXPECT_TRUE(poller.RemoveTarget("removed_target"));
+    removed = true;
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  EXPECT_FALSE(removed);
+  release_removed.count_down();
+  remove_thread.join();
+
+  // The kept target carries on being polled, and the removed one doesn't.
+  const int kept_polls = num_kept_polls;
+  while (num_kept_polls < kept_polls + 3) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  poller.Kill();
+  run_thread.join();
+
+  EXPECT_EQ(num_removed_polls, 1);
+  EXPECT_FALSE(poller.RemoveTarget("removed_target"));
+  for (const auto& batch : sink.batches()) {
+    for (const auto& result : batch) {
+      EXPECT_EQ(result.handle, 1);
+    }
+  }
+}
+
+TEST(RemoveTarget, ForgetsOriginOnceNoTargetIsLeftOnIt) {
+  auto scraper = std::make_unique<MockScraper>();
+  MockScraper* const mock_scraper = scraper.get();
+  Poller poller(std::make_unique<MockParser>(), std::move(scraper),
+                Poller::Options{});
+  poller.AddTarget("kettle", "10.0.0.1", /*handle=*/0);
+  poller.AddTarget("fridge", "10.0.0.1", /*handle=*/1);
+  poller.AddTarget("heater", "10.0.0.2", /*handle=*/2);
+
+  // A reload moves the heater to a new address, which is done by removing
+  // and adding it again.
+  EXPECT_CALL(*mock_scraper,
+              ForgetOrigin("http://10.0.0.2/rpc/Switch.GetStatus?id=0"));
+  EXPECT_TRUE(poller.RemoveTarget("heater"));
+  poller.AddTarget("heater", "10.0.0.3", /*handle=*/2);
+  testing::Mock::VerifyAndClearExpectations(mock_scraper);
+
+  // The fridge is still polled on the kettle's host.
+  EXPECT_CALL(*mock_scraper, ForgetOrigin(testing::_)).Times(0);
+  EXPECT_TRUE(poller.RemoveTarget("kettle"));
+  testing::Mock::VerifyAndClearExpectations(mock_scraper);
+
+  EXPECT_CALL(*mock_scraper,
+              ForgetOrigin("http://10.0.0.1/rpc/Switch.GetStatus?id=0"));
+  EXPECT_TRUE(poller.RemoveTarget("fridge"));
+}
+
+TEST(Run, BacksOffFailingTarget) {
+  constexpr auto kBackoff = absl::Milliseconds(200);
+  std::atomic<int> num_polls = 0;
+  std::mutex states_mutex;
+  std::vector<CircuitBreaker::State> states;
+  std::latch reopened(1);
+
+  auto scraper = std::make_unique<MockScraper>();
+  EXPECT_CALL(*scraper, ScrapeResult(testing::_, testing::_, testing::_))
+      .WillRepeatedly(testing::Invoke([&](const std::string&, std::string,
+                                          const Scraper::RequestOptions&) {
+        ++num_polls;
+        return absl::UnavailableError("expected error");
+      }));
+
+  const absl::Time start = absl::Now();
+  absl::Time reopened_time;
+  Poller poller(
+      std::make_unique<MockParser>(), std::move(scraper),
+      Poller::Options{
+          .poll_period = absl::Milliseconds(10),
+          .circuit_breaker = {.failure_threshold = 2,
+                              .initial_backoff = kBackoff},
+          .circuit_state_callback =
+              [&](TargetHandle, CircuitBreaker::State state) {
+                std::lock_guard<std::mutex> lock(states_mutex);
+                states.push_back(state);
+                if (states.size() == 3) {
+                  reopened_time = absl::Now();
+                  reopened.count_down();
+                }
+              },
+      });
+  poller.AddTarget("test_target", "localhost:80", /*handle=*/0);
+
+  std::thread run_thread([&poller] { poller.Run(); });
+  WaitUntilPollerIsAlive(poller);
+  reopened.wait();
+  poller.Kill();
+  run_thread.join();
+
+  // Two failures open the breaker, after which the target is left alone until
+  // a single probe is sent once the backoff has passed.
+  EXPECT_EQ(num_polls, 3);
+  EXPECT_THAT(states, testing::ElementsAre(CircuitBreaker::State::kOpen,
+                                           CircuitBreaker::State::kHalfOpen,
+                                           CircuitBreaker::State::kOpen));
+  EXPECT_GE(reopened_time - start, kBackoff);
+}
+
+TEST(Run, ReportsPollTimings) {
+  constexpr auto kParseTime = absl::Milliseconds(20);
+  std::latch latch(2);
+  std::once_flag once;
+  Poller::PollTimings received_timings;
+
+  auto scraper = std::make_unique<MockScraper>();
+  EXPECT_CALL(*scraper, ScrapeResult(testing::_, testing::_, testing::_))
+      .WillRepeatedly(testing::Return(ScraperResult{
+          .code = 200,
+          .content_type = "application/json",
+      }));
+  auto parser = std::make_unique<MockParser>();
+  EXPECT_CALL(*parser, Parse(testing::_))
+      .WillRepeatedly(testing::Invoke([&](const std::string&) {
+        absl::SleepFor(kParseTime);
+        return ::shelly::Metrics{};
+      }));
+
+  Poller poller(std::move(parser), std::move(scraper),
+                Poller::Options{
+                    .poll_period = absl::Seconds(10),
+                    .poll_timings_callback =
+                        [&](TargetHandle, const Poller::PollTimings& timings) {
+                          std::call_once(once, [&] {
+                            received_timings = timings;
+                            latch.count_down();
+                          });
+                        },
+                });
+  poller.AddTarget("test_target", "localhost:80", /*handle=*/0);
+
+  std::thread run_thread([&poller] { poller.Run(); });
+  WaitUntilPollerIsAlive(poller);
+  latch.arrive_and_wait();
+  poller.Kill();
+  run_thread.join();
+
+  EXPECT_GE(received_timings.scheduling_lag, absl::ZeroDuration());
+  EXPECT_GE(received_timings.parse_time, kParseTime);
+  EXPECT_GE(received_timings.duration, received_timings.parse_time);
+  EXPECT_EQ(received_timings.overrun, absl::ZeroDuration());
+}
+
+TEST(Run, ReportsScrapeStatsOfFailedScrapes) {
+  const ScrapeStats kStats = {
+      .reused_connection = true,
+      .first_byte_time = absl::Milliseconds(5),
+      .total_time = absl::Milliseconds(10),
+  };
+  std::latch latch(2);
+  std::once_flag once;
+  std::optional<ScrapeStats> received_stats;
+
+  auto scraper = std::make_unique<MockScraper>();
+  EXPECT_CALL(*scraper, ScrapeResult(testing::_, testing::_, testing::_))
+      .WillRepeatedly(
+          testing::Return(absl::DeadlineExceededError("expected error")));
+  scraper->stats = kStats;
+
+  Poller poller(std::make_unique<MockParser>(), std::move(scraper),
+                Poller::Options{
+                    .poll_period = absl::Seconds(10),
+                    .scrape_stats_callback =
+                        [&](TargetHandle, const ScrapeStats& stats) {
+                          std::call_once(once, [&] {
+                            received_stats = stats;
+                            latch.count_down();
+                          });
+                        },
+                });
+  poller.AddTarget("test_target", "localhost:80", /*handle=*/0);
+
+  std::thread run_thread([&poller] { poller.Run(); });
+  WaitUntilPollerIsAlive(poller);
+  latch.arrive_and_wait();
+  poller.Kill();
+  run_thread.join();
+
+  ASSERT_TRUE(received_stats.has_value());
+  EXPECT_TRUE(received_stats->reused_connection);
+  EXPECT_EQ(received_stats->name_lookup_time, absl::ZeroDuration());
+  EXPECT_EQ(received_stats->first_byte_time, kStats.first_byte_time);
+  EXPECT_EQ(received_stats->total_time, kStats.total_time);
+}
+
+TEST(Run, StaggersFirstPolls) {
+  constexpr int kNumTargets = 3;
+  constexpr auto kPollPeriod = std::chrono::milliseconds(300);
+  std::mutex first_polls_mutex;
+  std::map<std::string, std::chrono::steady_clock::time_point> first_polls;
+  std::latch latch(kNumTargets + 1);
+
+  auto scraper = std::make_unique<MockScraper>();
+  EXPECT_CALL(*scraper, ScrapeResult(testing::_, testing::_, testing::_))
+      .WillRepeatedly(
+          testing::Invoke([&](const std::string& url, std::string,
+                              const Scraper::RequestOptions&) {
+            std::lock_guard<std::mutex> lock(first_polls_mutex);
+            if (first_polls.emplace(url, std::chrono::steady_clock::now())
+                    .second) {
+              latch.count_down();
+            }
+            return ScraperResult{.code = 500};
+          }));
+
+  Poller poller(std::make_unique<MockParser>(), std::move(scraper),
+                Poller::Options{
+                    .poll_period = absl::FromChrono(kPollPeriod),
+                    .num_workers = kNumTargets,
+                });
+  for (int i = 0; i < kNumTargets; ++i) {
+    poller.AddTarget(absl::Substitute("target_$0", i), absl::StrCat(i), i);
+  }
+
+  std::thread run_thread([&poller] { poller.Run(); });
+  WaitUntilPollerIsAlive(poller);
+  latch.arrive_and_wait();
+  poller.Kill();
+  run_thread.join();
+
+  // The targets are spread a third of a period apart, in the order they were
+  // added. Only the lower bound is checked, as sleeps can overrun.
+  std::lock_guard<std::mutex> lock(first_polls_mutex);
+  const auto first_poll = [&](int i) {
+    return first_polls[absl::Substitute("http://$0/rpc/Switch.GetStatus?id=0",
+                                        i)];
+  };
+  for (int i = 1; i < kNumTargets; ++i) {
+    const auto gap = first_poll(i) - first_poll(i - 1);
+    EXPECT_GE(gap, kPollPeriod / kNumTargets - std::chrono::milliseconds(5));
+  }
+}
+
+TEST(Run, SetsPollDeadline) {
+  std::latch latch(2);
+  std::once_flag once;
+  std::optional<absl::Time> received_deadline;
+  absl::Duration received_timeout;
+
+  auto scraper = std::make_unique<MockScraper>();
+  EXPECT_CALL(*scraper, ScrapeResult(testing::_, testing::_, testing::_))
+      .WillRepeatedly(testing::Invoke(
+          [&](const std::string&, std::string,
+              const Scraper::RequestOptions& request_options) {
+            std::call_once(once, [&] {
+              received_deadline = request_options.deadline;
+              received_timeout = request_options.timeout.value_or(
+                  absl::ZeroDuration());
+              latch.count_down();
+            });
+            return ScraperResult{.code = 500};
+          }));
+
+  const absl::Time start = absl::Now();
+  Poller poller(std::make_unique<MockParser>(), std::move(scraper),
+                Poller::Options{
+                    .poll_period = absl::Seconds(10),
+                    .poll_budget = absl::Seconds(2),
+                });
+  poller.AddTarget("test_target", "localhost:80", /*handle=*/0,
+                   {.timeout = absl::Seconds(1)});
+
+  std::thread run_thread([&poller] { poller.Run(); });
+  WaitUntilPollerIsAlive(poller);
+  latch.arrive_and_wait();
+  poller.Kill();
+  run_thread.join();
+
+  // The deadline is the budget after the poll was due, while the target's own
+  // timeout is passed through.
+  ASSERT_TRUE(received_deadline.has_value());
+  EXPECT_GE(*received_deadline, start + absl::Seconds(2));
+  EXPECT_LE(*received_deadline, absl::Now() + absl::Seconds(2));
+  EXPECT_EQ(received_timeout, absl::Seconds(1));
+}
@@ -1,26 +1,90 @@
 #include "registry.h"
 
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
 #include <string>
+#include <utility>
+#include <vector>
 
 #include "absl/container/flat_hash_map.h"
+#include "absl/log/check.h"
 #include "absl/log/log.h"
 #include "absl/strings/substitute.h"
+#include "absl/time/clock.h"
+#include "absl/types/span.h"
+#include "prometheus/client_metric.h"
+#include "prometheus/collectable.h"
 #include "prometheus/counter.h"
 #include "prometheus/gauge.h"
+#include "prometheus/histogram.h"
+#include "prometheus/metric_family.h"
+#include "prometheus/metric_type.h"
+#include "prometheus/registry.h"
+#include "registry_internal.h"
+#include "seqlock.h"
 
 namespace {
 
-inline constexpr auto kTargetLabel = "target";
+using ::registry_internal::EnergyIntegrator;
+using ::registry_internal::GroupSums;
+using ::registry_internal::kTargetLabel;
+using ::registry_internal::LatencyBuckets;
+using ::registry_internal::ParseBuckets;
+using ::registry_internal::Sample;
+using ::registry_internal::WindowedSketch;
+
+// The parts of a target's metrics that are kept and rendered by
+// RegistryCollectable, rather than by prometheus-cpp.
+struct CollectedTarget final {
+  CollectedTarget(const std::string& name, absl::Duration quantile_window)
+      : label({{.name = kTargetLabel, .value = name}}),
+        apower_summary(quantile_window) {}
+
+  const std::vector<::prometheus::ClientMetric::Label> label;
+  // Stored by the worker polling the target, and loaded by collection
+  // without either blocking the other. prometheus-cpp's gauges are each
+  // synchronized separately, so would let a collection mix the readings of
+  // two polls.
+  SeqLock<Sample> sample;
+  WindowedSketch apower_summary;
+};
 
 struct TargetMetrics final {
-  ::prometheus::Gauge* const voltage;
-  ::prometheus::Gauge* const apower;
-  ::prometheus::Gauge* const current;
-  ::prometheus::Gauge* const temp_c;
-  ::prometheus::Gauge* const temp_f;
+  // Owned by the registry's collectable, and never null.
+  CollectedTarget* const collected;
   ::prometheus::Counter* const success_queries;
   ::prometheus::Counter* const error_queries;
-  ::prometheus::Gauge* const last_updated;
+  ::prometheus::Counter* const timeout_queries;
+  ::prometheus::Gauge* const circuit_state;
+  ::prometheus::Counter* const reused_connections;
+  ::prometheus::Counter* const new_connections;
+  ::prometheus::Histogram* const name_lookup_time;
+  ::prometheus::Histogram* const connect_time;
+  ::prometheus::Histogram* const first_byte_time;
+  ::prometheus::Histogram* const scrape_time;
+  ::prometheus::Histogram* const parse_time;
+  ::prometheus::Counter* const energy;
+  EnergyIntegrator energy_integrator;
+  // Only changed with the registry's exclusive lock held.
+  std::vector<GroupSums::Group*> groups;
+};
+
+// Exporter wide metrics, describing the poller rather than any one target.
+struct PoolMetrics final {
+  ::prometheus::Gauge* const workers;
+  ::prometheus::Gauge* const queue_depth;
+  ::prometheus::Gauge* const utilisation;
+};
+
+// Exporter wide distributions of the poll timings, across all targets.
+struct PollMetrics final {
+  ::prometheus::Histogram* const scheduling_lag;
+  ::prometheus::Histogram* const duration;
+  ::prometheus::Histogram* const overrun;
 };
 
 template <class T>
@@ -37,29 +101,112 @@ inline void SetIfNotNull(T* metric, V value) {
   }
 }
 
+inline void ObserveIfNotNull(::prometheus::Histogram* metric,
+                             absl::Duration value) {
+  if (metric != nullptr) {
+    metric->Observe(absl::ToDoubleSeconds(value));
+  }
+}
+
+// Collects the registry's families along with each target's readings and a
+// summary of its power draw. The readings are published together through a
+// SeqLock and rendered here, so that they're never torn between two polls.
+// prometheus-cpp's own summaries take a lock on every observation and can't
+// be merged, so the power draw is kept in sketches and rendered here too. As
+// are the group sums, as a group's label isn't the target label that the
+// families are keyed by.
+class RegistryCollectable final : public ::prometheus::Collectable {
+ public:
+  RegistryCollectable(std::shared_ptr<::prometheus::Registry> registry,
+                      const Registry::Options& options)
+      : registry_(std::move(registry)),
+        quantile_window_(options.quantile_window),
+        time_func_(options.time_func) {}
+
+  // Returns the named target's collected metrics, which are kept until it's
+  // removed.
+  CollectedTarget& AddTarget(const std::string& name) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return *targets_.emplace_back(
+        std::make_unique<CollectedTarget>(name, quantile_window_));
+  }
+
+  void RemoveTarget(const CollectedTarget* target) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::erase_if(targets_, [target](const auto& collected) {
+      return collected.get() == target;
+    });
+  }
+
+  GroupSums& group_sums() { return group_sums_; }
+
+  std::vector<::prometheus::MetricFamily> Collect() const override {
+    auto families = registry_->Collect();
+    group_sums_.Collect(families);
+    const absl::Time now = time_func_();
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (targets_.empty()) {
+      return families;
+    }
+
+    // Each target's sample is loaded once, so that all of its readings are
+    // from the same poll.
+    std::vector<Sample> samples;
+    samples.reserve(targets_.size());
+    for (const auto& target : targets_) {
+      samples.push_back(target->sample.Load());
+    }
+    for (const auto& sample_family : registry_internal::kSampleFamilies) {
+      auto& family = families.emplace_back(::prometheus::MetricFamily{
+          .name = sample_family.name,
+          .help = sample_family.help,
+          .type = ::prometheus::MetricType::Gauge,
+      });
+      family.metric.reserve(targets_.size());
+      for (size_t i = 0; i < targets_.size(); ++i) {
+        auto& metric = family.metric.emplace_back();
+        metric.label = targets_[i]->label;
+        metric.gauge.value = sample_family.get(samples[i]);
+      }
+    }
+
+    auto& family = families.emplace_back(::prometheus::MetricFamily{
+        .name = registry_internal::kApowerSummaryName,
+        .help = registry_internal::kApowerSummaryHelp,
+        .type = ::prometheus::MetricType::Summary,
+    });
+    family.metric.reserve(targets_.size());
+    for (const auto& target : targets_) {
+      auto& metric = family.metric.emplace_back();
+      metric.label = target->label;
+      metric.summary = target->apower_summary.Collect(now);
+    }
+    return families;
+  }
+
+ private:
+  const std::shared_ptr<::prometheus::Registry> registry_;
+  const absl::Duration quantile_window_;
+  const std::function<absl::Time()> time_func_;
+
+  // Guards the set of targets, but not their contents, so that storing a
+  // sample never waits for collection.
+  mutable std::mutex mutex_;
+  std::vector<std::unique_ptr<CollectedTarget>> targets_;
+  GroupSums group_sums_;
+};
+
 class RegistryImpl final : public Registry {
  public:
-  RegistryImpl()
+  explicit RegistryImpl(const Options& options)
       : registry_(std::make_shared<::prometheus::Registry>()),
-        voltage_(::prometheus::BuildGauge()
-                     .Name("shelly_voltage")
-                     .Help("Last observed voltage of the target")
-                     .Register(*registry_)),
-        apower_(::prometheus::BuildGauge()
-                    .Name("shelly_apower")
-                    .Help("Last observed power of the target")
-                    .Register(*registry_)),
-        current_(::prometheus::BuildGauge()
-                     .Name("shelly_current")
-                     .Help("Last observed current of the target")
-                     .Register(*registry_)),
-        temp_c_(::prometheus::BuildGauge()
-                    .Name("shelly_temp_c")
-                    .Help("Last observed temperature of the target")
-                    .Register(*registry_)),
-        temp_f_(::prometheus::BuildGauge()
-                    .Name("shelly_temp_f")
-                    .Help("Last observed temperature of the target")
+        collectable_(
+            std::make_shared<RegistryCollectable>(registry_, options)),
+        energy_max_gap_(options.energy_max_gap),
+        energy_(::prometheus::BuildCounter()
+                    .Name("shelly_energy_wh_total")
+                    .Help("Energy used by the target in watt hours, "
+                          "integrated from its power readings")
                     .Register(*registry_)),
         success_queries_(
             ::prometheus::BuildCounter()
@@ -71,97 +218,441 @@ class RegistryImpl final : public Registry {
                 .Name("shelly_error_counter")
                 .Help("Number of failed metrics queries for the target")
                 .Register(*registry_)),
-        last_updated_(
+        timeout_queries_(
+            ::prometheus::BuildCounter()
+                .Name("shelly_timeout_counter")
+                .Help("Number of metrics queries for the target that ran out "
+                      "of time")
+                .Register(*registry_)),
+        circuit_state_(
+            ::prometheus::BuildGauge()
+                .Name("shelly_circuit_state")
+                .Help("State of the target's circuit breaker: 0 if closed, 1 "
+                      "if half-open, or 2 if open and the target is being "
+                      "backed off")
+                .Register(*registry_)),
+        reused_connections_(
+            ::prometheus::BuildCounter()
+                .Name("shelly_connection_reuse_counter")
+                .Help("Number of queries for the target sent over an existing "
+                      "keep-alive connection")
+                .Register(*registry_)),
+        new_connections_(
+            ::prometheus::BuildCounter()
+                .Name("shelly_reconnect_counter")
+                .Help("Number of queries for the target that had to open a "
+                      "new connection")
+                .Register(*registry_)),
+        name_lookup_time_(
+            ::prometheus::BuildHistogram()
+                .Name("shelly_dns_seconds")
+                .Help("Time taken to resolve the target's hostname, or zero "
+                      "if a connection was reused")
+                .Register(*registry_)),
+        connect_time_(
+            ::prometheus::BuildHistogram()
+                .Name("shelly_connect_seconds")
+                .Help("Time from the start of a query until the target was "
+                      "connected to, or zero if a connection was reused")
+                .Register(*registry_)),
+        first_byte_time_(
+            ::prometheus::BuildHistogram()
+                .Name("shelly_first_byte_seconds")
+                .Help("Time from the start of a query until the first byte of "
+                      "the target's response was received")
+                .Register(*registry_)),
+        scrape_time_(::prometheus::BuildHistogram()
+                         .Name("shelly_scrape_seconds")
+                         .Help("Total time taken by each query of the target")
+                         .Register(*registry_)),
+        parse_time_(::prometheus::BuildHistogram()
+                        .Name("shelly_parse_seconds")
+                        .Help("Time taken to parse the target's responses")
+                        .Register(*registry_)),
+        workers_(::prometheus::BuildGauge()
+                     .Name("shelly_exporter_workers")
+                     .Help("Number of worker threads polling the targets")
+                     .Register(*registry_)),
+        queue_depth_(
             ::prometheus::BuildGauge()
-                .Name("shelly_last_updated")
-                .Help("Timestamp for the most recent update for this target")
+                .Name("shelly_exporter_queue_depth")
+                .Help("Peak number of targets waiting for a worker during the "
+                      "last poll period")
+                .Register(*registry_)),
+        utilisation_(
+            ::prometheus::BuildGauge()
+                .Name("shelly_exporter_worker_utilisation")
+                .Help("Fraction of worker time spent processing targets during "
+                      "the last poll period")
+                .Register(*registry_)),
+        scheduling_lag_(
+            ::prometheus::BuildHistogram()
+                .Name("shelly_exporter_scheduling_lag_seconds")
+                .Help("Time between a poll being due and a worker starting on "
+                      "it")
+                .Register(*registry_)),
+        poll_duration_(
+            ::prometheus::BuildHistogram()
+                .Name("shelly_exporter_poll_duration_seconds")
+                .Help("Time taken by a worker to scrape and parse a target")
+                .Register(*registry_)),
+        poll_overrun_(
+            ::prometheus::BuildHistogram()
+                .Name("shelly_exporter_poll_overrun_seconds")
+                .Help("How long polls that overran their period finished "
+                      "after the next poll was due")
                 .Register(*registry_)) {}
 
-  std::shared_ptr<::prometheus::Registry> GetRegistry() override {
-    return registry_;
+  std::shared_ptr<::prometheus::Collectable> GetCollectable() override {
+    return collectable_;
   }
 
-  absl::Status AddTarget(absl::string_view name) override {
-    if (target_metrics_.contains(name)) {
+  absl::StatusOr<TargetHandle> AddTarget(absl::string_view name) override {
+    std::unique_lock lock(mutex_);
+    if (handles_.contains(name)) {
       return absl::InvalidArgumentError(
           absl::Substitute("Duplicate target name \"$0\"", name));
     }
 
     const std::string name_str(name);
     TargetMetrics target_metrics = {
-        .voltage = &(voltage_.Add({{kTargetLabel, name_str}})),
-        .apower = &(apower_.Add({{kTargetLabel, name_str}})),
-        .current = &(current_.Add({{kTargetLabel, name_str}})),
-        .temp_c = &(temp_c_.Add({{kTargetLabel, name_str}})),
-        .temp_f = &(temp_f_.Add({{kTargetLabel, name_str}})),
+        .collected = &(collectable_->AddTarget(name_str)),
         .success_queries = &(success_queries_.Add({{kTargetLabel, name_str}})),
         .error_queries = &(error_queries_.Add({{kTargetLabel, name_str}})),
-        .last_updated = &(last_updated_.Add({{kTargetLabel, name_str}})),
+        .timeout_queries = &(timeout_queries_.Add({{kTargetLabel, name_str}})),
+        .circuit_state = &(circuit_state_.Add({{kTargetLabel, name_str}})),
+        .reused_connections =
+            &(reused_connections_.Add({{kTargetLabel, name_str}})),
+        .new_connections = &(new_connections_.Add({{kTargetLabel, name_str}})),
+        .name_lookup_time = &(name_lookup_time_.Add({{kTargetLabel, name_str}},
+                                                    LatencyBuckets())),
+        .connect_time =
+            &(connect_time_.Add({{kTargetLabel, name_str}}, LatencyBuckets())),
+        .first_byte_time = &(first_byte_time_.Add({{kTargetLabel, name_str}},
+                                                  LatencyBuckets())),
+        .scrape_time =
+            &(scrape_time_.Add({{kTargetLabel, name_str}}, LatencyBuckets())),
+        .parse_time =
+            &(parse_time_.Add({{kTargetLabel, name_str}}, ParseBuckets())),
+        .energy = &(energy_.Add({{kTargetLabel, name_str}})),
+        .energy_integrator = EnergyIntegrator(energy_max_gap_),
     };
-    if (!target_metrics_
-             .insert(std::make_pair(name_str, std::move(target_metrics)))
-             .second) {
-      return absl::InternalError(
-          absl::Substitute("Failed to add target metrics for \"$0\"", name));
+    TargetHandle handle;
+    if (!free_handles_.empty()) {
+      handle = free_handles_.back();
+      free_handles_.pop_back();
+      target_metrics_[handle].emplace(std::move(target_metrics));
+    } else {
+      handle = target_metrics_.size();
+      target_metrics_.emplace_back(std::move(target_metrics));
+    }
+    handles_.emplace(name_str, handle);
+    return handle;
+  }
+
+  absl::Status RemoveTarget(absl::string_view name) override {
+    std::unique_lock lock(mutex_);
+    const auto it = handles_.find(name);
+    if (it == handles_.end()) {
+      return absl::NotFoundError(
+          absl::Substitute("Unknown target name \"$0\"", name));
+    }
+    const TargetHandle handle = it->second;
+    handles_.erase(it);
+
+    const TargetMetrics& target_metrics = *target_metrics_[handle];
+    collectable_->group_sums().Leave(target_metrics.groups,
+                                     GetReadings(target_metrics));
+    // Removing the metrics from their families drops the target's labels
+    // from the exposition.
+    success_queries_.Remove(target_metrics.success_queries);
+    error_queries_.Remove(target_metrics.error_queries);
+    timeout_queries_.Remove(target_metrics.timeout_queries);
+    circuit_state_.Remove(target_metrics.circuit_state);
+    reused_connections_.Remove(target_metrics.reused_connections);
+    new_connections_.Remove(target_metrics.new_connections);
+    name_lookup_time_.Remove(target_metrics.name_lookup_time);
+    connect_time_.Remove(target_metrics.connect_time);
+    first_byte_time_.Remove(target_metrics.first_byte_time);
+    scrape_time_.Remove(target_metrics.scrape_time);
+    parse_time_.Remove(target_metrics.parse_time);
+    collectable_->RemoveTarget(target_metrics.collected);
+    energy_.Remove(target_metrics.energy);
+    target_metrics_[handle].reset();
+    free_handles_.push_back(handle);
+    return absl::OkStatus();
+  }
+
+  absl::Status SetTargetGroups(absl::string_view name,
+                               const TargetGroups& groups) override {
+    std::unique_lock lock(mutex_);
+    const auto it = handles_.find(name);
+    if (it == handles_.end()) {
+      return absl::NotFoundError(
+          absl::Substitute("Unknown target name \"$0\"", name));
+    }
+    TargetMetrics& target_metrics = *target_metrics_[it->second];
+    const ::shelly::Metrics readings = GetReadings(target_metrics);
+    GroupSums& group_sums = collectable_->group_sums();
+    group_sums.Leave(target_metrics.groups, readings);
+    target_metrics.groups = group_sums.Join(groups, readings);
+    return absl::OkStatus();
+  }
+
+  std::optional<TargetHandle> FindTarget(
+      absl::string_view name) const override {
+    std::shared_lock lock(mutex_);
+    auto it = handles_.find(name);
+    if (it == handles_.end()) {
+      return std::nullopt;
+    }
+    return it->second;
+  }
+
+  std::vector<TargetState> GetTargetStates() const override {
+    std::shared_lock lock(mutex_);
+    std::vector<TargetState> states;
+    states.reserve(handles_.size());
+    for (const auto& [name, handle] : handles_) {
+      const TargetMetrics& target_metrics = *target_metrics_[handle];
+      const Sample sample = target_metrics.collected->sample.Load();
+      states.push_back(TargetState{
+          .name = name,
+          .success_queries = target_metrics.success_queries->Value(),
+          .error_queries = target_metrics.error_queries->Value(),
+          .timeout_queries = target_metrics.timeout_queries->Value(),
+          .reused_connections = target_metrics.reused_connections->Value(),
+          .new_connections = target_metrics.new_connections->Value(),
+          .metrics = sample.metrics,
+          .last_updated = sample.last_updated,
+          .energy_wh = target_metrics.energy->Value(),
+      });
+    }
+    return states;
+  }
+
+  absl::Status RestoreTargetState(const TargetState& state) override {
+    std::shared_lock lock(mutex_);
+    const auto it = handles_.find(state.name);
+    if (it == handles_.end()) {
+      return absl::NotFoundError(
+          absl::Substitute("Unknown target name \"$0\"", state.name));
+    }
+    TargetMetrics& target_metrics = *target_metrics_[it->second];
+    // The counters start from zero, so are restored by incrementing them.
+    target_metrics.success_queries->Increment(state.success_queries);
+    target_metrics.error_queries->Increment(state.error_queries);
+    target_metrics.timeout_queries->Increment(state.timeout_queries);
+    target_metrics.reused_connections->Increment(state.reused_connections);
+    target_metrics.new_connections->Increment(state.new_connections);
+    target_metrics.energy->Increment(state.energy_wh);
+    if (state.last_updated > 0) {
+      GroupSums::Update(target_metrics.groups, GetReadings(target_metrics),
+                        state.metrics);
+      target_metrics.collected->sample.Store(Sample{
+          .metrics = state.metrics,
+          .last_updated = state.last_updated,
+      });
+      target_metrics.energy_integrator.Add(
+          state.metrics.apower,
+          absl::UnixEpoch() + absl::Seconds(state.last_updated));
     }
     return absl::OkStatus();
   }
 
-  void ErrorCallback(absl::string_view name,
+  void ErrorCallback(TargetHandle handle,
                      const absl::Status& status) override {
-    auto* const target_metrics = FindTargetMetricsOrNull(name);
+    std::shared_lock lock(mutex_);
+    auto* const target_metrics = GetTargetMetricsOrNull(handle);
     if (target_metrics == nullptr) {
-      LOG(ERROR) << "Unknown target \"" << name << "\"";
       return;
     }
-
-    IncrementIfNotNull(target_metrics->error_queries);
+    ApplyError(*target_metrics, status);
   }
 
-  void SuccessCallback(absl::string_view name,
+  void SuccessCallback(TargetHandle handle,
                        const ::shelly::Metrics& metrics) override {
-    auto* const target_metrics = FindTargetMetricsOrNull(name);
+    std::shared_lock lock(mutex_);
+    auto* const target_metrics = GetTargetMetricsOrNull(handle);
+    if (target_metrics == nullptr) {
+      return;
+    }
+    ApplySuccess(*target_metrics, metrics, absl::Now());
+  }
+
+  void Consume(absl::Span<const PollResult> results) override {
+    std::shared_lock lock(mutex_);
+    for (const auto& result : results) {
+      auto* const target_metrics = GetTargetMetricsOrNull(result.handle);
+      if (target_metrics == nullptr) {
+        continue;
+      }
+      if (result.metrics.ok()) {
+        ApplySuccess(*target_metrics, *result.metrics, result.time);
+      } else {
+        ApplyError(*target_metrics, result.metrics.status());
+      }
+    }
+  }
+
+  void ScrapeStatsCallback(TargetHandle handle,
+                           const ScrapeStats& stats) override {
+    std::shared_lock lock(mutex_);
+    auto* const target_metrics = GetTargetMetricsOrNull(handle);
+    if (target_metrics == nullptr) {
+      return;
+    }
+
+    IncrementIfNotNull(stats.reused_connection
+                           ? target_metrics->reused_connections
+                           : target_metrics->new_connections);
+    ObserveIfNotNull(target_metrics->name_lookup_time, stats.name_lookup_time);
+    ObserveIfNotNull(target_metrics->connect_time, stats.connect_time);
+    ObserveIfNotNull(target_metrics->first_byte_time, stats.first_byte_time);
+    ObserveIfNotNull(target_metrics->scrape_time, stats.total_time);
+  }
+
+  void PollTimingsCallback(TargetHandle handle,
+                           const Poller::PollTimings& timings) override {
+    // Unlike the pool stats, the timings are reported from every worker, so
+    // the exporter wide metrics are added under a once flag.
+    std::call_once(poll_metrics_once_, [this] {
+      poll_metrics_.emplace(PollMetrics{
+          .scheduling_lag = &(scheduling_lag_.Add({}, LatencyBuckets())),
+          .duration = &(poll_duration_.Add({}, LatencyBuckets())),
+          .overrun = &(poll_overrun_.Add({}, LatencyBuckets())),
+      });
+    });
+    ObserveIfNotNull(poll_metrics_->scheduling_lag, timings.scheduling_lag);
+    ObserveIfNotNull(poll_metrics_->duration, timings.duration);
+    if (timings.overrun > absl::ZeroDuration()) {
+      ObserveIfNotNull(poll_metrics_->overrun, timings.overrun);
+    }
+
+    std::shared_lock lock(mutex_);
+    auto* const target_metrics = GetTargetMetricsOrNull(handle);
+    if (target_metrics == nullptr) {
+      return;
+    }
+    if (timings.parse_time > absl::ZeroDuration()) {
+      ObserveIfNotNull(target_metrics->parse_time, timings.parse_time);
+    }
+  }
+
+  void CircuitStateCallback(TargetHandle handle,
+                            CircuitBreaker::State state) override {
+    std::shared_lock lock(mutex_);
+    auto* const target_metrics = GetTargetMetricsOrNull(handle);
     if (target_metrics == nullptr) {
-      LOG(ERROR) << "Unknown target \"" << name << "\"";
       return;
     }
 
-    SetIfNotNull(target_metrics->voltage, metrics.voltage);
-    SetIfNotNull(target_metrics->current, metrics.current);
-    SetIfNotNull(target_metrics->apower, metrics.apower);
-    SetIfNotNull(target_metrics->temp_c, metrics.temp_c);
-    SetIfNotNull(target_metrics->temp_f, metrics.temp_f);
-    IncrementIfNotNull(target_metrics->success_queries);
-    if (target_metrics->last_updated != nullptr) {
-      target_metrics->last_updated->SetToCurrentTime();
+    SetIfNotNull(target_metrics->circuit_state, static_cast<int>(state));
+  }
+
+  void PoolStatsCallback(const ThreadPool::Stats& stats) override {
+    // The pool metrics are only added once there are stats to report, so that
+    // an idle registry collects no metrics.
+    if (!pool_metrics_.has_value()) {
+      pool_metrics_.emplace(PoolMetrics{
+          .workers = &(workers_.Add({})),
+          .queue_depth = &(queue_depth_.Add({})),
+          .utilisation = &(utilisation_.Add({})),
+      });
     }
+    SetIfNotNull(pool_metrics_->workers, stats.num_workers);
+    SetIfNotNull(pool_metrics_->queue_depth, stats.peak_queue_depth);
+    SetIfNotNull(pool_metrics_->utilisation, stats.utilisation);
   }
 
  private:
   std::shared_ptr<::prometheus::Registry> registry_;
+  const std::shared_ptr<RegistryCollectable> collectable_;
+  const absl::Duration energy_max_gap_;
 
-  ::prometheus::Family<::prometheus::Gauge>& voltage_;
-  ::prometheus::Family<::prometheus::Gauge>& apower_;
-  ::prometheus::Family<::prometheus::Gauge>& current_;
-  ::prometheus::Family<::prometheus::Gauge>& temp_c_;
-  ::prometheus::Family<::prometheus::Gauge>& temp_f_;
+  ::prometheus::Family<::prometheus::Counter>& energy_;
   ::prometheus::Family<::prometheus::Counter>& success_queries_;
   ::prometheus::Family<::prometheus::Counter>& error_queries_;
-  ::prometheus::Family<::prometheus::Gauge>& last_updated_;
+  ::prometheus::Family<::prometheus::Counter>& timeout_queries_;
+  ::prometheus::Family<::prometheus::Gauge>& circuit_state_;
+  ::prometheus::Family<::prometheus::Counter>& reused_connections_;
+  ::prometheus::Family<::prometheus::Counter>& new_connections_;
+  ::prometheus::Family<::prometheus::Histogram>& name_lookup_time_;
+  ::prometheus::Family<::prometheus::Histogram>& connect_time_;
+  ::prometheus::Family<::prometheus::Histogram>& first_byte_time_;
+  ::prometheus::Family<::prometheus::Histogram>& scrape_time_;
+  ::prometheus::Family<::prometheus::Histogram>& parse_time_;
+  ::prometheus::Family<::prometheus::Gauge>& workers_;
+  ::prometheus::Family<::prometheus::Gauge>& queue_depth_;
+  ::prometheus::Family<::prometheus::Gauge>& utilisation_;
+  ::prometheus::Family<::prometheus::Histogram>& scheduling_lag_;
+  ::prometheus::Family<::prometheus::Histogram>& poll_duration_;
+  ::prometheus::Family<::prometheus::Histogram>& poll_overrun_;
 
-  absl::flat_hash_map<std::string, TargetMetrics> target_metrics_;
+  // Guards the set of targets. The metrics themselves are thread safe, so
+  // updating them only needs a shared lock, to keep the target from being
+  // removed meanwhile.
+  mutable std::shared_mutex mutex_;
+  // Indexed by target handle, and empty for removed targets.
+  std::vector<std::optional<TargetMetrics>> target_metrics_;
+  absl::flat_hash_map<std::string, TargetHandle> handles_;
+  // Handles of removed targets, to be reused before any new ones.
+  std::vector<TargetHandle> free_handles_;
+  std::optional<PoolMetrics> pool_metrics_;
+  std::once_flag poll_metrics_once_;
+  std::optional<PollMetrics> poll_metrics_;
+
+  static void ApplyError(TargetMetrics& target_metrics,
+                         const absl::Status& status) {
+    IncrementIfNotNull(target_metrics.error_queries);
+    if (status.code() == absl::StatusCode::kDeadlineExceeded) {
+      IncrementIfNotNull(target_metrics.timeout_queries);
+    }
+  }
+
+  static void ApplySuccess(TargetMetrics& target_metrics,
+                           const ::shelly::Metrics& metrics,
+                           absl::Time time) {
+    // The previous sample is only replaced by this target's own polls, so
+    // can be read back before storing the new one.
+    CollectedTarget& collected = *target_metrics.collected;
+    if (!target_metrics.groups.empty()) {
+      GroupSums::Update(target_metrics.groups, GetReadings(target_metrics),
+                        metrics);
+    }
+    collected.sample.Store(Sample{
+        .metrics = metrics,
+        .last_updated = static_cast<double>(absl::ToUnixSeconds(time)),
+    });
+    collected.apower_summary.Add(metrics.apower, time);
+    if (target_metrics.energy != nullptr) {
+      target_metrics.energy->Increment(
+          target_metrics.energy_integrator.Add(metrics.apower, time));
+    }
+    IncrementIfNotNull(target_metrics.success_queries);
+  }
+
+  // Returns the target's last successful readings, or zeros if it hasn't been
+  // polled. Reads just the collected sample, which every target has, rather
+  // than any of its optional metrics.
+  static ::shelly::Metrics GetReadings(const TargetMetrics& target_metrics) {
+    DCHECK(target_metrics.collected != nullptr);
+    return target_metrics.collected->sample.Load().metrics;
+  }
 
-  TargetMetrics* FindTargetMetricsOrNull(absl::string_view name) {
-    auto it = target_metrics_.find(name);
-    if (it == target_metrics_.end()) {
+  // Must be called with `mutex_` held.
+  TargetMetrics* GetTargetMetricsOrNull(TargetHandle handle) {
+    if (handle >= target_metrics_.size() ||
+        !target_metrics_[handle].has_value()) {
+      LOG(ERROR) << "Unknown target handle " << handle;
       return nullptr;
     }
-    return &(it->second);
+    return &*target_metrics_[handle];
   }
 };
 
 }  // namespace
 
-std::unique_ptr<Registry> CreateRegistry() {
-  return std::make_unique<RegistryImpl>();
+std::unique_ptr<Registry> CreateRegistry(const Registry::Options& options) {
+  return std::make_unique<RegistryImpl>(options);
 }
@@ -1,30 +1,104 @@
 #ifndef REGISTRY_H
 #define REGISTRY_H
 
+#include <functional>
 #include <memory>
+#include <optional>
 #include <string_view>
+#include <vector>
 
 #include "absl/status/status.h"
-#include "prometheus/registry.h"
+#include "absl/status/statusor.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "circuit_breaker.h"
+#include "poller.h"
+#include "prometheus/collectable.h"
+#include "scraper.h"
 #include "shelly.h"
+#include "sink.h"
+#include "state_file.h"
+#include "target.h"
+#include "thread_pool.h"
 
-class Registry {
+// Also a sink of poll results, applying each batch in one go. The time of a
+// successful result is used as its target's last updated time.
+class Registry : public Sink {
  public:
+  struct Options final {
+    // The window over which the quantiles of each target's power draw are
+    // taken, which would usually be the scrape interval.
+    absl::Duration quantile_window = absl::Seconds(30);
+    // The longest time between two of a target's readings that its power is
+    // integrated over, into the energy it used. Beyond this the target is
+    // assumed to have been unreachable, and the energy in between is left
+    // uncounted.
+    absl::Duration energy_max_gap = absl::Minutes(1);
+    // Used to tell which window the quantiles are collected from.
+    std::function<absl::Time()> time_func = [] { return absl::Now(); };
+  };
+
   virtual ~Registry() = default;
 
-  virtual std::shared_ptr<::prometheus::Registry> GetRegistry() = 0;
+  // Returns the metrics for serving, which may outlive the registry.
+  virtual std::shared_ptr<::prometheus::Collectable> GetCollectable() = 0;
 
-  virtual void ErrorCallback(absl::string_view name,
+  // The per-target callbacks take the handle returned by AddTarget, and
+  // ignore any unknown handle.
+  virtual void ErrorCallback(TargetHandle handle,
                              const absl::Status& status) = 0;
-  virtual void SuccessCallback(absl::string_view name,
+  virtual void SuccessCallback(TargetHandle handle,
                                const ::shelly::Metrics& metrics) = 0;
+  virtual void ScrapeStatsCallback(TargetHandle handle,
+                                   const ScrapeStats& stats) = 0;
+  virtual void PoolStatsCallback(const ThreadPool::Stats& stats) = 0;
+  virtual void PollTimingsCallback(TargetHandle handle,
+                                   const Poller::PollTimings& timings) = 0;
+  virtual void CircuitStateCallback(TargetHandle handle,
+                                    CircuitBreaker::State state) = 0;
+
+  // Adds a target's metrics, returning the handle with which to update them.
+  // Handles are dense, starting from zero, with the handles of removed
+  // targets being reused first.
+  virtual absl::StatusOr<TargetHandle> AddTarget(absl::string_view name) = 0;
+
+  // Removes the named target's metrics, so that they're no longer exported.
+  // Its handle is unknown from then on, until it's reused by AddTarget, so
+  // the target must first have been removed from the poller.
+  virtual absl::Status RemoveTarget(absl::string_view name) = 0;
+
+  // Sets the groups that the named target's readings are summed in to,
+  // replacing any it was in before. Fails if there is no such target.
+  virtual absl::Status SetTargetGroups(absl::string_view name,
+                                       const TargetGroups& groups) = 0;
 
-  virtual absl::Status AddTarget(absl::string_view name) = 0;
+  // Returns the handle of the named target, or nullopt if there is no such
+  // target.
+  virtual std::optional<TargetHandle> FindTarget(
+      absl::string_view name) const = 0;
+
+  // Returns the state of every target, to be carried over a restart.
+  virtual std::vector<TargetState> GetTargetStates() const = 0;
+
+  // Restores the metrics of the target named in `state`, which should have
+  // only just been added. The readings are only restored if the target had
+  // been polled successfully, in which case the energy used carries on being
+  // integrated from the last of them. Fails if there is no such target.
+  virtual absl::Status RestoreTargetState(const TargetState& state) = 0;
 
  protected:
   Registry() = default;
 };
 
-std::unique_ptr<Registry> CreateRegistry();
+// Keeps the metrics in prometheus-cpp families, with a labelled metric per
+// target.
+std::unique_ptr<Registry> CreateRegistry(
+    const Registry::Options& options = {});
+
+// Keeps each per-target metric in a flat array indexed by target, which is
+// rendered directly on collection. Cheaper to update and collect than the
+// prometheus-cpp families for large numbers of targets.
+std::unique_ptr<Registry> CreateFlatRegistry(
+    const Registry::Options& options = {});
 
 #endif  // REGISTRY_H
\ No newline at end of file
@@ -0,0 +1,241 @@
+#include "registry_internal.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <tuple>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "prometheus/metric_type.h"
+
+namespace registry_internal {
+
+const ::prometheus::Histogram::BucketBoundaries& LatencyBuckets() {
+  static const auto* const buckets =
+      new ::prometheus::Histogram::BucketBoundaries{
+          0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1,
+          0.25,  0.5,    1.0,   2.5,  5.0,   10.0};
+  return *buckets;
+}
+
+const ::prometheus::Histogram::BucketBoundaries& ParseBuckets() {
+  static const auto* const buckets =
+      new ::prometheus::Histogram::BucketBoundaries{
+          0.000001, 0.0000025, 0.000005, 0.00001, 0.000025,
+          0.00005,  0.0001,    0.00025,  0.0005,  0.001};
+  return *buckets;
+}
+
+namespace {
+
+// Power readings are in watts. A plug idling under half a watt counts as
+// drawing nothing, and none can draw more than ten kilowatts.
+inline constexpr DDSketch::Options kApowerSketchOptions = {
+    .relative_accuracy = 0.02,
+    .min_value = 0.5,
+    .max_value = 10000,
+};
+
+inline constexpr std::array<double, 4> kSummaryQuantiles = {0.5, 0.9, 0.99,
+                                                            1.0};
+
+}  // namespace
+
+WindowedSketch::WindowedSketch(absl::Duration window)
+    : window_(window),
+      slots_{Slot(kApowerSketchOptions), Slot(kApowerSketchOptions)} {}
+
+void WindowedSketch::Add(double value, absl::Time time) {
+  count_.fetch_add(1, std::memory_order_relaxed);
+  sum_.fetch_add(value, std::memory_order_relaxed);
+
+  const int64_t window = GetWindow(time);
+  Slot& slot = slots_[window & 1];
+  int64_t slot_window = slot.window.load(std::memory_order_acquire);
+  // The first sample of a window takes over the slot of the window before
+  // last, clearing out its samples.
+  while (slot_window < window) {
+    if (slot.window.compare_exchange_weak(slot_window, window,
+                                          std::memory_order_acq_rel)) {
+      slot.sketch.Clear();
+      slot_window = window;
+    }
+  }
+  if (slot_window == window) {
+    slot.sketch.Add(value);
+  }
+}
+
+void WindowedSketch::Clear() {
+  for (auto& slot : slots_) {
+    slot.window.store(std::numeric_limits<int64_t>::min(),
+                      std::memory_order_relaxed);
+    slot.sketch.Clear();
+  }
+  count_.store(0, std::memory_order_relaxed);
+  sum_.store(0, std::memory_order_relaxed);
+}
+
+::prometheus::ClientMetric::Summary WindowedSketch::Collect(
+    absl::Time now) const {
+  const int64_t window = GetWindow(now);
+  DDSketch sketch(kApowerSketchOptions);
+  for (const auto& slot : slots_) {
+    const int64_t slot_window = slot.window.load(std::memory_order_acquire);
+    if (slot_window == window || slot_window == window - 1) {
+      sketch.Merge(slot.sketch);
+    }
+  }
+
+  ::prometheus::ClientMetric::Summary summary;
+  summary.sample_count = count_.load(std::memory_order_relaxed);
+  summary.sample_sum = sum_.load(std::memory_order_relaxed);
+  summary.quantile.reserve(kSummaryQuantiles.size());
+  for (const double q : kSummaryQuantiles) {
+    summary.quantile.push_back({.quantile = q, .value = sketch.Quantile(q)});
+  }
+  return summary;
+}
+
+int64_t WindowedSketch::GetWindow(absl::Time time) const {
+  absl::Duration remainder;
+  return absl::IDivDuration(time - absl::UnixEpoch(), window_, &remainder);
+}
+
+double EnergyIntegrator::Add(double apower, absl::Time time) {
+  if (time <= last_time_) {
+    return 0;
+  }
+  apower = std::max(apower, 0.0);
+  const absl::Duration elapsed = time - last_time_;
+  const double energy =
+      elapsed <= max_gap_
+          ? (last_apower_ + apower) / 2 * absl::ToDoubleHours(elapsed)
+          : 0;
+  last_apower_ = apower;
+  last_time_ = time;
+  return energy;
+}
+
+void EnergyIntegrator::Reset() {
+  last_apower_ = 0;
+  last_time_ = absl::InfinitePast();
+}
+
+namespace {
+
+// Readings that aren't finite, or are too large to sum, count as zero.
+inline constexpr double kMaxGroupReading = 1e9;
+
+int64_t ToMillionths(double reading) {
+  if (!(std::abs(reading) <= kMaxGroupReading)) {
+    return 0;
+  }
+  return std::llround(reading * 1e6);
+}
+
+double FromMillionths(int64_t sum) { return static_cast<double>(sum) / 1e6; }
+
+}  // namespace
+
+std::vector<GroupSums::Group*> GroupSums::Join(
+    const TargetGroups& groups, const ::shelly::Metrics& metrics) {
+  std::vector<Group*> joined;
+  joined.reserve(groups.size());
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& [label, value] : groups) {
+    auto& group = groups_[{label, value}];
+    if (group == nullptr) {
+      group = std::make_unique<Group>(
+          std::vector<::prometheus::ClientMetric::Label>{
+              {.name = label, .value = value}});
+      const size_t num_groups = num_groups_.load(std::memory_order_relaxed);
+      ordered_groups_.Resize(num_groups + 1);
+      ordered_groups_[num_groups] = group.get();
+      num_groups_.store(num_groups + 1, std::memory_order_release);
+    }
+    group->num_targets_.fetch_add(1, std::memory_order_relaxed);
+    joined.push_back(group.get());
+  }
+  Update(joined, {}, metrics);
+  return joined;
+}
+
+void GroupSums::Leave(absl::Span<Group* const> groups,
+                      const ::shelly::Metrics& metrics) {
+  Update(groups, metrics, {});
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (Group* group : groups) {
+    group->num_targets_.fetch_sub(1, std::memory_order_relaxed);
+  }
+}
+
+void GroupSums::Update(absl::Span<Group* const> groups,
+                       const ::shelly::Metrics& previous,
+                       const ::shelly::Metrics& metrics) {
+  const int64_t apower =
+      ToMillionths(metrics.apower) - ToMillionths(previous.apower);
+  const int64_t current =
+      ToMillionths(metrics.current) - ToMillionths(previous.current);
+  if (apower == 0 && current == 0) {
+    return;
+  }
+  for (Group* group : groups) {
+    group->apower_.fetch_add(apower, std::memory_order_relaxed);
+    group->current_.fetch_add(current, std::memory_order_relaxed);
+  }
+}
+
+void GroupSums::Collect(
+    std::vector<::prometheus::MetricFamily>& families) const {
+  const size_t num_groups = num_groups_.load(std::memory_order_acquire);
+  std::vector<const Group*> groups;
+  groups.reserve(num_groups);
+  for (size_t i = 0; i < num_groups; ++i) {
+    const Group* group = ordered_groups_[i];
+    if (group->num_targets_.load(std::memory_order_relaxed) > 0) {
+      groups.push_back(group);
+    }
+  }
+  if (groups.empty()) {
+    return;
+  }
+  // Ordered by label name then value, whatever order the groups were added.
+  std::sort(groups.begin(), groups.end(),
+            [](const Group* lhs, const Group* rhs) {
+              const auto& lhs_label = lhs->label_.front();
+              const auto& rhs_label = rhs->label_.front();
+              return std::tie(lhs_label.name, lhs_label.value) <
+                     std::tie(rhs_label.name, rhs_label.value);
+            });
+  ::prometheus::MetricFamily apower = {
+      .name = "shelly_group_apower_sum",
+      .help = "Sum of the last observed power of the targets in the group",
+      .type = ::prometheus::MetricType::Gauge,
+  };
+  ::prometheus::MetricFamily current = {
+      .name = "shelly_group_current_sum",
+      .help = "Sum of the last observed current of the targets in the group",
+      .type = ::prometheus::MetricType::Gauge,
+  };
+  apower.metric.reserve(groups.size());
+  current.metric.reserve(groups.size());
+  for (const Group* group : groups) {
+    auto& apower_metric = apower.metric.emplace_back();
+    apower_metric.label = group->label_;
+    apower_metric.gauge.value =
+        FromMillionths(group->apower_.load(std::memory_order_relaxed));
+    auto& current_metric = current.metric.emplace_back();
+    current_metric.label = group->label_;
+    current_metric.gauge.value =
+        FromMillionths(group->current_.load(std::memory_order_relaxed));
+  }
+  families.push_back(std::move(apower));
+  families.push_back(std::move(current));
+}
+
+}  // namespace registry_internal
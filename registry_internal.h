@@ -0,0 +1,269 @@
+#ifndef REGISTRY_INTERNAL_H
+#define REGISTRY_INTERNAL_H
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+#include "ddsketch.h"
+#include "prometheus/client_metric.h"
+#include "prometheus/histogram.h"
+#include "prometheus/metric_family.h"
+#include "shelly.h"
+#include "target.h"
+
+// Implementation details shared by the Registry implementations.
+namespace registry_internal {
+
+inline constexpr auto kTargetLabel = "target";
+
+// Bucket boundaries, in seconds, for the network and poll latencies. These
+// span a fast local plug to one that is close to timing out.
+const ::prometheus::Histogram::BucketBoundaries& LatencyBuckets();
+
+// Bucket boundaries, in seconds, for parsing a response, which takes
+// microseconds rather than milliseconds.
+const ::prometheus::Histogram::BucketBoundaries& ParseBuckets();
+
+// The readings from a target's last successful poll. Both registries publish
+// these through a SeqLock, so that every reading collected for a target is
+// from the same poll.
+struct Sample final {
+  ::shelly::Metrics metrics = {};
+  // In Unix seconds, or zero until the target is first polled.
+  double last_updated = 0;
+};
+
+// A gauge family rendered from each target's Sample.
+struct SampleFamily final {
+  const char* name;
+  const char* help;
+  double (*get)(const Sample& sample);
+};
+
+inline constexpr std::array<SampleFamily, 6> kSampleFamilies = {{
+    {"shelly_voltage", "Last observed voltage of the target",
+     [](const Sample& sample) { return sample.metrics.voltage; }},
+    {"shelly_apower", "Last observed power of the target",
+     [](const Sample& sample) { return sample.metrics.apower; }},
+    {"shelly_current", "Last observed current of the target",
+     [](const Sample& sample) { return sample.metrics.current; }},
+    {"shelly_temp_c", "Last observed temperature of the target",
+     [](const Sample& sample) { return sample.metrics.temp_c; }},
+    {"shelly_temp_f", "Last observed temperature of the target",
+     [](const Sample& sample) { return sample.metrics.temp_f; }},
+    {"shelly_last_updated",
+     "Timestamp for the most recent update for this target",
+     [](const Sample& sample) { return sample.last_updated; }},
+}};
+
+inline constexpr auto kApowerSummaryName = "shelly_apower_summary";
+inline constexpr auto kApowerSummaryHelp =
+    "Power drawn by the target over its successful polls, with quantiles "
+    "over the last one to two quantile windows";
+
+// A sketch of a target's power draw over a trailing window, so that short
+// spikes between scrapes show up in the quantiles. Time is cut in to windows
+// of a fixed length, and the samples of the current and previous windows are
+// kept in two sketches, one of which is cleared whenever a sample starts a
+// new window. Adding a sample never blocks, nor is blocked by collection.
+class WindowedSketch final {
+ public:
+  WindowedSketch() = delete;
+  explicit WindowedSketch(absl::Duration window);
+
+  WindowedSketch(const WindowedSketch&) = delete;
+  WindowedSketch& operator=(const WindowedSketch&) = delete;
+
+  // Samples from before the previous window are only counted in the total.
+  // A sample added while another clears its window's sketch may be lost.
+  void Add(double value, absl::Time time);
+
+  // Must not race with Add.
+  void Clear();
+
+  // Returns the median, 90th and 99th percentiles, and the maximum of the
+  // samples in the current and previous windows as of `now`, or NaN if there
+  // are none. The count and sum are of every sample since the sketch was
+  // created or cleared.
+  ::prometheus::ClientMetric::Summary Collect(absl::Time now) const;
+
+ private:
+  struct Slot final {
+    explicit Slot(const DDSketch::Options& options) : sketch(options) {}
+
+    // Index of the window that the sketch's samples are from.
+    std::atomic<int64_t> window = std::numeric_limits<int64_t>::min();
+    DDSketch sketch;
+  };
+
+  const absl::Duration window_;
+  // Indexed by the window index modulo two.
+  Slot slots_[2];
+  std::atomic<uint64_t> count_ = 0;
+  std::atomic<double> sum_ = 0;
+
+  int64_t GetWindow(absl::Time time) const;
+};
+
+// Integrates a target's power readings in to the energy it used, by the
+// trapezoidal rule over the times that the readings were taken. Readings
+// further apart than the maximum gap, such as either side of an outage, aren't
+// integrated across, as the power in between is unknown. Negative readings
+// count as zero, so that the energy never decreases.
+//
+// Not thread safe, which suits a target being polled by one worker at a time.
+class EnergyIntegrator final {
+ public:
+  EnergyIntegrator() = delete;
+  explicit EnergyIntegrator(absl::Duration max_gap) : max_gap_(max_gap) {}
+
+  // Returns the energy used, in watt hours, between the previous reading and
+  // this one. Zero for the first reading after a gap, and for any reading no
+  // later than the previous one, which is otherwise ignored.
+  double Add(double apower, absl::Time time);
+
+  // Forgets the previous reading.
+  void Reset();
+
+ private:
+  const absl::Duration max_gap_;
+  double last_apower_ = 0;
+  absl::Time last_time_ = absl::InfinitePast();
+};
+
+// A growable array whose elements never move, so that they can be read while
+// others are being added. The elements are allocated in blocks that double in
+// size, which are only freed with the array.
+template <class T>
+class StableVector final {
+ public:
+  StableVector() = default;
+
+  StableVector(const StableVector&) = delete;
+  StableVector& operator=(const StableVector&) = delete;
+
+  ~StableVector() {
+    for (auto& block : blocks_) {
+      delete[] block.load(std::memory_order_relaxed);
+    }
+  }
+
+  // Grows to hold at least `size` elements, value initialising any new ones.
+  // Must not race with itself, but may with access to existing elements.
+  void Resize(size_t size) {
+    while (capacity_ < size) {
+      const size_t block_size = kFirstBlockSize << num_blocks_;
+      blocks_[num_blocks_].store(new T[block_size](),
+                                 std::memory_order_release);
+      ++num_blocks_;
+      capacity_ += block_size;
+    }
+  }
+
+  T& operator[](size_t index) { return *Find(index); }
+  const T& operator[](size_t index) const { return *Find(index); }
+
+ private:
+  static constexpr size_t kFirstBlockSize = 64;
+  static constexpr int kFirstBlockBits = std::countr_zero(kFirstBlockSize);
+  // Enough blocks for far more elements than could be allocated.
+  static constexpr size_t kMaxBlocks = 48;
+
+  std::array<std::atomic<T*>, kMaxBlocks> blocks_ = {};
+  size_t num_blocks_ = 0;
+  size_t capacity_ = 0;
+
+  // Block `b` holds the elements from kFirstBlockSize * (2^b - 1), so
+  // offsetting the index by the first block's size puts its block in the
+  // index's top bit.
+  T* Find(size_t index) const {
+    const size_t offset_index = index + kFirstBlockSize;
+    const int block = std::bit_width(offset_index) - 1 - kFirstBlockBits;
+    return blocks_[block].load(std::memory_order_acquire) +
+           (offset_index - (kFirstBlockSize << block));
+  }
+};
+
+// Sums of the power and current of the targets in each group, kept up to date
+// by adding the change in a target's readings as each poll succeeds, rather
+// than by summing every target on collection. Each group is a label shared by
+// its targets, such as room="Kitchen", and its sums are exported with just
+// that label. A target counts its last successful readings towards its groups,
+// or zero until it's first polled.
+//
+// The sums are kept in integer millionths of a watt or amp, so that they stay
+// exact however many changes are added, rather than drifting as floating
+// point sums would.
+class GroupSums final {
+ public:
+  class Group final {
+   public:
+    explicit Group(std::vector<::prometheus::ClientMetric::Label> label)
+        : label_(std::move(label)) {}
+
+   private:
+    friend class GroupSums;
+
+    const std::vector<::prometheus::ClientMetric::Label> label_;
+    std::atomic<int64_t> apower_ = 0;
+    std::atomic<int64_t> current_ = 0;
+    // Only changed with the GroupSums' mutex held. A group without targets
+    // isn't collected.
+    std::atomic<size_t> num_targets_ = 0;
+  };
+
+  GroupSums() = default;
+
+  GroupSums(const GroupSums&) = delete;
+  GroupSums& operator=(const GroupSums&) = delete;
+
+  // Adds a target's readings to each of its groups, creating any that don't
+  // exist yet. Returns the groups, to pass to Update and Leave.
+  std::vector<Group*> Join(const TargetGroups& groups,
+                           const ::shelly::Metrics& metrics);
+
+  // Subtracts a target's readings from each of its groups. A group that it
+  // was the last target of is no longer collected, but is kept for any target
+  // that joins it later.
+  void Leave(absl::Span<Group* const> groups,
+             const ::shelly::Metrics& metrics);
+
+  // Adds the change from a target's previous readings to its new ones. Must
+  // not race with the same target joining or leaving its groups, but doesn't
+  // block, nor is blocked by, any other target's updates or collection.
+  static void Update(absl::Span<Group* const> groups,
+                     const ::shelly::Metrics& previous,
+                     const ::shelly::Metrics& metrics);
+
+  // Appends the families of the sums, unless no group has any targets. Never
+  // blocks, nor is blocked by, targets joining or leaving.
+  void Collect(std::vector<::prometheus::MetricFamily>& families) const;
+
+ private:
+  // Guards adding groups and their targets, but not their sums. Collection
+  // doesn't take it.
+  std::mutex mutex_;
+  // Keyed by label name then value.
+  std::map<std::pair<std::string, std::string>, std::unique_ptr<Group>>
+      groups_;
+  // Every group in `groups_`, in the order they were added. Groups are never
+  // removed, so collection reads the first `num_groups_` without a lock.
+  StableVector<Group*> ordered_groups_;
+  std::atomic<size_t> num_groups_ = 0;
+};
+
+}  // namespace registry_internal
+
+#endif  // REGISTRY_INTERNAL_H
@@ -3,23 +3,36 @@
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 
+#include <atomic>
+#include <cmath>
 #include <optional>
 #include <string_view>
+#include <thread>
+#include <vector>
 
 #include "absl/container/flat_hash_map.h"
 #include "absl/log/check.h"
+#include "absl/strings/str_cat.h"
 #include "absl/types/span.h"
 #include "prometheus/client_metric.h"
 #include "prometheus/metric_family.h"
+#include "prometheus/metric_type.h"
 
 namespace {
 
 using ::testing::AllOf;
 using ::testing::Contains;
 using ::testing::DoubleEq;
+using ::testing::DoubleNear;
+using ::testing::IsEmpty;
 using ::testing::Pair;
+using ::testing::Optional;
+using ::testing::SizeIs;
 using ::testing::UnorderedElementsAre;
 
+// A handle that no target has been given.
+inline constexpr TargetHandle kUnknownHandle = 99;
+
 absl::flat_hash_map<std::string, absl::flat_hash_map<std::string, double>>
 GetMetricsAsDoubles(absl::Span<const ::prometheus::MetricFamily> families) {
   absl::flat_hash_map<std::string, absl::flat_hash_map<std::string, double>>
@@ -27,6 +40,10 @@ GetMetricsAsDoubles(absl::Span<const ::prometheus::MetricFamily> families) {
 
   for (const auto& family : families) {
     for (const auto& metric : family.metric) {
+      // Exporter wide metrics have no target label.
+      if (metric.label.empty()) {
+        continue;
+      }
       CHECK(metric.label.size() == 1)
           << "Expected metric \"" << family.name << "\" to have exactly one "
           << "label";
@@ -38,59 +55,190 @@ GetMetricsAsDoubles(absl::Span<const ::prometheus::MetricFamily> families) {
   return results;
 }
 
+absl::flat_hash_map<std::string, double> GetExporterMetricsAsDoubles(
+    absl::Span<const ::prometheus::MetricFamily> families) {
+  absl::flat_hash_map<std::string, double> results;
+  for (const auto& family : families) {
+    for (const auto& metric : family.metric) {
+      if (metric.label.empty()) {
+        results[family.name] = metric.gauge.value;
+      }
+    }
+  }
+  return results;
+}
+
+// Returns the number of samples in each histogram, keyed by the target label
+// or by an empty string for exporter wide histograms.
+absl::flat_hash_map<std::string, absl::flat_hash_map<std::string, uint64_t>>
+GetHistogramCounts(absl::Span<const ::prometheus::MetricFamily> families) {
+  absl::flat_hash_map<std::string, absl::flat_hash_map<std::string, uint64_t>>
+      results;
+  for (const auto& family : families) {
+    if (family.type != ::prometheus::MetricType::Histogram) {
+      continue;
+    }
+    for (const auto& metric : family.metric) {
+      const std::string target =
+          metric.label.empty() ? "" : metric.label.at(0).value;
+      results[target][family.name] = metric.histogram.sample_count;
+    }
+  }
+  return results;
+}
+
+// Returns the summary of each target's power draw, keyed by target label.
+absl::flat_hash_map<std::string, ::prometheus::ClientMetric::Summary>
+GetApowerSummaries(absl::Span<const ::prometheus::MetricFamily> families) {
+  absl::flat_hash_map<std::string, ::prometheus::ClientMetric::Summary>
+      results;
+  for (const auto& family : families) {
+    if (family.name != "shelly_apower_summary") {
+      continue;
+    }
+    for (const auto& metric : family.metric) {
+      results[metric.label.at(0).value] = metric.summary;
+    }
+  }
+  return results;
+}
+
+// Returns each group's sums, keyed by its label as "name=value".
+absl::flat_hash_map<std::string, absl::flat_hash_map<std::string, double>>
+GetGroupSums(absl::Span<const ::prometheus::MetricFamily> families) {
+  absl::flat_hash_map<std::string, absl::flat_hash_map<std::string, double>>
+      results;
+  for (const auto& family : families) {
+    if (!family.name.starts_with("shelly_group_")) {
+      continue;
+    }
+    for (const auto& metric : family.metric) {
+      CHECK(metric.label.size() == 1)
+          << "Expected metric \"" << family.name << "\" to have exactly one "
+          << "label";
+      const auto& label = metric.label.at(0);
+      results[label.name + "=" + label.value][family.name] =
+          metric.gauge.value;
+    }
+  }
+  return results;
+}
+
 }  // namespace
 
-TEST(AddTargets, CreatesMetrics) {
+using RegistryFactory =
+    std::unique_ptr<Registry> (*)(const Registry::Options& options);
+
+class RegistryTest : public ::testing::TestWithParam<RegistryFactory> {
+ protected:
+  std::unique_ptr<Registry> CreateRegistry(
+      const Registry::Options& options = {}) {
+    return GetParam()(options);
+  }
+};
+
+TEST_P(RegistryTest, AddTargetsCreatesMetrics) {
   auto registry = CreateRegistry();
-  EXPECT_TRUE(registry->GetRegistry()->Collect().empty());
+  EXPECT_TRUE(registry->GetCollectable()->Collect().empty());
 
-  EXPECT_TRUE(registry->AddTarget("target_one").ok());
-  ASSERT_FALSE(registry->GetRegistry()->Collect().empty());
-  const size_t families_size = registry->GetRegistry()->Collect().size();
-  EXPECT_EQ(registry->GetRegistry()->Collect().front().metric.size(), 1);
+  const auto target_one = registry->AddTarget("target_one");
+  ASSERT_TRUE(target_one.ok());
+  EXPECT_EQ(*target_one, 0);
+  ASSERT_FALSE(registry->GetCollectable()->Collect().empty());
+  const size_t families_size = registry->GetCollectable()->Collect().size();
+  EXPECT_EQ(registry->GetCollectable()->Collect().front().metric.size(), 1);
 
   // Adding a second target should not increase the number of families, as all
   // targets should have the same metrics. However it should increase the
   // metrics per family by one.
-  EXPECT_TRUE(registry->AddTarget("target_two").ok());
-  EXPECT_EQ(registry->GetRegistry()->Collect().size(), families_size);
-  EXPECT_EQ(registry->GetRegistry()->Collect().front().metric.size(), 2);
+  const auto target_two = registry->AddTarget("target_two");
+  ASSERT_TRUE(target_two.ok());
+  EXPECT_EQ(*target_two, 1);
+  EXPECT_EQ(registry->GetCollectable()->Collect().size(), families_size);
+  EXPECT_EQ(registry->GetCollectable()->Collect().front().metric.size(), 2);
 }
 
-TEST(AddTargets, Duplicate) {
+TEST_P(RegistryTest, AddTargetsDuplicate) {
   auto registry = CreateRegistry();
 
   EXPECT_TRUE(registry->AddTarget("target").ok());
   const auto result = registry->AddTarget("target");
   EXPECT_FALSE(result.ok());
-  EXPECT_EQ(result.code(), absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(result.status().code(), absl::StatusCode::kInvalidArgument);
+}
+
+TEST_P(RegistryTest, FindTarget) {
+  auto registry = CreateRegistry();
+  ASSERT_TRUE(registry->AddTarget("target_one").ok());
+  ASSERT_TRUE(registry->AddTarget("target_two").ok());
+
+  EXPECT_THAT(registry->FindTarget("target_one"), Optional(0));
+  EXPECT_THAT(registry->FindTarget("target_two"), Optional(1));
+  EXPECT_EQ(registry->FindTarget("missing_target"), std::nullopt);
+}
+
+TEST_P(RegistryTest, RemoveTarget) {
+  auto registry = CreateRegistry();
+  const auto target_one = registry->AddTarget("target_one");
+  ASSERT_TRUE(target_one.ok());
+  ASSERT_TRUE(registry->AddTarget("target_two").ok());
+  registry->ErrorCallback(*target_one, absl::InternalError("expected error"));
+  registry->ScrapeStatsCallback(*target_one, ScrapeStats{});
+
+  ASSERT_TRUE(registry->RemoveTarget("target_one").ok());
+  const auto families = registry->GetCollectable()->Collect();
+  EXPECT_THAT(GetMetricsAsDoubles(families),
+              UnorderedElementsAre(Pair("target_two", testing::_)));
+  EXPECT_FALSE(GetHistogramCounts(families).contains("target_one"));
+  EXPECT_EQ(registry->FindTarget("target_one"), std::nullopt);
+  EXPECT_EQ(registry->RemoveTarget("target_one").code(),
+            absl::StatusCode::kNotFound);
+
+  // The removed target's handle is now unknown, and so ignored.
+  registry->ErrorCallback(*target_one, absl::InternalError("expected error"));
+  EXPECT_THAT(GetMetricsAsDoubles(registry->GetCollectable()->Collect()),
+              UnorderedElementsAre(Pair("target_two", testing::_)));
+
+  // Until it's reused for a new target, which starts from scratch.
+  const auto target_three = registry->AddTarget("target_three");
+  ASSERT_TRUE(target_three.ok());
+  EXPECT_EQ(*target_three, *target_one);
+  EXPECT_THAT(GetMetricsAsDoubles(registry->GetCollectable()->Collect()),
+              UnorderedElementsAre(
+                  Pair("target_two", testing::_),
+                  Pair("target_three",
+                       Contains(Pair("shelly_error_counter", DoubleEq(0.0))))));
+  EXPECT_THAT(GetHistogramCounts(registry->GetCollectable()->Collect()),
+              Contains(Pair("target_three",
+                            Contains(Pair("shelly_scrape_seconds", 0)))));
 }
 
-TEST(ErrorCallback, NoTargets) {
+TEST_P(RegistryTest, ErrorCallbackNoTargets) {
   auto registry = CreateRegistry();
-  registry->ErrorCallback("missing_target",
+  registry->ErrorCallback(kUnknownHandle,
                           absl::InternalError("expected error"));
 }
 
-TEST(ErrorCallback, UnknownTarget) {
+TEST_P(RegistryTest, ErrorCallbackUnknownTarget) {
   auto registry = CreateRegistry();
   ASSERT_TRUE(registry->AddTarget("target").ok());
 
-  registry->ErrorCallback("missing_target",
+  registry->ErrorCallback(kUnknownHandle,
                           absl::InternalError("expected error"));
   EXPECT_THAT(
-      GetMetricsAsDoubles(registry->GetRegistry()->Collect()),
+      GetMetricsAsDoubles(registry->GetCollectable()->Collect()),
       UnorderedElementsAre(Pair(
           "target", Contains(Pair("shelly_error_counter", DoubleEq(0.0))))));
 }
 
-TEST(ErrorCallback, UpdatesMetric) {
+TEST_P(RegistryTest, ErrorCallbackUpdatesMetric) {
   auto registry = CreateRegistry();
 
   // Create two targets and confirm that their error count is zero.
-  ASSERT_TRUE(registry->AddTarget("target_one").ok());
+  const auto target_one = registry->AddTarget("target_one");
+  ASSERT_TRUE(target_one.ok());
   ASSERT_TRUE(registry->AddTarget("target_two").ok());
-  EXPECT_THAT(GetMetricsAsDoubles(registry->GetRegistry()->Collect()),
+  EXPECT_THAT(GetMetricsAsDoubles(registry->GetCollectable()->Collect()),
               UnorderedElementsAre(
                   Pair("target_one",
                        Contains(Pair("shelly_error_counter", DoubleEq(0.0)))),
@@ -99,8 +247,8 @@ TEST(ErrorCallback, UpdatesMetric) {
 
   // Call error callback for the first target and ensure that its error count
   // increments, but the second target's error count remains unchanged.
-  registry->ErrorCallback("target_one", absl::InternalError("expected error"));
-  EXPECT_THAT(GetMetricsAsDoubles(registry->GetRegistry()->Collect()),
+  registry->ErrorCallback(*target_one, absl::InternalError("expected error"));
+  EXPECT_THAT(GetMetricsAsDoubles(registry->GetCollectable()->Collect()),
               UnorderedElementsAre(
                   Pair("target_one",
                        Contains(Pair("shelly_error_counter", DoubleEq(1.0)))),
@@ -108,34 +256,52 @@ TEST(ErrorCallback, UpdatesMetric) {
                        Contains(Pair("shelly_error_counter", DoubleEq(0.0))))));
 }
 
-TEST(SuccessCallback, NoTargets) {
+TEST_P(RegistryTest, ErrorCallbackCountsTimeouts) {
   auto registry = CreateRegistry();
-  registry->SuccessCallback("missing_target", {.voltage = 120.0});
+  const auto target = registry->AddTarget("target");
+  ASSERT_TRUE(target.ok());
+
+  // Timeouts count as errors too, but other errors aren't timeouts.
+  registry->ErrorCallback(*target, absl::InternalError("expected error"));
+  registry->ErrorCallback(*target,
+                          absl::DeadlineExceededError("expected timeout"));
+  EXPECT_THAT(
+      GetMetricsAsDoubles(registry->GetCollectable()->Collect()),
+      UnorderedElementsAre(Pair(
+          "target",
+          AllOf(Contains(Pair("shelly_error_counter", DoubleEq(2.0))),
+                Contains(Pair("shelly_timeout_counter", DoubleEq(1.0)))))));
 }
 
-TEST(SuccessCallback, UnknownTarget) {
+TEST_P(RegistryTest, SuccessCallbackNoTargets) {
+  auto registry = CreateRegistry();
+  registry->SuccessCallback(kUnknownHandle, {.voltage = 120.0});
+}
+
+TEST_P(RegistryTest, SuccessCallbackUnknownTarget) {
   auto registry = CreateRegistry();
   ASSERT_TRUE(registry->AddTarget("target").ok());
 
-  registry->SuccessCallback("missing_target", {.voltage = 120.0});
-  EXPECT_THAT(GetMetricsAsDoubles(registry->GetRegistry()->Collect()),
+  registry->SuccessCallback(kUnknownHandle, {.voltage = 120.0});
+  EXPECT_THAT(GetMetricsAsDoubles(registry->GetCollectable()->Collect()),
               UnorderedElementsAre(Pair(
                   "target",
                   AllOf(Contains(Pair("shelly_success_counter", DoubleEq(0.0))),
                         Contains(Pair("shelly_voltage", DoubleEq(0.0)))))));
 }
 
-TEST(SuccessCallback, UpdateMetrics) {
+TEST_P(RegistryTest, SuccessCallbackUpdateMetrics) {
   auto registry = CreateRegistry();
-  ASSERT_TRUE(registry->AddTarget("target_one").ok());
+  const auto target_one = registry->AddTarget("target_one");
+  ASSERT_TRUE(target_one.ok());
   ASSERT_TRUE(registry->AddTarget("target_two").ok());
 
   // Update the voltage for the first target and confirm it's applied without
   // affecting the second target.
-  registry->SuccessCallback("target_one", {.voltage = 120.0});
+  registry->SuccessCallback(*target_one, {.voltage = 120.0});
 
   EXPECT_THAT(
-      GetMetricsAsDoubles(registry->GetRegistry()->Collect()),
+      GetMetricsAsDoubles(registry->GetCollectable()->Collect()),
       UnorderedElementsAre(
           Pair("target_one",
                AllOf(Contains(Pair("shelly_success_counter", DoubleEq(1.0))),
@@ -143,4 +309,537 @@ TEST(SuccessCallback, UpdateMetrics) {
           Pair("target_two",
                AllOf(Contains(Pair("shelly_success_counter", DoubleEq(0.0))),
                      Contains(Pair("shelly_voltage", DoubleEq(0.0)))))));
-}
\ No newline at end of file
+}
+
+TEST_P(RegistryTest, ConsumeAppliesResults) {
+  auto registry = CreateRegistry();
+  const auto target_one = registry->AddTarget("target_one");
+  ASSERT_TRUE(target_one.ok());
+  const auto target_two = registry->AddTarget("target_two");
+  ASSERT_TRUE(target_two.ok());
+
+  const PollResult results[] = {
+      {.handle = *target_one,
+       .time = absl::FromUnixSeconds(1000),
+       .metrics = ::shelly::Metrics{.voltage = 120.0}},
+      {.handle = *target_two,
+       .time = absl::FromUnixSeconds(1001),
+       .metrics = absl::DeadlineExceededError("expected timeout")},
+      {.handle = kUnknownHandle,
+       .time = absl::FromUnixSeconds(1002),
+       .metrics = ::shelly::Metrics{.voltage = 240.0}},
+  };
+  registry->Consume(results);
+
+  EXPECT_THAT(
+      GetMetricsAsDoubles(registry->GetCollectable()->Collect()),
+      UnorderedElementsAre(
+          Pair("target_one",
+               AllOf(Contains(Pair("shelly_success_counter", DoubleEq(1.0))),
+                     Contains(Pair("shelly_voltage", DoubleEq(120.0))),
+                     Contains(Pair("shelly_last_updated", DoubleEq(1000.0))))),
+          Pair("target_two",
+               AllOf(Contains(Pair("shelly_error_counter", DoubleEq(1.0))),
+                     Contains(Pair("shelly_timeout_counter", DoubleEq(1.0))),
+                     Contains(Pair("shelly_voltage", DoubleEq(0.0)))))));
+}
+
+TEST_P(RegistryTest, RestoresTargetState) {
+  auto registry = CreateRegistry();
+  ASSERT_TRUE(registry->AddTarget("target_one").ok());
+  ASSERT_TRUE(registry->AddTarget("target_two").ok());
+
+  ASSERT_TRUE(registry
+                  ->RestoreTargetState({
+                      .name = "target_one",
+                      .success_queries = 5,
+                      .error_queries = 2,
+                      .timeout_queries = 1,
+                      .metrics = {.voltage = 120.0},
+                      .last_updated = 1000,
+                      .energy_wh = 5.0,
+                  })
+                  .ok());
+  // A target that was never polled successfully only has its counters
+  // restored.
+  ASSERT_TRUE(registry
+                  ->RestoreTargetState({
+                      .name = "target_two",
+                      .error_queries = 3,
+                      .metrics = {.voltage = 240.0},
+                  })
+                  .ok());
+  EXPECT_EQ(registry->RestoreTargetState({.name = "missing_target"}).code(),
+            absl::StatusCode::kNotFound);
+
+  EXPECT_THAT(
+      GetMetricsAsDoubles(registry->GetCollectable()->Collect()),
+      UnorderedElementsAre(
+          Pair("target_one",
+               AllOf(Contains(Pair("shelly_success_counter", DoubleEq(5.0))),
+                     Contains(Pair("shelly_error_counter", DoubleEq(2.0))),
+                     Contains(Pair("shelly_timeout_counter", DoubleEq(1.0))),
+                     Contains(Pair("shelly_voltage", DoubleEq(120.0))),
+                     Contains(Pair("shelly_last_updated", DoubleEq(1000.0))),
+                     Contains(Pair("shelly_energy_wh_total", DoubleEq(5.0))))),
+          Pair("target_two",
+               AllOf(Contains(Pair("shelly_error_counter", DoubleEq(3.0))),
+                     Contains(Pair("shelly_voltage", DoubleEq(0.0)))))));
+
+  // The restored state is saved again, along with any later updates.
+  registry->Consume(std::vector<PollResult>{{
+      .handle = *registry->FindTarget("target_one"),
+      .time = absl::FromUnixSeconds(2000),
+      .metrics = ::shelly::Metrics{.voltage = 121.0},
+  }});
+  const auto states = registry->GetTargetStates();
+  ASSERT_EQ(states.size(), 2);
+  const auto& state = states[0].name == "target_one" ? states[0] : states[1];
+  EXPECT_EQ(state.name, "target_one");
+  EXPECT_EQ(state.success_queries, 6);
+  EXPECT_EQ(state.error_queries, 2);
+  EXPECT_EQ(state.timeout_queries, 1);
+  EXPECT_EQ(state.metrics.voltage, 121.0);
+  EXPECT_EQ(state.last_updated, 2000);
+  EXPECT_EQ(state.energy_wh, 5.0);
+}
+
+TEST_P(RegistryTest, IntegratesEnergy) {
+  auto registry = CreateRegistry({.energy_max_gap = absl::Minutes(1)});
+  const auto target = registry->AddTarget("target");
+  ASSERT_TRUE(target.ok());
+  const auto reading = [&](int64_t seconds, double apower) {
+    return PollResult{
+        .handle = *target,
+        .time = absl::FromUnixSeconds(seconds),
+        .metrics = ::shelly::Metrics{.apower = apower},
+    };
+  };
+  const auto energy = [&] {
+    return GetMetricsAsDoubles(registry->GetCollectable()->Collect())
+        .at("target")
+        .at("shelly_energy_wh_total");
+  };
+
+  // Half a minute ramping from 100W to 200W, then a failed poll before
+  // another half minute at 200W.
+  registry->Consume(std::vector<PollResult>{
+      reading(1000, 100.0),
+      reading(1030, 200.0),
+      {.handle = *target,
+       .time = absl::FromUnixSeconds(1045),
+       .metrics = absl::DeadlineExceededError("expected timeout")},
+      reading(1060, 200.0),
+  });
+  EXPECT_THAT(energy(), DoubleNear(150.0 * 30 / 3600 + 200.0 * 30 / 3600,
+                                   1e-9));
+
+  // The power isn't integrated across a gap longer than the maximum, nor
+  // back to an earlier reading.
+  registry->Consume(std::vector<PollResult>{
+      reading(1200, 300.0),
+      reading(1236, 300.0),
+      reading(1230, 1000.0),
+  });
+  EXPECT_THAT(energy(),
+              DoubleNear(150.0 * 30 / 3600 + 200.0 * 30 / 3600 + 300.0 / 100,
+                         1e-9));
+}
+
+TEST_P(RegistryTest, SummarisesPowerDraw) {
+  absl::Time now = absl::FromUnixSeconds(1005);
+  auto registry = CreateRegistry({
+      .quantile_window = absl::Seconds(10),
+      .time_func = [&now] { return now; },
+  });
+  const auto target = registry->AddTarget("target");
+  ASSERT_TRUE(target.ok());
+
+  // A steady draw with a short spike, polled every tenth of a second.
+  std::vector<PollResult> results;
+  for (int i = 0; i < 100; ++i) {
+    results.push_back({
+        .handle = *target,
+        .time = absl::FromUnixSeconds(1000) + i * absl::Milliseconds(100),
+        .metrics = ::shelly::Metrics{.apower = i < 98 ? 100.0 : 2000.0},
+    });
+  }
+  registry->Consume(results);
+
+  auto summary =
+      GetApowerSummaries(registry->GetCollectable()->Collect())["target"];
+  EXPECT_EQ(summary.sample_count, 100);
+  EXPECT_THAT(summary.sample_sum, DoubleEq(98 * 100.0 + 2 * 2000.0));
+  ASSERT_EQ(summary.quantile.size(), 4);
+  EXPECT_THAT(summary.quantile[0].value, DoubleNear(100.0, 2.0));
+  EXPECT_THAT(summary.quantile[1].value, DoubleNear(100.0, 2.0));
+  EXPECT_THAT(summary.quantile[2].value, DoubleNear(2000.0, 40.0));
+  EXPECT_THAT(summary.quantile[3].value, DoubleEq(2000.0));
+
+  // Still reported through the next window, but not the one after.
+  now += absl::Seconds(10);
+  summary = GetApowerSummaries(registry->GetCollectable()->Collect())["target"];
+  EXPECT_THAT(summary.quantile[3].value, DoubleEq(2000.0));
+  now += absl::Seconds(10);
+  summary = GetApowerSummaries(registry->GetCollectable()->Collect())["target"];
+  EXPECT_EQ(summary.sample_count, 100);
+  EXPECT_TRUE(std::isnan(summary.quantile[0].value));
+  EXPECT_TRUE(std::isnan(summary.quantile[3].value));
+
+  // A sample in a new window starts the quantiles afresh.
+  registry->Consume(std::vector<PollResult>{{
+      .handle = *target,
+      .time = now,
+      .metrics = ::shelly::Metrics{.apower = 50.0},
+  }});
+  summary = GetApowerSummaries(registry->GetCollectable()->Collect())["target"];
+  EXPECT_EQ(summary.sample_count, 101);
+  EXPECT_THAT(summary.quantile[0].value, DoubleNear(50.0, 1.0));
+  EXPECT_THAT(summary.quantile[3].value, DoubleEq(50.0));
+}
+
+TEST_P(RegistryTest, SumsGroups) {
+  auto registry = CreateRegistry();
+  const auto kettle = registry->AddTarget("kettle");
+  const auto fridge = registry->AddTarget("fridge");
+  const auto heater = registry->AddTarget("heater");
+  ASSERT_TRUE(kettle.ok());
+  ASSERT_TRUE(fridge.ok());
+  ASSERT_TRUE(heater.ok());
+  ASSERT_TRUE(registry
+                  ->SetTargetGroups("kettle",
+                                    {{"room", "Kitchen"}, {"circuit", "B1"}})
+                  .ok());
+  ASSERT_TRUE(registry->SetTargetGroups("fridge", {{"room", "Kitchen"}}).ok());
+  EXPECT_EQ(registry->SetTargetGroups("unknown", {{"room", "Kitchen"}}).code(),
+            absl::StatusCode::kNotFound);
+  const auto sums = [&] {
+    return GetGroupSums(registry->GetCollectable()->Collect());
+  };
+
+  // Groups are exported from when their first target joins, with zero sums
+  // until their targets are polled.
+  EXPECT_THAT(sums(), UnorderedElementsAre(
+                          Pair("room=Kitchen",
+                               UnorderedElementsAre(
+                                   Pair("shelly_group_apower_sum", 0.0),
+                                   Pair("shelly_group_current_sum", 0.0))),
+                          Pair("circuit=B1", SizeIs(2))));
+
+  registry->Consume(std::vector<PollResult>{
+      {.handle = *kettle,
+       .metrics = ::shelly::Metrics{.apower = 2000.0, .current = 8.0}},
+      {.handle = *fridge,
+       .metrics = ::shelly::Metrics{.apower = 100.0, .current = 0.5}},
+      {.handle = *heater,
+       .metrics = ::shelly::Metrics{.apower = 1500.0, .current = 6.0}},
+  });
+  EXPECT_THAT(sums()["room=Kitchen"]["shelly_group_apower_sum"],
+              DoubleEq(2100.0));
+  EXPECT_THAT(sums()["room=Kitchen"]["shelly_group_current_sum"],
+              DoubleEq(8.5));
+  EXPECT_THAT(sums()["circuit=B1"]["shelly_group_apower_sum"],
+              DoubleEq(2000.0));
+
+  // Each reading replaces the target's previous one in the sums, while a
+  // failed poll leaves it in place.
+  registry->Consume(std::vector<PollResult>{
+      {.handle = *kettle,
+       .metrics = ::shelly::Metrics{.apower = 1800.0, .current = 7.5}},
+      {.handle = *fridge, .metrics = absl::UnavailableError("unreachable")},
+  });
+  EXPECT_THAT(sums()["room=Kitchen"]["shelly_group_apower_sum"],
+              DoubleEq(1900.0));
+  EXPECT_THAT(sums()["circuit=B1"]["shelly_group_current_sum"],
+              DoubleEq(7.5));
+
+  // A target moving groups takes its last reading with it.
+  ASSERT_TRUE(registry->SetTargetGroups("fridge", {{"room", "Garage"}}).ok());
+  EXPECT_THAT(sums()["room=Kitchen"]["shelly_group_apower_sum"],
+              DoubleEq(1800.0));
+  EXPECT_THAT(sums()["room=Garage"]["shelly_group_apower_sum"],
+              DoubleEq(100.0));
+
+  // Groups are dropped along with their last target.
+  ASSERT_TRUE(registry->RemoveTarget("kettle").ok());
+  EXPECT_THAT(sums(), UnorderedElementsAre(Pair("room=Garage", SizeIs(2))));
+  ASSERT_TRUE(registry->SetTargetGroups("fridge", {}).ok());
+  EXPECT_THAT(sums(), IsEmpty());
+}
+
+TEST_P(RegistryTest, SumsGroupsWithoutDrift) {
+  auto registry = CreateRegistry();
+  const auto kettle = registry->AddTarget("kettle");
+  const auto fridge = registry->AddTarget("fridge");
+  ASSERT_TRUE(kettle.ok());
+  ASSERT_TRUE(fridge.ok());
+  ASSERT_TRUE(registry->SetTargetGroups("kettle", {{"room", "Kitchen"}}).ok());
+  ASSERT_TRUE(registry->SetTargetGroups("fridge", {{"room", "Kitchen"}}).ok());
+
+  // Changes that don't add up exactly in floating point leave the sums equal
+  // to the sum of the last readings.
+  for (int i = 0; i < 10000; ++i) {
+    registry->Consume(std::vector<PollResult>{
+        {.handle = *kettle,
+         .metrics = ::shelly::Metrics{.apower = 0.1 * (i % 7),
+                                      .current = 0.3 * (i % 11)}},
+        {.handle = *fridge,
+         .metrics = ::shelly::Metrics{.apower = 100.7 + 0.01 * (i % 13)}},
+    });
+  }
+  registry->Consume(std::vector<PollResult>{
+      {.handle = *kettle,
+       .metrics = ::shelly::Metrics{.apower = 0.0, .current = 0.0}},
+      {.handle = *fridge, .metrics = ::shelly::Metrics{.apower = 100.7}},
+  });
+  auto sums = GetGroupSums(registry->GetCollectable()->Collect());
+  EXPECT_EQ(sums["room=Kitchen"]["shelly_group_apower_sum"], 100.7);
+  EXPECT_EQ(sums["room=Kitchen"]["shelly_group_current_sum"], 0.0);
+
+  // A group that all its targets left starts again from zero.
+  ASSERT_TRUE(registry->SetTargetGroups("fridge", {}).ok());
+  ASSERT_TRUE(registry->SetTargetGroups("kettle", {}).ok());
+  EXPECT_THAT(GetGroupSums(registry->GetCollectable()->Collect()), IsEmpty());
+  ASSERT_TRUE(registry->SetTargetGroups("kettle", {{"room", "Kitchen"}}).ok());
+  sums = GetGroupSums(registry->GetCollectable()->Collect());
+  EXPECT_EQ(sums["room=Kitchen"]["shelly_group_apower_sum"], 0.0);
+  EXPECT_EQ(sums["room=Kitchen"]["shelly_group_current_sum"], 0.0);
+}
+
+TEST_P(RegistryTest, SumsRestoredReadingsInGroups) {
+  auto registry = CreateRegistry();
+  ASSERT_TRUE(registry->AddTarget("fridge").ok());
+  ASSERT_TRUE(registry->SetTargetGroups("fridge", {{"room", "Kitchen"}}).ok());
+  ASSERT_TRUE(registry
+                  ->RestoreTargetState({
+                      .name = "fridge",
+                      .metrics = {.apower = 100.0, .current = 0.5},
+                      .last_updated = 1000,
+                  })
+                  .ok());
+
+  const auto sums = GetGroupSums(registry->GetCollectable()->Collect());
+  EXPECT_THAT(sums.at("room=Kitchen").at("shelly_group_apower_sum"),
+              DoubleEq(100.0));
+  EXPECT_THAT(sums.at("room=Kitchen").at("shelly_group_current_sum"),
+              DoubleEq(0.5));
+}
+
+TEST_P(RegistryTest, ScrapeStatsCallbackUpdatesMetrics) {
+  auto registry = CreateRegistry();
+  const auto target = registry->AddTarget("target");
+  ASSERT_TRUE(target.ok());
+
+  registry->ScrapeStatsCallback(*target, {.reused_connection = false});
+  registry->ScrapeStatsCallback(*target, {.reused_connection = true});
+  registry->ScrapeStatsCallback(*target, {.reused_connection = true});
+  registry->ScrapeStatsCallback(kUnknownHandle, {.reused_connection = true});
+
+  EXPECT_THAT(
+      GetMetricsAsDoubles(registry->GetCollectable()->Collect()),
+      UnorderedElementsAre(Pair(
+          "target",
+          AllOf(Contains(Pair("shelly_reconnect_counter", DoubleEq(1.0))),
+                Contains(Pair("shelly_connection_reuse_counter",
+                              DoubleEq(2.0)))))));
+}
+
+TEST_P(RegistryTest, ScrapeStatsCallbackObservesTimings) {
+  auto registry = CreateRegistry();
+  const auto target = registry->AddTarget("target");
+  ASSERT_TRUE(target.ok());
+
+  registry->ScrapeStatsCallback(*target,
+                                {.name_lookup_time = absl::Milliseconds(1),
+                                 .connect_time = absl::Milliseconds(2),
+                                 .first_byte_time = absl::Milliseconds(10),
+                                 .total_time = absl::Milliseconds(11)});
+
+  EXPECT_THAT(GetHistogramCounts(registry->GetCollectable()->Collect()),
+              UnorderedElementsAre(Pair(
+                  "target", UnorderedElementsAre(
+                                Pair("shelly_dns_seconds", 1),
+                                Pair("shelly_connect_seconds", 1),
+                                Pair("shelly_first_byte_seconds", 1),
+                                Pair("shelly_scrape_seconds", 1),
+                                Pair("shelly_parse_seconds", 0)))));
+}
+
+TEST_P(RegistryTest, PollTimingsCallbackObservesTimings) {
+  auto registry = CreateRegistry();
+  const auto target = registry->AddTarget("target");
+  ASSERT_TRUE(target.ok());
+
+  // Only polls that overran, and that had a response to parse, are observed
+  // in the overrun and parse time histograms.
+  registry->PollTimingsCallback(*target,
+                                {.scheduling_lag = absl::Milliseconds(1),
+                                 .duration = absl::Milliseconds(20),
+                                 .parse_time = absl::Microseconds(5)});
+  registry->PollTimingsCallback(*target,
+                                {.scheduling_lag = absl::Milliseconds(1),
+                                 .duration = absl::Seconds(20),
+                                 .overrun = absl::Seconds(5)});
+
+  const auto counts = GetHistogramCounts(registry->GetCollectable()->Collect());
+  EXPECT_THAT(counts,
+              Contains(Pair(
+                  "", UnorderedElementsAre(
+                          Pair("shelly_exporter_scheduling_lag_seconds", 2),
+                          Pair("shelly_exporter_poll_duration_seconds", 2),
+                          Pair("shelly_exporter_poll_overrun_seconds", 1)))));
+  EXPECT_THAT(counts,
+              Contains(Pair("target",
+                            Contains(Pair("shelly_parse_seconds", 1)))));
+}
+
+TEST_P(RegistryTest, CircuitStateCallbackUpdatesMetric) {
+  auto registry = CreateRegistry();
+  const auto target_one = registry->AddTarget("target_one");
+  ASSERT_TRUE(target_one.ok());
+  ASSERT_TRUE(registry->AddTarget("target_two").ok());
+
+  registry->CircuitStateCallback(*target_one, CircuitBreaker::State::kOpen);
+  registry->CircuitStateCallback(kUnknownHandle,
+                                 CircuitBreaker::State::kOpen);
+  EXPECT_THAT(GetMetricsAsDoubles(registry->GetCollectable()->Collect()),
+              UnorderedElementsAre(
+                  Pair("target_one",
+                       Contains(Pair("shelly_circuit_state", DoubleEq(2.0)))),
+                  Pair("target_two",
+                       Contains(Pair("shelly_circuit_state", DoubleEq(0.0))))));
+}
+
+TEST_P(RegistryTest, PoolStatsCallbackUpdatesMetrics) {
+  auto registry = CreateRegistry();
+  ASSERT_TRUE(registry->AddTarget("target").ok());
+  EXPECT_TRUE(GetExporterMetricsAsDoubles(
+                  registry->GetCollectable()->Collect())
+                  .empty());
+
+  registry->PoolStatsCallback({
+      .num_workers = 4,
+      .busy_workers = 1,
+      .queue_depth = 0,
+      .peak_queue_depth = 3,
+      .utilisation = 0.5,
+  });
+  EXPECT_THAT(
+      GetExporterMetricsAsDoubles(registry->GetCollectable()->Collect()),
+      UnorderedElementsAre(
+          Pair("shelly_exporter_workers", DoubleEq(4.0)),
+          Pair("shelly_exporter_queue_depth", DoubleEq(3.0)),
+          Pair("shelly_exporter_worker_utilisation", DoubleEq(0.5))));
+}
+
+TEST(FlatRegistry, MatchesRegistryFamilies) {
+  // Both implementations should export the same families, so that they can
+  // be swapped without changing any dashboards.
+  auto registry = ::CreateRegistry();
+  auto flat_registry = ::CreateFlatRegistry();
+  for (auto* r : {registry.get(), flat_registry.get()}) {
+    const auto target = r->AddTarget("target");
+    ASSERT_TRUE(target.ok());
+    r->SuccessCallback(*target, {.voltage = 120.0});
+    r->PoolStatsCallback({.num_workers = 4});
+    r->PollTimingsCallback(*target, {.duration = absl::Seconds(1)});
+  }
+
+  const auto families = registry->GetCollectable()->Collect();
+  const auto flat_families = flat_registry->GetCollectable()->Collect();
+  absl::flat_hash_map<std::string, std::string> help;
+  for (const auto& family : families) {
+    help[family.name] = family.help;
+  }
+  absl::flat_hash_map<std::string, std::string> flat_help;
+  for (const auto& family : flat_families) {
+    flat_help[family.name] = family.help;
+  }
+  EXPECT_EQ(flat_help, help);
+}
+
+TEST_P(RegistryTest, CollectsConsistentSamples) {
+  constexpr int kNumUpdates = 20000;
+  auto registry = CreateRegistry();
+  const auto target = registry->AddTarget("target");
+  ASSERT_TRUE(target.ok());
+
+  // Every reading of an update is the same, so a collection that mixed two
+  // updates would see different readings.
+  std::atomic<bool> done = false;
+  std::thread writer([&] {
+    for (int i = 1; i <= kNumUpdates; ++i) {
+      const double value = i;
+      registry->SuccessCallback(*target, {.apower = value,
+                                          .voltage = value,
+                                          .current = value,
+                                          .temp_c = value,
+                                          .temp_f = value});
+    }
+    done = true;
+  });
+  int num_torn = 0;
+  while (!done) {
+    const auto metrics = GetMetricsAsDoubles(
+        registry->GetCollectable()->Collect())["target"];
+    const double voltage = metrics.at("shelly_voltage");
+    for (const auto* name : {"shelly_apower", "shelly_current",
+                             "shelly_temp_c", "shelly_temp_f"}) {
+      if (metrics.at(name) != voltage) {
+        ++num_torn;
+      }
+    }
+  }
+  writer.join();
+  EXPECT_EQ(num_torn, 0);
+}
+
+TEST(FlatRegistry, CollectsWhileTargetsChange) {
+  constexpr int kNumChanges = 2000;
+  auto registry = ::CreateFlatRegistry();
+  ASSERT_TRUE(registry->AddTarget("kept").ok());
+
+  // Targets are added and removed while collecting, reusing rows and growing
+  // the columns. Each collection should see every family with the same
+  // targets, and the removed targets' values never under another's label.
+  std::atomic<bool> done = false;
+  std::thread writer([&] {
+    for (int i = 0; i < kNumChanges; ++i) {
+      const std::string name = absl::StrCat("target_", i);
+      const auto handle = registry->AddTarget(name);
+      CHECK(handle.ok());
+      registry->ErrorCallback(*handle, absl::InternalError("expected error"));
+      if (i % 3 != 0) {
+        CHECK(registry->RemoveTarget(name).ok());
+      }
+    }
+    done = true;
+  });
+  while (!done) {
+    const auto families = registry->GetCollectable()->Collect();
+    std::optional<size_t> num_targets;
+    for (const auto& family : families) {
+      if (family.name.starts_with("shelly_group_") ||
+          family.name.starts_with("shelly_exporter_")) {
+        continue;
+      }
+      if (!num_targets.has_value()) {
+        num_targets = family.metric.size();
+      }
+      EXPECT_EQ(family.metric.size(), *num_targets) << family.name;
+    }
+    for (const auto& [name, metrics] : GetMetricsAsDoubles(families)) {
+      if (name != "kept") {
+        EXPECT_EQ(metrics.at("shelly_error_counter"), 1.0) << name;
+      }
+    }
+  }
+  writer.join();
+  EXPECT_THAT(GetMetricsAsDoubles(registry->GetCollectable()->Collect()),
+              SizeIs(1 + (kNumChanges + 2) / 3));
+}
+
+INSTANTIATE_TEST_SUITE_P(Prometheus, RegistryTest,
+                         ::testing::Values(&::CreateRegistry));
+INSTANTIATE_TEST_SUITE_P(Flat, RegistryTest,
+                         ::testing::Values(&::CreateFlatRegistry));
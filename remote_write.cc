@@ -0,0 +1,602 @@
+#include "remote_write.h"
+
+#include <algorithm>
+#include <array>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/log/log.h"
+#include "absl/status/status.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/strip.h"
+#include "absl/strings/substitute.h"
+#include "absl/time/clock.h"
+#include "curl/curl.h"
+#include "registry_internal.h"
+#include "remote_write_internal.h"
+#include "shelly.h"
+#include "snappy.h"
+#include "status_macros/status_macros.h"
+
+namespace {
+
+using ::remote_write_internal::EncodeWriteRequest;
+using ::remote_write_internal::Label;
+using ::remote_write_internal::TimeSeries;
+
+struct Reading final {
+  double ::shelly::Metrics::*field;
+  const char* name;
+};
+
+// The same series as the registries' gauges.
+inline constexpr std::array<Reading, 5> kReadings = {{
+    {&::shelly::Metrics::voltage, "shelly_voltage"},
+    {&::shelly::Metrics::apower, "shelly_apower"},
+    {&::shelly::Metrics::current, "shelly_current"},
+    {&::shelly::Metrics::temp_c, "shelly_temp_c"},
+    {&::shelly::Metrics::temp_f, "shelly_temp_f"},
+}};
+
+inline constexpr std::string_view kSpillSuffix = ".rw";
+inline constexpr std::string_view kTempSuffix = ".tmp";
+
+struct QueuedPoll final {
+  // Shared by every poll of the target, so that a removed target's queued
+  // polls keep their label.
+  std::shared_ptr<const std::string> name;
+  int64_t timestamp_ms;
+  ::shelly::Metrics metrics;
+  // When the poll was pushed to its shard's queue.
+  absl::Time queued;
+};
+
+// A compressed request, numbered in the order that its polls were queued.
+struct Batch final {
+  uint64_t sequence;
+  std::string payload;
+  // True if read back from a spill file, which is deleted once sent.
+  bool spilled = false;
+};
+
+// Encodes a series for each of the targets' readings, with the samples in
+// the order they were queued.
+std::string EncodeBatch(absl::Span<const QueuedPoll> polls) {
+  std::vector<TimeSeries> series;
+  // Maps each target's name to the index of its first series.
+  absl::flat_hash_map<const std::string*, size_t> first_series;
+  for (const auto& poll : polls) {
+    const auto [it, inserted] =
+        first_series.emplace(poll.name.get(), series.size());
+    if (inserted) {
+      for (const auto& reading : kReadings) {
+        // Labels are sorted by name, and "__name__" sorts first.
+        series.push_back({.labels = {
+                              {.name = "__name__", .value = reading.name},
+                              {.name = registry_internal::kTargetLabel,
+                               .value = *poll.name},
+                          }});
+      }
+    }
+    for (size_t i = 0; i < kReadings.size(); ++i) {
+      series[it->second + i].samples.push_back({
+          .value = poll.metrics.*kReadings[i].field,
+          .timestamp_ms = poll.timestamp_ms,
+      });
+    }
+  }
+  std::string request;
+  EncodeWriteRequest(series, request);
+  std::string compressed(snappy::MaxCompressedLength(request.size()), '\0');
+  size_t compressed_size = 0;
+  snappy::RawCompress(request.data(), request.size(), compressed.data(),
+                      &compressed_size);
+  compressed.resize(compressed_size);
+  return compressed;
+}
+
+size_t DiscardBody(char*, size_t size, size_t nitems, void*) {
+  return size * nitems;
+}
+
+// Returns a status that's unavailable if the request should be retried.
+absl::Status CheckResponse(CURLcode code, long http_code) {
+  if (code != CURLE_OK) {
+    return absl::UnavailableError(absl::StrCat(
+        "Remote write request failed: ", curl_easy_strerror(code)));
+  }
+  if (http_code >= 200 && http_code < 300) {
+    return absl::OkStatus();
+  }
+  const std::string message =
+      absl::Substitute("Remote write endpoint returned HTTP $0", http_code);
+  // Too many requests is the only client error worth retrying, as any other
+  // would be returned again.
+  if (http_code >= 500 || http_code == 429) {
+    return absl::UnavailableError(message);
+  }
+  return absl::InvalidArgumentError(message);
+}
+
+class Shard final {
+ public:
+  Shard(size_t index, const RemoteWriter::Options& options)
+      : index_(index),
+        options_(options),
+        max_spill_bytes_(options.max_spill_bytes / options.num_shards),
+        curl_(curl_easy_init()) {
+    for (const char* header : {
+             "Content-Encoding: snappy",
+             "Content-Type: application/x-protobuf",
+             "X-Prometheus-Remote-Write-Version: 0.1.0",
+         }) {
+      headers_ = curl_slist_append(headers_, header);
+    }
+  }
+
+  ~Shard() {
+    curl_slist_free_all(headers_);
+    curl_easy_cleanup(curl_);
+  }
+
+  // Takes over a spill file left by a previous run. Must be called before
+  // Start.
+  void AddSpillFile(uint64_t sequence, size_t size) {
+    spilled_.emplace(sequence, size);
+    spilled_bytes_ += size;
+    next_sequence_ = std::max(next_sequence_, sequence + 1);
+  }
+
+  void Start() {
+    thread_ = std::thread([this] { Run(); });
+  }
+
+  // Sends or spills everything queued, then stops the thread. Does nothing if
+  // the shard was never started.
+  void Stop() {
+    if (!thread_.joinable()) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    cv_.notify_all();
+    thread_.join();
+  }
+
+  void Push(std::vector<QueuedPoll>& polls) {
+    if (polls.empty()) {
+      return;
+    }
+    size_t num_dropped = 0;
+    bool notify;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      const absl::Time now = absl::Now();
+      for (auto& poll : polls) {
+        poll.queued = now;
+        if (queue_.size() == options_.queue_capacity) {
+          queue_.pop_front();
+          ++num_dropped;
+        }
+        queue_.push_back(std::move(poll));
+      }
+      notify = queue_.size() == polls.size() ||
+               queue_.size() >= options_.max_polls_per_send;
+    }
+    polls.clear();
+    if (num_dropped > 0) {
+      LOG_EVERY_N_SEC(WARNING, 10)
+          << "Remote write shard " << index_ << " is full, dropped "
+          << num_dropped << " polls";
+    }
+    if (notify) {
+      cv_.notify_all();
+    }
+  }
+
+ private:
+  const size_t index_;
+  const RemoteWriter::Options& options_;
+  const size_t max_spill_bytes_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<QueuedPoll> queue_;
+  bool stopping_ = false;
+
+  // The rest are only used by the shard's thread, once started.
+  CURL* const curl_;
+  curl_slist* headers_ = nullptr;
+  uint64_t next_sequence_ = 0;
+  // Sizes of the spill files, keyed and so ordered by sequence number.
+  std::map<uint64_t, size_t> spilled_;
+  size_t spilled_bytes_ = 0;
+  std::thread thread_;
+
+  void Run() {
+    while (auto batch = NextBatch()) {
+      if (!Send(*batch)) {
+        // Stopped while the endpoint was failing, so keep what's left for
+        // the next run. The batch keeps its sequence number, so is still
+        // sent first.
+        if (!batch->spilled) {
+          Spill(*batch);
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (auto queued = TakeBatch(lock)) {
+          Spill(*queued);
+        }
+        return;
+      }
+    }
+  }
+
+  // Returns the oldest spilled batch if there is one, or else waits for a
+  // batch to be due from the queue. Returns nullopt once stopped with nothing
+  // left to send.
+  std::optional<Batch> NextBatch() {
+    while (!spilled_.empty()) {
+      const uint64_t sequence = spilled_.begin()->first;
+      std::ifstream file(SpillPath(sequence), std::ios::binary);
+      std::string payload(std::istreambuf_iterator<char>(file), {});
+      if (file.bad() || payload.empty()) {
+        LOG(ERROR) << "Failed to read remote write spill file "
+                   << SpillPath(sequence);
+        RemoveSpillFile(sequence);
+        continue;
+      }
+      return Batch{
+          .sequence = sequence,
+          .payload = std::move(payload),
+          .spilled = true,
+      };
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      if (queue_.size() >= options_.max_polls_per_send ||
+          (!queue_.empty() &&
+           (stopping_ || absl::Now() >= BatchDue()))) {
+        return TakeBatch(lock);
+      }
+      if (stopping_) {
+        return std::nullopt;
+      }
+      if (queue_.empty()) {
+        cv_.wait(lock);
+      } else {
+        cv_.wait_until(lock, absl::ToChronoTime(BatchDue()));
+      }
+    }
+  }
+
+  // Returns when a batch is due to be sent, however few polls it has, which is
+  // the batch delay after the oldest poll left in the queue was queued. Must
+  // be called with `mutex_` held, and the queue not empty.
+  absl::Time BatchDue() const {
+    return queue_.front().queued + options_.batch_delay;
+  }
+
+  // Takes up to a full batch from the queue, and encodes it outside of the
+  // lock. Returns nullopt if the queue is empty.
+  std::optional<Batch> TakeBatch(std::unique_lock<std::mutex>& lock) {
+    if (queue_.empty()) {
+      return std::nullopt;
+    }
+    const size_t size = std::min(queue_.size(), options_.max_polls_per_send);
+    std::vector<QueuedPoll> polls(std::make_move_iterator(queue_.begin()),
+                                  std::make_move_iterator(queue_.begin() +
+                                                          size));
+    queue_.erase(queue_.begin(), queue_.begin() + size);
+    lock.unlock();
+    Batch batch = {
+        .sequence = next_sequence_++,
+        .payload = EncodeBatch(polls),
+    };
+    lock.lock();
+    return batch;
+  }
+
+  // Sends the batch, retrying until it's either sent or rejected. Returns
+  // false if stopped while retrying.
+  bool Send(const Batch& batch) {
+    absl::Duration backoff = options_.min_backoff;
+    while (true) {
+      const absl::Status status = Post(batch.payload);
+      if (status.ok()) {
+        break;
+      }
+      if (status.code() != absl::StatusCode::kUnavailable) {
+        LOG(ERROR) << "Dropping remote write batch: " << status;
+        break;
+      }
+      LOG_EVERY_N_SEC(WARNING, 10) << status << ", retrying";
+      if (!WaitToRetry(backoff)) {
+        return false;
+      }
+      backoff = std::min(backoff * 2, options_.max_backoff);
+    }
+    if (batch.spilled) {
+      RemoveSpillFile(batch.sequence);
+    }
+    return true;
+  }
+
+  absl::Status Post(const std::string& payload) {
+    curl_easy_reset(curl_);
+    curl_easy_setopt(curl_, CURLOPT_USERAGENT, "Shelly Plug Metrics Exporter");
+    curl_easy_setopt(curl_, CURLOPT_URL, options_.url.c_str());
+    curl_easy_setopt(curl_, CURLOPT_HTTPHEADER, headers_);
+    curl_easy_setopt(curl_, CURLOPT_POSTFIELDS, payload.data());
+    curl_easy_setopt(curl_, CURLOPT_POSTFIELDSIZE_LARGE,
+                     static_cast<curl_off_t>(payload.size()));
+    curl_easy_setopt(curl_, CURLOPT_TIMEOUT_MS,
+                     static_cast<long>(absl::ToInt64Milliseconds(
+                         absl::Ceil(options_.timeout, absl::Milliseconds(1)))));
+    curl_easy_setopt(curl_, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl_, CURLOPT_WRITEFUNCTION, DiscardBody);
+    const CURLcode code = curl_easy_perform(curl_);
+    long http_code = 0;
+    curl_easy_getinfo(curl_, CURLINFO_RESPONSE_CODE, &http_code);
+    return CheckResponse(code, http_code);
+  }
+
+  // Waits out the backoff, spilling any full batches queued meanwhile so
+  // that the queue doesn't overflow while the endpoint is down. Returns false
+  // if stopped first.
+  bool WaitToRetry(absl::Duration backoff) {
+    const auto deadline = absl::ToChronoTime(absl::Now() + backoff);
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_) {
+      if (!options_.spill_directory.empty() &&
+          queue_.size() >= options_.max_polls_per_send) {
+        auto batch = TakeBatch(lock);
+        lock.unlock();
+        Spill(*batch);
+        lock.lock();
+        continue;
+      }
+      if (cv_.wait_until(lock, deadline) == std::cv_status::timeout) {
+        return !stopping_;
+      }
+    }
+    return false;
+  }
+
+  std::string SpillPath(uint64_t sequence) const {
+    return absl::Substitute("$0/$1-$2$3", options_.spill_directory, index_,
+                            sequence, kSpillSuffix);
+  }
+
+  // Writes the batch to a spill file, deleting the oldest files if needed to
+  // stay within the shard's share of the spill limit.
+  void Spill(const Batch& batch) {
+    if (options_.spill_directory.empty()) {
+      LOG_EVERY_N_SEC(WARNING, 10)
+          << "Dropping remote write batch, as there is no spill directory";
+      return;
+    }
+    while (!spilled_.empty() &&
+           spilled_bytes_ + batch.payload.size() > max_spill_bytes_) {
+      LOG_EVERY_N_SEC(WARNING, 10)
+          << "Remote write spill files are full, dropping the oldest";
+      // The batch that failed to send is spilled last, but is the oldest.
+      if (batch.sequence < spilled_.begin()->first) {
+        return;
+      }
+      RemoveSpillFile(spilled_.begin()->first);
+    }
+
+    // Written alongside and renamed, so that a crash never leaves a partial
+    // spill file to be sent.
+    const std::string path = SpillPath(batch.sequence);
+    const std::string temp_path = absl::StrCat(path, kTempSuffix);
+    {
+      std::ofstream file(temp_path, std::ios::binary | std::ios::trunc);
+      file.write(batch.payload.data(), batch.payload.size());
+      if (!file.good()) {
+        LOG(ERROR) << "Failed to write remote write spill file " << temp_path;
+        return;
+      }
+    }
+    if (std::rename(temp_path.c_str(), path.c_str()) != 0) {
+      LOG(ERROR) << "Failed to rename remote write spill file " << temp_path;
+      return;
+    }
+    spilled_.emplace(batch.sequence, batch.payload.size());
+    spilled_bytes_ += batch.payload.size();
+  }
+
+  void RemoveSpillFile(uint64_t sequence) {
+    const auto it = spilled_.find(sequence);
+    if (it == spilled_.end()) {
+      return;
+    }
+    std::remove(SpillPath(sequence).c_str());
+    spilled_bytes_ -= it->second;
+    spilled_.erase(it);
+  }
+};
+
+// Parses a spill file name of the form "<shard>-<sequence>.rw".
+std::optional<std::pair<size_t, uint64_t>> ParseSpillFileName(
+    std::string_view name) {
+  if (!absl::ConsumeSuffix(&name, kSpillSuffix)) {
+    return std::nullopt;
+  }
+  const std::vector<std::string_view> parts = absl::StrSplit(name, '-');
+  size_t shard;
+  uint64_t sequence;
+  if (parts.size() != 2 || !absl::SimpleAtoi(parts[0], &shard) ||
+      !absl::SimpleAtoi(parts[1], &sequence)) {
+    return std::nullopt;
+  }
+  return std::make_pair(shard, sequence);
+}
+
+class RemoteWriterImpl final : public RemoteWriter {
+ public:
+  explicit RemoteWriterImpl(const Options& options)
+      : options_(options), pending_(options.num_shards) {
+    shards_.reserve(options_.num_shards);
+    for (size_t i = 0; i < options_.num_shards; ++i) {
+      shards_.push_back(std::make_unique<Shard>(i, options_));
+    }
+  }
+
+  ~RemoteWriterImpl() override {
+    for (auto& shard : shards_) {
+      shard->Stop();
+    }
+    shards_.clear();
+    curl_global_cleanup();
+  }
+
+  absl::Status TakeOverSpillFiles() {
+    if (options_.spill_directory.empty()) {
+      return absl::OkStatus();
+    }
+    std::error_code error;
+    std::filesystem::create_directories(options_.spill_directory, error);
+    if (error) {
+      return absl::InternalError(absl::Substitute(
+          "Failed to create spill directory \"$0\": $1",
+          options_.spill_directory, error.message()));
+    }
+    // Each entry's own errors only skip that entry, and only failing to list
+    // the directory fails.
+    std::error_code list_error;
+    for (std::filesystem::directory_iterator
+             it(options_.spill_directory, list_error),
+         end;
+         !list_error && it != end; it.increment(list_error)) {
+      const std::filesystem::directory_entry& entry = *it;
+      const std::string name = entry.path().filename().string();
+      if (name.ends_with(kTempSuffix)) {
+        // Left by a crash part way through spilling.
+        std::error_code remove_error;
+        if (!std::filesystem::remove(entry.path(), remove_error) &&
+            remove_error) {
+          LOG(WARNING) << "Failed to remove remote write spill file "
+                       << entry.path() << ": " << remove_error.message();
+        }
+        continue;
+      }
+      const auto parsed = ParseSpillFileName(name);
+      if (!parsed.has_value()) {
+        continue;
+      }
+      if (parsed->first >= shards_.size()) {
+        LOG(WARNING) << "Ignoring remote write spill file " << entry.path()
+                     << " from a run with more shards";
+        continue;
+      }
+      std::error_code size_error;
+      const uintmax_t size = entry.file_size(size_error);
+      if (size_error) {
+        LOG(WARNING) << "Ignoring remote write spill file " << entry.path()
+                     << ": " << size_error.message();
+        continue;
+      }
+      shards_[parsed->first]->AddSpillFile(parsed->second, size);
+    }
+    if (list_error) {
+      return absl::InternalError(
+          absl::Substitute("Failed to list spill directory \"$0\": $1",
+                           options_.spill_directory, list_error.message()));
+    }
+    return absl::OkStatus();
+  }
+
+  void Start() {
+    for (auto& shard : shards_) {
+      shard->Start();
+    }
+  }
+
+  void AddTarget(TargetHandle handle, std::string_view name) override {
+    std::lock_guard<std::mutex> lock(names_mutex_);
+    if (handle >= names_.size()) {
+      names_.resize(handle + 1);
+    }
+    names_[handle] = std::make_shared<const std::string>(name);
+  }
+
+  void RemoveTarget(TargetHandle handle) override {
+    std::lock_guard<std::mutex> lock(names_mutex_);
+    if (handle < names_.size()) {
+      names_[handle].reset();
+    }
+  }
+
+  void Consume(absl::Span<const PollResult> results) override {
+    {
+      std::lock_guard<std::mutex> lock(names_mutex_);
+      for (const auto& result : results) {
+        if (!result.metrics.ok() || result.handle >= names_.size() ||
+            names_[result.handle] == nullptr) {
+          continue;
+        }
+        pending_[result.handle % pending_.size()].push_back({
+            .name = names_[result.handle],
+            .timestamp_ms = absl::ToUnixMillis(result.time),
+            .metrics = *result.metrics,
+        });
+      }
+    }
+    // Each shard's lock is only taken once per batch.
+    for (size_t i = 0; i < shards_.size(); ++i) {
+      shards_[i]->Push(pending_[i]);
+    }
+  }
+
+ private:
+  const Options options_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+
+  std::mutex names_mutex_;
+  // Indexed by target handle, and null for unknown targets.
+  std::vector<std::shared_ptr<const std::string>> names_;
+
+  // The polls of the batch being consumed for each shard, which are reused
+  // between batches as consuming is never concurrent.
+  std::vector<std::vector<QueuedPoll>> pending_;
+};
+
+}  // namespace
+
+absl::StatusOr<std::unique_ptr<RemoteWriter>> CreateRemoteWriter(
+    const RemoteWriter::Options& options) {
+  if (options.url.empty()) {
+    return absl::InvalidArgumentError("Remote write URL must be set");
+  }
+  if (options.num_shards == 0 || options.queue_capacity == 0 ||
+      options.max_polls_per_send == 0) {
+    return absl::InvalidArgumentError(
+        "Remote write shards, queue capacity and batch size must be positive");
+  }
+  const CURLcode code = curl_global_init(CURL_GLOBAL_ALL);
+  if (code != CURLE_OK) {
+    return absl::InternalError(curl_easy_strerror(code));
+  }
+  auto writer = std::make_unique<RemoteWriterImpl>(options);
+  RETURN_IF_ERROR(writer->TakeOverSpillFiles());
+  writer->Start();
+  return writer;
+}
@@ -0,0 +1,89 @@
+#ifndef REMOTE_WRITE_H
+#define REMOTE_WRITE_H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "absl/status/statusor.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+#include "sink.h"
+#include "target.h"
+
+// Pushes the readings of every successful poll to a Prometheus remote write
+// endpoint, for exporters that can't be scraped, such as those behind NAT.
+// Each reading is sent as a sample of the same series that the registries
+// export, timestamped with when the poll completed.
+//
+// The polls are queued in to a fixed number of shards by target, each shard
+// with a bounded queue and its own thread sending batches from it. A target's
+// samples are always sent in order, which the endpoint requires, while the
+// shards send in parallel. A send that fails with a server error or a network
+// error is retried with exponential backoff, while one that's rejected by the
+// endpoint is dropped.
+//
+// While a shard is backing off, full batches are spilled from its queue to
+// files in the spill directory, to be sent once the endpoint is back ahead
+// of anything still queued. Any queued polls are also spilled on shutdown,
+// and files left by a previous run are sent on startup. Without a spill
+// directory, or once the spill files reach their size limit, the oldest polls
+// are dropped instead.
+class RemoteWriter : public Sink {
+ public:
+  struct Options final {
+    // The endpoint's URL, such as "http://localhost:9090/api/v1/write".
+    std::string url;
+
+    // Number of shards, each of which has at most one request in flight.
+    size_t num_shards = 4;
+    // Number of polls queued in each shard. Each poll is five samples.
+    size_t queue_capacity = 2000;
+    // Largest number of polls sent in one request.
+    size_t max_polls_per_send = 200;
+    // How long a partial batch waits for more polls before being sent.
+    absl::Duration batch_delay = absl::Seconds(5);
+
+    // Limit on the time taken by each request.
+    absl::Duration timeout = absl::Seconds(30);
+    // Bounds on the delay before retrying a failed request, which doubles
+    // with each failure.
+    absl::Duration min_backoff = absl::Milliseconds(100);
+    absl::Duration max_backoff = absl::Seconds(30);
+
+    // Directory that batches are spilled to while the endpoint is down,
+    // which is created if needed. Empty means nothing is spilled.
+    std::string spill_directory;
+    // Limit on the size of the spill files across all the shards, beyond
+    // which the oldest are deleted.
+    size_t max_spill_bytes = 256 << 20;
+  };
+
+  RemoteWriter(const RemoteWriter&) = delete;
+  RemoteWriter& operator=(const RemoteWriter&) = delete;
+
+  // Sends or spills any queued polls before returning.
+  virtual ~RemoteWriter() = default;
+
+  // Starts sending the readings of the target reported with `handle`,
+  // labelled with `name`. Results of other handles are ignored.
+  virtual void AddTarget(TargetHandle handle, std::string_view name) = 0;
+  // Stops sending the target's readings, although any already queued are
+  // still sent.
+  virtual void RemoveTarget(TargetHandle handle) = 0;
+
+  // Queues the readings of every successful result, without blocking on the
+  // endpoint.
+  void Consume(absl::Span<const PollResult> results) override = 0;
+
+ protected:
+  RemoteWriter() = default;
+};
+
+// Starts the shards' threads, and takes over any spill files left in the
+// spill directory.
+absl::StatusOr<std::unique_ptr<RemoteWriter>> CreateRemoteWriter(
+    const RemoteWriter::Options& options);
+
+#endif  // REMOTE_WRITE_H
@@ -0,0 +1,254 @@
+#include "remote_write_internal.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstring>
+#include <utility>
+
+#include "absl/status/status.h"
+#include "absl/strings/substitute.h"
+#include "status_macros/status_macros.h"
+
+namespace remote_write_internal {
+namespace {
+
+// Protobuf wire types.
+enum WireType : uint32_t {
+  kVarint = 0,
+  kFixed64 = 1,
+  kLengthDelimited = 2,
+  kFixed32 = 5,
+};
+
+// Field numbers, from the remote write protocol's types.proto and
+// remote.proto.
+inline constexpr uint32_t kWriteRequestTimeseries = 1;
+inline constexpr uint32_t kTimeSeriesLabels = 1;
+inline constexpr uint32_t kTimeSeriesSamples = 2;
+inline constexpr uint32_t kLabelName = 1;
+inline constexpr uint32_t kLabelValue = 2;
+inline constexpr uint32_t kSampleValue = 1;
+inline constexpr uint32_t kSampleTimestamp = 2;
+
+size_t VarintSize(uint64_t value) {
+  // Each byte holds seven bits, and zero still takes a byte.
+  return std::max<size_t>(1, (std::bit_width(value) + 6) / 7);
+}
+
+void AppendVarint(std::string& buffer, uint64_t value) {
+  while (value >= 0x80) {
+    buffer.push_back(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  buffer.push_back(static_cast<char>(value));
+}
+
+void AppendTag(std::string& buffer, uint32_t field, WireType wire_type) {
+  AppendVarint(buffer, (field << 3) | wire_type);
+}
+
+// Every field number used is below 16, so every tag is a single byte.
+inline constexpr size_t kTagSize = 1;
+
+size_t LengthDelimitedSize(size_t size) {
+  return kTagSize + VarintSize(size) + size;
+}
+
+void AppendString(std::string& buffer, uint32_t field,
+                  std::string_view value) {
+  AppendTag(buffer, field, kLengthDelimited);
+  AppendVarint(buffer, value.size());
+  buffer.append(value);
+}
+
+size_t LabelSize(const Label& label) {
+  return LengthDelimitedSize(label.name.size()) +
+         LengthDelimitedSize(label.value.size());
+}
+
+size_t SampleSize(const Sample& sample) {
+  return kTagSize + sizeof(double) + kTagSize +
+         VarintSize(static_cast<uint64_t>(sample.timestamp_ms));
+}
+
+size_t TimeSeriesSize(const TimeSeries& series) {
+  size_t size = 0;
+  for (const auto& label : series.labels) {
+    size += LengthDelimitedSize(LabelSize(label));
+  }
+  for (const auto& sample : series.samples) {
+    size += LengthDelimitedSize(SampleSize(sample));
+  }
+  return size;
+}
+
+// Reads the fields of a message, failing rather than reading past its end.
+class MessageReader final {
+ public:
+  explicit MessageReader(std::string_view message) : message_(message) {}
+
+  bool done() const { return message_.empty(); }
+  std::string_view remaining() const { return message_; }
+
+  absl::StatusOr<uint64_t> ReadVarint() {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (message_.empty()) {
+        return absl::InvalidArgumentError("Truncated varint");
+      }
+      const auto byte = static_cast<uint8_t>(message_.front());
+      message_.remove_prefix(1);
+      value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0) {
+        return value;
+      }
+    }
+    return absl::InvalidArgumentError("Varint is too long");
+  }
+
+  absl::StatusOr<std::string_view> ReadBytes(size_t size) {
+    if (size > message_.size()) {
+      return absl::InvalidArgumentError("Truncated field");
+    }
+    const auto bytes = message_.substr(0, size);
+    message_.remove_prefix(size);
+    return bytes;
+  }
+
+  absl::StatusOr<std::string_view> ReadLengthDelimited() {
+    ASSIGN_OR_RETURN(const auto size, ReadVarint());
+    return ReadBytes(size);
+  }
+
+  absl::StatusOr<double> ReadDouble() {
+    ASSIGN_OR_RETURN(const auto bytes, ReadBytes(sizeof(double)));
+    double value;
+    std::memcpy(&value, bytes.data(), sizeof(value));
+    return value;
+  }
+
+  // Reads the next field's tag, returning its field number and wire type.
+  absl::StatusOr<std::pair<uint32_t, WireType>> ReadTag() {
+    ASSIGN_OR_RETURN(const auto tag, ReadVarint());
+    return std::make_pair(static_cast<uint32_t>(tag >> 3),
+                          static_cast<WireType>(tag & 7));
+  }
+
+  absl::Status SkipField(WireType wire_type) {
+    switch (wire_type) {
+      case kVarint:
+        return ReadVarint().status();
+      case kFixed64:
+        return ReadBytes(8).status();
+      case kLengthDelimited:
+        return ReadLengthDelimited().status();
+      case kFixed32:
+        return ReadBytes(4).status();
+    }
+    return absl::InvalidArgumentError(
+        absl::Substitute("Unsupported wire type $0", wire_type));
+  }
+
+ private:
+  std::string_view message_;
+};
+
+absl::StatusOr<Label> DecodeLabel(std::string_view message) {
+  Label label;
+  MessageReader reader(message);
+  while (!reader.done()) {
+    ASSIGN_OR_RETURN(const auto tag, reader.ReadTag());
+    if (tag.first == kLabelName && tag.second == kLengthDelimited) {
+      ASSIGN_OR_RETURN(label.name, reader.ReadLengthDelimited());
+    } else if (tag.first == kLabelValue && tag.second == kLengthDelimited) {
+      ASSIGN_OR_RETURN(label.value, reader.ReadLengthDelimited());
+    } else {
+      RETURN_IF_ERROR(reader.SkipField(tag.second));
+    }
+  }
+  return label;
+}
+
+absl::StatusOr<Sample> DecodeSample(std::string_view message) {
+  Sample sample;
+  MessageReader reader(message);
+  while (!reader.done()) {
+    ASSIGN_OR_RETURN(const auto tag, reader.ReadTag());
+    if (tag.first == kSampleValue && tag.second == kFixed64) {
+      ASSIGN_OR_RETURN(sample.value, reader.ReadDouble());
+    } else if (tag.first == kSampleTimestamp && tag.second == kVarint) {
+      ASSIGN_OR_RETURN(const auto timestamp, reader.ReadVarint());
+      sample.timestamp_ms = static_cast<int64_t>(timestamp);
+    } else {
+      RETURN_IF_ERROR(reader.SkipField(tag.second));
+    }
+  }
+  return sample;
+}
+
+absl::StatusOr<TimeSeries> DecodeTimeSeries(std::string_view message) {
+  TimeSeries series;
+  MessageReader reader(message);
+  while (!reader.done()) {
+    ASSIGN_OR_RETURN(const auto tag, reader.ReadTag());
+    if (tag.first == kTimeSeriesLabels && tag.second == kLengthDelimited) {
+      ASSIGN_OR_RETURN(const auto field, reader.ReadLengthDelimited());
+      ASSIGN_OR_RETURN(auto label, DecodeLabel(field));
+      series.labels.push_back(std::move(label));
+    } else if (tag.first == kTimeSeriesSamples &&
+               tag.second == kLengthDelimited) {
+      ASSIGN_OR_RETURN(const auto field, reader.ReadLengthDelimited());
+      ASSIGN_OR_RETURN(const auto sample, DecodeSample(field));
+      series.samples.push_back(sample);
+    } else {
+      RETURN_IF_ERROR(reader.SkipField(tag.second));
+    }
+  }
+  return series;
+}
+
+}  // namespace
+
+void EncodeWriteRequest(absl::Span<const TimeSeries> series,
+                        std::string& buffer) {
+  for (const auto& time_series : series) {
+    AppendTag(buffer, kWriteRequestTimeseries, kLengthDelimited);
+    AppendVarint(buffer, TimeSeriesSize(time_series));
+    for (const auto& label : time_series.labels) {
+      AppendTag(buffer, kTimeSeriesLabels, kLengthDelimited);
+      AppendVarint(buffer, LabelSize(label));
+      AppendString(buffer, kLabelName, label.name);
+      AppendString(buffer, kLabelValue, label.value);
+    }
+    for (const auto& sample : time_series.samples) {
+      AppendTag(buffer, kTimeSeriesSamples, kLengthDelimited);
+      AppendVarint(buffer, SampleSize(sample));
+      AppendTag(buffer, kSampleValue, kFixed64);
+      buffer.append(reinterpret_cast<const char*>(&sample.value),
+                    sizeof(sample.value));
+      AppendTag(buffer, kSampleTimestamp, kVarint);
+      AppendVarint(buffer, static_cast<uint64_t>(sample.timestamp_ms));
+    }
+  }
+}
+
+absl::StatusOr<std::vector<TimeSeries>> DecodeWriteRequest(
+    std::string_view request) {
+  std::vector<TimeSeries> series;
+  MessageReader reader(request);
+  while (!reader.done()) {
+    ASSIGN_OR_RETURN(const auto tag, reader.ReadTag());
+    if (tag.first == kWriteRequestTimeseries &&
+        tag.second == kLengthDelimited) {
+      ASSIGN_OR_RETURN(const auto field, reader.ReadLengthDelimited());
+      ASSIGN_OR_RETURN(auto time_series, DecodeTimeSeries(field));
+      series.push_back(std::move(time_series));
+    } else {
+      RETURN_IF_ERROR(reader.SkipField(tag.second));
+    }
+  }
+  return series;
+}
+
+}  // namespace remote_write_internal
@@ -0,0 +1,53 @@
+#ifndef REMOTE_WRITE_INTERNAL_H
+#define REMOTE_WRITE_INTERNAL_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "absl/status/statusor.h"
+#include "absl/types/span.h"
+
+// The wire format of the Prometheus remote write protocol, which is a
+// snappy compressed protobuf WriteRequest. The request is only a few nested
+// messages, so it's encoded by hand rather than through generated code, with
+// the field numbers of the protocol's remote.proto and types.proto. The
+// decoder is there for the tests, which check that the encoding round trips
+// and that the fake receiver in remote_write_test.cc can read what's sent.
+namespace remote_write_internal {
+
+struct Label final {
+  std::string name;
+  std::string value;
+
+  bool operator==(const Label&) const = default;
+};
+
+struct Sample final {
+  double value = 0;
+  int64_t timestamp_ms = 0;
+
+  bool operator==(const Sample&) const = default;
+};
+
+// The labels must be sorted by name, including the "__name__" label.
+struct TimeSeries final {
+  std::vector<Label> labels;
+  std::vector<Sample> samples;
+
+  bool operator==(const TimeSeries&) const = default;
+};
+
+// Appends the encoded WriteRequest holding `series` to `buffer`.
+void EncodeWriteRequest(absl::Span<const TimeSeries> series,
+                        std::string& buffer);
+
+// Decodes the time series from a WriteRequest, skipping any fields other than
+// those above.
+absl::StatusOr<std::vector<TimeSeries>> DecodeWriteRequest(
+    std::string_view request);
+
+}  // namespace remote_write_internal
+
+#endif  // REMOTE_WRITE_INTERNAL_H
@@ -0,0 +1,388 @@
+#include "remote_write.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "absl/log/check.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/substitute.h"
+#include "absl/time/clock.h"
+#include "civetweb.h"
+#include "remote_write_internal.h"
+#include "snappy.h"
+
+namespace {
+
+using ::remote_write_internal::DecodeWriteRequest;
+using ::remote_write_internal::EncodeWriteRequest;
+using ::remote_write_internal::Label;
+using ::remote_write_internal::Sample;
+using ::remote_write_internal::TimeSeries;
+using ::testing::ElementsAre;
+using ::testing::IsEmpty;
+
+inline constexpr absl::Duration kWaitTimeout = absl::Seconds(10);
+
+uint16_t FindUnusedPortOrDie() {
+  int fd = socket(AF_INET, SOCK_STREAM, /*protocol=*/0);
+  CHECK(fd != -1) << "Failed to create socket";
+
+  sockaddr_in addr;
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = INADDR_ANY;
+  addr.sin_port = htons(0);  // Bind to any available port.
+  CHECK(bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0)
+      << "Failed to bind socket";
+
+  socklen_t addrlen = sizeof(addr);
+  CHECK(getsockname(fd, reinterpret_cast<sockaddr*>(&addr), &addrlen) == 0)
+      << "Failed to get socket name";
+  const uint16_t port = ntohs(addr.sin_port);
+  CHECK(port != 0) << "Failed to get port number";
+
+  shutdown(fd, SHUT_RDWR);
+  CHECK(close(fd) == 0) << "Failed to close socket";
+  return port;
+}
+
+// Stands in for a Prometheus server, decoding every request it receives and
+// responding with a configurable status.
+class Receiver final {
+ public:
+  Receiver() {
+    port_ = FindUnusedPortOrDie();
+    const std::string port_str = absl::StrCat(port_);
+    const char* options[] = {"listening_ports", port_str.c_str(),
+                             "num_threads", "4", nullptr};
+    mg_init_library(0);
+    ctx_ = mg_start(nullptr, nullptr, options);
+    CHECK(ctx_ != nullptr) << "Failed to initialize Civetweb server";
+    mg_set_request_handler(ctx_, "/api/v1/write", Handle, this);
+  }
+
+  ~Receiver() {
+    mg_stop(ctx_);
+    mg_exit_library();
+  }
+
+  std::string Url() const {
+    return absl::Substitute("http://localhost:$0/api/v1/write", port_);
+  }
+
+  // Sets the status of the responses to later requests.
+  void set_status(int status) { status_ = status; }
+
+  int num_requests() const { return num_requests_; }
+
+  // Returns the series received in requests that were accepted.
+  std::vector<TimeSeries> series() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return series_;
+  }
+
+  // Waits until at least `num_samples` samples have been accepted.
+  bool WaitForSamples(size_t num_samples) {
+    const absl::Time deadline = absl::Now() + kWaitTimeout;
+    while (absl::Now() < deadline) {
+      size_t received = 0;
+      for (const auto& series : series()) {
+        received += series.samples.size();
+      }
+      if (received >= num_samples) {
+        return true;
+      }
+      absl::SleepFor(absl::Milliseconds(10));
+    }
+    return false;
+  }
+
+  bool WaitForRequests(int num_requests) {
+    const absl::Time deadline = absl::Now() + kWaitTimeout;
+    while (num_requests_ < num_requests) {
+      if (absl::Now() >= deadline) {
+        return false;
+      }
+      absl::SleepFor(absl::Milliseconds(10));
+    }
+    return true;
+  }
+
+ private:
+  mg_context* ctx_;
+  int port_;
+  std::atomic<int> status_ = 204;
+  std::atomic<int> num_requests_ = 0;
+  std::mutex mutex_;
+  std::vector<TimeSeries> series_;
+
+  static int Handle(mg_connection* conn, void* user_data) {
+    return static_cast<Receiver*>(user_data)->HandleRequest(conn);
+  }
+
+  int HandleRequest(mg_connection* conn) {
+    std::string body;
+    char buffer[4096];
+    int read;
+    while ((read = mg_read(conn, buffer, sizeof(buffer))) > 0) {
+      body.append(buffer, read);
+    }
+    ++num_requests_;
+
+    const char* encoding = mg_get_header(conn, "Content-Encoding");
+    EXPECT_STREQ(encoding, "snappy");
+    const int status = status_;
+    if (status / 100 != 2) {
+      mg_send_http_error(conn, status, "%s", "Failed");
+      return status;
+    }
+    std::string request;
+    EXPECT_TRUE(snappy::Uncompress(body.data(), body.size(), &request));
+    auto series = DecodeWriteRequest(request);
+    EXPECT_TRUE(series.ok()) << series.status();
+    if (series.ok()) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      series_.insert(series_.end(), series->begin(), series->end());
+    }
+    mg_send_http_ok(conn, "text/plain", 0);
+    return status;
+  }
+};
+
+::shelly::Metrics MakeMetrics(double apower) {
+  return {
+      .apower = apower,
+      .voltage = 230,
+      .current = apower / 230,
+      .temp_c = 30,
+      .temp_f = 86,
+  };
+}
+
+PollResult MakeResult(TargetHandle handle, int64_t time_ms, double apower) {
+  return {
+      .handle = handle,
+      .time = absl::FromUnixMillis(time_ms),
+      .metrics = MakeMetrics(apower),
+  };
+}
+
+// Returns the samples of the named series of the target.
+std::vector<Sample> GetSamples(absl::Span<const TimeSeries> series,
+                               std::string_view name,
+                               std::string_view target) {
+  const std::vector<Label> labels = {
+      {.name = "__name__", .value = std::string(name)},
+      {.name = "target", .value = std::string(target)},
+  };
+  std::vector<Sample> samples;
+  for (const auto& s : series) {
+    if (s.labels == labels) {
+      samples.insert(samples.end(), s.samples.begin(), s.samples.end());
+    }
+  }
+  return samples;
+}
+
+class RemoteWriterTest : public ::testing::Test {
+ protected:
+  RemoteWriterTest()
+      : spill_directory_(absl::StrCat(::testing::TempDir(),
+                                      "remote_write_test_", getpid())) {
+    std::filesystem::remove_all(spill_directory_);
+  }
+
+  ~RemoteWriterTest() override {
+    std::filesystem::remove_all(spill_directory_);
+  }
+
+  std::unique_ptr<RemoteWriter> CreateWriter(
+      RemoteWriter::Options options = {}) {
+    options.url = receiver_.Url();
+    options.num_shards = 2;
+    options.batch_delay = absl::Milliseconds(10);
+    options.min_backoff = absl::Milliseconds(10);
+    options.max_backoff = absl::Milliseconds(50);
+    auto writer = CreateRemoteWriter(options);
+    CHECK(writer.ok()) << writer.status();
+    (*writer)->AddTarget(0, "plug-0");
+    (*writer)->AddTarget(1, "plug-1");
+    return std::move(*writer);
+  }
+
+  size_t NumSpillFiles() const {
+    if (!std::filesystem::exists(spill_directory_)) {
+      return 0;
+    }
+    return std::distance(
+        std::filesystem::directory_iterator(spill_directory_),
+        std::filesystem::directory_iterator());
+  }
+
+  Receiver receiver_;
+  const std::string spill_directory_;
+};
+
+}  // namespace
+
+TEST(WriteRequest, RoundTrip) {
+  const std::vector<TimeSeries> series = {
+      {.labels = {{.name = "__name__", .value = "shelly_apower"},
+                  {.name = "target", .value = "plug-0"}},
+       .samples = {{.value = 12.5, .timestamp_ms = 1700000000000},
+                   {.value = -1, .timestamp_ms = 1700000001000}}},
+      {.labels = {{.name = "__name__", .value = "shelly_voltage"}},
+       .samples = {{.value = 0, .timestamp_ms = 0}}},
+      {},
+  };
+  std::string request;
+  EncodeWriteRequest(series, request);
+
+  const auto decoded = DecodeWriteRequest(request);
+  ASSERT_TRUE(decoded.ok()) << decoded.status();
+  EXPECT_EQ(*decoded, series);
+  EXPECT_FALSE(DecodeWriteRequest(request.substr(0, request.size() - 1)).ok());
+}
+
+TEST_F(RemoteWriterTest, SendsReadings) {
+  auto writer = CreateWriter();
+  writer->Consume({MakeResult(0, 1000, 10), MakeResult(1, 1000, 20)});
+  writer->Consume({
+      MakeResult(0, 2000, 11),
+      {.handle = 1,
+       .time = absl::FromUnixMillis(2000),
+       .metrics = absl::UnavailableError("Unreachable")},
+      // Unknown targets are ignored.
+      MakeResult(2, 2000, 30),
+  });
+
+  ASSERT_TRUE(receiver_.WaitForSamples(15));
+  const auto series = receiver_.series();
+  EXPECT_THAT(GetSamples(series, "shelly_apower", "plug-0"),
+              ElementsAre(Sample{10, 1000}, Sample{11, 2000}));
+  EXPECT_THAT(GetSamples(series, "shelly_apower", "plug-1"),
+              ElementsAre(Sample{20, 1000}));
+  EXPECT_THAT(GetSamples(series, "shelly_voltage", "plug-1"),
+              ElementsAre(Sample{230, 1000}));
+  EXPECT_THAT(GetSamples(series, "shelly_temp_f", "plug-0"),
+              ElementsAre(Sample{86, 1000}, Sample{86, 2000}));
+}
+
+TEST_F(RemoteWriterTest, StopsSendingRemovedTargets) {
+  auto writer = CreateWriter();
+  writer->RemoveTarget(1);
+  writer->Consume({MakeResult(0, 1000, 10), MakeResult(1, 1000, 20)});
+
+  ASSERT_TRUE(receiver_.WaitForSamples(5));
+  writer.reset();
+  EXPECT_THAT(GetSamples(receiver_.series(), "shelly_apower", "plug-1"),
+              IsEmpty());
+}
+
+TEST_F(RemoteWriterTest, RetriesUnavailableEndpoint) {
+  receiver_.set_status(503);
+  auto writer = CreateWriter();
+  writer->Consume({MakeResult(0, 1000, 10)});
+
+  ASSERT_TRUE(receiver_.WaitForRequests(3));
+  receiver_.set_status(204);
+  ASSERT_TRUE(receiver_.WaitForSamples(5));
+  EXPECT_THAT(GetSamples(receiver_.series(), "shelly_apower", "plug-0"),
+              ElementsAre(Sample{10, 1000}));
+}
+
+TEST_F(RemoteWriterTest, DropsRejectedBatches) {
+  receiver_.set_status(400);
+  auto writer = CreateWriter();
+  writer->Consume({MakeResult(0, 1000, 10)});
+  ASSERT_TRUE(receiver_.WaitForRequests(1));
+
+  receiver_.set_status(204);
+  writer->Consume({MakeResult(0, 2000, 11)});
+  ASSERT_TRUE(receiver_.WaitForSamples(5));
+  EXPECT_EQ(receiver_.num_requests(), 2);
+  EXPECT_THAT(GetSamples(receiver_.series(), "shelly_apower", "plug-0"),
+              ElementsAre(Sample{11, 2000}));
+}
+
+TEST_F(RemoteWriterTest, SpillsWhileEndpointIsDown) {
+  receiver_.set_status(503);
+  auto writer = CreateWriter({
+      .max_polls_per_send = 2,
+      .spill_directory = spill_directory_,
+  });
+  // Handle 0 is always on the first shard, so its batches are sent in order.
+  std::vector<PollResult> results;
+  for (int i = 0; i < 10; ++i) {
+    results.push_back(MakeResult(0, 1000 * i, i));
+  }
+  writer->Consume(results);
+  ASSERT_TRUE(receiver_.WaitForRequests(2));
+  // Whatever is still queued is spilled on shutdown.
+  writer.reset();
+  EXPECT_EQ(NumSpillFiles(), 5);
+
+  // The next writer sends what was spilled, and deletes the files.
+  receiver_.set_status(204);
+  writer = CreateWriter({.spill_directory = spill_directory_});
+  ASSERT_TRUE(receiver_.WaitForSamples(50));
+  EXPECT_THAT(GetSamples(receiver_.series(), "shelly_apower", "plug-0"),
+              ElementsAre(Sample{0, 0}, Sample{1, 1000}, Sample{2, 2000},
+                          Sample{3, 3000}, Sample{4, 4000}, Sample{5, 5000},
+                          Sample{6, 6000}, Sample{7, 7000}, Sample{8, 8000},
+                          Sample{9, 9000}));
+  writer.reset();
+  EXPECT_EQ(NumSpillFiles(), 0);
+}
+
+TEST_F(RemoteWriterTest, FailsIfSpillDirectoryCannotBeCreated) {
+  // A directory can't be created under a regular file, even by root.
+  const std::string file = absl::StrCat(spill_directory_, ".file");
+  std::ofstream(file).put('x');
+  const auto writer = CreateRemoteWriter({
+      .url = receiver_.Url(),
+      .spill_directory = absl::StrCat(file, "/spill"),
+  });
+  std::filesystem::remove(file);
+  EXPECT_EQ(writer.status().code(), absl::StatusCode::kInternal);
+}
+
+TEST_F(RemoteWriterTest, LimitsSpillSize) {
+  receiver_.set_status(503);
+  auto writer = CreateWriter({
+      .max_polls_per_send = 1,
+      .spill_directory = spill_directory_,
+      // Room for a couple of batches in each shard.
+      .max_spill_bytes = 400,
+  });
+  std::vector<PollResult> results;
+  for (int i = 0; i < 10; ++i) {
+    results.push_back(MakeResult(0, 1000 * i, i));
+  }
+  writer->Consume(results);
+  ASSERT_TRUE(receiver_.WaitForRequests(2));
+  writer.reset();
+  const size_t num_spilled = NumSpillFiles();
+  EXPECT_GT(num_spilled, 0);
+  EXPECT_LT(num_spilled, 10);
+
+  // Only the newest batches are kept.
+  receiver_.set_status(204);
+  writer = CreateWriter({.spill_directory = spill_directory_});
+  ASSERT_TRUE(receiver_.WaitForSamples(5 * num_spilled));
+  const auto samples =
+      GetSamples(receiver_.series(), "shelly_apower", "plug-0");
+  ASSERT_EQ(samples.size(), num_spilled);
+  EXPECT_EQ(samples.back(), (Sample{9, 9000}));
+}
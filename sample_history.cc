@@ -0,0 +1,170 @@
+#include "sample_history.h"
+
+#include <algorithm>
+#include <array>
+#include <limits>
+#include <utility>
+
+#include "absl/strings/str_cat.h"
+#include "prometheus/client_metric.h"
+#include "prometheus/metric_type.h"
+#include "registry_internal.h"
+
+namespace {
+
+using ::prometheus::ClientMetric;
+using ::prometheus::MetricFamily;
+using ::prometheus::MetricType;
+
+struct Reading final {
+  double ::shelly::Metrics::*field;
+  // Used in the family names, after "shelly_".
+  const char* name;
+  const char* description;
+};
+
+inline constexpr std::array<Reading, 5> kReadings = {{
+    {&::shelly::Metrics::voltage, "voltage", "voltage"},
+    {&::shelly::Metrics::apower, "apower", "power"},
+    {&::shelly::Metrics::current, "current", "current"},
+    {&::shelly::Metrics::temp_c, "temp_c", "temperature"},
+    {&::shelly::Metrics::temp_f, "temp_f", "temperature"},
+}};
+
+enum Statistic : size_t {
+  kMin,
+  kMax,
+  kAvg,
+  kNumStatistics,
+};
+
+inline constexpr std::array<const char*, kNumStatistics> kStatisticNames = {
+    "min", "max", "avg"};
+inline constexpr std::array<const char*, kNumStatistics>
+    kStatisticDescriptions = {"Minimum", "Maximum", "Mean"};
+
+}  // namespace
+
+SampleHistory::SampleHistory(const Options& options) : options_(options) {}
+
+void SampleHistory::AddTarget(TargetHandle handle, std::string_view name) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (handle >= rings_.size()) {
+    rings_.resize(handle + 1);
+    samples_.resize(rings_.size() * options_.capacity);
+  }
+  rings_[handle] = Ring{.name = std::string(name)};
+}
+
+void SampleHistory::RemoveTarget(TargetHandle handle) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (handle < rings_.size()) {
+    rings_[handle] = Ring{};
+  }
+}
+
+void SampleHistory::Consume(absl::Span<const PollResult> results) {
+  if (options_.capacity == 0) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto& result : results) {
+    if (!result.metrics.ok() || result.handle >= rings_.size()) {
+      continue;
+    }
+    Ring& ring = rings_[result.handle];
+    if (ring.name.empty()) {
+      continue;
+    }
+    samples_[result.handle * options_.capacity + ring.next] = {
+        .time = result.time,
+        .metrics = *result.metrics,
+    };
+    ring.next = ring.next + 1 == options_.capacity ? 0 : ring.next + 1;
+    ring.size = std::min(ring.size + 1, options_.capacity);
+  }
+}
+
+std::vector<MetricFamily> SampleHistory::Collect() const {
+  std::vector<MetricFamily> families;
+  families.reserve(kReadings.size() * kNumStatistics + 1);
+  for (const auto& reading : kReadings) {
+    for (size_t statistic = 0; statistic < kNumStatistics; ++statistic) {
+      families.push_back({
+          .name = absl::StrCat("shelly_", reading.name, "_window_",
+                               kStatisticNames[statistic]),
+          .help = absl::StrCat(kStatisticDescriptions[statistic], " ",
+                               reading.description,
+                               " of the target over the sample window"),
+          .type = MetricType::Gauge,
+      });
+    }
+  }
+  families.push_back({
+      .name = "shelly_window_samples",
+      .help = "Number of successful polls of the target in the sample window",
+      .type = MetricType::Gauge,
+  });
+
+  const absl::Time cutoff = options_.time_func() - options_.window;
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (size_t handle = 0; handle < rings_.size(); ++handle) {
+    const Ring& ring = rings_[handle];
+    if (ring.name.empty()) {
+      continue;
+    }
+
+    std::array<std::array<double, kNumStatistics>, kReadings.size()> stats;
+    for (auto& reading_stats : stats) {
+      reading_stats = {std::numeric_limits<double>::infinity(),
+                       -std::numeric_limits<double>::infinity(), 0};
+    }
+    // The samples are appended in the order the polls completed, so walk
+    // back from the newest until one falls outside the window.
+    const Sample* const ring_samples =
+        samples_.data() + handle * options_.capacity;
+    size_t count = 0;
+    for (size_t i = 0; i < ring.size; ++i) {
+      const size_t slot =
+          (ring.next + options_.capacity - 1 - i) % options_.capacity;
+      const Sample& sample = ring_samples[slot];
+      if (sample.time < cutoff) {
+        break;
+      }
+      for (size_t r = 0; r < kReadings.size(); ++r) {
+        const double value = sample.metrics.*kReadings[r].field;
+        stats[r][kMin] = std::min(stats[r][kMin], value);
+        stats[r][kMax] = std::max(stats[r][kMax], value);
+        stats[r][kAvg] += value;
+      }
+      ++count;
+    }
+    if (count == 0) {
+      continue;
+    }
+
+    const std::vector<ClientMetric::Label> label = {{
+        .name = registry_internal::kTargetLabel,
+        .value = ring.name,
+    }};
+    for (size_t r = 0; r < kReadings.size(); ++r) {
+      stats[r][kAvg] /= count;
+      for (size_t statistic = 0; statistic < kNumStatistics; ++statistic) {
+        auto& metric =
+            families[r * kNumStatistics + statistic].metric.emplace_back();
+        metric.label = label;
+        metric.gauge.value = stats[r][statistic];
+      }
+    }
+    auto& metric = families.back().metric.emplace_back();
+    metric.label = label;
+    metric.gauge.value = static_cast<double>(count);
+  }
+
+  // Like the registries, families are only collected once there is something
+  // to report.
+  if (families.back().metric.empty()) {
+    return {};
+  }
+  return families;
+}
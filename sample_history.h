@@ -0,0 +1,86 @@
+#ifndef SAMPLE_HISTORY_H
+#define SAMPLE_HISTORY_H
+
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+#include "prometheus/collectable.h"
+#include "prometheus/metric_family.h"
+#include "shelly.h"
+#include "sink.h"
+#include "target.h"
+
+// Keeps each target's most recent successful readings in a fixed size ring
+// buffer, and exports the minimum, maximum and mean of every reading over a
+// trailing window. This lets the targets be polled more often than the
+// exporter is scraped without losing what happened between scrapes.
+//
+// The rings of all the targets are held back to back in one allocation, and
+// appending a sample never allocates.
+class SampleHistory final : public Sink, public ::prometheus::Collectable {
+ public:
+  struct Options final {
+    // Number of samples kept for each target, after which the oldest are
+    // overwritten. Bounds the memory used to this many samples per target.
+    size_t capacity = 64;
+    // The trailing window that the readings are summarised over, which would
+    // usually be the scrape interval.
+    absl::Duration window = absl::Seconds(30);
+    std::function<absl::Time()> time_func = [] { return absl::Now(); };
+  };
+
+  SampleHistory() = delete;
+  explicit SampleHistory(const Options& options);
+
+  SampleHistory(const SampleHistory&) = delete;
+  SampleHistory& operator=(const SampleHistory&) = delete;
+
+  // Starts keeping the samples of the target reported with `handle`, which
+  // are labelled with `name`. Any samples of a previous target with the same
+  // handle are discarded.
+  void AddTarget(TargetHandle handle, std::string_view name);
+  // Stops keeping the samples of the target, discarding those held.
+  void RemoveTarget(TargetHandle handle);
+
+  // Appends the readings of every successful result. Results of unknown
+  // targets are ignored.
+  void Consume(absl::Span<const PollResult> results) override;
+
+  // Summarises the samples taken within the window before now. Targets with
+  // no samples in the window are left out.
+  std::vector<::prometheus::MetricFamily> Collect() const override;
+
+ private:
+  struct Sample final {
+    absl::Time time;
+    ::shelly::Metrics metrics;
+  };
+
+  struct Ring final {
+    // Empty if no target has the handle.
+    std::string name;
+    // Index of the slot the next sample is written to.
+    size_t next = 0;
+    size_t size = 0;
+  };
+
+  const Options options_;
+
+  // Guards the rings. Held by the sinks while appending a batch, and by
+  // collection while summarising the windows.
+  mutable std::mutex mutex_;
+  // Indexed by target handle.
+  std::vector<Ring> rings_;
+  // The ring of the target with handle `h` is held in the `capacity` samples
+  // starting at `h * capacity`.
+  std::vector<Sample> samples_;
+};
+
+#endif  // SAMPLE_HISTORY_H
@@ -0,0 +1,147 @@
+#include "sample_history.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <string>
+#include <vector>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/status/status.h"
+
+namespace {
+
+using ::testing::DoubleEq;
+using ::testing::IsEmpty;
+using ::testing::Pair;
+using ::testing::UnorderedElementsAre;
+
+// Returns the value of every family for each target, keyed by target label.
+absl::flat_hash_map<std::string, absl::flat_hash_map<std::string, double>>
+CollectByTarget(const SampleHistory& history) {
+  absl::flat_hash_map<std::string, absl::flat_hash_map<std::string, double>>
+      results;
+  for (const auto& family : history.Collect()) {
+    for (const auto& metric : family.metric) {
+      results[metric.label.at(0).value][family.name] = metric.gauge.value;
+    }
+  }
+  return results;
+}
+
+PollResult VoltageResult(TargetHandle handle, int64_t seconds,
+                         double voltage) {
+  return PollResult{
+      .handle = handle,
+      .time = absl::FromUnixSeconds(seconds),
+      .metrics = ::shelly::Metrics{.voltage = voltage},
+  };
+}
+
+class SampleHistoryTest : public ::testing::Test {
+ protected:
+  SampleHistory CreateHistory(size_t capacity) {
+    return SampleHistory({
+        .capacity = capacity,
+        .window = absl::Seconds(10),
+        .time_func = [this] { return now_; },
+    });
+  }
+
+  absl::Time now_ = absl::FromUnixSeconds(100);
+};
+
+}  // namespace
+
+TEST_F(SampleHistoryTest, NoSamples) {
+  auto history = CreateHistory(8);
+  EXPECT_THAT(history.Collect(), IsEmpty());
+  history.AddTarget(0, "target");
+  EXPECT_THAT(history.Collect(), IsEmpty());
+}
+
+TEST_F(SampleHistoryTest, SummarisesWindow) {
+  auto history = CreateHistory(8);
+  history.AddTarget(0, "target_one");
+  history.AddTarget(1, "target_two");
+  history.Consume(std::vector<PollResult>{
+      // Outside of the window.
+      VoltageResult(0, 85, 100.0),
+      VoltageResult(0, 92, 2.0),
+      VoltageResult(1, 93, 240.0),
+      VoltageResult(0, 95, 3.0),
+      VoltageResult(0, 99, 7.0),
+  });
+
+  const auto results = CollectByTarget(history);
+  ASSERT_TRUE(results.contains("target_one"));
+  EXPECT_THAT(results.at("target_one").at("shelly_voltage_window_min"),
+              DoubleEq(2.0));
+  EXPECT_THAT(results.at("target_one").at("shelly_voltage_window_max"),
+              DoubleEq(7.0));
+  EXPECT_THAT(results.at("target_one").at("shelly_voltage_window_avg"),
+              DoubleEq(4.0));
+  EXPECT_THAT(results.at("target_one").at("shelly_window_samples"),
+              DoubleEq(3.0));
+  ASSERT_TRUE(results.contains("target_two"));
+  EXPECT_THAT(results.at("target_two").at("shelly_voltage_window_avg"),
+              DoubleEq(240.0));
+  EXPECT_THAT(results.at("target_two").at("shelly_window_samples"),
+              DoubleEq(1.0));
+
+  // Once every sample has left the window, the targets are left out.
+  now_ += absl::Seconds(20);
+  EXPECT_THAT(history.Collect(), IsEmpty());
+}
+
+TEST_F(SampleHistoryTest, OverwritesOldestSamples) {
+  auto history = CreateHistory(2);
+  history.AddTarget(0, "target");
+  history.Consume(std::vector<PollResult>{
+      VoltageResult(0, 95, 1.0),
+      VoltageResult(0, 96, 2.0),
+      VoltageResult(0, 97, 3.0),
+  });
+
+  const auto results = CollectByTarget(history);
+  EXPECT_THAT(results.at("target").at("shelly_voltage_window_min"),
+              DoubleEq(2.0));
+  EXPECT_THAT(results.at("target").at("shelly_window_samples"),
+              DoubleEq(2.0));
+}
+
+TEST_F(SampleHistoryTest, IgnoresFailuresAndUnknownTargets) {
+  auto history = CreateHistory(8);
+  history.AddTarget(0, "target");
+  history.Consume(std::vector<PollResult>{
+      VoltageResult(0, 95, 1.0),
+      {.handle = 0,
+       .time = absl::FromUnixSeconds(96),
+       .metrics = absl::InternalError("expected error")},
+      VoltageResult(5, 97, 3.0),
+  });
+
+  EXPECT_THAT(CollectByTarget(history),
+              UnorderedElementsAre(Pair(
+                  "target", testing::Contains(Pair("shelly_window_samples",
+                                                   DoubleEq(1.0))))));
+}
+
+TEST_F(SampleHistoryTest, RemoveTargetDiscardsSamples) {
+  auto history = CreateHistory(8);
+  history.AddTarget(0, "target_one");
+  history.Consume(std::vector<PollResult>{VoltageResult(0, 95, 1.0)});
+
+  history.RemoveTarget(0);
+  EXPECT_THAT(history.Collect(), IsEmpty());
+  history.Consume(std::vector<PollResult>{VoltageResult(0, 96, 2.0)});
+  EXPECT_THAT(history.Collect(), IsEmpty());
+
+  // A new target given the same handle starts with no samples.
+  history.AddTarget(0, "target_two");
+  history.Consume(std::vector<PollResult>{VoltageResult(0, 97, 3.0)});
+  EXPECT_THAT(CollectByTarget(history),
+              UnorderedElementsAre(Pair(
+                  "target_two", testing::Contains(Pair("shelly_window_samples",
+                                                       DoubleEq(1.0))))));
+}
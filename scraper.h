@@ -1,11 +1,29 @@
 #ifndef SCRAPER_H
 #define SCRAPER_H
 
+#include <cstddef>
+#include <functional>
 #include <memory>
+#include <optional>
 #include <string>
 #include <string_view>
 
 #include "absl/status/statusor.h"
+#include "absl/time/time.h"
+
+struct ScrapeStats final {
+  // True if the request was sent over an existing keep-alive connection,
+  // rather than a newly opened one.
+  bool reused_connection = false;
+
+  // Time from the start of the request until each phase completed, as
+  // reported by curl. The name lookup and connect times are zero when a
+  // connection was reused.
+  absl::Duration name_lookup_time = absl::ZeroDuration();
+  absl::Duration connect_time = absl::ZeroDuration();
+  absl::Duration first_byte_time = absl::ZeroDuration();
+  absl::Duration total_time = absl::ZeroDuration();
+};
 
 struct ScraperResult final {
   int code;
@@ -14,18 +32,79 @@ struct ScraperResult final {
   std::string content;
 };
 
+// The outcome of a scrape, successful or not.
+struct ScrapeOutcome final {
+  absl::StatusOr<ScraperResult> result;
+  // Set for every scrape that got as far as starting a request, including
+  // those that then failed, so that they can be reported alike.
+  std::optional<ScrapeStats> stats;
+};
+
+// Returns the scheme, host and port prefix of `url`, which identifies the
+// connections that can be shared between requests.
+std::string_view UrlOrigin(std::string_view url);
+
 class Scraper {
  public:
   struct Options final {
     bool verbose = false;
+
+    // Number of event loop threads driving the requests, only used by the
+    // scraper returned from CreateAsyncScraper.
+    int event_loop_threads = 1;
+
+    // Responses with a body larger than this, in bytes, are aborted and
+    // return a resource exhausted error. Zero means no limit.
+    size_t max_body_size = 64 * 1024;
+
+    // Limits on the time taken to connect to a target, and on the whole
+    // request including the connection. Requests that run out of time return
+    // a deadline exceeded error. Zero means no limit.
+    absl::Duration connect_timeout = absl::Seconds(5);
+    absl::Duration timeout = absl::Seconds(10);
+  };
+
+  // Per-request overrides of the scraper's options.
+  struct RequestOptions final {
+    std::optional<absl::Duration> connect_timeout;
+    std::optional<absl::Duration> timeout;
+    // If set, the request is abandoned at this time even if its timeouts
+    // haven't been reached.
+    std::optional<absl::Time> deadline;
   };
 
+  using ScrapeCallback = std::function<void(ScrapeOutcome outcome)>;
+
   Scraper(const Scraper&) = delete;
   Scraper& operator=(const Scraper&) = delete;
 
   virtual ~Scraper() = default;
 
-  virtual absl::StatusOr<ScraperResult> Scrape(const std::string& url) = 0;
+  // Scrapes `url`, writing the response body in to `buffer` and returning it
+  // as the result's content. Any existing contents of `buffer` are discarded
+  // but its capacity is kept, so passing back the content of a previous
+  // result avoids allocating for the body.
+  virtual ScrapeOutcome Scrape(const std::string& url, std::string buffer,
+                               const RequestOptions& request_options) = 0;
+  ScrapeOutcome Scrape(const std::string& url, std::string buffer) {
+    return Scrape(url, std::move(buffer), RequestOptions());
+  }
+  ScrapeOutcome Scrape(const std::string& url) {
+    return Scrape(url, std::string(), RequestOptions());
+  }
+
+  // Starts scraping `url` and calls `callback` with the result once complete.
+  // The callback may be called on an internal scraper thread, so should not
+  // block. By default this calls Scrape and blocks until it has completed.
+  virtual void ScrapeAsync(const std::string& url, std::string buffer,
+                           const RequestOptions& request_options,
+                           ScrapeCallback callback);
+
+  // Closes any idle connections kept open for the origin of `url`, once no
+  // more requests are expected there, such as after its target is removed.
+  // Later requests to the origin still work, but open a new connection. By
+  // default this does nothing.
+  virtual void ForgetOrigin(std::string_view url);
 
   virtual std::string_view Version() const = 0;
 
@@ -35,4 +114,10 @@ class Scraper {
 
 absl::StatusOr<std::unique_ptr<Scraper>> CreateScraper(const Scraper::Options& options);
 
+// Creates a scraper whose requests are all driven by a small number of event
+// loop threads, using the curl multi interface. ScrapeAsync returns
+// immediately.
+absl::StatusOr<std::unique_ptr<Scraper>> CreateAsyncScraper(
+    const Scraper::Options& options);
+
 #endif  // SCRAPER_H
@@ -0,0 +1,272 @@
+#include "scraper_internal.h"
+
+#include <algorithm>
+#include <string>
+
+#include "absl/status/status.h"
+#include "absl/strings/ascii.h"
+#include "absl/strings/match.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/strip.h"
+#include "absl/strings/substitute.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+#include "curl/curlver.h"
+
+namespace scraper_internal {
+namespace {
+
+inline constexpr std::string_view kHttpPrefix = "HTTP/";
+
+bool IsDigit(char c) { return c >= '0' && c <= '9'; }
+
+// Converts a timeout in to curl's milliseconds, where zero means no limit.
+// Rounds up so that a sub-millisecond timeout doesn't become no limit.
+long TimeoutMillis(absl::Duration timeout) {
+  if (timeout <= absl::ZeroDuration()) {
+    return 0;
+  }
+  return absl::ToInt64Milliseconds(
+      absl::Ceil(timeout, absl::Milliseconds(1)));
+}
+
+// Reads one of curl's CURLINFO_*_TIME_T timings, in microseconds.
+absl::Duration GetTiming(CURL* curl, CURLINFO info) {
+  curl_off_t micros = 0;
+  if (curl_easy_getinfo(curl, info, &micros) != CURLE_OK) {
+    return absl::ZeroDuration();
+  }
+  return absl::Microseconds(micros);
+}
+
+absl::Status HandleHeaderField(State& state, const HeaderField& field) {
+  if (absl::EqualsIgnoreCase(field.name, "content-type")) {
+    state.content_type.assign(field.value);
+    absl::AsciiStrToLower(&state.content_type);
+  } else if (absl::EqualsIgnoreCase(field.name, "content-length")) {
+    if (!absl::SimpleAtoi(field.value, &state.content_length)) {
+      return absl::InvalidArgumentError(absl::Substitute(
+          "Unable to parse content length value: $0", field.value));
+    }
+    // Abort oversized responses before any of the body is received.
+    if (state.max_body_size > 0 && state.content_length > state.max_body_size) {
+      return absl::ResourceExhaustedError(absl::Substitute(
+          "Content length $0 exceeds the maximum body size of $1",
+          state.content_length, state.max_body_size));
+    }
+  }
+  return absl::OkStatus();
+}
+
+ScrapeStats ReadScrapeStats(CURL* curl) {
+  // Curl reports the number of new connections it had to open for the
+  // transfer, which is zero when a cached connection was reused, but also
+  // when connecting failed before any request was sent.
+  long num_connects = 0;
+  curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &num_connects);
+  long request_size = 0;
+  curl_easy_getinfo(curl, CURLINFO_REQUEST_SIZE, &request_size);
+
+  return ScrapeStats{
+      .reused_connection = num_connects == 0 && request_size > 0,
+      .name_lookup_time = GetTiming(curl, CURLINFO_NAMELOOKUP_TIME_T),
+      .connect_time = GetTiming(curl, CURLINFO_CONNECT_TIME_T),
+      .first_byte_time = GetTiming(curl, CURLINFO_STARTTRANSFER_TIME_T),
+      .total_time = GetTiming(curl, CURLINFO_TOTAL_TIME_T),
+  };
+}
+
+absl::StatusOr<ScraperResult> GetResult(CURLcode code, State& state) {
+  if (code != CURLE_OK) {
+    if (!state.error.ok()) {
+      return state.error;
+    }
+    if (code == CURLE_OPERATION_TIMEDOUT) {
+      return absl::DeadlineExceededError(curl_easy_strerror(code));
+    }
+    return absl::InternalError(curl_easy_strerror(code));
+  }
+  if (!state.error.ok()) {
+    return state.error;
+  }
+
+  if (state.code == 0 || state.status.empty()) {
+    return absl::InvalidArgumentError("Missing status or status code");
+  }
+  if (state.content_type.empty()) {
+    return absl::InvalidArgumentError("Missing content type");
+  }
+
+  return ScraperResult{
+      .code = state.code,
+      .status = std::move(state.status),
+      .content_type = std::move(state.content_type),
+      .content = std::move(state.content),
+  };
+}
+
+}  // namespace
+
+std::string_view VersionString() {
+  static const auto* const version = [] {
+    return new std::string(absl::Substitute("libcurl $0", LIBCURL_VERSION));
+  }();
+  return *version;
+}
+
+absl::StatusOr<StatusLine> ParseStatusLine(std::string_view line) {
+  const auto invalid = [line] {
+    return absl::InvalidArgumentError(
+        absl::Substitute("Invalid header: $0", line));
+  };
+
+  // Expects "HTTP/<major>[.<minor>] <code> <reason>".
+  std::string_view remaining = line;
+  if (!absl::ConsumePrefix(&remaining, kHttpPrefix) || remaining.empty() ||
+      !IsDigit(remaining.front())) {
+    return invalid();
+  }
+  StatusLine status_line = {.major_version = remaining.front() - '0'};
+  remaining.remove_prefix(1);
+  if (absl::ConsumePrefix(&remaining, ".")) {
+    if (remaining.empty() || !IsDigit(remaining.front())) {
+      return invalid();
+    }
+    status_line.minor_version = remaining.front() - '0';
+    remaining.remove_prefix(1);
+  }
+
+  const std::string_view after_version =
+      absl::StripLeadingAsciiWhitespace(remaining);
+  if (after_version.size() == remaining.size()) {
+    return invalid();
+  }
+  const size_t code_length = std::find_if_not(after_version.begin(),
+                                              after_version.end(), IsDigit) -
+                             after_version.begin();
+  if (code_length == 0 ||
+      !absl::SimpleAtoi(after_version.substr(0, code_length),
+                        &status_line.code)) {
+    return absl::InvalidArgumentError(
+        absl::Substitute("Status code in header not a number: $0", line));
+  }
+  status_line.reason =
+      absl::StripAsciiWhitespace(after_version.substr(code_length));
+  return status_line;
+}
+
+absl::StatusOr<HeaderField> ParseHeaderLine(std::string_view line) {
+  const size_t separator = line.find(':');
+  if (separator == std::string_view::npos) {
+    return absl::InvalidArgumentError(
+        absl::Substitute("Failed to parse header line: $0", line));
+  }
+  return HeaderField{
+      .name = absl::StripAsciiWhitespace(line.substr(0, separator)),
+      .value = absl::StripAsciiWhitespace(line.substr(separator + 1)),
+  };
+}
+
+size_t HeaderCallback(char* buffer, size_t size, size_t nitems,
+                      void* user_data) {
+  if (user_data == nullptr) {
+    return 0;
+  }
+  State& state = *reinterpret_cast<State*>(user_data);
+
+  const std::string_view line =
+      absl::StripAsciiWhitespace(std::string_view(buffer, nitems));
+  if (line.empty()) {
+    return size * nitems;
+  }
+
+  // A status line starts each response, of which there may be several when
+  // redirects are followed.
+  if (state.code < 0 || absl::StartsWith(line, kHttpPrefix)) {
+    auto maybe_status_line = ParseStatusLine(line);
+    if (!maybe_status_line.ok()) {
+      state.error = maybe_status_line.status();
+      return 0;
+    }
+    state.code = maybe_status_line->code;
+    state.status.assign(maybe_status_line->reason);
+    state.content_type.clear();
+    state.content_length = 0;
+  } else {
+    auto maybe_field = ParseHeaderLine(line);
+    if (!maybe_field.ok()) {
+      state.error = maybe_field.status();
+      return 0;
+    }
+    const auto handle_status = HandleHeaderField(state, *maybe_field);
+    if (!handle_status.ok()) {
+      state.error = handle_status;
+      return 0;
+    }
+  }
+  return size * nitems;
+}
+
+size_t BodyCallback(char* buffer, size_t size, size_t nitems, void* user_data) {
+  if (user_data == nullptr) {
+    return 0;
+  }
+  State& state = *reinterpret_cast<State*>(user_data);
+  const size_t length = size * nitems;
+  if (state.max_body_size > 0 &&
+      state.content.size() + length > state.max_body_size) {
+    state.error = absl::ResourceExhaustedError(absl::Substitute(
+        "Response body exceeds the maximum size of $0", state.max_body_size));
+    return 0;
+  }
+  if (state.content.capacity() < state.content_length) {
+    state.content.reserve(state.content_length);
+  }
+  state.content.append(buffer, length);
+  return length;
+}
+
+absl::Status ConfigureRequest(CURL* curl, const Scraper::Options& options,
+                              const Scraper::RequestOptions& request_options,
+                              const std::string& url, std::string buffer,
+                              State& state) {
+  state.content = std::move(buffer);
+  state.content.clear();
+  state.max_body_size = options.max_body_size;
+
+  const absl::Duration connect_timeout =
+      request_options.connect_timeout.value_or(options.connect_timeout);
+  absl::Duration timeout = request_options.timeout.value_or(options.timeout);
+  if (request_options.deadline.has_value()) {
+    const absl::Duration remaining = *request_options.deadline - absl::Now();
+    if (remaining <= absl::ZeroDuration()) {
+      return absl::DeadlineExceededError(
+          absl::Substitute("Deadline passed before requesting $0", url));
+    }
+    if (timeout <= absl::ZeroDuration() || remaining < timeout) {
+      timeout = remaining;
+    }
+  }
+
+  curl_easy_setopt(curl, CURLOPT_VERBOSE, options.verbose ? 1 : 0);
+  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
+  curl_easy_setopt(curl, CURLOPT_USERAGENT, "Shelly Plug Metrics Exporter");
+  curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, &state);
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, HeaderCallback);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &state);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, BodyCallback);
+  curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS,
+                   TimeoutMillis(connect_timeout));
+  curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, TimeoutMillis(timeout));
+  return absl::OkStatus();
+}
+
+ScrapeOutcome CompleteRequest(CURL* curl, CURLcode code, State& state) {
+  return {
+      .result = GetResult(code, state),
+      .stats = ReadScrapeStats(curl),
+  };
+}
+
+}  // namespace scraper_internal
@@ -0,0 +1,73 @@
+#ifndef SCRAPER_INTERNAL_H
+#define SCRAPER_INTERNAL_H
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "curl/curl.h"
+#include "scraper.h"
+
+// Implementation details shared by the blocking and event driven scrapers.
+namespace scraper_internal {
+
+std::string_view VersionString();
+
+// Holds the response state that's built up by the header and body callbacks.
+struct State final {
+  int code = -1;
+  std::string status;
+  size_t content_length = 0;
+  std::string content_type;
+  std::string content;
+  // Zero means no limit.
+  size_t max_body_size = 0;
+
+  // Used to pass back parsing errors.
+  absl::Status error = absl::OkStatus();
+};
+
+struct StatusLine final {
+  int major_version = 0;
+  int minor_version = 0;
+  int code = 0;
+  // Points in to the parsed line.
+  std::string_view reason;
+};
+
+struct HeaderField final {
+  // Both point in to the parsed line.
+  std::string_view name;
+  std::string_view value;
+};
+
+// Parses a response status line, such as "HTTP/1.1 200 OK".
+absl::StatusOr<StatusLine> ParseStatusLine(std::string_view line);
+
+// Parses a "name: value" header line, with the whitespace surrounding the name
+// and value removed.
+absl::StatusOr<HeaderField> ParseHeaderLine(std::string_view line);
+
+size_t HeaderCallback(char* buffer, size_t size, size_t nitems,
+                      void* user_data);
+size_t BodyCallback(char* buffer, size_t size, size_t nitems, void* user_data);
+
+// Sets the options for fetching `url` on the `curl` handle, with the response
+// written in to `state` and the body in to `buffer`'s storage. Both `url` and
+// `state` must outlive the request. Returns a deadline exceeded error if the
+// request's deadline has already passed.
+absl::Status ConfigureRequest(CURL* curl, const Scraper::Options& options,
+                              const Scraper::RequestOptions& request_options,
+                              const std::string& url, std::string buffer,
+                              State& state);
+
+// Converts the final state of a request on `curl` in to its outcome, where
+// `code` is the transfer result reported by curl. The outcome has the
+// request's stats whether or not it succeeded.
+ScrapeOutcome CompleteRequest(CURL* curl, CURLcode code, State& state);
+
+}  // namespace scraper_internal
+
+#endif  // SCRAPER_INTERNAL_H
@@ -5,10 +5,15 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 
+#include <atomic>
+#include <latch>
+
 #include "absl/log/check.h"
 #include "absl/strings/substitute.h"
+#include "absl/time/clock.h"
 #include "civetweb.h"
 #include "parser.h"
+#include "scraper_internal.h"
 
 namespace {
 
@@ -26,6 +31,12 @@ int CivetWebHandler(mg_connection* conn, void*) {
   return 200;
 }
 
+// Responds only after a delay, for exercising the request timeouts.
+int SlowCivetWebHandler(mg_connection* conn, void* user_data) {
+  absl::SleepFor(absl::Milliseconds(500));
+  return CivetWebHandler(conn, user_data);
+}
+
 uint16_t FindUnusedPortOrDie() {
   int fd = socket(AF_INET, SOCK_STREAM, /*protocol=*/0);
   CHECK(fd != -1) << "Failed to create socket";
@@ -54,23 +65,31 @@ uint16_t FindUnusedPortOrDie() {
 
 }  // namespace
 
+using ScraperFactory =
+    absl::StatusOr<std::unique_ptr<Scraper>> (*)(const Scraper::Options&);
+
 class Fixture final {
  public:
-  Fixture() {
+  explicit Fixture(ScraperFactory factory,
+                   const Scraper::Options& scraper_options = {
+                       .verbose = kVerboseScraper}) {
     // Use a random open port for the Civetweb server. Note that this is
     // susceptible to race conditions and should probably have retry logic.
     port_ = FindUnusedPortOrDie();
     std::string port_str = absl::Substitute("$0", port_);
-    const char* options[] = {"listening_ports", port_str.c_str(), "num_threads",
-                             "4", nullptr};
+    const char* options[] = {"listening_ports",   port_str.c_str(),
+                             "num_threads",       "4",
+                             "enable_keep_alive", "yes",
+                             nullptr};
 
     // Setup Civetweb server to act as the endpoint for the scraper tests.
     mg_init_library(0);
     ctx_ = mg_start(nullptr, nullptr, options);
     CHECK(ctx_ != nullptr) << "Failed to initialize Civetweb server";
     mg_set_request_handler(ctx_, "/valid", CivetWebHandler, nullptr);
+    mg_set_request_handler(ctx_, "/slow", SlowCivetWebHandler, nullptr);
 
-    auto scraper = CreateScraper({.verbose = kVerboseScraper});
+    auto scraper = factory(scraper_options);
     CHECK(scraper.ok()) << "Failed to create Scraper: " << scraper.status();
     scraper_ = std::move(*scraper);
   }
@@ -93,28 +112,242 @@ class Fixture final {
   std::unique_ptr<Scraper> scraper_;
 };
 
-TEST(ScrapeJson, InvalidHost) {
-  Fixture fixture;
+TEST(ParseStatusLine, Valid) {
+  const auto result =
+      scraper_internal::ParseStatusLine("HTTP/1.1  404 Not Found");
+  ASSERT_TRUE(result.ok());
+  EXPECT_EQ(result->major_version, 1);
+  EXPECT_EQ(result->minor_version, 1);
+  EXPECT_EQ(result->code, 404);
+  EXPECT_EQ(result->reason, "Not Found");
+}
+
+TEST(ParseStatusLine, NoMinorVersion) {
+  const auto result = scraper_internal::ParseStatusLine("HTTP/2 200 OK");
+  ASSERT_TRUE(result.ok());
+  EXPECT_EQ(result->major_version, 2);
+  EXPECT_EQ(result->code, 200);
+  EXPECT_EQ(result->reason, "OK");
+}
 
-  const auto result = fixture.scraper().Scrape("http://invalid");
+TEST(ParseStatusLine, Invalid) {
+  for (const auto line : {"", "HTTP", "HTTP/1.1", "HTTP/1.1200 OK",
+                          "HTTP/x.1 200 OK", "HTTP/1.1 OK", "FTP/1.1 200 OK"}) {
+    const auto result = scraper_internal::ParseStatusLine(line);
+    EXPECT_FALSE(result.ok()) << line;
+    EXPECT_EQ(result.status().code(), absl::StatusCode::kInvalidArgument)
+        << line;
+  }
+}
+
+TEST(ParseHeaderLine, Valid) {
+  const auto result =
+      scraper_internal::ParseHeaderLine("Content-Type :  text/html: x ");
+  ASSERT_TRUE(result.ok());
+  EXPECT_EQ(result->name, "Content-Type");
+  EXPECT_EQ(result->value, "text/html: x");
+}
+
+TEST(ParseHeaderLine, EmptyValue) {
+  const auto result = scraper_internal::ParseHeaderLine("X-Empty:");
+  ASSERT_TRUE(result.ok());
+  EXPECT_EQ(result->name, "X-Empty");
+  EXPECT_EQ(result->value, "");
+}
+
+TEST(ParseHeaderLine, MissingSeparator) {
+  const auto result = scraper_internal::ParseHeaderLine("Content-Type");
+  EXPECT_FALSE(result.ok());
+  EXPECT_EQ(result.status().code(), absl::StatusCode::kInvalidArgument);
+}
+
+class ScraperTest : public ::testing::TestWithParam<ScraperFactory> {};
+
+TEST_P(ScraperTest, InvalidHost) {
+  Fixture fixture(GetParam());
+
+  const auto result = fixture.scraper().Scrape("http://invalid").result;
   EXPECT_FALSE(result.ok());
   EXPECT_EQ(result.status().code(), absl::StatusCode::kInternal);
 }
 
-TEST(ScrapeJson, InvalidPage) {
-  Fixture fixture;
+TEST_P(ScraperTest, InvalidPage) {
+  Fixture fixture(GetParam());
 
-  const auto result = fixture.scraper().Scrape(fixture.Host() + "/invalid");
+  const auto result =
+      fixture.scraper().Scrape(fixture.Host() + "/invalid").result;
   EXPECT_TRUE(result.ok());
   EXPECT_EQ(result->code, 404);
 }
 
-TEST(ScapeJson, ValidPage) {
-  Fixture fixture;
+TEST_P(ScraperTest, ValidPage) {
+  Fixture fixture(GetParam());
 
-  auto result = fixture.scraper().Scrape(fixture.Host() + "/valid");
+  auto result = fixture.scraper().Scrape(fixture.Host() + "/valid").result;
   EXPECT_TRUE(result.ok());
   EXPECT_EQ(result->code, 200);
   EXPECT_EQ(result->content_type, kResponseType);
   EXPECT_EQ(result->content, kResponseContent);
-}
\ No newline at end of file
+}
+
+TEST_P(ScraperTest, ReusesBuffer) {
+  Fixture fixture(GetParam());
+
+  std::string buffer = "previous content";
+  buffer.reserve(4096);
+  const char* const buffer_data = buffer.data();
+
+  auto result =
+      fixture.scraper()
+          .Scrape(fixture.Host() + "/valid", std::move(buffer))
+          .result;
+  ASSERT_TRUE(result.ok());
+  EXPECT_EQ(result->content, kResponseContent);
+  EXPECT_EQ(result->content.data(), buffer_data);
+}
+
+TEST_P(ScraperTest, BodyTooLarge) {
+  Fixture fixture(GetParam(),
+                  {.verbose = kVerboseScraper, .max_body_size = 10});
+
+  const auto result =
+      fixture.scraper().Scrape(fixture.Host() + "/valid").result;
+  EXPECT_FALSE(result.ok());
+  EXPECT_EQ(result.status().code(), absl::StatusCode::kResourceExhausted);
+}
+
+TEST_P(ScraperTest, Timeout) {
+  Fixture fixture(GetParam(), {.verbose = kVerboseScraper,
+                               .timeout = absl::Milliseconds(50)});
+
+  const auto outcome = fixture.scraper().Scrape(fixture.Host() + "/slow");
+  EXPECT_FALSE(outcome.result.ok());
+  EXPECT_EQ(outcome.result.status().code(),
+            absl::StatusCode::kDeadlineExceeded);
+
+  // The request was sent, so its stats are reported with the error.
+  ASSERT_TRUE(outcome.stats.has_value());
+  EXPECT_FALSE(outcome.stats->reused_connection);
+  EXPECT_GE(outcome.stats->total_time, absl::Milliseconds(50));
+}
+
+TEST_P(ScraperTest, RequestTimeoutOverridesDefault) {
+  Fixture fixture(GetParam());
+
+  const auto result = fixture.scraper()
+                          .Scrape(fixture.Host() + "/slow", /*buffer=*/"",
+                                  {.timeout = absl::Milliseconds(50)})
+                          .result;
+  EXPECT_FALSE(result.ok());
+  EXPECT_EQ(result.status().code(), absl::StatusCode::kDeadlineExceeded);
+}
+
+TEST_P(ScraperTest, DeadlineCapsTimeout) {
+  Fixture fixture(GetParam());
+
+  const auto result =
+      fixture.scraper()
+          .Scrape(fixture.Host() + "/slow", /*buffer=*/"",
+                  {.deadline = absl::Now() + absl::Milliseconds(50)})
+          .result;
+  EXPECT_FALSE(result.ok());
+  EXPECT_EQ(result.status().code(), absl::StatusCode::kDeadlineExceeded);
+}
+
+TEST_P(ScraperTest, DeadlinePassed) {
+  Fixture fixture(GetParam());
+
+  const auto outcome = fixture.scraper().Scrape(
+      fixture.Host() + "/valid", /*buffer=*/"",
+      {.deadline = absl::Now() - absl::Seconds(1)});
+  EXPECT_FALSE(outcome.result.ok());
+  EXPECT_EQ(outcome.result.status().code(),
+            absl::StatusCode::kDeadlineExceeded);
+  EXPECT_FALSE(outcome.stats.has_value());
+}
+
+TEST_P(ScraperTest, ReusesConnection) {
+  Fixture fixture(GetParam());
+
+  const auto first = fixture.scraper().Scrape(fixture.Host() + "/valid");
+  ASSERT_TRUE(first.result.ok());
+  ASSERT_TRUE(first.stats.has_value());
+  EXPECT_FALSE(first.stats->reused_connection);
+
+  const auto second = fixture.scraper().Scrape(fixture.Host() + "/valid");
+  ASSERT_TRUE(second.result.ok());
+  ASSERT_TRUE(second.stats.has_value());
+  EXPECT_TRUE(second.stats->reused_connection);
+}
+
+TEST_P(ScraperTest, ReportsTimings) {
+  Fixture fixture(GetParam());
+
+  const auto outcome = fixture.scraper().Scrape(fixture.Host() + "/slow");
+  ASSERT_TRUE(outcome.result.ok());
+  ASSERT_TRUE(outcome.stats.has_value());
+  const auto& stats = *outcome.stats;
+  EXPECT_LE(stats.name_lookup_time, stats.connect_time);
+  EXPECT_LE(stats.connect_time, stats.first_byte_time);
+  EXPECT_LE(stats.first_byte_time, stats.total_time);
+  // The slow handler delays the response, so most of the time is spent
+  // waiting for the first byte.
+  EXPECT_GE(stats.first_byte_time, absl::Milliseconds(400));
+}
+
+TEST_P(ScraperTest, ConcurrentAsyncRequests) {
+  constexpr int kNumRequests = 20;
+  Fixture fixture(GetParam());
+
+  std::latch latch(kNumRequests);
+  std::atomic<int> num_valid = 0;
+  for (int i = 0; i < kNumRequests; ++i) {
+    fixture.scraper().ScrapeAsync(
+        fixture.Host() + "/valid", /*buffer=*/"", Scraper::RequestOptions(),
+        [&](ScrapeOutcome outcome) {
+          const auto& result = outcome.result;
+          if (result.ok() && result->code == 200 &&
+              result->content == kResponseContent) {
+            ++num_valid;
+          }
+          latch.count_down();
+        });
+  }
+  latch.wait();
+  EXPECT_EQ(num_valid, kNumRequests);
+}
+
+INSTANTIATE_TEST_SUITE_P(Blocking, ScraperTest,
+                         ::testing::Values(&CreateScraper));
+INSTANTIATE_TEST_SUITE_P(Async, ScraperTest,
+                         ::testing::Values(&CreateAsyncScraper));
+
+TEST(UrlOrigin, StripsPath) {
+  EXPECT_EQ(UrlOrigin("http://10.0.0.1/rpc/Switch.GetStatus?id=0"),
+            "http://10.0.0.1");
+  EXPECT_EQ(UrlOrigin("http://plug.local:8080/"), "http://plug.local:8080");
+  EXPECT_EQ(UrlOrigin("http://plug.local"), "http://plug.local");
+}
+
+// Only the blocking scraper keeps connections per origin.
+TEST(Scraper, ForgetOriginClosesIdleConnections) {
+  Fixture fixture(&CreateScraper);
+
+  const auto first = fixture.scraper().Scrape(fixture.Host() + "/valid");
+  ASSERT_TRUE(first.result.ok());
+  const auto second = fixture.scraper().Scrape(fixture.Host() + "/valid");
+  ASSERT_TRUE(second.stats.has_value());
+  EXPECT_TRUE(second.stats->reused_connection);
+
+  // Forgetting another origin leaves the connection alone.
+  fixture.scraper().ForgetOrigin("http://unknown.invalid/valid");
+  const auto third = fixture.scraper().Scrape(fixture.Host() + "/valid");
+  ASSERT_TRUE(third.stats.has_value());
+  EXPECT_TRUE(third.stats->reused_connection);
+
+  fixture.scraper().ForgetOrigin(fixture.Host() + "/valid");
+  const auto fourth = fixture.scraper().Scrape(fixture.Host() + "/valid");
+  ASSERT_TRUE(fourth.result.ok());
+  ASSERT_TRUE(fourth.stats.has_value());
+  EXPECT_FALSE(fourth.stats->reused_connection);
+}
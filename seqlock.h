@@ -0,0 +1,87 @@
+#ifndef SEQLOCK_H
+#define SEQLOCK_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+// Publishes a value from writers to readers using a sequence lock. Readers
+// never block or write to shared memory: they copy the value and retry if a
+// store overlapped the copy, so they always see a value from a single Store.
+// Stores are serialized between themselves, but they're expected to be rare
+// compared to reads and seldom concurrent with each other.
+template <class T>
+class SeqLock final {
+ public:
+  static_assert(std::is_trivially_copyable_v<T>,
+                "SeqLock values are copied word by word");
+  static_assert(std::is_default_constructible_v<T>);
+
+  SeqLock() : SeqLock(T{}) {}
+  explicit SeqLock(const T& value) { Store(value); }
+
+  // Copies take a consistent snapshot of `other`, so that a SeqLock may be
+  // held in a container that reallocates. They aren't atomic with respect to
+  // stores to `this`.
+  SeqLock(const SeqLock& other) : SeqLock(other.Load()) {}
+  SeqLock& operator=(const SeqLock& other) {
+    Store(other.Load());
+    return *this;
+  }
+
+  void Store(const T& value) {
+    // An odd sequence marks a store in progress, so acquire the lock by
+    // making the sequence odd.
+    uint64_t sequence = sequence_.load(std::memory_order_relaxed);
+    do {
+      while ((sequence & 1) != 0) {
+        sequence = sequence_.load(std::memory_order_relaxed);
+      }
+    } while (!sequence_.compare_exchange_weak(sequence, sequence + 1,
+                                              std::memory_order_acquire,
+                                              std::memory_order_relaxed));
+    // Keeps the word stores below from being seen before the odd sequence.
+    std::atomic_thread_fence(std::memory_order_release);
+
+    std::array<uint64_t, kNumWords> words = {};
+    std::memcpy(words.data(), &value, sizeof(T));
+    for (size_t i = 0; i < kNumWords; ++i) {
+      words_[i].store(words[i], std::memory_order_relaxed);
+    }
+    sequence_.store(sequence + 2, std::memory_order_release);
+  }
+
+  T Load() const {
+    std::array<uint64_t, kNumWords> words;
+    uint64_t before;
+    uint64_t after;
+    do {
+      before = sequence_.load(std::memory_order_acquire);
+      for (size_t i = 0; i < kNumWords; ++i) {
+        words[i] = words_[i].load(std::memory_order_relaxed);
+      }
+      // Keeps the word loads above from being seen after the second sequence
+      // load.
+      std::atomic_thread_fence(std::memory_order_acquire);
+      after = sequence_.load(std::memory_order_relaxed);
+    } while ((before & 1) != 0 || before != after);
+
+    T value;
+    std::memcpy(static_cast<void*>(&value), words.data(), sizeof(T));
+    return value;
+  }
+
+ private:
+  static constexpr size_t kNumWords =
+      (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+  std::atomic<uint64_t> sequence_ = 0;
+  // The value is held in atomic words so that a read racing a store is well
+  // defined, and then discarded.
+  std::array<std::atomic<uint64_t>, kNumWords> words_ = {};
+};
+
+#endif  // SEQLOCK_H
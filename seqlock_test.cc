@@ -0,0 +1,97 @@
+#include "seqlock.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace {
+
+// Every field of a value written by the tests is the same, so a torn read
+// shows up as a mix of fields.
+struct Value final {
+  double a = 0;
+  double b = 0;
+  double c = 0;
+  int32_t d = 0;
+  int32_t e = 0;
+
+  bool Consistent() const {
+    return a == b && b == c && c == d && d == e;
+  }
+};
+
+Value MakeValue(int i) {
+  return Value{.a = static_cast<double>(i),
+               .b = static_cast<double>(i),
+               .c = static_cast<double>(i),
+               .d = i,
+               .e = i};
+}
+
+}  // namespace
+
+TEST(SeqLock, DefaultConstructsValue) {
+  SeqLock<Value> lock;
+  const Value value = lock.Load();
+  EXPECT_EQ(value.a, 0);
+  EXPECT_EQ(value.e, 0);
+}
+
+TEST(SeqLock, LoadsStoredValue) {
+  SeqLock<Value> lock(MakeValue(1));
+  EXPECT_EQ(lock.Load().a, 1);
+
+  lock.Store(MakeValue(2));
+  const Value value = lock.Load();
+  EXPECT_TRUE(value.Consistent());
+  EXPECT_EQ(value.d, 2);
+}
+
+TEST(SeqLock, CopiesValue) {
+  std::vector<SeqLock<Value>> locks(1, SeqLock<Value>(MakeValue(3)));
+  // Growing the vector copies the existing lock.
+  locks.resize(100);
+  EXPECT_EQ(locks[0].Load().c, 3);
+  EXPECT_EQ(locks[99].Load().c, 0);
+}
+
+TEST(SeqLock, ReadersNeverSeeTornValues) {
+  constexpr int kNumWriters = 2;
+  constexpr int kNumReaders = 4;
+  constexpr int kNumStores = 100000;
+  SeqLock<Value> lock;
+  std::atomic<bool> done = false;
+  std::atomic<int> num_torn = 0;
+
+  std::vector<std::thread> readers;
+  for (int i = 0; i < kNumReaders; ++i) {
+    readers.emplace_back([&] {
+      while (!done) {
+        if (!lock.Load().Consistent()) {
+          ++num_torn;
+        }
+      }
+    });
+  }
+  std::vector<std::thread> writers;
+  for (int i = 0; i < kNumWriters; ++i) {
+    writers.emplace_back([&, i] {
+      for (int j = 0; j < kNumStores; ++j) {
+        lock.Store(MakeValue(j * kNumWriters + i));
+      }
+    });
+  }
+
+  for (auto& writer : writers) {
+    writer.join();
+  }
+  done = true;
+  for (auto& reader : readers) {
+    reader.join();
+  }
+  EXPECT_EQ(num_torn, 0);
+  EXPECT_TRUE(lock.Load().Consistent());
+}
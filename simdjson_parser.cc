@@ -0,0 +1,182 @@
+#include <string>
+
+#include "absl/status/status.h"
+#include "absl/strings/substitute.h"
+#include "parser.h"
+#include "simdjson.h"
+#include "status_macros/status_macros.h"
+
+namespace {
+
+std::string_view VersionString() {
+  static const auto* const version = [] {
+    return new std::string(
+        absl::Substitute("simdjson $0 ($1)", SIMDJSON_VERSION,
+                         simdjson::get_active_implementation()->name()));
+  }();
+  return *version;
+}
+
+absl::Status ParseStatus(simdjson::error_code error) {
+  if (error != simdjson::SUCCESS) {
+    return absl::InvalidArgumentError(absl::Substitute(
+        "Failed to parse JSON: $0", simdjson::error_message(error)));
+  }
+  return absl::OkStatus();
+}
+
+absl::Status FieldStatus(simdjson::error_code error, std::string_view field) {
+  switch (error) {
+    case simdjson::SUCCESS:
+      return absl::OkStatus();
+    case simdjson::NO_SUCH_FIELD:
+      return absl::NotFoundError(
+          absl::Substitute("Missing JSON field \"$0\"", field));
+    case simdjson::INCORRECT_TYPE:
+      return absl::InvalidArgumentError(
+          absl::Substitute("JSON field \"$0\" has the wrong type", field));
+    default:
+      return ParseStatus(error);
+  }
+}
+
+// Returns the error for a top level value that isn't an object. The on-demand
+// parser decides that from the first character alone, whereas the other
+// parsers still reject invalid JSON and otherwise find "voltage" missing. So
+// `input`, which must be padded, is checked in full with the DOM parser, which
+// is fine for such unexpected responses.
+absl::Status TopLevelNotObjectStatus(const std::string& input) {
+  thread_local simdjson::dom::parser validator;
+  simdjson::dom::element element;
+  RETURN_IF_ERROR(ParseStatus(
+      validator.parse(input.data(), input.size(), /*realloc_if_needed=*/false)
+          .get(element)));
+  return FieldStatus(simdjson::NO_SUCH_FIELD, "voltage");
+}
+
+// A wanted number field, which is missing until it's read.
+struct NumberField final {
+  simdjson::error_code error = simdjson::NO_SUCH_FIELD;
+  double value = 0.0;
+
+  // Reads the field's value, replacing any earlier one. A value of the wrong
+  // type is recorded rather than returned, so the rest of the input is still
+  // checked for syntax errors.
+  absl::Status Read(simdjson::ondemand::value& json_value) {
+    error = json_value.get_double().get(value);
+    if (error == simdjson::INCORRECT_TYPE) {
+      return absl::OkStatus();
+    }
+    return ParseStatus(error);
+  }
+
+  absl::Status Get(std::string_view field, double& result) const {
+    RETURN_IF_ERROR(FieldStatus(error, field));
+    result = value;
+    return absl::OkStatus();
+  }
+};
+
+// Calls `fn(key, value)` for every field of `object`, in order. Unlike
+// find_field_unordered(), which stops at the first match, this sees every
+// occurrence of a repeated key, so callers can let the last one win as the
+// DOM and streaming parsers do.
+template <typename Fn>
+absl::Status ForEachField(simdjson::ondemand::object& object, Fn fn) {
+  for (auto field : object) {
+    std::string_view key;
+    RETURN_IF_ERROR(ParseStatus(field.unescaped_key().get(key)));
+    simdjson::ondemand::value value;
+    RETURN_IF_ERROR(ParseStatus(field.value().get(value)));
+    RETURN_IF_ERROR(fn(key, value));
+  }
+  return absl::OkStatus();
+}
+
+class SimdjsonParserImpl final : public Parser {
+ public:
+  SimdjsonParserImpl() = default;
+
+  absl::StatusOr<::shelly::Metrics> Parse(const std::string& data) override {
+    // The on-demand parser reads past the end of the input, so it must be
+    // padded. Use the string's spare capacity when there's enough of it,
+    // otherwise copy in to a reusable padded buffer.
+    thread_local simdjson::ondemand::parser parser;
+    thread_local std::string padded;
+    const std::string* input = &data;
+    if (data.capacity() - data.size() < simdjson::SIMDJSON_PADDING) {
+      padded.reserve(data.size() + simdjson::SIMDJSON_PADDING);
+      padded.assign(data);
+      input = &padded;
+    }
+
+    simdjson::ondemand::document document;
+    RETURN_IF_ERROR(ParseStatus(
+        parser.iterate(input->data(), input->size(), input->capacity())
+            .get(document)));
+    simdjson::ondemand::object parsed;
+    const simdjson::error_code top_level = document.get_object().get(parsed);
+    if (top_level == simdjson::INCORRECT_TYPE) {
+      return TopLevelNotObjectStatus(*input);
+    }
+    RETURN_IF_ERROR(ParseStatus(top_level));
+
+    NumberField voltage, apower, current, temp_c, temp_f;
+    simdjson::error_code temperature = simdjson::NO_SUCH_FIELD;
+    RETURN_IF_ERROR(ForEachField(
+        parsed,
+        [&](std::string_view key,
+            simdjson::ondemand::value& value) -> absl::Status {
+          if (key == "voltage") {
+            return voltage.Read(value);
+          } else if (key == "apower") {
+            return apower.Read(value);
+          } else if (key == "current") {
+            return current.Read(value);
+          } else if (key != "temperature") {
+            return absl::OkStatus();
+          }
+          temp_c = NumberField();
+          temp_f = NumberField();
+          simdjson::ondemand::object object;
+          temperature = value.get_object().get(object);
+          if (temperature == simdjson::INCORRECT_TYPE) {
+            return absl::OkStatus();
+          }
+          RETURN_IF_ERROR(ParseStatus(temperature));
+          return ForEachField(
+              object,
+              [&](std::string_view name,
+                  simdjson::ondemand::value& number) -> absl::Status {
+                if (name == "tC") {
+                  return temp_c.Read(number);
+                } else if (name == "tF") {
+                  return temp_f.Read(number);
+                }
+                return absl::OkStatus();
+              });
+        }));
+    // Like the other parsers, reject anything after the top level object.
+    if (!document.at_end()) {
+      return ParseStatus(simdjson::TRAILING_CONTENT);
+    }
+
+    // Report the first problem in the same order as the DOM parser.
+    ::shelly::Metrics metrics;
+    RETURN_IF_ERROR(voltage.Get("voltage", metrics.voltage));
+    RETURN_IF_ERROR(apower.Get("apower", metrics.apower));
+    RETURN_IF_ERROR(current.Get("current", metrics.current));
+    RETURN_IF_ERROR(FieldStatus(temperature, "temperature"));
+    RETURN_IF_ERROR(temp_c.Get("tC", metrics.temp_c));
+    RETURN_IF_ERROR(temp_f.Get("tF", metrics.temp_f));
+    return metrics;
+  }
+
+  std::string_view Version() const override { return VersionString(); }
+};
+
+}  // namespace
+
+std::unique_ptr<Parser> CreateSimdjsonParser() {
+  return std::make_unique<SimdjsonParserImpl>();
+}
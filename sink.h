@@ -0,0 +1,33 @@
+#ifndef SINK_H
+#define SINK_H
+
+#include "absl/status/statusor.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
+#include "shelly.h"
+#include "target.h"
+
+// The outcome of a single poll of a target.
+struct PollResult final {
+  TargetHandle handle;
+  // When the poll completed, measured with the poller's time function.
+  absl::Time time;
+  absl::StatusOr<::shelly::Metrics> metrics;
+};
+
+// Receives the results of polls in batches, so that a consumer can apply a
+// whole batch at once rather than paying its per-update costs for every
+// result.
+class Sink {
+ public:
+  virtual ~Sink() = default;
+
+  // Called with each batch of results, in the order that they completed.
+  // Calls from the same poller are never concurrent.
+  virtual void Consume(absl::Span<const PollResult> results) = 0;
+
+ protected:
+  Sink() = default;
+};
+
+#endif  // SINK_H
@@ -0,0 +1,409 @@
+#include "state_file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <optional>
+#include <utility>
+
+#include "absl/strings/str_cat.h"
+#include "absl/strings/substitute.h"
+#include "status_macros/status_macros.h"
+
+namespace {
+
+// The file starts with a header, followed by two slots of `slot_capacity`
+// bytes each. Every value is stored in native byte order, as the file is only
+// ever read back on the host that wrote it.
+inline constexpr char kMagic[8] = {'S', 'H', 'L', 'Y', 'S', 'T', 'A', 'T'};
+// Version 2 added the energy used to the end of each target record. Files of
+// version 1 are still read, and rewritten in the current version by the next
+// save.
+inline constexpr uint32_t kVersion = 2;
+inline constexpr uint32_t kMinVersion = 1;
+inline constexpr size_t kFileHeaderSize = 64;
+inline constexpr size_t kNumSlots = 2;
+inline constexpr size_t kMinSlotCapacity = 4096;
+
+struct FileHeader final {
+  char magic[8];
+  uint32_t version;
+  uint32_t slot_capacity;
+};
+static_assert(sizeof(FileHeader) <= kFileHeaderSize);
+
+// Each slot starts with this header, followed by `payload_size` bytes holding
+// `num_targets` target records. A target record is the size of its name as a
+// uint32_t, the name, then the doubles written by AppendTargetState.
+struct SlotHeader final {
+  // Zero in a slot that has never been written.
+  uint64_t generation;
+  uint32_t num_targets;
+  uint32_t payload_size;
+  // Covers the fields above and the payload.
+  uint32_t crc;
+  uint32_t reserved;
+};
+inline constexpr size_t kSlotHeaderCrcSize = offsetof(SlotHeader, crc);
+
+template <class T>
+void AppendValue(std::string& buffer, const T& value) {
+  buffer.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+void AppendTargetState(std::string& buffer, const TargetState& state) {
+  AppendValue(buffer, static_cast<uint32_t>(state.name.size()));
+  buffer.append(state.name);
+  for (const double value : {
+           state.success_queries,
+           state.error_queries,
+           state.timeout_queries,
+           state.reused_connections,
+           state.new_connections,
+           state.metrics.apower,
+           state.metrics.voltage,
+           state.metrics.current,
+           state.metrics.temp_c,
+           state.metrics.temp_f,
+           state.last_updated,
+           state.energy_wh,
+       }) {
+    AppendValue(buffer, value);
+  }
+}
+
+// Reads values from a payload, failing rather than reading past its end.
+class PayloadReader final {
+ public:
+  explicit PayloadReader(std::string_view payload) : payload_(payload) {}
+
+  template <class T>
+  absl::StatusOr<T> Read() {
+    T value;
+    ASSIGN_OR_RETURN(const auto bytes, ReadBytes(sizeof(T)));
+    std::memcpy(&value, bytes.data(), sizeof(T));
+    return value;
+  }
+
+  absl::StatusOr<std::string_view> ReadBytes(size_t size) {
+    if (size > payload_.size()) {
+      return absl::DataLossError("Truncated target record");
+    }
+    const auto bytes = payload_.substr(0, size);
+    payload_.remove_prefix(size);
+    return bytes;
+  }
+
+ private:
+  std::string_view payload_;
+};
+
+absl::StatusOr<TargetState> ReadTargetState(PayloadReader& reader,
+                                            uint32_t version) {
+  TargetState state;
+  ASSIGN_OR_RETURN(const auto name_size, reader.Read<uint32_t>());
+  ASSIGN_OR_RETURN(const auto name, reader.ReadBytes(name_size));
+  state.name = std::string(name);
+  for (double* value : {
+           &state.success_queries,
+           &state.error_queries,
+           &state.timeout_queries,
+           &state.reused_connections,
+           &state.new_connections,
+           &state.metrics.apower,
+           &state.metrics.voltage,
+           &state.metrics.current,
+           &state.metrics.temp_c,
+           &state.metrics.temp_f,
+           &state.last_updated,
+       }) {
+    ASSIGN_OR_RETURN(*value, reader.Read<double>());
+  }
+  if (version >= 2) {
+    ASSIGN_OR_RETURN(state.energy_wh, reader.Read<double>());
+  }
+  return state;
+}
+
+uint32_t SlotCrc(const SlotHeader& header, std::string_view payload) {
+  uLong crc = crc32(0L, Z_NULL, 0);
+  crc = crc32(crc, reinterpret_cast<const Bytef*>(&header), kSlotHeaderCrcSize);
+  crc = crc32(crc, reinterpret_cast<const Bytef*>(payload.data()),
+              payload.size());
+  return static_cast<uint32_t>(crc);
+}
+
+absl::Status ErrnoError(std::string_view message, std::string_view filename) {
+  return absl::InternalError(
+      absl::Substitute("$0 \"$1\": $2", message, filename, strerror(errno)));
+}
+
+// Flushes the directory holding `filename`, so that a file renamed into it
+// survives a crash.
+absl::Status SyncParentDirectory(const std::string& filename) {
+  std::string directory = std::filesystem::path(filename).parent_path();
+  if (directory.empty()) {
+    directory = ".";
+  }
+  const int fd = open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1) {
+    return ErrnoError("Failed to open state file directory", directory);
+  }
+  if (fsync(fd) == -1) {
+    const auto status =
+        ErrnoError("Failed to sync state file directory", directory);
+    close(fd);
+    return status;
+  }
+  close(fd);
+  return absl::OkStatus();
+}
+
+class StateFileImpl final : public StateFile {
+ public:
+  StateFileImpl() = delete;
+  explicit StateFileImpl(std::string_view filename) : filename_(filename) {}
+
+  ~StateFileImpl() override { Unmap(); }
+
+  // Maps the file if it exists, and finds the most recent slot.
+  absl::Status Map() {
+    const int fd = open(filename_.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd == -1) {
+      if (errno == ENOENT) {
+        return absl::OkStatus();
+      }
+      return ErrnoError("Failed to open state file", filename_);
+    }
+    struct stat stat_buffer;
+    if (fstat(fd, &stat_buffer) == -1) {
+      const auto status = ErrnoError("Failed to stat state file", filename_);
+      close(fd);
+      return status;
+    }
+    size_ = stat_buffer.st_size;
+    if (size_ > 0) {
+      void* data =
+          mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+      if (data == MAP_FAILED) {
+        const auto status = ErrnoError("Failed to map state file", filename_);
+        close(fd);
+        return status;
+      }
+      data_ = static_cast<char*>(data);
+    }
+    // The mapping stays valid once the descriptor is closed.
+    close(fd);
+
+    FileHeader header;
+    if (size_ < kFileHeaderSize) {
+      return absl::OkStatus();
+    }
+    std::memcpy(&header, data_, sizeof(header));
+    if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+        header.version < kMinVersion || header.version > kVersion ||
+        header.slot_capacity < sizeof(SlotHeader) ||
+        size_ < kFileHeaderSize + kNumSlots * header.slot_capacity) {
+      return absl::OkStatus();
+    }
+    version_ = header.version;
+    slot_capacity_ = header.slot_capacity;
+    for (size_t slot = 0; slot < kNumSlots; ++slot) {
+      const auto slot_header = ReadValidSlotHeader(slot);
+      if (slot_header.has_value() &&
+          slot_header->generation > generation_) {
+        generation_ = slot_header->generation;
+        latest_slot_ = slot;
+      }
+    }
+    return absl::OkStatus();
+  }
+
+  absl::StatusOr<std::vector<TargetState>> Load() const override {
+    if (data_ == nullptr) {
+      return std::vector<TargetState>();
+    }
+    if (slot_capacity_ == 0) {
+      return absl::DataLossError(absl::Substitute(
+          "\"$0\" is not a state file of versions $1 to $2", filename_,
+          kMinVersion, kVersion));
+    }
+    if (!latest_slot_.has_value()) {
+      return absl::DataLossError(
+          absl::Substitute("\"$0\" holds no complete state", filename_));
+    }
+
+    const auto header = *ReadValidSlotHeader(*latest_slot_);
+    PayloadReader reader(GetPayload(*latest_slot_, header));
+    std::vector<TargetState> states;
+    states.reserve(header.num_targets);
+    for (uint32_t i = 0; i < header.num_targets; ++i) {
+      ASSIGN_OR_RETURN(auto state, ReadTargetState(reader, version_),
+                       _ << "Failed to read \"" << filename_ << "\"");
+      states.push_back(std::move(state));
+    }
+    return states;
+  }
+
+  absl::Status Save(absl::Span<const TargetState> states) override {
+    buffer_.clear();
+    for (const auto& state : states) {
+      AppendTargetState(buffer_, state);
+    }
+    const SlotHeader header = {
+        .generation = generation_ + 1,
+        .num_targets = static_cast<uint32_t>(states.size()),
+        .payload_size = static_cast<uint32_t>(buffer_.size()),
+        .crc = 0,
+        .reserved = 0,
+    };
+    if (slot_capacity_ == 0 || version_ != kVersion ||
+        sizeof(SlotHeader) + buffer_.size() > slot_capacity_) {
+      return Rewrite(header);
+    }
+
+    // Overwrite the older slot, leaving the latest intact until this one is
+    // complete.
+    const size_t slot = latest_slot_.has_value() ? 1 - *latest_slot_ : 0;
+    WriteSlot(data_ + GetSlotOffset(slot), header, buffer_);
+    // Only needed for the state to survive the host crashing, so the writes
+    // are left to be flushed in the background.
+    msync(data_, size_, MS_ASYNC);
+    generation_ = header.generation;
+    latest_slot_ = slot;
+    return absl::OkStatus();
+  }
+
+ private:
+  const std::string filename_;
+  char* data_ = nullptr;
+  size_t size_ = 0;
+  // Zero unless the file has a valid header.
+  size_t slot_capacity_ = 0;
+  uint32_t version_ = 0;
+  uint64_t generation_ = 0;
+  std::optional<size_t> latest_slot_;
+  // Reused between saves to hold the payload being written.
+  std::string buffer_;
+
+  size_t GetSlotOffset(size_t slot) const {
+    return kFileHeaderSize + slot * slot_capacity_;
+  }
+
+  std::string_view GetPayload(size_t slot, const SlotHeader& header) const {
+    return std::string_view(
+        data_ + GetSlotOffset(slot) + sizeof(SlotHeader), header.payload_size);
+  }
+
+  std::optional<SlotHeader> ReadValidSlotHeader(size_t slot) const {
+    SlotHeader header;
+    std::memcpy(&header, data_ + GetSlotOffset(slot), sizeof(header));
+    if (header.generation == 0 ||
+        header.payload_size > slot_capacity_ - sizeof(SlotHeader) ||
+        header.crc != SlotCrc(header, GetPayload(slot, header))) {
+      return std::nullopt;
+    }
+    return header;
+  }
+
+  static void WriteSlot(char* slot_data, SlotHeader header,
+                        std::string_view payload) {
+    header.crc = SlotCrc(header, payload);
+    std::memcpy(slot_data, &header, sizeof(header));
+    std::memcpy(slot_data + sizeof(header), payload.data(), payload.size());
+  }
+
+  // Replaces the whole file with one whose slots fit the payload, holding
+  // just the new state. The file is written alongside and renamed over the
+  // old one, and the directory is synced after the rename, so that a crash
+  // leaves one or the other.
+  absl::Status Rewrite(const SlotHeader& header) {
+    // Leave room for the payload to grow, so that adding a few targets doesn't
+    // rewrite the file every time.
+    const size_t slot_capacity = std::max(
+        kMinSlotCapacity, std::bit_ceil(2 * (sizeof(SlotHeader) +
+                                             header.payload_size)));
+    std::string contents(kFileHeaderSize + kNumSlots * slot_capacity, '\0');
+    FileHeader file_header = {
+        .version = kVersion,
+        .slot_capacity = static_cast<uint32_t>(slot_capacity),
+    };
+    std::memcpy(file_header.magic, kMagic, sizeof(kMagic));
+    std::memcpy(contents.data(), &file_header, sizeof(file_header));
+    WriteSlot(contents.data() + kFileHeaderSize, header, buffer_);
+
+    const std::string temp_filename = absl::StrCat(filename_, ".tmp");
+    const int fd = open(temp_filename.c_str(),
+                        O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+      return ErrnoError("Failed to create state file", temp_filename);
+    }
+    size_t written = 0;
+    while (written < contents.size()) {
+      const ssize_t result =
+          write(fd, contents.data() + written, contents.size() - written);
+      if (result == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        const auto status =
+            ErrnoError("Failed to write state file", temp_filename);
+        close(fd);
+        return status;
+      }
+      written += result;
+    }
+    if (fsync(fd) == -1) {
+      const auto status =
+          ErrnoError("Failed to write state file", temp_filename);
+      close(fd);
+      return status;
+    }
+    if (close(fd) == -1) {
+      return ErrnoError("Failed to write state file", temp_filename);
+    }
+    if (rename(temp_filename.c_str(), filename_.c_str()) == -1) {
+      return ErrnoError("Failed to replace state file", filename_);
+    }
+    RETURN_IF_ERROR(SyncParentDirectory(filename_));
+
+    Unmap();
+    slot_capacity_ = 0;
+    version_ = 0;
+    generation_ = 0;
+    latest_slot_.reset();
+    RETURN_IF_ERROR(Map());
+    if (latest_slot_ != 0 || generation_ != header.generation) {
+      return absl::InternalError(absl::Substitute(
+          "Rewritten state file \"$0\" is invalid", filename_));
+    }
+    return absl::OkStatus();
+  }
+
+  void Unmap() {
+    if (data_ != nullptr) {
+      munmap(data_, size_);
+      data_ = nullptr;
+      size_ = 0;
+    }
+  }
+};
+
+}  // namespace
+
+absl::StatusOr<std::unique_ptr<StateFile>> OpenStateFile(
+    std::string_view filename) {
+  auto state_file = std::make_unique<StateFileImpl>(filename);
+  RETURN_IF_ERROR(state_file->Map());
+  return state_file;
+}
@@ -0,0 +1,61 @@
+#ifndef STATE_FILE_H
+#define STATE_FILE_H
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "absl/status/status.h"
+#include "absl/status/statusor.h"
+#include "absl/types/span.h"
+#include "shelly.h"
+
+// The part of a target's metrics that is carried over a restart of the
+// exporter.
+struct TargetState final {
+  std::string name;
+
+  double success_queries = 0;
+  double error_queries = 0;
+  double timeout_queries = 0;
+  double reused_connections = 0;
+  double new_connections = 0;
+
+  // Readings from the last successful poll, and when it happened as a Unix
+  // timestamp. Zero if the target has never been polled successfully.
+  ::shelly::Metrics metrics = {};
+  double last_updated = 0;
+
+  // Energy used by the target, in watt hours.
+  double energy_wh = 0;
+};
+
+// Checkpoints the target states in a memory mapped file, so that they can be
+// restored as soon as the exporter restarts.
+//
+// The file holds two slots, each with a generation number and a CRC of its
+// contents. Every save overwrites the older slot, so a crash part way through
+// a save leaves the newer slot intact, and the torn slot fails its CRC. The
+// layout is versioned, and a file with an unknown version is treated as
+// holding no state and rewritten by the next save.
+class StateFile {
+ public:
+  virtual ~StateFile() = default;
+
+  // Returns the states from the most recent complete save, or none if there
+  // has never been one. Fails if the file exists but holds no valid state.
+  virtual absl::StatusOr<std::vector<TargetState>> Load() const = 0;
+
+  // Replaces the saved states. Not thread safe.
+  virtual absl::Status Save(absl::Span<const TargetState> states) = 0;
+
+ protected:
+  StateFile() = default;
+};
+
+// Maps `filename` if it exists, or else creates it on the first save.
+absl::StatusOr<std::unique_ptr<StateFile>> OpenStateFile(
+    std::string_view filename);
+
+#endif  // STATE_FILE_H
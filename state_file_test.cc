@@ -0,0 +1,235 @@
+#include "state_file.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <zlib.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/log/check.h"
+#include "absl/strings/str_cat.h"
+
+namespace {
+
+using ::testing::ElementsAre;
+using ::testing::IsEmpty;
+
+MATCHER_P(StateEq, expected, "") {
+  return arg.name == expected.name &&
+         arg.success_queries == expected.success_queries &&
+         arg.error_queries == expected.error_queries &&
+         arg.timeout_queries == expected.timeout_queries &&
+         arg.reused_connections == expected.reused_connections &&
+         arg.new_connections == expected.new_connections &&
+         arg.metrics.apower == expected.metrics.apower &&
+         arg.metrics.voltage == expected.metrics.voltage &&
+         arg.metrics.current == expected.metrics.current &&
+         arg.metrics.temp_c == expected.metrics.temp_c &&
+         arg.metrics.temp_f == expected.metrics.temp_f &&
+         arg.last_updated == expected.last_updated &&
+         arg.energy_wh == expected.energy_wh;
+}
+
+TargetState MakeState(const std::string& name, int i) {
+  return TargetState{
+      .name = name,
+      .success_queries = 10.0 * i + 1,
+      .error_queries = 10.0 * i + 2,
+      .timeout_queries = 10.0 * i + 3,
+      .reused_connections = 10.0 * i + 4,
+      .new_connections = 10.0 * i + 5,
+      .metrics = {.apower = 10.0 * i + 6,
+                  .voltage = 10.0 * i + 7,
+                  .current = 10.0 * i + 8,
+                  .temp_c = 10.0 * i + 9,
+                  .temp_f = 10.0 * i + 10},
+      .last_updated = 1700000000.0 + i,
+      .energy_wh = 10.0 * i + 11,
+  };
+}
+
+class StateFileTest : public ::testing::Test {
+ protected:
+  StateFileTest()
+      : filename_(absl::StrCat(::testing::TempDir(), "state_file_test_",
+                               ::testing::UnitTest::GetInstance()
+                                   ->current_test_info()
+                                   ->name())) {
+    std::remove(filename_.c_str());
+  }
+  ~StateFileTest() override { std::remove(filename_.c_str()); }
+
+  std::unique_ptr<StateFile> OpenOrDie() {
+    auto maybe_state_file = OpenStateFile(filename_);
+    CHECK_OK(maybe_state_file.status());
+    return std::move(maybe_state_file).value();
+  }
+
+  std::string ReadFile() const {
+    std::ifstream file(filename_, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(file), {});
+  }
+
+  void WriteFile(const std::string& contents) const {
+    std::ofstream file(filename_, std::ios::binary | std::ios::trunc);
+    file << contents;
+  }
+
+  const std::string filename_;
+};
+
+}  // namespace
+
+TEST_F(StateFileTest, MissingFileHasNoState) {
+  auto state_file = OpenOrDie();
+  const auto states = state_file->Load();
+  ASSERT_TRUE(states.ok());
+  EXPECT_THAT(*states, IsEmpty());
+  EXPECT_FALSE(std::filesystem::exists(filename_));
+}
+
+TEST_F(StateFileTest, LoadsSavedState) {
+  const auto one = MakeState("one", 1);
+  const auto two = MakeState("two", 2);
+  ASSERT_TRUE(OpenOrDie()->Save({one, two}).ok());
+
+  const auto states = OpenOrDie()->Load();
+  ASSERT_TRUE(states.ok());
+  EXPECT_THAT(*states, ElementsAre(StateEq(one), StateEq(two)));
+}
+
+TEST_F(StateFileTest, LoadsLatestSave) {
+  auto state_file = OpenOrDie();
+  for (int i = 0; i < 5; ++i) {
+    ASSERT_TRUE(state_file->Save({MakeState("target", i)}).ok());
+    const auto states = state_file->Load();
+    ASSERT_TRUE(states.ok());
+    EXPECT_THAT(*states, ElementsAre(StateEq(MakeState("target", i))));
+  }
+
+  const auto states = OpenOrDie()->Load();
+  ASSERT_TRUE(states.ok());
+  EXPECT_THAT(*states, ElementsAre(StateEq(MakeState("target", 4))));
+}
+
+TEST_F(StateFileTest, SurvivesTornSave) {
+  auto state_file = OpenOrDie();
+  ASSERT_TRUE(state_file->Save({MakeState("target", 1)}).ok());
+  ASSERT_TRUE(state_file->Save({MakeState("target", 2)}).ok());
+  state_file.reset();
+
+  // The first save went in to the first slot, and the second in to the other.
+  // Corrupting the second's payload stands in for a crash part way through
+  // writing it.
+  std::string contents = ReadFile();
+  uint32_t slot_capacity;
+  std::memcpy(&slot_capacity, contents.data() + 12, sizeof(slot_capacity));
+  contents[64 + slot_capacity + 32] ^= 0xff;
+  WriteFile(contents);
+
+  state_file = OpenOrDie();
+  const auto states = state_file->Load();
+  ASSERT_TRUE(states.ok());
+  EXPECT_THAT(*states, ElementsAre(StateEq(MakeState("target", 1))));
+
+  // The torn slot is the one overwritten by the next save.
+  ASSERT_TRUE(state_file->Save({MakeState("target", 3)}).ok());
+  EXPECT_THAT(*OpenOrDie()->Load(),
+              ElementsAre(StateEq(MakeState("target", 3))));
+}
+
+TEST_F(StateFileTest, RewritesUnknownFile) {
+  WriteFile(std::string(1024, 'x'));
+
+  auto state_file = OpenOrDie();
+  const auto states = state_file->Load();
+  EXPECT_EQ(states.status().code(), absl::StatusCode::kDataLoss);
+
+  ASSERT_TRUE(state_file->Save({MakeState("target", 1)}).ok());
+  EXPECT_THAT(*OpenOrDie()->Load(),
+              ElementsAre(StateEq(MakeState("target", 1))));
+}
+
+TEST_F(StateFileTest, ReadsVersionOneFile) {
+  // A version 1 file, whose target records have no energy, with one save in
+  // the first slot.
+  TargetState expected = MakeState("target", 1);
+  expected.energy_wh = 0;
+  std::string payload;
+  const auto append = [&payload](const auto& value) {
+    payload.append(reinterpret_cast<const char*>(&value), sizeof(value));
+  };
+  append(static_cast<uint32_t>(expected.name.size()));
+  payload.append(expected.name);
+  for (const double value :
+       {expected.success_queries, expected.error_queries,
+        expected.timeout_queries, expected.reused_connections,
+        expected.new_connections, expected.metrics.apower,
+        expected.metrics.voltage, expected.metrics.current,
+        expected.metrics.temp_c, expected.metrics.temp_f,
+        expected.last_updated}) {
+    append(value);
+  }
+  constexpr uint32_t kSlotCapacity = 4096;
+  std::string contents(64 + 2 * kSlotCapacity, '\0');
+  const uint32_t file_header[] = {1, kSlotCapacity};
+  std::memcpy(contents.data(), "SHLYSTAT", 8);
+  std::memcpy(contents.data() + 8, file_header, sizeof(file_header));
+  const uint64_t generation = 1;
+  const uint32_t sizes[] = {1, static_cast<uint32_t>(payload.size())};
+  std::string slot_header;
+  slot_header.append(reinterpret_cast<const char*>(&generation),
+                     sizeof(generation));
+  slot_header.append(reinterpret_cast<const char*>(sizes), sizeof(sizes));
+  uLong crc = crc32(0L, Z_NULL, 0);
+  crc = crc32(crc, reinterpret_cast<const Bytef*>(slot_header.data()),
+              slot_header.size());
+  crc = crc32(crc, reinterpret_cast<const Bytef*>(payload.data()),
+              payload.size());
+  const uint32_t crc_fields[] = {static_cast<uint32_t>(crc), 0};
+  slot_header.append(reinterpret_cast<const char*>(crc_fields),
+                     sizeof(crc_fields));
+  contents.replace(64, slot_header.size(), slot_header);
+  contents.replace(64 + slot_header.size(), payload.size(), payload);
+  WriteFile(contents);
+
+  auto state_file = OpenOrDie();
+  const auto states = state_file->Load();
+  ASSERT_TRUE(states.ok()) << states.status();
+  EXPECT_THAT(*states, ElementsAre(StateEq(expected)));
+
+  // The next save rewrites the file in the current version.
+  ASSERT_TRUE(state_file->Save({MakeState("target", 2)}).ok());
+  uint32_t version;
+  std::memcpy(&version, ReadFile().data() + 8, sizeof(version));
+  EXPECT_EQ(version, 2);
+  EXPECT_THAT(*OpenOrDie()->Load(),
+              ElementsAre(StateEq(MakeState("target", 2))));
+}
+
+TEST_F(StateFileTest, GrowsForMoreTargets) {
+  auto state_file = OpenOrDie();
+  ASSERT_TRUE(state_file->Save({MakeState("target", 0)}).ok());
+
+  std::vector<TargetState> expected;
+  for (int i = 0; i < 1000; ++i) {
+    expected.push_back(MakeState(absl::StrCat("target_", i), i));
+  }
+  ASSERT_TRUE(state_file->Save(expected).ok());
+  ASSERT_TRUE(state_file->Save(expected).ok());
+
+  const auto states = OpenOrDie()->Load();
+  ASSERT_TRUE(states.ok());
+  ASSERT_EQ(states->size(), expected.size());
+  for (size_t i = 0; i < expected.size(); ++i) {
+    EXPECT_THAT((*states)[i], StateEq(expected[i]));
+  }
+}
@@ -0,0 +1,232 @@
+#include <cstdint>
+#include <string>
+
+#include "absl/status/status.h"
+#include "absl/strings/substitute.h"
+#include "nlohmann/json.hpp"
+#include "parser.h"
+#include "status_macros/status_macros.h"
+
+namespace {
+
+using json = ::nlohmann::json;
+
+std::string_view VersionString() {
+  static const auto* const version = [] {
+    return new std::string(absl::Substitute(
+        "nlohmann json $0 (streaming)",
+        json::meta()["version"]["string"].template get<std::string>()));
+  }();
+  return *version;
+}
+
+// The fields of the response that are used, everything else is skipped.
+enum class Field {
+  kNone,
+  kVoltage,
+  kApower,
+  kCurrent,
+  kTemperature,
+  kTempC,
+  kTempF,
+};
+
+struct NumberField final {
+  enum class State { kMissing, kNotNumber, kPresent };
+
+  State state = State::kMissing;
+  double value = 0.0;
+};
+
+// Records the wanted fields as they're streamed past, without building a DOM.
+// Only the top level object and its "temperature" object are inspected, any
+// other nesting is skipped over.
+class MetricsHandler final : public ::nlohmann::json_sax<json> {
+ public:
+  enum class TemperatureState { kMissing, kNotObject, kPresent };
+
+  NumberField voltage;
+  NumberField apower;
+  NumberField current;
+  TemperatureState temperature = TemperatureState::kMissing;
+  NumberField temp_c;
+  NumberField temp_f;
+
+  // Set if the input wasn't valid JSON.
+  std::string error;
+
+  bool null() override { return OtherValue(); }
+  bool boolean(bool) override { return OtherValue(); }
+  bool number_integer(number_integer_t value) override {
+    return NumberValue(static_cast<double>(value));
+  }
+  bool number_unsigned(number_unsigned_t value) override {
+    return NumberValue(static_cast<double>(value));
+  }
+  bool number_float(number_float_t value, const string_t&) override {
+    return NumberValue(value);
+  }
+  bool string(string_t&) override { return OtherValue(); }
+  bool binary(binary_t&) override { return OtherValue(); }
+
+  bool start_object(std::size_t) override {
+    if (depth_ == 1 && field_ == Field::kTemperature) {
+      // Repeated keys take the last value, as they do when parsed in to a DOM.
+      temperature = TemperatureState::kPresent;
+      temp_c = NumberField();
+      temp_f = NumberField();
+      in_temperature_ = true;
+    } else {
+      OtherValue();
+    }
+    ++depth_;
+    return true;
+  }
+
+  bool end_object() override {
+    --depth_;
+    if (depth_ == 1) {
+      in_temperature_ = false;
+    }
+    return true;
+  }
+
+  bool start_array(std::size_t) override {
+    OtherValue();
+    ++depth_;
+    return true;
+  }
+
+  bool end_array() override {
+    --depth_;
+    return true;
+  }
+
+  bool key(string_t& name) override {
+    field_ = Field::kNone;
+    if (depth_ == 1) {
+      if (name == "voltage") {
+        field_ = Field::kVoltage;
+      } else if (name == "apower") {
+        field_ = Field::kApower;
+      } else if (name == "current") {
+        field_ = Field::kCurrent;
+      } else if (name == "temperature") {
+        field_ = Field::kTemperature;
+      }
+    } else if (depth_ == 2 && in_temperature_) {
+      if (name == "tC") {
+        field_ = Field::kTempC;
+      } else if (name == "tF") {
+        field_ = Field::kTempF;
+      }
+    }
+    return true;
+  }
+
+  bool parse_error(std::size_t, const std::string&,
+                   const ::nlohmann::detail::exception& e) override {
+    error = e.what();
+    return false;
+  }
+
+ private:
+  int depth_ = 0;
+  bool in_temperature_ = false;
+  Field field_ = Field::kNone;
+
+  NumberField* CurrentNumberField() {
+    switch (field_) {
+      case Field::kVoltage:
+        return &voltage;
+      case Field::kApower:
+        return &apower;
+      case Field::kCurrent:
+        return &current;
+      case Field::kTempC:
+        return &temp_c;
+      case Field::kTempF:
+        return &temp_f;
+      default:
+        return nullptr;
+    }
+  }
+
+  bool NumberValue(double value) {
+    if (auto* const field = CurrentNumberField()) {
+      *field = {.state = NumberField::State::kPresent, .value = value};
+    } else if (field_ == Field::kTemperature) {
+      temperature = TemperatureState::kNotObject;
+    }
+    field_ = Field::kNone;
+    return true;
+  }
+
+  // Handles any value that isn't a number or the temperature object.
+  bool OtherValue() {
+    if (auto* const field = CurrentNumberField()) {
+      *field = {.state = NumberField::State::kNotNumber};
+    } else if (field_ == Field::kTemperature) {
+      temperature = TemperatureState::kNotObject;
+    }
+    field_ = Field::kNone;
+    return true;
+  }
+};
+
+absl::Status GetNumberField(const NumberField& field, std::string_view name,
+                            double& value) {
+  switch (field.state) {
+    case NumberField::State::kMissing:
+      return absl::NotFoundError(
+          absl::Substitute("Missing JSON field \"$0\"", name));
+    case NumberField::State::kNotNumber:
+      return absl::InvalidArgumentError(
+          absl::Substitute("JSON field \"$0\" is not a number", name));
+    case NumberField::State::kPresent:
+      break;
+  }
+  value = field.value;
+  return absl::OkStatus();
+}
+
+class StreamingParserImpl final : public Parser {
+ public:
+  StreamingParserImpl() = default;
+
+  absl::StatusOr<::shelly::Metrics> Parse(const std::string& data) override {
+    MetricsHandler handler;
+    if (!json::sax_parse(data, &handler)) {
+      return absl::InvalidArgumentError(
+          absl::Substitute("Failed to parse JSON: $0", handler.error));
+    }
+
+    // Report the first problem in the same order as the DOM parser.
+    ::shelly::Metrics metrics;
+    RETURN_IF_ERROR(
+        GetNumberField(handler.voltage, "voltage", metrics.voltage));
+    RETURN_IF_ERROR(GetNumberField(handler.apower, "apower", metrics.apower));
+    RETURN_IF_ERROR(
+        GetNumberField(handler.current, "current", metrics.current));
+    switch (handler.temperature) {
+      case MetricsHandler::TemperatureState::kMissing:
+        return absl::NotFoundError("Missing JSON field \"temperature\"");
+      case MetricsHandler::TemperatureState::kNotObject:
+        return absl::InvalidArgumentError(
+            "JSON field \"temperature\" is not an object");
+      case MetricsHandler::TemperatureState::kPresent:
+        break;
+    }
+    RETURN_IF_ERROR(GetNumberField(handler.temp_c, "tC", metrics.temp_c));
+    RETURN_IF_ERROR(GetNumberField(handler.temp_f, "tF", metrics.temp_f));
+    return metrics;
+  }
+
+  std::string_view Version() const override { return VersionString(); }
+};
+
+}  // namespace
+
+std::unique_ptr<Parser> CreateStreamingParser() {
+  return std::make_unique<StreamingParserImpl>();
+}
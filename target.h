@@ -1,11 +1,34 @@
 #ifndef TARGET_H
 #define TARGET_H
 
+#include <cstddef>
+#include <map>
+#include <optional>
 #include <string>
 
+#include "absl/time/time.h"
+
+// Dense index of a target in the registry, handed out in the order that the
+// targets are added. The poller reports each target's results by its handle,
+// so that the registry can update the target's metrics without looking up its
+// name.
+using TargetHandle = size_t;
+
+// The groups that a target belongs to, such as its room or circuit, keyed by
+// label name with the group as the label's value.
+using TargetGroups = std::map<std::string, std::string>;
+
 struct Target final {
   std::string name;
   std::string hostname;
+
+  // Overrides of the scraper's timeouts for just this target.
+  std::optional<absl::Duration> connect_timeout;
+  std::optional<absl::Duration> timeout;
+
+  TargetGroups groups;
+
+  bool operator==(const Target& other) const = default;
 };
 
 #endif  // TARGET_H
\ No newline at end of file
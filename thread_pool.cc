@@ -0,0 +1,122 @@
+#include "thread_pool.h"
+
+#include <algorithm>
+#include <utility>
+
+#include "absl/log/check.h"
+#include "absl/time/clock.h"
+
+ThreadPool::ThreadPool(int num_workers) : last_stats_time_(absl::Now()) {
+  CHECK(num_workers > 0) << "ThreadPool requires at least one worker";
+  workers_.reserve(num_workers);
+  for (int i = 0; i < num_workers; ++i) {
+    workers_.push_back(std::make_unique<Worker>());
+  }
+  // Only start the threads once every worker exists, as they steal from each
+  // other's queues.
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    workers_[i]->thread = std::thread([this, i] { WorkerLoop(i); });
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::unique_lock<std::mutex> lock(sleep_mutex_);
+    stopping_ = true;
+  }
+  sleeper_.notify_all();
+  for (auto& worker : workers_) {
+    worker->thread.join();
+  }
+}
+
+void ThreadPool::Schedule(std::function<void()> task) {
+  // Count the task as pending before it becomes visible to the workers, so
+  // that the count never drops below the number of queued tasks.
+  size_t pending;
+  {
+    std::unique_lock<std::mutex> lock(sleep_mutex_);
+    pending = ++pending_;
+  }
+  size_t peak = peak_pending_.load();
+  while (pending > peak && !peak_pending_.compare_exchange_weak(peak, pending)) {
+  }
+
+  Worker& worker = *workers_[next_worker_++ % workers_.size()];
+  {
+    std::unique_lock<std::mutex> lock(worker.mutex);
+    worker.queue.push_back(std::move(task));
+  }
+  sleeper_.notify_one();
+}
+
+ThreadPool::Stats ThreadPool::GetStats() {
+  std::unique_lock<std::mutex> lock(stats_mutex_);
+  const auto now = absl::Now();
+  const int64_t busy_nanos = busy_nanos_.load();
+  const int64_t available_nanos =
+      absl::ToInt64Nanoseconds(now - last_stats_time_) * num_workers();
+
+  Stats stats = {
+      .num_workers = num_workers(),
+      .busy_workers = busy_workers_.load(),
+      .queue_depth = pending_.load(),
+      .peak_queue_depth = peak_pending_.exchange(pending_.load()),
+      .utilisation =
+          available_nanos > 0
+              ? std::clamp(static_cast<double>(busy_nanos - last_busy_nanos_) /
+                               available_nanos,
+                           0.0, 1.0)
+              : 0.0,
+  };
+
+  last_stats_time_ = now;
+  last_busy_nanos_ = busy_nanos;
+  return stats;
+}
+
+void ThreadPool::WorkerLoop(size_t index) {
+  std::function<void()> task;
+  while (true) {
+    if (PopOrSteal(index, task)) {
+      --pending_;
+      ++busy_workers_;
+      const auto start_time = absl::Now();
+      task();
+      busy_nanos_ += absl::ToInt64Nanoseconds(absl::Now() - start_time);
+      --busy_workers_;
+      task = nullptr;
+      continue;
+    }
+
+    std::unique_lock<std::mutex> lock(sleep_mutex_);
+    if (stopping_ && pending_ == 0) {
+      return;
+    }
+    sleeper_.wait(lock, [this] { return stopping_ || pending_ > 0; });
+  }
+}
+
+bool ThreadPool::PopOrSteal(size_t index, std::function<void()>& task) {
+  // Take the oldest task from our own queue first, then fall back to stealing
+  // the newest task from the other workers.
+  {
+    Worker& worker = *workers_[index];
+    std::unique_lock<std::mutex> lock(worker.mutex);
+    if (!worker.queue.empty()) {
+      task = std::move(worker.queue.front());
+      worker.queue.pop_front();
+      return true;
+    }
+  }
+  for (size_t i = 1; i < workers_.size(); ++i) {
+    Worker& victim = *workers_[(index + i) % workers_.size()];
+    std::unique_lock<std::mutex> lock(victim.mutex);
+    if (!victim.queue.empty()) {
+      task = std::move(victim.queue.back());
+      victim.queue.pop_back();
+      return true;
+    }
+  }
+  return false;
+}
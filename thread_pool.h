@@ -0,0 +1,75 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "absl/time/time.h"
+
+// Fixed size pool of long-lived worker threads. Each worker has its own task
+// queue, tasks are distributed across the queues round-robin and idle workers
+// will steal queued tasks from the other workers.
+class ThreadPool final {
+ public:
+  struct Stats final {
+    int num_workers = 0;
+    int busy_workers = 0;
+    // Number of tasks queued but not yet started.
+    size_t queue_depth = 0;
+    // Largest queue depth seen since the previous call to GetStats.
+    size_t peak_queue_depth = 0;
+    // Fraction of the available worker time spent running tasks since the
+    // previous call to GetStats, in the range [0, 1].
+    double utilisation = 0.0;
+  };
+
+  ThreadPool() = delete;
+  explicit ThreadPool(int num_workers);
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  // Runs any remaining queued tasks and then joins the workers.
+  ~ThreadPool();
+
+  void Schedule(std::function<void()> task);
+
+  Stats GetStats();
+
+  int num_workers() const { return static_cast<int>(workers_.size()); }
+
+ private:
+  struct Worker final {
+    std::mutex mutex;
+    std::deque<std::function<void()>> queue;
+    std::thread thread;
+  };
+
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::atomic<size_t> next_worker_ = 0;
+
+  std::mutex sleep_mutex_;
+  std::condition_variable sleeper_;
+  bool stopping_ = false;
+  std::atomic<size_t> pending_ = 0;
+  std::atomic<size_t> peak_pending_ = 0;
+
+  std::atomic<int> busy_workers_ = 0;
+  std::atomic<int64_t> busy_nanos_ = 0;
+
+  std::mutex stats_mutex_;
+  absl::Time last_stats_time_;
+  int64_t last_busy_nanos_ = 0;
+
+  void WorkerLoop(size_t index);
+  bool PopOrSteal(size_t index, std::function<void()>& task);
+};
+
+#endif  // THREAD_POOL_H
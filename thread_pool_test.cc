@@ -0,0 +1,116 @@
+#include "thread_pool.h"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <latch>
+#include <mutex>
+#include <set>
+#include <thread>
+
+TEST(Schedule, RunsAllTasks) {
+  constexpr int kNumTasks = 100;
+  std::atomic<int> counter = 0;
+  std::latch latch(kNumTasks);
+
+  ThreadPool pool(4);
+  for (int i = 0; i < kNumTasks; ++i) {
+    pool.Schedule([&] {
+      ++counter;
+      latch.count_down();
+    });
+  }
+  latch.wait();
+  EXPECT_EQ(counter, kNumTasks);
+}
+
+TEST(Schedule, RunsTasksInParallel) {
+  constexpr int kNumWorkers = 4;
+
+  // Each task blocks until all of them have started, which can only happen if
+  // every worker is running a task at the same time.
+  std::latch latch(kNumWorkers);
+  std::mutex thread_ids_mutex;
+  std::set<std::thread::id> thread_ids;
+
+  {
+    ThreadPool pool(kNumWorkers);
+    for (int i = 0; i < kNumWorkers; ++i) {
+      pool.Schedule([&] {
+        {
+          std::lock_guard<std::mutex> lock(thread_ids_mutex);
+          thread_ids.insert(std::this_thread::get_id());
+        }
+        latch.arrive_and_wait();
+      });
+    }
+  }
+  EXPECT_EQ(thread_ids.size(), kNumWorkers);
+}
+
+TEST(Schedule, IdleWorkersStealTasks) {
+  constexpr int kNumTasks = 8;
+
+  // Block the first worker, the remaining tasks queued behind it should still
+  // complete as the second worker steals them.
+  std::latch blocker(1);
+  std::latch completed(kNumTasks - 1);
+
+  ThreadPool pool(2);
+  pool.Schedule([&] { blocker.wait(); });
+  for (int i = 1; i < kNumTasks; ++i) {
+    pool.Schedule([&] { completed.count_down(); });
+  }
+  completed.wait();
+  blocker.count_down();
+}
+
+TEST(Destructor, RunsQueuedTasks) {
+  std::atomic<int> counter = 0;
+  {
+    ThreadPool pool(1);
+    for (int i = 0; i < 10; ++i) {
+      pool.Schedule([&] { ++counter; });
+    }
+  }
+  EXPECT_EQ(counter, 10);
+}
+
+TEST(GetStats, ReportsQueueDepth) {
+  std::latch blocker(1);
+  std::latch started(1);
+
+  ThreadPool pool(1);
+  pool.Schedule([&] {
+    started.count_down();
+    blocker.wait();
+  });
+  started.wait();
+  pool.Schedule([] {});
+  pool.Schedule([] {});
+
+  const auto stats = pool.GetStats();
+  EXPECT_EQ(stats.num_workers, 1);
+  EXPECT_EQ(stats.busy_workers, 1);
+  EXPECT_EQ(stats.queue_depth, 2);
+  EXPECT_EQ(stats.peak_queue_depth, 2);
+  blocker.count_down();
+}
+
+TEST(GetStats, ReportsUtilisation) {
+  ThreadPool pool(1);
+  pool.GetStats();
+
+  // With a single worker the second task only starts once the first has been
+  // fully accounted for.
+  std::latch completed(1);
+  pool.Schedule(
+      [] { std::this_thread::sleep_for(std::chrono::milliseconds(50)); });
+  pool.Schedule([&] { completed.count_down(); });
+  completed.wait();
+
+  const auto stats = pool.GetStats();
+  EXPECT_GT(stats.utilisation, 0.0);
+  EXPECT_LE(stats.utilisation, 1.0);
+}